@@ -0,0 +1,2581 @@
+/*
+IPCBench_v2.c
+Author:ashokh@microsoft.com
+Last modified date: 07-01-2020
+
+User mode load test for the IPCDrv routing core. The routing core
+(IPCDrv_v2/IPCRoute_v2.c) is built in user mode through IPCShim_v2.h and
+driven with thousands of simulated ports, so routing cost can be measured on
+any machine without the driver installed.
+
+Build on Linux:
+	cc -O2 -pthread -o IPCBench_v2 IPCBench_v2/IPCBench_v2.c IPCDrv_v2/IPCRoute_v2.c IPCDrv_v2/IPCRouter_v2.c IPCDrv_v2/IPCPool_v2.c IPC_Dll_v2/IPC_Ring_v2.c
+
+Usage:
+	IPCBench_v2 route [ports] [messages] [payload bytes]
+	IPCBench_v2 copy [max messages] [payload bytes...]
+	IPCBench_v2 ring [messages] [payload bytes] [ring bytes]
+	IPCBench_v2 batch [messages] [batch size] [destinations] [payload bytes]
+	IPCBench_v2 drain [queue depth] [rounds] [payload bytes] [read buffer bytes]
+	IPCBench_v2 pending [messages] [payload bytes] [small reader every n]
+	IPCBench_v2 router [routing threads] [senders] [messages per sender] [payload bytes] [mixed]
+	IPCBench_v2 fanin [max senders] [messages per sender] [payload bytes]
+	IPCBench_v2 multicast [recipients] [messages] [payload bytes]
+	IPCBench_v2 stream [message MB] [rounds]
+	IPCBench_v2 credit [queue limit] [messages] [payload bytes] [receive ns]
+	IPCBench_v2 lanes [control messages] [bulk backlog] [bulk payload bytes] [reads per control message]
+	IPCBench_v2 endpoint [ports] [messages] [server shards]
+	IPCBench_v2 call [round trips] [request bytes] [reply bytes]
+	IPCBench_v2 gather [messages] [blob bytes...]
+	IPCBench_v2 suite [sizes] [fan-in senders] [fan-out receivers] [MB per test]
+*/
+
+#include"IPCBench_v2.h"
+#include<unistd.h>
+#include<sys/wait.h>
+
+//Monotonic time in seconds
+
+double BenchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+PIPC_PORT_TABLE BenchCreateTable()
+{
+	PIPC_PORT_TABLE pTable = (PIPC_PORT_TABLE)malloc(sizeof(IPC_PORT_TABLE));
+	if (pTable && !NT_SUCCESS(IPCPortTableInit(pTable)))
+	{
+		free(pTable);
+		pTable = NULL;
+	}
+	return pTable;
+}
+
+void BenchDestroyTable(PIPC_PORT_TABLE pTable)
+{
+	IPCPortTableDelete(pTable);
+	free(pTable);
+}
+
+//Prints the packet pool counters of a table
+
+void BenchPrintPool(PIPC_PORT_TABLE pTable)
+{
+	IPC_POOL_STATS PoolStats;
+
+	IPCPoolQueryStats(&(pTable->PktPool), &PoolStats);
+	printf("     pool allocs=%lld hits=%lld misses=%lld large=%lld hit-rate=%.2f%%\n",
+		(long long)PoolStats.nAllocs, (long long)PoolStats.nHits, (long long)PoolStats.nMisses,
+		(long long)PoolStats.nLargeAllocs, PoolStats.nAllocs ? 100.0 * PoolStats.nHits / PoolStats.nAllocs : 0.0);
+}
+
+//Creates nProcs simulated processes with PIDs spread like Windows PIDs (multiples of 4)
+//and registers a port for each one
+
+PBENCH_PROC BenchCreateProcs(PIPC_PORT_TABLE pTable, int nProcs, HANDLE* pPids)
+{
+	PBENCH_PROC pProcs = (PBENCH_PROC)calloc(nProcs, sizeof(BENCH_PROC));
+	int i;
+
+	if (!pProcs)
+	{
+		return NULL;
+	}
+
+	for (i = 0; i < nProcs; i++)
+	{
+		pPids[i] = (HANDLE)(ULONG_PTR)(4 * (1000 + i * 7 + rand() % 7));
+		KeInitializeEvent(&pProcs[i].Kevent, NotificationEvent, FALSE);
+		pProcs[i].pPort = IPCPortCreate(pTable, pPids[i], &pProcs[i].FileObj);
+		IPCPortSetEvent(pProcs[i].pPort, &pProcs[i].Kevent);
+		IPCPortTableInsert(pTable, pProcs[i].pPort);
+	}
+
+	return pProcs;
+}
+
+//Closes every simulated process the way IPCDrvClose does
+
+void BenchDestroyProcs(PIPC_PORT_TABLE pTable, PBENCH_PROC pProcs, int nProcs)
+{
+	int i;
+
+	for (i = 0; i < nProcs; i++)
+	{
+		IPCPortTableRemove(pTable, pProcs[i].pPort);
+		IPCPortDereference(pProcs[i].pPort);
+	}
+
+	free(pProcs);
+}
+
+PIPC_WIRE_HEADER BenchCreatePacket(size_t payloadbytes)
+{
+	PIPC_WIRE_HEADER pPkt = (PIPC_WIRE_HEADER)calloc(1, sizeof(IPC_WIRE_HEADER) + payloadbytes);
+	if (pPkt)
+	{
+		pPkt->bVersion = IPC_WIRE_VERSION;
+		pPkt->bFlags = IPC_WIRE_END_OF_MSG;
+		pPkt->cbPayload = (UINT32)payloadbytes;
+		memset(IPCWirePayload(pPkt), 'A', payloadbytes);
+	}
+	return pPkt;
+}
+
+//Routes messages from random senders to random destinations across a large number of ports.
+//Destination queues are drained between rounds so memory stays bounded
+
+int BenchRoute(int argc, char** argv)
+{
+	int nPorts = argc > 2 ? atoi(argv[2]) : 4096;
+	long nMsgs = argc > 3 ? atol(argv[3]) : 1000000;
+	size_t payloadbytes = argc > 4 ? (size_t)atol(argv[4]) : 16;
+	PIPC_PORT_TABLE pTable;
+	PBENCH_PROC pProcs;
+	HANDLE* pPids;
+	PIPC_WIRE_HEADER pPkt;
+	PIPC_PACKET pIn_Pkt;
+	double dStart, dRouted = 0;
+	long lSent = 0, lDropped = 0;
+	int i;
+
+	pTable = BenchCreateTable();
+	pPids = (HANDLE*)calloc(nPorts, sizeof(HANDLE));
+	pPkt = BenchCreatePacket(payloadbytes);
+	if (!pTable || !pPids || !pPkt)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	pProcs = BenchCreateProcs(pTable, nPorts, pPids);
+	if (!pProcs)
+	{
+		printf("Unable to create simulated processes\n");
+		return -1;
+	}
+
+	while (lSent < nMsgs)
+	{
+		long lRound = nMsgs - lSent < nPorts ? nMsgs - lSent : nPorts;
+		long r;
+
+		dStart = BenchNow();
+		for (r = 0; r < lRound; r++)
+		{
+			pPkt->dwPid = (UINT32)(ULONG_PTR)pPids[rand() % nPorts];
+			pPkt->uiMsgID = (UINT32)(lSent + r);
+			pIn_Pkt = IPCPacketCreate(pTable, pPkt, pPids[rand() % nPorts]);
+			if (!pIn_Pkt || !NT_SUCCESS(IPCRouteDeliver(pTable, pIn_Pkt)))
+			{
+				lDropped++;
+			}
+		}
+		dRouted += BenchNow() - dStart;
+		lSent += lRound;
+
+		for (i = 0; i < nPorts; i++)
+		{
+			while ((pIn_Pkt = IPCPortDequeue(pProcs[i].pPort)) != NULL)
+			{
+				IPCPacketFree(pTable, pIn_Pkt);
+			}
+		}
+	}
+
+	printf("route ports=%d msgs=%ld payload=%zu dropped=%ld ns/msg=%.1f msgs/s=%.0f\n",
+		nPorts, lSent, payloadbytes, lDropped, dRouted * 1e9 / lSent, lSent / dRouted);
+	BenchPrintPool(pTable);
+
+	BenchDestroyProcs(pTable, pProcs, nPorts);
+	free(pPids);
+	free(pPkt);
+	BenchDestroyTable(pTable);
+	return 0;
+}
+
+//Sends messages from one simulated process to another through the whole write, route and
+//read path, once with the original double copy routing and once with ownership transfer.
+//Reports packet copies per message and payload throughput for each message size
+
+int BenchCopy(int argc, char** argv)
+{
+	static const size_t DefaultSizes[] = { 16, 256, 4096, 65536, 1048576 };
+	static const char* ModeNames[] = { "transfer", "copy" };
+	long nMaxMsgs = argc > 2 ? atol(argv[2]) : 1000000;
+	int nSizes = argc > 3 ? argc - 3 : (int)(sizeof(DefaultSizes) / sizeof(DefaultSizes[0]));
+	int iSize, iMode;
+
+	for (iSize = 0; iSize < nSizes; iSize++)
+	{
+		size_t payloadbytes = argc > 3 ? (size_t)atol(argv[3 + iSize]) : DefaultSizes[iSize];
+		long nMsgs = (long)((1UL << 30) / (sizeof(IPC_WIRE_HEADER) + payloadbytes));
+		PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(payloadbytes);
+		char* pRecvBuf = (char*)malloc(sizeof(IPC_WIRE_HEADER) + payloadbytes);
+
+		if (!pUserPkt || !pRecvBuf)
+		{
+			printf("Unable to allocate benchmark buffers\n");
+			return -1;
+		}
+
+		if (nMsgs > nMaxMsgs)
+		{
+			nMsgs = nMaxMsgs;
+		}
+
+		for (iMode = IPC_ROUTE_COPY; iMode >= IPC_ROUTE_TRANSFER; iMode--)
+		{
+			PIPC_PORT_TABLE pTable = BenchCreateTable();
+			HANDLE Pids[2];
+			PBENCH_PROC pProcs = BenchCreateProcs(pTable, 2, Pids);
+			PIPC_PACKET pPkt;
+			double dStart, dElapsed;
+			long i;
+
+			pTable->RouteMode = (IPC_ROUTE_MODE)iMode;
+			pUserPkt->dwPid = (UINT32)(ULONG_PTR)Pids[1];
+
+			dStart = BenchNow();
+			for (i = 0; i < nMsgs; i++)
+			{
+				pPkt = IPCPacketCreate(pTable, pUserPkt, Pids[0]);
+				IPCRouteDeliver(pTable, pPkt);
+				pPkt = IPCPortDequeue(pProcs[1].pPort);
+				IPCPacketCopyOut(pTable, pRecvBuf, pPkt);
+				IPCPacketFree(pTable, pPkt);
+			}
+			dElapsed = BenchNow() - dStart;
+
+			printf("copy mode=%s payload=%zu msgs=%ld copies/msg=%.2f bytes-copied/msg=%.0f ns/msg=%.1f MB/s=%.1f\n",
+				ModeNames[iMode], payloadbytes, nMsgs,
+				(double)pTable->nPktCopies / nMsgs, (double)pTable->nPktBytesCopied / nMsgs,
+				dElapsed * 1e9 / nMsgs, nMsgs * (double)payloadbytes / dElapsed / 1e6);
+			BenchPrintPool(pTable);
+
+			BenchDestroyProcs(pTable, pProcs, 2);
+			BenchDestroyTable(pTable);
+		}
+
+		free(pUserPkt);
+		free(pRecvBuf);
+	}
+
+	return 0;
+}
+
+//Streams messages from a forked producer process to this process through the shared memory
+//ring transport. Only wakeups go through the kernel (futex), payloads never do
+
+int BenchRing(int argc, char** argv)
+{
+	long nMsgs = argc > 2 ? atol(argv[2]) : 5000000;
+	size_t payloadbytes = argc > 3 ? (size_t)atol(argv[3]) : 64;
+	uint32_t cbRing = argc > 4 ? (uint32_t)atol(argv[4]) : IPC_RING_DEFAULT_SIZE;
+	IPC_RING Ring;
+	PIPC_RING_RECORD pRecord;
+	uint32_t dwOwnerPid = (uint32_t)getpid();
+	double dStart, dElapsed;
+	long i, lErrors = 0;
+	pid_t Producer;
+	int iError;
+
+	iError = IPCRingCreate(&Ring, dwOwnerPid, cbRing);
+	if (iError)
+	{
+		printf("Unable to create ring:%d\n", iError);
+		return -1;
+	}
+
+	Producer = fork();
+	if (Producer == 0)
+	{
+		IPC_RING ProducerRing;
+
+		if (IPCRingOpen(&ProducerRing, dwOwnerPid))
+		{
+			_exit(1);
+		}
+		for (i = 0; i < nMsgs; i++)
+		{
+			pRecord = IPCRingReserve(&ProducerRing, payloadbytes, IPC_RING_INFINITE);
+			pRecord->uiMsgID = (uint32_t)i;
+			pRecord->uiSourcePID = (uint32_t)getpid();
+			pRecord->bEndofMsg = 1;
+			memset(pRecord->szMsg, 'A' + (int)(i % 26), payloadbytes);
+			IPCRingCommit(&ProducerRing, pRecord);
+		}
+		IPCRingClose(&ProducerRing);
+		_exit(0);
+	}
+
+	dStart = BenchNow();
+	for (i = 0; i < nMsgs; i++)
+	{
+		pRecord = IPCRingPeek(&Ring, 10000);
+		if (!pRecord)
+		{
+			printf("Timed out waiting for message %ld\n", i);
+			break;
+		}
+		if (pRecord->uiMsgID != (uint32_t)i || pRecord->MsgSize != payloadbytes ||
+			(payloadbytes && pRecord->szMsg[payloadbytes - 1] != 'A' + (int)(i % 26)))
+		{
+			lErrors++;
+		}
+		IPCRingRelease(&Ring, pRecord);
+	}
+	dElapsed = BenchNow() - dStart;
+	cbRing = Ring.uiMask + 1;
+
+	waitpid(Producer, NULL, 0);
+	IPCRingClose(&Ring);
+
+	printf("ring payload=%zu ring=%u msgs=%ld errors=%ld ns/msg=%.1f msgs/s=%.0f MB/s=%.1f\n",
+		payloadbytes, cbRing, i, lErrors, dElapsed * 1e9 / i, i / dElapsed,
+		i * (double)payloadbytes / dElapsed / 1e6);
+	return lErrors ? -1 : 0;
+}
+
+//Routes bursts from one sender to a few destinations, once packet by packet as IPCDrvWrite
+//does and once as IOCTL_SEND_BATCH does. Destination queues are drained after every burst
+
+int BenchBatch(int argc, char** argv)
+{
+	long nMsgs = argc > 2 ? atol(argv[2]) : 2000000;
+	int nBatch = argc > 3 ? atoi(argv[3]) : 256;
+	int nDests = argc > 4 ? atoi(argv[4]) : 4;
+	size_t payloadbytes = argc > 5 ? (size_t)atol(argv[5]) : 16;
+	PIPC_PACKET* ppPkts = (PIPC_PACKET*)calloc(nBatch, sizeof(PIPC_PACKET));
+	NTSTATUS* pStatus = (NTSTATUS*)calloc(nBatch, sizeof(NTSTATUS));
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(payloadbytes);
+	int iBatched;
+
+	if (!ppPkts || !pStatus || !pUserPkt || nDests < 1 || nBatch < 1)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	for (iBatched = 0; iBatched <= 1; iBatched++)
+	{
+		PIPC_PORT_TABLE pTable = BenchCreateTable();
+		HANDLE* pPids = (HANDLE*)calloc(nDests + 1, sizeof(HANDLE));
+		PBENCH_PROC pProcs = BenchCreateProcs(pTable, nDests + 1, pPids);
+		PIPC_PACKET pPkt;
+		double dStart, dElapsed = 0;
+		long lSent = 0, lFailed = 0;
+		int i, d;
+
+
+		while (lSent < nMsgs)
+		{
+			dStart = BenchNow();
+			for (i = 0; i < nBatch; i++)
+			{
+				pUserPkt->dwPid = (UINT32)(ULONG_PTR)pPids[1 + i % nDests];
+				pUserPkt->uiMsgID = (UINT32)(lSent + i);
+				ppPkts[i] = IPCPacketCreate(pTable, pUserPkt, pPids[0]);
+				pStatus[i] = ppPkts[i] ? STATUS_PENDING : STATUS_INSUFFICIENT_RESOURCES;
+				if (!iBatched && ppPkts[i])
+				{
+					pStatus[i] = IPCRouteDeliver(pTable, ppPkts[i]);
+				}
+			}
+			if (iBatched)
+			{
+				IPCRouteDeliverBatch(pTable, ppPkts, nBatch, pStatus, NULL);
+			}
+			dElapsed += BenchNow() - dStart;
+
+			for (i = 0; i < nBatch; i++)
+			{
+				if (!NT_SUCCESS(pStatus[i]))
+				{
+					lFailed++;
+				}
+			}
+			for (d = 1; d <= nDests; d++)
+			{
+				while ((pPkt = IPCPortDequeue(pProcs[d].pPort)) != NULL)
+				{
+					IPCPacketFree(pTable, pPkt);
+				}
+			}
+			lSent += nBatch;
+		}
+
+		printf("batch mode=%s batch=%d dests=%d payload=%zu msgs=%ld failed=%ld ns/msg=%.1f msgs/s=%.0f\n",
+			iBatched ? "batch" : "single", nBatch, nDests, payloadbytes, lSent, lFailed,
+			dElapsed * 1e9 / lSent, lSent / dElapsed);
+
+		BenchDestroyProcs(pTable, pProcs, nDests + 1);
+		BenchDestroyTable(pTable);
+		free(pPids);
+	}
+
+	free(ppPkts);
+	free(pStatus);
+	free(pUserPkt);
+	return 0;
+}
+
+//Fills a port's incoming queue and drains it, once one packet per read as IPCDrvRead does
+//and once with batch reads as IPCDrvRecvBatch does
+
+int BenchDrain(int argc, char** argv)
+{
+	long nDepth = argc > 2 ? atol(argv[2]) : 10000;
+	int nRounds = argc > 3 ? atoi(argv[3]) : 100;
+	size_t payloadbytes = argc > 4 ? (size_t)atol(argv[4]) : 64;
+	size_t cbBatch = argc > 5 ? (size_t)atol(argv[5]) : 65536;
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(payloadbytes);
+	char* pRecvBuf = (char*)malloc(cbBatch > sizeof(IPC_WIRE_HEADER) + payloadbytes ? cbBatch : sizeof(IPC_WIRE_HEADER) + payloadbytes);
+	int iBatched;
+
+	if (!pUserPkt || !pRecvBuf)
+	{
+		printf("Unable to allocate benchmark buffers\n");
+		return -1;
+	}
+
+	for (iBatched = 0; iBatched <= 1; iBatched++)
+	{
+		PIPC_PORT_TABLE pTable = BenchCreateTable();
+		HANDLE Pids[2];
+		PBENCH_PROC pProcs = BenchCreateProcs(pTable, 2, Pids);
+		PIPC_PACKET pPkt;
+		LIST_ENTRY Pkt_List;
+		size_t cbNext, uiOffset;
+		double dStart, dElapsed = 0;
+		long lRead = 0, lReads = 0, i;
+		int r;
+
+		pUserPkt->dwPid = (UINT32)(ULONG_PTR)Pids[1];
+
+		for (r = 0; r < nRounds; r++)
+		{
+			for (i = 0; i < nDepth; i++)
+			{
+				IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pUserPkt, Pids[0]));
+			}
+
+			dStart = BenchNow();
+			if (!iBatched)
+			{
+				while ((pPkt = IPCPortDequeue(pProcs[1].pPort)) != NULL)
+				{
+					IPCPacketCopyOut(pTable, pRecvBuf, pPkt);
+					IPCPacketFree(pTable, pPkt);
+					lRead++;
+					lReads++;
+				}
+			}
+			else
+			{
+				while (IPCPortDequeueBatch(pProcs[1].pPort, MAXULONG, cbBatch, &Pkt_List, &cbNext))
+				{
+					uiOffset = sizeof(IPC_BATCH_HEADER);
+					while (!IsListEmpty(&Pkt_List))
+					{
+						pPkt = CONTAINING_RECORD(RemoveHeadList(&Pkt_List), IPC_PACKET, list_entry);
+						uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+						uiOffset += IPCPacketCopyOut(pTable, pRecvBuf + uiOffset, pPkt);
+						IPCPacketFree(pTable, pPkt);
+						lRead++;
+					}
+					lReads++;
+				}
+			}
+			dElapsed += BenchNow() - dStart;
+		}
+
+		printf("drain mode=%s depth=%ld payload=%zu msgs=%ld reads=%ld msgs/read=%.1f ns/msg=%.1f msgs/s=%.0f\n",
+			iBatched ? "batch" : "single", nDepth, payloadbytes, lRead, lReads, (double)lRead / lReads,
+			dElapsed * 1e9 / lRead, lRead / dElapsed);
+
+		BenchDestroyProcs(pTable, pProcs, 2);
+		BenchDestroyTable(pTable);
+	}
+
+	free(pUserPkt);
+	free(pRecvBuf);
+	return 0;
+}
+
+//Reader hooks of the pending scenario, the user mode counterparts of IPCDrvParkRead,
+//IPCDrvTakeRead and IPCDrvCompleteRead
+
+static NTSTATUS BenchParkReader(PIPC_PORT pPort, PVOID pReader)
+{
+	PBENCH_PENDING_READS pPendingReads = (PBENCH_PENDING_READS)pPort->pReaderContext;
+	PBENCH_READER pBenchReader = (PBENCH_READER)pReader;
+
+	pBenchReader->pNext = NULL;
+	if (pPendingReads->pTail)
+	{
+		pPendingReads->pTail->pNext = pBenchReader;
+	}
+	else
+	{
+		pPendingReads->pHead = pBenchReader;
+	}
+	pPendingReads->pTail = pBenchReader;
+
+	return STATUS_PENDING;
+}
+
+static PVOID BenchTakeReader(PIPC_PORT pPort)
+{
+	PBENCH_PENDING_READS pPendingReads = (PBENCH_PENDING_READS)pPort->pReaderContext;
+	PBENCH_READER pBenchReader = pPendingReads->pHead;
+
+	if (pBenchReader)
+	{
+		pPendingReads->pHead = pBenchReader->pNext;
+		if (!pPendingReads->pHead)
+		{
+			pPendingReads->pTail = NULL;
+		}
+	}
+
+	return pBenchReader;
+}
+
+static BOOLEAN BenchCompleteReader(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, PVOID pReader, PIPC_PACKET pIPC_Pkt)
+{
+	PBENCH_READER pBenchReader = (PBENCH_READER)pReader;
+
+	pBenchReader->bCompleted = 1;
+	if (pBenchReader->cbBuffer < IPCPacketReadLength(pIPC_Pkt))
+	{
+		return FALSE;
+	}
+
+	pBenchReader->cbRead = IPCPacketCopyOut(pTable, pBenchReader->pBuffer, pIPC_Pkt);
+	IPCPacketFree(pTable, pIPC_Pkt);
+	return TRUE;
+}
+
+//Compares a reader polling after the packet was queued with a reader parked before it was
+//routed, which the routing core completes directly. Every nSmall-th parked reader has a
+//buffer too small for the packet, so the packet moves on to the next parked reader
+
+int BenchPending(int argc, char** argv)
+{
+	long nMsgs = argc > 2 ? atol(argv[2]) : 1000000;
+	size_t payloadbytes = argc > 3 ? (size_t)atol(argv[3]) : 64;
+	long nSmall = argc > 4 ? atol(argv[4]) : 0;
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(payloadbytes);
+	char* pRecvBuf = (char*)malloc(sizeof(IPC_WIRE_HEADER) + payloadbytes);
+	int iParked;
+
+	if (!pUserPkt || !pRecvBuf)
+	{
+		printf("Unable to allocate benchmark buffers\n");
+		return -1;
+	}
+
+	for (iParked = 0; iParked <= 1; iParked++)
+	{
+		PIPC_PORT_TABLE pTable = BenchCreateTable();
+		HANDLE Pids[2];
+		PBENCH_PROC pProcs;
+		PIPC_PACKET pPkt;
+		BENCH_READER SmallReader, Reader;
+		NTSTATUS ntStatus;
+		size_t cbRequired;
+		long lRead = 0, lSmall = 0, i;
+		double dStart, dElapsed;
+
+		pTable->ReaderOps.pfnParkReader = BenchParkReader;
+		pTable->ReaderOps.pfnTakeReader = BenchTakeReader;
+		pTable->ReaderOps.pfnCompleteReader = BenchCompleteReader;
+		pTable->ReaderOps.cbReaderContext = sizeof(BENCH_PENDING_READS);
+		pProcs = BenchCreateProcs(pTable, 2, Pids);
+		for (i = 0; i < 2; i++)
+		{
+			memset(pProcs[i].pPort->pReaderContext, 0, sizeof(BENCH_PENDING_READS));
+		}
+
+		pUserPkt->dwPid = (UINT32)(ULONG_PTR)Pids[1];
+
+		dStart = BenchNow();
+		for (i = 0; i < nMsgs; i++)
+		{
+			if (!iParked)
+			{
+				IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pUserPkt, Pids[0]));
+				pPkt = IPCPortDequeueOrPark(pProcs[1].pPort, sizeof(IPC_WIRE_HEADER) + payloadbytes, &Reader, &ntStatus, &cbRequired);
+				if (pPkt)
+				{
+					IPCPacketCopyOut(pTable, pRecvBuf, pPkt);
+					IPCPacketFree(pTable, pPkt);
+					lRead++;
+				}
+				continue;
+			}
+
+			if (nSmall && i % nSmall == 0)
+			{
+				memset(&SmallReader, 0, sizeof(SmallReader));
+				SmallReader.pBuffer = pRecvBuf;
+				SmallReader.cbBuffer = sizeof(IPC_WIRE_HEADER) - 1;
+				IPCPortDequeueOrPark(pProcs[1].pPort, SmallReader.cbBuffer, &SmallReader, &ntStatus, &cbRequired);
+			}
+			memset(&Reader, 0, sizeof(Reader));
+			Reader.pBuffer = pRecvBuf;
+			Reader.cbBuffer = sizeof(IPC_WIRE_HEADER) + payloadbytes;
+			IPCPortDequeueOrPark(pProcs[1].pPort, Reader.cbBuffer, &Reader, &ntStatus, &cbRequired);
+
+			IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pUserPkt, Pids[0]));
+			if (nSmall && i % nSmall == 0 && SmallReader.bCompleted && !SmallReader.cbRead)
+			{
+				lSmall++;
+			}
+			if (Reader.cbRead)
+			{
+				lRead++;
+			}
+		}
+		dElapsed = BenchNow() - dStart;
+
+		printf("pending mode=%s payload=%zu msgs=%ld read=%ld small-readers=%ld ns/msg=%.1f msgs/s=%.0f\n",
+			iParked ? "parked" : "poll", payloadbytes, nMsgs, lRead, lSmall, dElapsed * 1e9 / nMsgs, nMsgs / dElapsed);
+
+		BenchDestroyProcs(pTable, pProcs, 2);
+		BenchDestroyTable(pTable);
+	}
+
+	free(pUserPkt);
+	free(pRecvBuf);
+	return 0;
+}
+
+//Sending thread of the router and fanin scenarios, writes numbered packets the way IPCDrvWrite
+//queues them to the routing threads, or routes them straight away when there is no router. A mixed
+//sender routes every other packet itself after flushing its routing thread, as IPCDrvSendBatch does
+
+static void* BenchSenderMain(void* pContext)
+{
+	PBENCH_SENDER pSender = (PBENCH_SENDER)pContext;
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(pSender->payloadbytes);
+	PIPC_PACKET pPkt;
+	NTSTATUS ntStatus;
+	long i;
+
+	if (!pUserPkt)
+	{
+		return NULL;
+	}
+
+	pUserPkt->dwPid = (UINT32)(ULONG_PTR)pSender->DestPid;
+
+	for (i = 0; i < pSender->nMsgs; i++)
+	{
+		pUserPkt->uiMsgID = (UINT32)i;
+		pPkt = IPCPacketCreate(pSender->pTable, pUserPkt, pSender->SourcePid);
+		if (pPkt && pSender->pRouter && pSender->bMixed && (i & 1))
+		{
+			IPCRouterFlush(pSender->pRouter, (ULONG_PTR)pSender->SourcePid);
+			ntStatus = STATUS_PENDING;
+			IPCRouteDeliverBatch(pSender->pTable, &pPkt, 1, &ntStatus, NULL);
+		}
+		else if (pPkt && pSender->pRouter)
+		{
+			IPCRouterQueuePacket(pSender->pRouter, (ULONG_PTR)pSender->SourcePid, pPkt);
+		}
+		else if (pPkt)
+		{
+			IPCRouteDeliver(pSender->pTable, pPkt);
+		}
+	}
+
+	free(pUserPkt);
+	return NULL;
+}
+
+//Several sending processes write to one receiving process through the routing threads.
+//The receiver checks that the packets of every sender arrive in the order they were written,
+//and the drain latency of each routing thread is reported. With mixed set every other packet
+//is routed inline like a batch send, which must not overtake the queued writes before it
+
+int BenchRouter(int argc, char** argv)
+{
+	ULONG nThreads = argc > 2 ? (ULONG)atol(argv[2]) : 0;
+	int nSenders = argc > 3 ? atoi(argv[3]) : 4;
+	long nMsgs = argc > 4 ? atol(argv[4]) : 250000;
+	size_t payloadbytes = argc > 5 ? (size_t)atol(argv[5]) : 64;
+	int bMixed = argc > 6 ? atoi(argv[6]) : 0;
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	PBENCH_SENDER pSenders = (PBENCH_SENDER)calloc(nSenders, sizeof(BENCH_SENDER));
+	UINT32* pNextId = (UINT32*)calloc(nSenders, sizeof(UINT32));
+	IPC_ROUTER Router;
+	IPC_ROUTER_THREAD_STATS RouterStats;
+	HANDLE RecvPid;
+	PBENCH_PROC pRecv;
+	PIPC_PACKET pPkt;
+	long lReceived = 0, lOutOfOrder = 0, lTotal = (long)nSenders * nMsgs;
+	double dStart, dElapsed;
+	int s;
+	ULONG t;
+
+	if (!pTable || !pSenders || !pNextId)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	pRecv = BenchCreateProcs(pTable, 1, &RecvPid);
+	if (!pRecv || !NT_SUCCESS(IPCRouterStart(&Router, pTable, nThreads)))
+	{
+		printf("Unable to start the routing threads\n");
+		return -1;
+	}
+
+	dStart = BenchNow();
+	for (s = 0; s < nSenders; s++)
+	{
+		pSenders[s].pTable = pTable;
+		pSenders[s].pRouter = &Router;
+		pSenders[s].SourcePid = (HANDLE)(ULONG_PTR)(4 * (5000 + s));
+		pSenders[s].DestPid = RecvPid;
+		pSenders[s].nMsgs = nMsgs;
+		pSenders[s].payloadbytes = payloadbytes;
+		pSenders[s].bMixed = bMixed;
+		pthread_create(&pSenders[s].Thread, NULL, BenchSenderMain, &pSenders[s]);
+	}
+
+	//Receive everything, checking the per sender packet numbers
+
+	while (lReceived < lTotal)
+	{
+		IPCShimWaitForEvent(&pRecv[0].Kevent);
+		while ((pPkt = IPCPortDequeue(pRecv[0].pPort)) != NULL)
+		{
+			s = (int)(pPkt->header.dwSourcePid / 4 - 5000);
+			if (pPkt->header.nPacketid != pNextId[s])
+			{
+				lOutOfOrder++;
+			}
+			pNextId[s] = pPkt->header.nPacketid + 1;
+			IPCPacketFree(pTable, pPkt);
+			lReceived++;
+		}
+	}
+	dElapsed = BenchNow() - dStart;
+
+	for (s = 0; s < nSenders; s++)
+	{
+		pthread_join(pSenders[s].Thread, NULL);
+	}
+
+	//The routing threads finish their last drain before their counters are read
+
+	IPCRouterStop(&Router);
+
+	printf("router threads=%u senders=%d payload=%zu mode=%s msgs=%ld out-of-order=%ld ns/msg=%.1f msgs/s=%.0f\n",
+		Router.nThreads, nSenders, payloadbytes, bMixed ? "mixed" : "queued", lReceived, lOutOfOrder, dElapsed * 1e9 / lReceived, lReceived / dElapsed);
+	for (t = 0; t < Router.nThreads; t++)
+	{
+		IPCRouterQueryStats(&Router, t, &RouterStats);
+		printf("     thread %u pkts=%lld drains=%lld pkts/drain=%.1f avg-latency-us=%.1f max-latency-us=%.1f\n",
+			t, (long long)RouterStats.nPkts, (long long)RouterStats.nDrains,
+			RouterStats.nDrains ? (double)RouterStats.nPkts / RouterStats.nDrains : 0.0,
+			RouterStats.nPkts ? RouterStats.llLatencyTotal / 1e3 / RouterStats.nPkts : 0.0, RouterStats.llLatencyMax / 1e3);
+	}
+
+	IPCRouterFree(&Router);
+	BenchDestroyProcs(pTable, pRecv, 1);
+	BenchDestroyTable(pTable);
+	free(pSenders);
+	free(pNextId);
+	return 0;
+}
+
+//Many senders route straight into one receiving port, doubling the number of senders up to
+//the maximum, to show how the incoming queue lock scales. The receiver drains with
+//IPCPortDequeueBatch and checks the order of every sender's packets
+
+int BenchFanIn(int argc, char** argv)
+{
+	int nMaxSenders = argc > 2 ? atoi(argv[2]) : 8;
+	long nMsgs = argc > 3 ? atol(argv[3]) : 250000;
+	size_t payloadbytes = argc > 4 ? (size_t)atol(argv[4]) : 64;
+	PBENCH_SENDER pSenders = (PBENCH_SENDER)calloc(nMaxSenders, sizeof(BENCH_SENDER));
+	UINT32* pNextId = (UINT32*)calloc(nMaxSenders, sizeof(UINT32));
+	PIPC_PORT_TABLE pTable;
+	PBENCH_PROC pRecv;
+	HANDLE RecvPid;
+	LIST_ENTRY Pkt_List;
+	PIPC_PACKET pPkt;
+	size_t cbNext;
+	long lReceived, lOutOfOrder, lTotal, lReads;
+	double dStart, dElapsed;
+	int nSenders, s;
+
+	if (!pSenders || !pNextId)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	for (nSenders = 1; nSenders <= nMaxSenders; nSenders *= 2)
+	{
+		pTable = BenchCreateTable();
+		if (!pTable)
+		{
+			printf("Unable to create the port table\n");
+			return -1;
+		}
+		pRecv = BenchCreateProcs(pTable, 1, &RecvPid);
+
+		memset(pNextId, 0, nMaxSenders * sizeof(UINT32));
+		lReceived = 0;
+		lOutOfOrder = 0;
+		lReads = 0;
+		lTotal = (long)nSenders * nMsgs;
+
+		dStart = BenchNow();
+		for (s = 0; s < nSenders; s++)
+		{
+			pSenders[s].pTable = pTable;
+			pSenders[s].pRouter = NULL;
+			pSenders[s].SourcePid = (HANDLE)(ULONG_PTR)(4 * (5000 + s));
+			pSenders[s].DestPid = RecvPid;
+			pSenders[s].nMsgs = nMsgs;
+			pSenders[s].payloadbytes = payloadbytes;
+			pthread_create(&pSenders[s].Thread, NULL, BenchSenderMain, &pSenders[s]);
+		}
+
+		while (lReceived < lTotal)
+		{
+			IPCShimWaitForEvent(&pRecv[0].Kevent);
+			if (!IPCPortDequeueBatch(pRecv[0].pPort, 256, 1 << 20, &Pkt_List, &cbNext))
+			{
+				continue;
+			}
+			lReads++;
+
+			while (!IsListEmpty(&Pkt_List))
+			{
+				pPkt = CONTAINING_RECORD(RemoveHeadList(&Pkt_List), IPC_PACKET, list_entry);
+				s = (int)(pPkt->header.dwSourcePid / 4 - 5000);
+				if (pPkt->header.nPacketid != pNextId[s])
+				{
+					lOutOfOrder++;
+				}
+				pNextId[s] = pPkt->header.nPacketid + 1;
+				IPCPacketFree(pTable, pPkt);
+				lReceived++;
+			}
+		}
+		dElapsed = BenchNow() - dStart;
+
+		for (s = 0; s < nSenders; s++)
+		{
+			pthread_join(pSenders[s].Thread, NULL);
+		}
+
+		printf("fanin senders=%d payload=%zu msgs=%ld out-of-order=%ld pkts/read=%.1f ns/msg=%.1f msgs/s=%.0f\n",
+			nSenders, payloadbytes, lReceived, lOutOfOrder,
+			lReads ? (double)lReceived / lReads : 0.0, dElapsed * 1e9 / lReceived, lReceived / dElapsed);
+
+		BenchDestroyProcs(pTable, pRecv, 1);
+		BenchDestroyTable(pTable);
+	}
+
+	free(pSenders);
+	free(pNextId);
+	return 0;
+}
+
+//One sender delivers every message to the same set of recipients, with one unicast packet per
+//recipient and then with an explicit PID list, a group and a broadcast. The recipients read
+//every message after each send, the payload they get is checked against the one sent
+
+int BenchMulticast(int argc, char** argv)
+{
+	int nRecipients = argc > 2 ? atoi(argv[2]) : 64;
+	long nMsgs = argc > 3 ? atol(argv[3]) : 20000;
+	size_t payloadbytes = argc > 4 ? (size_t)atol(argv[4]) : 16384;
+	static const char* ModeNames[] = { "unicast", "pids", "group", "broadcast" };
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	HANDLE* pPids = (HANDLE*)calloc(nRecipients + 1, sizeof(HANDLE));
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(payloadbytes);
+	char* pRecvBuf = (char*)malloc(sizeof(IPC_WIRE_HEADER) + payloadbytes);
+	PBENCH_PROC pProcs;
+	PIPC_PACKET pPkt;
+	IPC_POOL_STATS PoolStats;
+	LONG64 nBytesBefore, nAllocsBefore;
+	long lBad, lReceived, i;
+	ULONG nDelivered;
+	double dStart, dElapsed;
+	int m, r;
+
+	if (!pTable || !pPids || !pUserPkt || !pRecvBuf)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	//Process 0 is the sender, it joins the group too and must not get its own messages
+
+	pProcs = BenchCreateProcs(pTable, nRecipients + 1, pPids);
+	for (r = 0; r <= nRecipients; r++)
+	{
+		IPCPortJoinGroup(pTable, pProcs[r].pPort, "bench");
+	}
+
+	for (m = 0; m < 4; m++)
+	{
+		IPCPoolQueryStats(&(pTable->PktPool), &PoolStats);
+		nAllocsBefore = PoolStats.nAllocs + PoolStats.nLargeAllocs;
+		nBytesBefore = pTable->nPktBytesCopied;
+		lBad = 0;
+		lReceived = 0;
+
+		dStart = BenchNow();
+		for (i = 0; i < nMsgs; i++)
+		{
+			pUserPkt->uiMsgID = (UINT32)i;
+			IPCWirePayload(pUserPkt)[0] = (char)i;
+
+			if (m == 0)
+			{
+				for (r = 1; r <= nRecipients; r++)
+				{
+					pUserPkt->dwPid = (UINT32)(ULONG_PTR)pPids[r];
+					IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pUserPkt, pPids[0]));
+				}
+			}
+			else
+			{
+				pPkt = IPCPacketCreate(pTable, pUserPkt, pPids[0]);
+				if (m == 1)
+				{
+					IPCRouteMulticast(pTable, pPkt, pPids + 1, nRecipients, NULL, &nDelivered);
+				}
+				else if (m == 2)
+				{
+					IPCRouteMulticastGroup(pTable, pPkt, "bench", pProcs[0].pPort, NULL, &nDelivered);
+				}
+				else
+				{
+					IPCRouteBroadcast(pTable, pPkt, pProcs[0].pPort, NULL, &nDelivered);
+				}
+			}
+
+			//Every recipient reads the message, the sender must have nothing queued
+
+			for (r = 0; r <= nRecipients; r++)
+			{
+				while ((pPkt = IPCPortDequeue(pProcs[r].pPort)) != NULL)
+				{
+					IPCPacketCopyOut(pTable, pRecvBuf, pPkt);
+					IPCPacketFree(pTable, pPkt);
+					if (r == 0 || ((PIPC_WIRE_HEADER)pRecvBuf)->uiMsgID != (UINT32)i ||
+						((PIPC_WIRE_HEADER)pRecvBuf)->dwPid != (UINT32)(ULONG_PTR)pPids[0] ||
+						memcmp(IPCWirePayload((PIPC_WIRE_HEADER)pRecvBuf), IPCWirePayload(pUserPkt), payloadbytes))
+					{
+						lBad++;
+					}
+					lReceived++;
+				}
+			}
+		}
+		dElapsed = BenchNow() - dStart;
+
+		IPCPoolQueryStats(&(pTable->PktPool), &PoolStats);
+		printf("multicast mode=%-9s recipients=%d payload=%zu msgs=%ld received=%ld bad=%ld allocs/msg=%.1f bytes-copied/msg=%.0f us/msg=%.2f\n",
+			ModeNames[m], nRecipients, payloadbytes, nMsgs, lReceived, lBad,
+			(double)(PoolStats.nAllocs + PoolStats.nLargeAllocs - nAllocsBefore) / nMsgs,
+			(double)(pTable->nPktBytesCopied - nBytesBefore) / nMsgs, dElapsed * 1e6 / nMsgs);
+	}
+
+	BenchDestroyProcs(pTable, pProcs, nRecipients + 1);
+	BenchDestroyTable(pTable);
+	free(pPids);
+	free(pUserPkt);
+	free(pRecvBuf);
+	return 0;
+}
+
+//Sends one message as fragments the way SendIPCStream does: each fragment is staged behind a
+//packet header, copied into a pool packet and routed before the next one is built
+
+static void* BenchStreamMain(void* pContext)
+{
+	PBENCH_STREAM pStream = (PBENCH_STREAM)pContext;
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(pStream->cbFragment);
+	PIPC_PACKET pPkt;
+	size_t uiOffset = 0;
+	size_t cbFragment;
+	UINT32 nFragment = 0;
+
+	if (!pUserPkt)
+	{
+		return NULL;
+	}
+
+	pUserPkt->dwPid = (UINT32)(ULONG_PTR)pStream->DestPid;
+
+	do
+	{
+		cbFragment = pStream->cbData - uiOffset < pStream->cbFragment ? pStream->cbData - uiOffset : pStream->cbFragment;
+		pUserPkt->uiMsgID = nFragment++;
+		pUserPkt->cbPayload = (UINT32)cbFragment;
+		pUserPkt->bFlags = (uiOffset + cbFragment == pStream->cbData) ? IPC_WIRE_END_OF_MSG : 0;
+		memcpy(IPCWirePayload(pUserPkt), pStream->pData + uiOffset, cbFragment);
+
+		pPkt = IPCPacketCreate(pStream->pTable, pUserPkt, pStream->SourcePid);
+		if (pPkt)
+		{
+			InterlockedExchangeAdd64(&(pStream->cbQueued), (LONG64)(sizeof(IPC_PACKET) + cbFragment));
+			IPCRouteDeliver(pStream->pTable, pPkt);
+		}
+		uiOffset += cbFragment;
+	} while (uiOffset < pStream->cbData);
+
+	free(pUserPkt);
+	return NULL;
+}
+
+//Transfers one large message from a sending thread to a receiving thread, whole or as 64KB
+//fragments reassembled into the receiver's buffer, and compares the throughput with a plain
+//memcpy of the message. The peak of packet bytes queued to the receiver is sampled on each read
+
+int BenchStream(int argc, char** argv)
+{
+	size_t cbData = (size_t)(argc > 2 ? atol(argv[2]) : 64) << 20;
+	int nRounds = argc > 3 ? atoi(argv[3]) : 4;
+	size_t FragmentSizes[] = { 0, 65280, 16384 };
+	char* pData = (char*)malloc(cbData);
+	char* pRecvBuf = (char*)malloc(cbData);
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	BENCH_STREAM Stream;
+	PBENCH_PROC pProcs;
+	HANDLE Pids[2];
+	LIST_ENTRY Pkt_List;
+	PIPC_PACKET pPkt;
+	IPC_POOL_STATS PoolStats;
+	LONG64 nLargeBefore, cbPeak, cbQueued;
+	size_t cbNext, cbReceived;
+	long lBad, nFragments;
+	double dStart, dElapsed;
+	int f, r, bEnd;
+
+	if (!pData || !pRecvBuf || !pTable)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	for (cbNext = 0; cbNext < cbData; cbNext++)
+	{
+		pData[cbNext] = (char)(cbNext * 31 + 7);
+	}
+	pProcs = BenchCreateProcs(pTable, 2, Pids);
+
+	dStart = BenchNow();
+	for (r = 0; r < nRounds; r++)
+	{
+		memcpy(pRecvBuf, pData, cbData);
+	}
+	dElapsed = BenchNow() - dStart;
+	printf("stream mode=memcpy   size=%zuMB GB/s=%.2f\n", cbData >> 20, (double)cbData * nRounds / dElapsed / 1e9);
+
+	for (f = 0; f < (int)(sizeof(FragmentSizes) / sizeof(FragmentSizes[0])); f++)
+	{
+		IPCPoolQueryStats(&(pTable->PktPool), &PoolStats);
+		nLargeBefore = PoolStats.nLargeAllocs;
+		cbPeak = 0;
+		lBad = 0;
+		nFragments = 0;
+
+		dStart = BenchNow();
+		for (r = 0; r < nRounds; r++)
+		{
+			memset(&Stream, 0, sizeof(Stream));
+			Stream.pTable = pTable;
+			Stream.SourcePid = Pids[0];
+			Stream.DestPid = Pids[1];
+			Stream.pData = pData;
+			Stream.cbData = cbData;
+			Stream.cbFragment = FragmentSizes[f] ? FragmentSizes[f] : cbData;
+			pthread_create(&Stream.Thread, NULL, BenchStreamMain, &Stream);
+
+			//Reassemble in the receiving thread while the fragments are still being sent
+
+			cbReceived = 0;
+			bEnd = 0;
+			while (!bEnd)
+			{
+				IPCShimWaitForEvent(&pProcs[1].Kevent);
+				cbQueued = Stream.cbQueued;
+				cbPeak = cbQueued > cbPeak ? cbQueued : cbPeak;
+				if (!IPCPortDequeueBatch(pProcs[1].pPort, MAXULONG, (size_t)1 << 20, &Pkt_List, &cbNext)
+					&& (!cbNext || !IPCPortDequeueBatch(pProcs[1].pPort, MAXULONG, IPC_BATCH_ALIGN_UP(sizeof(IPC_BATCH_HEADER)) + cbNext, &Pkt_List, &cbNext)))
+				{
+					continue;
+				}
+
+				while (!IsListEmpty(&Pkt_List))
+				{
+					pPkt = CONTAINING_RECORD(RemoveHeadList(&Pkt_List), IPC_PACKET, list_entry);
+					if (bEnd || cbReceived + pPkt->header.sizeofpayload > cbData)
+					{
+						lBad++;
+					}
+					else
+					{
+						memcpy(pRecvBuf + cbReceived, pPkt->szbuffer, pPkt->header.sizeofpayload);
+					}
+					cbReceived += pPkt->header.sizeofpayload;
+					InterlockedExchangeAdd64(&(Stream.cbQueued), -(LONG64)(sizeof(IPC_PACKET) + pPkt->header.sizeofpayload));
+					nFragments++;
+					bEnd = pPkt->header.EndofPacket;
+					IPCPacketFree(pTable, pPkt);
+				}
+			}
+			pthread_join(Stream.Thread, NULL);
+
+			if (cbReceived != cbData || memcmp(pRecvBuf, pData, cbData))
+			{
+				lBad++;
+			}
+		}
+		dElapsed = BenchNow() - dStart;
+
+		IPCPoolQueryStats(&(pTable->PktPool), &PoolStats);
+		printf("stream mode=%-8s size=%zuMB fragments/msg=%ld bad=%ld peak queued KB=%lld large allocs=%lld GB/s=%.2f\n",
+			FragmentSizes[f] ? (FragmentSizes[f] == 65280 ? "64KB" : "16KB") : "whole", cbData >> 20, nFragments / nRounds, lBad,
+			(long long)(cbPeak >> 10), (long long)(PoolStats.nLargeAllocs - nLargeBefore), (double)cbData * nRounds / dElapsed / 1e9);
+	}
+
+	BenchDestroyProcs(pTable, pProcs, 2);
+	BenchDestroyTable(pTable);
+	free(pData);
+	free(pRecvBuf);
+	return 0;
+}
+
+//Sends numbered packets through IPCRouteAdmit the way IPCDrvWrite does, a packet the overflow
+//policy rejects is counted and the next one is sent
+
+static void* BenchCreditMain(void* pContext)
+{
+	PBENCH_CREDIT pCredit = (PBENCH_CREDIT)pContext;
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(pCredit->payloadbytes);
+	PIPC_PACKET pPkt;
+	long i;
+
+	if (pUserPkt)
+	{
+		pUserPkt->dwPid = (UINT32)(ULONG_PTR)pCredit->DestPid;
+
+		for (i = 0; i < pCredit->nMsgs; i++)
+		{
+			pUserPkt->uiMsgID = (UINT32)i;
+			pPkt = IPCPacketCreate(pCredit->pTable, pUserPkt, pCredit->SourcePid);
+			if (!pPkt)
+			{
+				continue;
+			}
+			if (!NT_SUCCESS(IPCRouteAdmit(pCredit->pTable, pPkt, &(pCredit->Overflow))))
+			{
+				IPCPacketFree(pCredit->pTable, pPkt);
+				InterlockedIncrement64(&(pCredit->nRejected));
+				continue;
+			}
+			IPCRouteDeliver(pCredit->pTable, pPkt);
+			InterlockedIncrement64(&(pCredit->nDelivered));
+		}
+		free(pUserPkt);
+	}
+
+	InterlockedIncrement(&(pCredit->bDone));
+	return NULL;
+}
+
+//A fast sender and a receiver spending a fixed time on every packet. Without a limit the
+//receiver's queue grows with whatever the sender gets ahead by, with a limit it stays bounded
+//and the overflow policy decides whether the sender is slowed down, loses packets or drops the
+//receiver's oldest ones. Peak queued is sampled on every read, credits left must be 0 once the
+//receiver has drained its queue
+
+int BenchCredit(int argc, char** argv)
+{
+	ULONG nLimit = argc > 2 ? (ULONG)atol(argv[2]) : 256;
+	long nMsgs = argc > 3 ? atol(argv[3]) : 200000;
+	size_t payloadbytes = argc > 4 ? (size_t)atol(argv[4]) : 64;
+	double dReceiveTime = (argc > 5 ? atof(argv[5]) : 1000) / 1e9;
+	static const char* PolicyNames[] = { "unlimited", "fail", "block", "drop-oldest" };
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	IPC_QUEUE_LIMIT Limit;
+	BENCH_CREDIT Credit;
+	PBENCH_PROC pProcs;
+	HANDLE Pids[2];
+	PIPC_PACKET pPkt;
+	LONG64 nReceived, nQueued, nPeak;
+	long lOutOfOrder, lLastId;
+	double dStart, dElapsed, dBusy;
+	int p;
+
+	if (!pTable)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	pProcs = BenchCreateProcs(pTable, 2, Pids);
+
+	for (p = 0; p < 4; p++)
+	{
+		Limit.nMaxPkts = p ? nLimit : 0;
+		Limit.uiReserved = 0;
+		Limit.cbMaxBytes = 0;
+		IPCPortSetLimit(pProcs[1].pPort, &Limit);
+		pProcs[1].pPort->nDropped = 0;
+
+		memset(&Credit, 0, sizeof(Credit));
+		Credit.pTable = pTable;
+		Credit.SourcePid = Pids[0];
+		Credit.DestPid = Pids[1];
+		Credit.Overflow.uiPolicy = p == 2 ? IPC_OVERFLOW_BLOCK : (p == 3 ? IPC_OVERFLOW_DROP_OLDEST : IPC_OVERFLOW_FAIL);
+		Credit.Overflow.uiTimeoutMs = MAXULONG;
+		Credit.nMsgs = nMsgs;
+		Credit.payloadbytes = payloadbytes;
+
+		nReceived = 0;
+		nPeak = 0;
+		lOutOfOrder = 0;
+		lLastId = -1;
+
+		dStart = BenchNow();
+		pthread_create(&Credit.Thread, NULL, BenchCreditMain, &Credit);
+
+		//Read until everything delivered has been received or dropped
+
+		while (!Credit.bDone || nReceived + pProcs[1].pPort->nDropped < Credit.nDelivered)
+		{
+			pPkt = IPCPortDequeue(pProcs[1].pPort);
+			if (!pPkt)
+			{
+				sched_yield();
+				continue;
+			}
+
+			nQueued = Credit.nDelivered - nReceived - pProcs[1].pPort->nDropped;
+			nPeak = nQueued > nPeak ? nQueued : nPeak;
+			if ((long)pPkt->header.nPacketid <= lLastId)
+			{
+				lOutOfOrder++;
+			}
+			lLastId = (long)pPkt->header.nPacketid;
+			IPCPacketFree(pTable, pPkt);
+			nReceived++;
+
+			for (dBusy = BenchNow(); BenchNow() - dBusy < dReceiveTime;)
+			{
+			}
+		}
+		dElapsed = BenchNow() - dStart;
+		pthread_join(Credit.Thread, NULL);
+
+		printf("credit policy=%-11s limit=%lu payload=%zu msgs=%ld received=%lld rejected=%lld dropped=%lld out-of-order=%ld peak queued=%lld credits left=%ld ms=%.0f\n",
+			PolicyNames[p], (unsigned long)Limit.nMaxPkts, payloadbytes, nMsgs, (long long)nReceived, (long long)Credit.nRejected,
+			(long long)pProcs[1].pPort->nDropped, lOutOfOrder, (long long)nPeak, (long)pProcs[1].pPort->nQueuedPkts, dElapsed * 1e3);
+	}
+
+	BenchDestroyProcs(pTable, pProcs, 2);
+	BenchDestroyTable(pTable);
+	return 0;
+}
+
+static int BenchCompareDouble(const void* pLeft, const void* pRight)
+{
+	double dLeft = *(const double*)pLeft, dRight = *(const double*)pRight;
+	return dLeft < dRight ? -1 : dLeft > dRight;
+}
+
+//Control messages sharing a receiver with bulk traffic. Before every read the bulk sender tops
+//the receiver's backlog of large packets up, as a sender held back by flow control would, and
+//every few reads a small control message stamped with its send time is routed as well. The
+//receiver drains its port with 1MB batch reads the way IPCDrvRecvBatch does. With both in the
+//same lane a control message waits for the whole backlog to be read, in the control lane it is
+//read with the next batch whatever the backlog, and weighted reads bound its wait by the bulk
+//lane's weight. Everything runs on one thread so the latency is queueing alone
+
+int BenchLanes(int argc, char** argv)
+{
+	long nControl = argc > 2 ? atol(argv[2]) : 2000;
+	long nBacklog = argc > 3 ? atol(argv[3]) : 256;
+	size_t bulkbytes = argc > 4 ? (size_t)atol(argv[4]) : 16384;
+	long nEvery = argc > 5 ? atol(argv[5]) : 4;
+	static const char* ModeNames[] = { "same-lane", "strict", "weighted" };
+	size_t cbBatch = 1048576;
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	double* pLatency = (double*)malloc(nControl * sizeof(double));
+	char* pRecvBuf = (char*)malloc(cbBatch);
+	PIPC_WIRE_HEADER pBulkPkt = BenchCreatePacket(bulkbytes);
+	PIPC_WIRE_HEADER pControlPkt = BenchCreatePacket(64);
+	IPC_LANE_WEIGHTS Weights;
+	PBENCH_PROC pProcs;
+	HANDLE Pids[3];
+	PIPC_PACKET pPkt;
+	LIST_ENTRY Pkt_List;
+	size_t cbNext, uiOffset;
+	long nBulkSent, nBulkReceived, nControlSent, nLatency, nReads;
+	double dStart, dElapsed, dSent;
+	int m;
+
+	if (!pTable || !pLatency || !pRecvBuf || !pBulkPkt || !pControlPkt || nControl < 1 || nBacklog < 1 || nEvery < 1)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	pProcs = BenchCreateProcs(pTable, 3, Pids);
+
+	pBulkPkt->dwPid = (UINT32)(ULONG_PTR)Pids[2];
+	pBulkPkt->bPriority = 0;
+	pControlPkt->dwPid = (UINT32)(ULONG_PTR)Pids[2];
+
+	for (m = 0; m < 3; m++)
+	{
+		memset(&Weights, 0, sizeof(Weights));
+		if (m == 2)
+		{
+			Weights.Weights[0] = 8;
+			Weights.Weights[IPC_PRIORITY_LANES - 1] = 1;
+		}
+		IPCPortSetLaneWeights(pProcs[2].pPort, &Weights);
+		pControlPkt->bPriority = m ? IPC_PRIORITY_LANES - 1 : 0;
+
+		nBulkSent = nBulkReceived = nControlSent = nLatency = nReads = 0;
+		dStart = BenchNow();
+
+		while (nLatency < nControl)
+		{
+			for (; nBulkSent - nBulkReceived < nBacklog; nBulkSent++)
+			{
+				IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pBulkPkt, Pids[0]));
+			}
+			if (nReads % nEvery == 0 && nControlSent < nControl)
+			{
+				dSent = BenchNow();
+				memcpy(IPCWirePayload(pControlPkt), &dSent, sizeof(dSent));
+				IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pControlPkt, Pids[1]));
+				nControlSent++;
+			}
+
+			//Control latency is taken as the message is copied out of the batch
+
+			IPCPortDequeueBatch(pProcs[2].pPort, MAXULONG, cbBatch, &Pkt_List, &cbNext);
+			nReads++;
+
+			uiOffset = sizeof(IPC_BATCH_HEADER);
+			while (!IsListEmpty(&Pkt_List))
+			{
+				pPkt = CONTAINING_RECORD(RemoveHeadList(&Pkt_List), IPC_PACKET, list_entry);
+				uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+				uiOffset += IPCPacketCopyOut(pTable, pRecvBuf + uiOffset, pPkt);
+				if (pPkt->header.dwSourcePid == (DWORD32)(ULONG_PTR)Pids[1])
+				{
+					memcpy(&dSent, pPkt->szbuffer, sizeof(dSent));
+					pLatency[nLatency++] = BenchNow() - dSent;
+				}
+				else
+				{
+					nBulkReceived++;
+				}
+				IPCPacketFree(pTable, pPkt);
+			}
+		}
+		dElapsed = BenchNow() - dStart;
+
+		while ((pPkt = IPCPortDequeue(pProcs[2].pPort)) != NULL)
+		{
+			IPCPacketFree(pTable, pPkt);
+		}
+
+		qsort(pLatency, nControl, sizeof(double), BenchCompareDouble);
+		printf("lanes mode=%-9s backlog=%ld bulk payload=%zu control msgs=%ld control us p50=%.1f p99=%.1f max=%.1f bulk MB/s=%.0f\n",
+			ModeNames[m], nBacklog, bulkbytes, nControl, pLatency[nControl / 2] * 1e6, pLatency[nControl * 99 / 100] * 1e6,
+			pLatency[nControl - 1] * 1e6, nBulkReceived * (double)bulkbytes / dElapsed / 1e6);
+	}
+
+	BenchDestroyProcs(pTable, pProcs, 3);
+	BenchDestroyTable(pTable);
+	free(pLatency);
+	free(pRecvBuf);
+	free(pBulkPkt);
+	free(pControlPkt);
+	return 0;
+}
+
+//Routes to the same destinations once by PID and once by endpoint handle. The port table is
+//filled with far more ports than it has buckets, so a PID lookup walks a hash chain while a
+//handle goes straight to its slot. Then a server opens the device once per shard: by PID every
+//message reaches its first port, by the shards' endpoint handles the load is spread over all of them
+
+int BenchEndpoint(int argc, char** argv)
+{
+	int nPorts = argc > 2 ? atoi(argv[2]) : 16384;
+	long nMsgs = argc > 3 ? atol(argv[3]) : 2000000;
+	int nShards = argc > 4 ? atoi(argv[4]) : 8;
+	static const char* ModeNames[] = { "pid", "endpoint" };
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	HANDLE* pPids = (HANDLE*)calloc(nPorts, sizeof(HANDLE));
+	HANDLE* pDests = (HANDLE*)calloc(IPC_ENDPOINT_SLOTS, sizeof(HANDLE));
+	int* pTargets = (int*)calloc(nMsgs, sizeof(int));
+	long* pShardPkts = (long*)calloc(nShards, sizeof(long));
+	PIPC_WIRE_HEADER pPkt = BenchCreatePacket(16);
+	PBENCH_PROC pProcs;
+	BENCH_PROC* pShards;
+	PIPC_PACKET pIn_Pkt;
+	ULONG dwEndpoint;
+	char szName[IPC_ENDPOINT_NAME_MAX];
+	double dStart, dLookup, dRouted;
+	long lSent, lDropped, lMaxShare;
+	int nEndpoints, nUsed, m, i;
+
+	if (!pTable || !pPids || !pDests || !pTargets || !pShardPkts || !pPkt || nPorts < 1 || nShards < 1 || nShards >= IPC_ENDPOINT_SLOTS)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	//The endpoints are the first ports, messages go to them in a random order
+
+	pProcs = BenchCreateProcs(pTable, nPorts, pPids);
+	nEndpoints = nPorts < IPC_ENDPOINT_SLOTS - nShards ? nPorts : IPC_ENDPOINT_SLOTS - nShards;
+	for (i = 0; i < nEndpoints; i++)
+	{
+		snprintf(szName, sizeof(szName), "endpoint%d", i);
+		IPCPortRegisterEndpoint(pTable, pProcs[i].pPort, szName, &dwEndpoint);
+	}
+	for (lSent = 0; lSent < nMsgs; lSent++)
+	{
+		pTargets[lSent] = rand() % nEndpoints;
+	}
+
+	for (m = 0; m < 2; m++)
+	{
+		for (i = 0; i < nEndpoints; i++)
+		{
+			snprintf(szName, sizeof(szName), "endpoint%d", i);
+			IPCPortResolveEndpoint(pTable, szName, &dwEndpoint);
+			pDests[i] = m ? (HANDLE)(ULONG_PTR)dwEndpoint : pPids[i];
+		}
+
+		//Lookup alone, then the full route
+
+		dStart = BenchNow();
+		for (lSent = 0; lSent < nMsgs; lSent++)
+		{
+			PIPC_PORT pPort = IPCPortTableLookup(pTable, pDests[pTargets[lSent]]);
+
+			if (pPort)
+			{
+				IPCPortDereference(pPort);
+			}
+		}
+		dLookup = BenchNow() - dStart;
+
+		lSent = 0;
+		lDropped = 0;
+		dRouted = 0;
+
+		while (lSent < nMsgs)
+		{
+			long lRound = nMsgs - lSent < nEndpoints ? nMsgs - lSent : nEndpoints;
+			long r;
+
+			dStart = BenchNow();
+			for (r = 0; r < lRound; r++)
+			{
+				pPkt->dwPid = (UINT32)(ULONG_PTR)pDests[pTargets[lSent + r]];
+				pIn_Pkt = IPCPacketCreate(pTable, pPkt, pPids[nPorts - 1]);
+				if (!pIn_Pkt || !NT_SUCCESS(IPCRouteDeliver(pTable, pIn_Pkt)))
+				{
+					lDropped++;
+				}
+			}
+			dRouted += BenchNow() - dStart;
+			lSent += lRound;
+
+			for (i = 0; i < nEndpoints; i++)
+			{
+				while ((pIn_Pkt = IPCPortDequeue(pProcs[i].pPort)) != NULL)
+				{
+					IPCPacketFree(pTable, pIn_Pkt);
+				}
+			}
+		}
+
+		printf("endpoint lookup=%-8s ports=%d destinations=%d msgs=%ld dropped=%ld lookup ns=%.1f route ns/msg=%.1f msgs/s=%.0f\n",
+			ModeNames[m], nPorts, nEndpoints, lSent, lDropped, dLookup * 1e9 / nMsgs, dRouted * 1e9 / lSent, lSent / dRouted);
+	}
+
+	//A server process with one port per shard, all with the same PID
+
+	pShards = (BENCH_PROC*)calloc(nShards, sizeof(BENCH_PROC));
+	if (!pShards)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+	for (i = 0; i < nShards; i++)
+	{
+		pShards[i].pPort = IPCPortCreate(pTable, (HANDLE)(ULONG_PTR)4, &pShards[i].FileObj);
+		IPCPortTableInsert(pTable, pShards[i].pPort);
+		snprintf(szName, sizeof(szName), "shard%d", i);
+		IPCPortRegisterEndpoint(pTable, pShards[i].pPort, szName, &dwEndpoint);
+		pDests[i] = (HANDLE)(ULONG_PTR)dwEndpoint;
+	}
+
+	for (m = 0; m < 2; m++)
+	{
+		memset(pShardPkts, 0, nShards * sizeof(long));
+		for (lSent = 0; lSent < nShards * 10000L; lSent++)
+		{
+			pPkt->dwPid = (UINT32)(ULONG_PTR)(m ? pDests[lSent % nShards] : (HANDLE)(ULONG_PTR)4);
+			pIn_Pkt = IPCPacketCreate(pTable, pPkt, pPids[nPorts - 1]);
+			if (pIn_Pkt)
+			{
+				IPCRouteDeliver(pTable, pIn_Pkt);
+			}
+		}
+
+		nUsed = 0;
+		lMaxShare = 0;
+		for (i = 0; i < nShards; i++)
+		{
+			while ((pIn_Pkt = IPCPortDequeue(pShards[i].pPort)) != NULL)
+			{
+				IPCPacketFree(pTable, pIn_Pkt);
+				pShardPkts[i]++;
+			}
+			nUsed += pShardPkts[i] != 0;
+			lMaxShare = pShardPkts[i] > lMaxShare ? pShardPkts[i] : lMaxShare;
+		}
+
+		printf("endpoint shards=%d addressed by=%-8s msgs=%ld ports used=%d busiest port share=%.1f%%\n",
+			nShards, ModeNames[m], lSent, nUsed, 100.0 * lMaxShare / lSent);
+	}
+
+	for (i = 0; i < nShards; i++)
+	{
+		IPCPortTableRemove(pTable, pShards[i].pPort);
+		IPCPortDereference(pShards[i].pPort);
+	}
+	free(pShards);
+
+	BenchDestroyProcs(pTable, pProcs, nPorts);
+	BenchDestroyTable(pTable);
+	free(pPids);
+	free(pDests);
+	free(pTargets);
+	free(pShardPkts);
+	free(pPkt);
+	return 0;
+}
+
+//Call hook of the call scenario, copies the reply into the caller's buffer
+
+static VOID BenchCompleteCall(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, const IPC_WIRE_HEADER* pReply)
+{
+	PBENCH_CALL pBenchCall = CONTAINING_RECORD(pCall, BENCH_CALL, Call);
+
+	pBenchCall->cbReply = 0;
+	if (pReply)
+	{
+		pBenchCall->cbReply = IPCWireLength(pReply);
+		memcpy(pBenchCall->pBuffer, pReply, pBenchCall->cbReply);
+	}
+	pBenchCall->bCompleted = 1;
+}
+
+//Request/response round trips between two processes, once as two plain messages and once as a
+//call. As messages the request is queued to the callee, read, and the reply is queued back to the
+//caller, whose Read notification is signalled before it reads the reply: every packet is allocated,
+//queued, dequeued and copied out. As a call the callee's reply is matched to the waiting caller by
+//call ID and copied straight into its buffer. Both run on one thread so the latency is the driver
+//work alone, the user/kernel transitions saved (a read per round trip) come on top
+
+int BenchCall(int argc, char** argv)
+{
+	long nCalls = argc > 2 ? atol(argv[2]) : 200000;
+	size_t requestbytes = argc > 3 ? (size_t)atol(argv[3]) : 64;
+	size_t replybytes = argc > 4 ? (size_t)atol(argv[4]) : 64;
+	static const char* ModeNames[] = { "message", "call" };
+	size_t cbBuffer = sizeof(IPC_WIRE_HEADER) + sizeof(IPC_WIRE_CALL_ID) + (requestbytes > replybytes ? requestbytes : replybytes);
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	double* pLatency = (double*)malloc(nCalls * sizeof(double));
+	char* pCallerBuf = (char*)malloc(cbBuffer);
+	char* pCalleeBuf = (char*)malloc(cbBuffer);
+	PIPC_WIRE_HEADER pRequestPkt = BenchCreatePacket(requestbytes);
+	PIPC_WIRE_HEADER pReplyPkt = BenchCreatePacket(replybytes);
+	PIPC_WIRE_HEADER pCallReplyPkt = BenchCreatePacket(sizeof(IPC_WIRE_CALL_ID) + replybytes);
+	BENCH_CALL BenchCall;
+	PBENCH_PROC pProcs;
+	HANDLE Pids[2];
+	PIPC_PACKET pPkt;
+	long i, nFailed;
+	double dStart, dElapsed, dCall;
+	int m;
+
+	if (!pTable || !pLatency || !pCallerBuf || !pCalleeBuf || !pRequestPkt || !pReplyPkt || !pCallReplyPkt || nCalls < 1)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	pTable->pfnCompleteCall = BenchCompleteCall;
+	pProcs = BenchCreateProcs(pTable, 2, Pids);
+
+	pRequestPkt->dwPid = (UINT32)(ULONG_PTR)Pids[1];
+	pReplyPkt->dwPid = (UINT32)(ULONG_PTR)Pids[0];
+
+	//A reply written with IOCTL_REPLY carries the call ID between its header and payload
+
+	pCallReplyPkt->bFlags |= IPC_WIRE_CALL;
+	pCallReplyPkt->cbPayload = (UINT32)replybytes;
+	pCallReplyPkt->dwPid = (UINT32)(ULONG_PTR)Pids[0];
+
+	for (m = 0; m < 2; m++)
+	{
+		nFailed = 0;
+		dStart = BenchNow();
+
+		for (i = 0; i < nCalls; i++)
+		{
+			dCall = BenchNow();
+
+			if (m == 0)
+			{
+				//Request written by the caller and read by the callee
+
+				IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pRequestPkt, Pids[0]));
+				pPkt = IPCPortDequeue(pProcs[1].pPort);
+				IPCPacketCopyOut(pTable, pCalleeBuf, pPkt);
+				IPCPacketFree(pTable, pPkt);
+
+				//Reply written by the callee, the caller wakes on its event and reads it
+
+				IPCRouteDeliver(pTable, IPCPacketCreate(pTable, pReplyPkt, Pids[1]));
+				pPkt = IPCPortDequeue(pProcs[0].pPort);
+				if (!pPkt)
+				{
+					nFailed++;
+					continue;
+				}
+				IPCPacketCopyOut(pTable, pCallerBuf, pPkt);
+				IPCPacketFree(pTable, pPkt);
+			}
+			else
+			{
+				//IOCTL_CALL registers the call and routes the request, the callee reads it
+
+				BenchCall.pBuffer = pCallerBuf;
+				BenchCall.bCompleted = 0;
+				IPCCallRegister(pTable, &(BenchCall.Call), pProcs[0].pPort, cbBuffer);
+				IPCRouteCall(pTable, &(BenchCall.Call), IPCPacketCreate(pTable, pRequestPkt, Pids[0]), NULL);
+				pPkt = IPCPortDequeue(pProcs[1].pPort);
+				IPCPacketCopyOut(pTable, pCalleeBuf, pPkt);
+				IPCPacketFree(pTable, pPkt);
+
+				//IOCTL_REPLY completes the caller with the reply
+
+				((PIPC_WIRE_CALL_ID)(pCallReplyPkt + 1))->uiCallId = IPCWireCallId((PIPC_WIRE_HEADER)pCalleeBuf);
+				if (!NT_SUCCESS(IPCRouteReply(pTable, pCallReplyPkt, Pids[1])) || !BenchCall.bCompleted || !BenchCall.cbReply)
+				{
+					nFailed++;
+				}
+			}
+
+			pLatency[i] = BenchNow() - dCall;
+		}
+		dElapsed = BenchNow() - dStart;
+
+		qsort(pLatency, nCalls, sizeof(double), BenchCompareDouble);
+		printf("call mode=%-7s request=%zu reply=%zu round trips=%ld failed=%ld us p50=%.2f p99=%.2f max=%.2f round trips/s=%.0f\n",
+			ModeNames[m], requestbytes, replybytes, nCalls, nFailed, pLatency[nCalls / 2] * 1e6, pLatency[nCalls * 99 / 100] * 1e6,
+			pLatency[nCalls - 1] * 1e6, nCalls / dElapsed);
+		BenchPrintPool(pTable);
+	}
+
+	BenchDestroyProcs(pTable, pProcs, 2);
+	BenchDestroyTable(pTable);
+	free(pLatency);
+	free(pCallerBuf);
+	free(pCalleeBuf);
+	free(pRequestPkt);
+	free(pReplyPkt);
+	free(pCallReplyPkt);
+	return 0;
+}
+
+//Returns the counters of dwPID in a statistics query, NULL if the port was not returned
+
+static PIPC_PORT_STATS BenchFindPortStats(PIPC_STATS pStats, DWORD32 dwPID)
+{
+	UINT32 i;
+
+	for (i = 0; i < pStats->nReturned; i++)
+	{
+		if (pStats->Ports[i].dwPID == dwPID)
+		{
+			return &(pStats->Ports[i]);
+		}
+	}
+	return NULL;
+}
+
+//Several senders route straight into one receiver which reads nothing until they are done, then
+//drains its queue, a sender writes to a PID nobody registered and the senders close. The runtime
+//statistics are queried after every step the way IOCTL_QUERY_STATS does and checked against what
+//was sent, including the counters of the closed ports which the totals must keep
+
+int BenchStats(int argc, char** argv)
+{
+	int nSenders = argc > 2 ? atoi(argv[2]) : 4;
+	long nMsgs = argc > 3 ? atol(argv[3]) : 250000;
+	size_t payloadbytes = argc > 4 ? (size_t)atol(argv[4]) : 64;
+	long nUndeliverable = 1000;
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	PBENCH_SENDER pSenders = (PBENCH_SENDER)calloc(nSenders, sizeof(BENCH_SENDER));
+	HANDLE* pSenderPids = (HANDLE*)calloc(nSenders, sizeof(HANDLE));
+	PIPC_STATS pStats = (PIPC_STATS)malloc(sizeof(IPC_STATS) + (nSenders + 1) * sizeof(IPC_PORT_STATS));
+	UINT64 nTotal = (UINT64)nSenders * nMsgs;
+	PBENCH_PROC pSenderProcs, pRecv;
+	PIPC_PORT_STATS pRecvStats, pSenderStats;
+	PIPC_WIRE_HEADER pUserPkt;
+	PIPC_PACKET pPkt;
+	HANDLE RecvPid;
+	double dStart, dSend, dQuery;
+	int nErrors = 0;
+	long i;
+	int s;
+
+	if (!pTable || !pSenders || !pSenderPids || !pStats || !(pUserPkt = BenchCreatePacket(payloadbytes)))
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	pSenderProcs = BenchCreateProcs(pTable, nSenders, pSenderPids);
+	pRecv = BenchCreateProcs(pTable, 1, &RecvPid);
+
+	dStart = BenchNow();
+	for (s = 0; s < nSenders; s++)
+	{
+		pSenders[s].pTable = pTable;
+		pSenders[s].SourcePid = pSenderPids[s];
+		pSenders[s].DestPid = RecvPid;
+		pSenders[s].nMsgs = nMsgs;
+		pSenders[s].payloadbytes = payloadbytes;
+		pthread_create(&pSenders[s].Thread, NULL, BenchSenderMain, &pSenders[s]);
+	}
+	for (s = 0; s < nSenders; s++)
+	{
+		pthread_join(pSenders[s].Thread, NULL);
+	}
+	dSend = BenchNow() - dStart;
+
+	//Everything is queued and nothing read
+
+	dStart = BenchNow();
+	IPCPortTableQueryStats(pTable, pStats, nSenders + 1);
+	dQuery = BenchNow() - dStart;
+	pRecvStats = BenchFindPortStats(pStats, (DWORD32)(ULONG_PTR)RecvPid);
+	if (pStats->nReturned != (UINT32)nSenders + 1 || !pRecvStats || pRecvStats->nPktsIn != nTotal ||
+		pRecvStats->cbBytesIn != nTotal * payloadbytes || pRecvStats->nDepth != nTotal || pStats->Totals.nPktsIn != nTotal)
+	{
+		printf("stats queued: counters do not match what was sent\n");
+		nErrors++;
+	}
+
+	//Drain, the first read moves the whole queue into the lanes so the peak is everything sent
+
+	while ((pPkt = IPCPortDequeue(pRecv[0].pPort)) != NULL)
+	{
+		IPCPacketFree(pTable, pPkt);
+	}
+	IPCPortTableQueryStats(pTable, pStats, nSenders + 1);
+	pRecvStats = BenchFindPortStats(pStats, (DWORD32)(ULONG_PTR)RecvPid);
+	if (!pRecvStats || pRecvStats->nPktsOut != nTotal || pRecvStats->cbBytesOut != nTotal * payloadbytes ||
+		pRecvStats->nDepth != 0 || pRecvStats->nPeakDepth != nTotal || pStats->Totals.nPktsOut != nTotal)
+	{
+		printf("stats drained: counters do not match what was read\n");
+		nErrors++;
+	}
+
+	//Undeliverable packets are counted against their sender
+
+	pUserPkt->dwPid = 4 * 999;
+	for (i = 0; i < nUndeliverable; i++)
+	{
+		pPkt = IPCPacketCreate(pTable, pUserPkt, pSenderPids[0]);
+		if (pPkt)
+		{
+			IPCRouteDeliver(pTable, pPkt);
+		}
+	}
+	IPCPortTableQueryStats(pTable, pStats, nSenders + 1);
+	pSenderStats = BenchFindPortStats(pStats, (DWORD32)(ULONG_PTR)pSenderPids[0]);
+	if (!pSenderStats || pSenderStats->nUndeliverable != (UINT64)nUndeliverable || pStats->Totals.nUndeliverable != (UINT64)nUndeliverable)
+	{
+		printf("stats undeliverable: counters do not match what was sent\n");
+		nErrors++;
+	}
+
+	//Closed ports leave the list, their counters stay in the totals
+
+	BenchDestroyProcs(pTable, pSenderProcs, nSenders);
+	IPCPortTableQueryStats(pTable, pStats, nSenders + 1);
+	if (pStats->nPorts != 1 || pStats->Totals.nPktsIn != nTotal || pStats->Totals.nPktsOut != nTotal ||
+		pStats->Totals.nUndeliverable != (UINT64)nUndeliverable || pStats->Totals.nPeakDepth != nTotal)
+	{
+		printf("stats closed: totals lost the counters of the closed ports\n");
+		nErrors++;
+	}
+
+	printf("stats senders=%d payload=%zu msgs=%llu undeliverable=%llu peak=%u errors=%d msgs/s=%.0f query-us=%.1f\n",
+		nSenders, payloadbytes, (unsigned long long)pStats->Totals.nPktsOut, (unsigned long long)pStats->Totals.nUndeliverable,
+		pStats->Totals.nPeakDepth, nErrors, nTotal / dSend, dQuery * 1e6);
+
+	BenchDestroyProcs(pTable, pRecv, 1);
+	BenchDestroyTable(pTable);
+	free(pUserPkt);
+	free(pStats);
+	free(pSenderPids);
+	free(pSenders);
+	return nErrors ? 1 : 0;
+}
+
+//Returns the upper bound in nanoseconds of the bucket holding the dPercentile'th span of a histogram
+
+static double BenchTracePercentile(const UINT64* pCounts, UINT64 nTotal, double dPercentile)
+{
+	UINT64 nSeen = 0;
+	int b;
+
+	for (b = 0; b < IPC_TRACE_BUCKETS; b++)
+	{
+		nSeen += pCounts[b];
+		if (nSeen && nSeen >= nTotal * dPercentile)
+		{
+			break;
+		}
+	}
+	return (double)((UINT64)2 << (b < IPC_TRACE_BUCKETS ? b : IPC_TRACE_BUCKETS - 1));
+}
+
+//Several senders write to one receiver through the routing threads, once with tracing switched off
+//and once on. Every packet read while tracing is on must carry its stamps in order, and the port's
+//histograms must count every packet. The percentiles of each span are reported along with the cost
+//of tracing, the difference in ns/msg between the two runs
+
+int BenchTrace(int argc, char** argv)
+{
+	static const char* SpanNames[IPC_TRACE_SPANS] = { "copy", "route", "queue", "total" };
+	int nSenders = argc > 2 ? atoi(argv[2]) : 4;
+	long nMsgs = argc > 3 ? atol(argv[3]) : 100000;
+	size_t payloadbytes = argc > 4 ? (size_t)atol(argv[4]) : 64;
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	PBENCH_SENDER pSenders = (PBENCH_SENDER)calloc(nSenders, sizeof(BENCH_SENDER));
+	char* pRecvBuf = (char*)malloc(sizeof(IPC_WIRE_HEADER) + payloadbytes + sizeof(IPC_PACKET_TRACE));
+	long lTotal = (long)nSenders * nMsgs;
+	IPC_TRACE_STATS TraceStats;
+	IPC_PACKET_TRACE Trace;
+	IPC_ROUTER Router;
+	HANDLE RecvPid;
+	PBENCH_PROC pRecv;
+	PIPC_PACKET pPkt;
+	long lReceived, lBadStamps = 0;
+	double dElapsed[2];
+	UINT64 nCounted;
+	size_t cbRead;
+	int nErrors = 0;
+	int bTrace, s, b;
+
+	if (!pTable || !pSenders || !pRecvBuf)
+	{
+		printf("Unable to allocate benchmark state\n");
+		return -1;
+	}
+
+	pRecv = BenchCreateProcs(pTable, 1, &RecvPid);
+	if (!pRecv || !NT_SUCCESS(IPCRouterStart(&Router, pTable, 0)))
+	{
+		printf("Unable to start the routing threads\n");
+		return -1;
+	}
+
+	for (bTrace = 0; bTrace < 2; bTrace++)
+	{
+		if (!NT_SUCCESS(IPCPortSetTrace(pTable, pRecv[0].pPort, (BOOLEAN)bTrace)))
+		{
+			printf("trace: tracing is compiled out\n");
+			nErrors++;
+			break;
+		}
+
+		lReceived = 0;
+		dElapsed[bTrace] = BenchNow();
+		for (s = 0; s < nSenders; s++)
+		{
+			pSenders[s].pTable = pTable;
+			pSenders[s].pRouter = &Router;
+			pSenders[s].SourcePid = (HANDLE)(ULONG_PTR)(4 * (5000 + s));
+			pSenders[s].DestPid = RecvPid;
+			pSenders[s].nMsgs = nMsgs;
+			pSenders[s].payloadbytes = payloadbytes;
+			pthread_create(&pSenders[s].Thread, NULL, BenchSenderMain, &pSenders[s]);
+		}
+
+		//Read everything the way IPCDrvRead does, the stamps follow the payload of a traced packet
+
+		while (lReceived < lTotal)
+		{
+			IPCShimWaitForEvent(&pRecv[0].Kevent);
+			while ((pPkt = IPCPortDequeue(pRecv[0].pPort)) != NULL)
+			{
+				cbRead = IPCPacketCopyOut(pTable, pRecvBuf, pPkt);
+				IPCPacketFree(pTable, pPkt);
+				lReceived++;
+
+				if (cbRead != sizeof(IPC_WIRE_HEADER) + payloadbytes + (bTrace ? sizeof(IPC_PACKET_TRACE) : 0))
+				{
+					lBadStamps++;
+				}
+				else if (bTrace)
+				{
+					memcpy(&Trace, pRecvBuf + sizeof(IPC_WIRE_HEADER) + payloadbytes, sizeof(IPC_PACKET_TRACE));
+					if (!Trace.Stamps[IPC_TRACE_WRITE] || Trace.Stamps[IPC_TRACE_WRITE] > Trace.Stamps[IPC_TRACE_COPIED] ||
+						Trace.Stamps[IPC_TRACE_COPIED] > Trace.Stamps[IPC_TRACE_QUEUED] || Trace.Stamps[IPC_TRACE_QUEUED] > Trace.Stamps[IPC_TRACE_READ])
+					{
+						lBadStamps++;
+					}
+				}
+			}
+		}
+		dElapsed[bTrace] = BenchNow() - dElapsed[bTrace];
+
+		for (s = 0; s < nSenders; s++)
+		{
+			pthread_join(pSenders[s].Thread, NULL);
+		}
+	}
+
+	if (bTrace == 2)
+	{
+		if (lBadStamps)
+		{
+			printf("trace: %ld packets read without their stamps or with stamps out of order\n", lBadStamps);
+			nErrors++;
+		}
+
+		IPCPortQueryTrace(pTable, RecvPid, &TraceStats);
+		printf("trace senders=%d payload=%zu msgs=%ld ns/msg off=%.1f on=%.1f\n",
+			nSenders, payloadbytes, lTotal, dElapsed[0] * 1e9 / lTotal, dElapsed[1] * 1e9 / lTotal);
+		for (s = 0; s < IPC_TRACE_SPANS; s++)
+		{
+			for (b = 0, nCounted = 0; b < IPC_TRACE_BUCKETS; b++)
+			{
+				nCounted += TraceStats.Counts[s][b];
+			}
+			if (nCounted != (UINT64)lTotal)
+			{
+				printf("trace: the %s histogram counted %llu of %ld packets\n", SpanNames[s], (unsigned long long)nCounted, lTotal);
+				nErrors++;
+			}
+			printf("     %-5s p50<%.0fns p90<%.0fns p99<%.0fns p99.9<%.0fns\n", SpanNames[s],
+				BenchTracePercentile(TraceStats.Counts[s], nCounted, 0.5), BenchTracePercentile(TraceStats.Counts[s], nCounted, 0.9),
+				BenchTracePercentile(TraceStats.Counts[s], nCounted, 0.99), BenchTracePercentile(TraceStats.Counts[s], nCounted, 0.999));
+		}
+	}
+
+	IPCRouterStop(&Router);
+	IPCRouterFree(&Router);
+	BenchDestroyProcs(pTable, pRecv, 1);
+	BenchDestroyTable(pTable);
+	free(pRecvBuf);
+	free(pSenders);
+	return nErrors ? 1 : 0;
+}
+
+//Gather hook of the benchmark, the sender's memory is this process's
+
+static NTSTATUS BenchCopySegment(PVOID pDst, const IPC_GATHER_SEGMENT* pSegment)
+{
+	memcpy(pDst, (const void*)(ULONG_PTR)pSegment->pData, pSegment->cbData);
+	return STATUS_SUCCESS;
+}
+
+//Sends a message made of a 64 byte header, a blob and a 16 byte trailer kept in separate buffers.
+//"assemble" copies them into an IPCMSG and then into a send buffer as SendIPCMsg does before the
+//routing core copies the packet in, "gather" hands the routing core the three segments the way
+//SendIPCMsgGather does. Every received payload is checked, the user mode bytes copied are counted
+//along with the routing core's
+
+int BenchGather(int argc, char** argv)
+{
+	static const size_t DefaultSizes[] = { 256, 4096, 65536, 1048576 };
+	static const char* ModeNames[] = { "assemble", "gather" };
+	long nMaxMsgs = argc > 2 ? atol(argv[2]) : 200000;
+	int nSizes = argc > 3 ? argc - 3 : (int)(sizeof(DefaultSizes) / sizeof(DefaultSizes[0]));
+	char Header[64], Trailer[16];
+	int iSize, iMode, nErrors = 0;
+
+	memset(Header, 'H', sizeof(Header));
+	memset(Trailer, 'T', sizeof(Trailer));
+
+	for (iSize = 0; iSize < nSizes; iSize++)
+	{
+		size_t cbBlob = argc > 3 ? (size_t)atol(argv[3 + iSize]) : DefaultSizes[iSize];
+		size_t payloadbytes = sizeof(Header) + cbBlob + sizeof(Trailer);
+		long nMsgs = (long)((1UL << 30) / (sizeof(IPC_WIRE_HEADER) + payloadbytes));
+		char* pBlob = (char*)malloc(cbBlob);
+		char* pMsg = (char*)malloc(payloadbytes);
+		PIPC_WIRE_HEADER pSendPkt = BenchCreatePacket(payloadbytes);
+		char* pRecvBuf = (char*)malloc(sizeof(IPC_WIRE_HEADER) + payloadbytes);
+		struct
+		{
+			IPC_GATHER_HEADER Header;
+			IPC_GATHER_SEGMENT Segments[3];
+		}Gather;
+
+		if (!pBlob || !pMsg || !pSendPkt || !pRecvBuf)
+		{
+			printf("Unable to allocate benchmark buffers\n");
+			return -1;
+		}
+		memset(pBlob, 'B', cbBlob);
+
+		if (nMsgs > nMaxMsgs)
+		{
+			nMsgs = nMaxMsgs;
+		}
+
+		for (iMode = 0; iMode < 2; iMode++)
+		{
+			PIPC_PORT_TABLE pTable = BenchCreateTable();
+			HANDLE Pids[2];
+			PBENCH_PROC pProcs = BenchCreateProcs(pTable, 2, Pids);
+			PIPC_PACKET pPkt;
+			double dStart, dElapsed, cbUserCopied = 0;
+			long i;
+
+			Gather.Header.Wire = *pSendPkt;
+			Gather.Header.Wire.dwPid = (UINT32)(ULONG_PTR)Pids[1];
+			Gather.Header.nSegments = 3;
+			Gather.Header.uiReserved = 0;
+			Gather.Segments[0].pData = (UINT64)(ULONG_PTR)Header;
+			Gather.Segments[0].cbData = sizeof(Header);
+			Gather.Segments[1].pData = (UINT64)(ULONG_PTR)pBlob;
+			Gather.Segments[1].cbData = (UINT32)cbBlob;
+			Gather.Segments[2].pData = (UINT64)(ULONG_PTR)Trailer;
+			Gather.Segments[2].cbData = sizeof(Trailer);
+			pSendPkt->dwPid = (UINT32)(ULONG_PTR)Pids[1];
+
+			dStart = BenchNow();
+			for (i = 0; i < nMsgs; i++)
+			{
+				if (iMode == 0)
+				{
+					memcpy(pMsg, Header, sizeof(Header));
+					memcpy(pMsg + sizeof(Header), pBlob, cbBlob);
+					memcpy(pMsg + sizeof(Header) + cbBlob, Trailer, sizeof(Trailer));
+					memcpy(IPCWirePayload(pSendPkt), pMsg, payloadbytes);
+					cbUserCopied += 2.0 * payloadbytes;
+					pPkt = IPCPacketCreate(pTable, pSendPkt, Pids[0]);
+				}
+				else if (!NT_SUCCESS(IPCPacketCheckGather(&Gather, sizeof(Gather))) ||
+					!NT_SUCCESS(IPCPacketCreateGather(pTable, &Gather.Header, Pids[0], BenchCopySegment, &pPkt)))
+				{
+					pPkt = NULL;
+				}
+
+				if (!pPkt)
+				{
+					printf("gather: unable to create packet %ld\n", i);
+					nErrors++;
+					break;
+				}
+				IPCRouteDeliver(pTable, pPkt);
+				pPkt = IPCPortDequeue(pProcs[1].pPort);
+				IPCPacketCopyOut(pTable, pRecvBuf, pPkt);
+				IPCPacketFree(pTable, pPkt);
+			}
+			dElapsed = BenchNow() - dStart;
+
+			if (memcmp(IPCWirePayload((PIPC_WIRE_HEADER)pRecvBuf), Header, sizeof(Header)) ||
+				memcmp(IPCWirePayload((PIPC_WIRE_HEADER)pRecvBuf) + sizeof(Header), pBlob, cbBlob) ||
+				memcmp(IPCWirePayload((PIPC_WIRE_HEADER)pRecvBuf) + sizeof(Header) + cbBlob, Trailer, sizeof(Trailer)))
+			{
+				printf("gather: mode=%s received a different payload\n", ModeNames[iMode]);
+				nErrors++;
+			}
+
+			printf("gather mode=%-8s blob=%zu msgs=%ld user-bytes-copied/msg=%.0f bytes-copied/msg=%.0f ns/msg=%.1f MB/s=%.1f\n",
+				ModeNames[iMode], cbBlob, nMsgs, cbUserCopied / nMsgs, (double)pTable->nPktBytesCopied / nMsgs,
+				dElapsed * 1e9 / nMsgs, nMsgs * (double)payloadbytes / dElapsed / 1e6);
+
+			BenchDestroyProcs(pTable, pProcs, 2);
+			BenchDestroyTable(pTable);
+		}
+
+		free(pBlob);
+		free(pMsg);
+		free(pSendPkt);
+		free(pRecvBuf);
+	}
+
+	return nErrors ? 1 : 0;
+}
+
+//Suite senders write the way IPCDrvWrite does, waiting for credits when the receiver is over its
+//queue limit, so a fast sender cannot queue more than the limit whatever the message size
+
+static const IPC_OVERFLOW BenchSuiteOverflow = { IPC_OVERFLOW_BLOCK, MAXULONG };
+
+static void BenchSuiteWrite(PIPC_PORT_TABLE pTable, PIPC_WIRE_HEADER pUserPkt, HANDLE SourcePid)
+{
+	PIPC_PACKET pPkt = IPCPacketCreate(pTable, pUserPkt, SourcePid);
+
+	if (pPkt && !NT_SUCCESS(IPCRouteAdmit(pTable, pPkt, &BenchSuiteOverflow)))
+	{
+		IPCPacketFree(pTable, pPkt);
+	}
+	else if (pPkt)
+	{
+		IPCRouteDeliver(pTable, pPkt);
+	}
+}
+
+//Reads the next packet of a suite process the way RecvIPCMsg does, waiting on the Read
+//notification while the queue is empty, and copies it into the read buffer
+
+static PIPC_WIRE_HEADER BenchSuiteRead(PBENCH_SUITE_PROC pSuiteProc)
+{
+	PIPC_PACKET pPkt;
+
+	while ((pPkt = IPCPortDequeue(pSuiteProc->pProc->pPort)) == NULL)
+	{
+		IPCShimWaitForEvent(&(pSuiteProc->pProc->Kevent));
+	}
+
+	IPCPacketCopyOut(pSuiteProc->pTable, pSuiteProc->pRecvBuf, pPkt);
+	IPCPacketFree(pSuiteProc->pTable, pPkt);
+
+	return (PIPC_WIRE_HEADER)pSuiteProc->pRecvBuf;
+}
+
+static void* BenchSuiteSendMain(void* pContext)
+{
+	PBENCH_SUITE_PROC pSuiteProc = (PBENCH_SUITE_PROC)pContext;
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(pSuiteProc->payloadbytes);
+	long i;
+
+	if (!pUserPkt)
+	{
+		return NULL;
+	}
+
+	for (i = 0; i < pSuiteProc->nMsgs; i++)
+	{
+		pUserPkt->dwPid = (UINT32)(ULONG_PTR)pSuiteProc->pDestPids[i % pSuiteProc->nDestPids];
+		BenchSuiteWrite(pSuiteProc->pTable, pUserPkt, pSuiteProc->pProc->pPort->dwPID);
+	}
+
+	free(pUserPkt);
+	return NULL;
+}
+
+static void* BenchSuiteRecvMain(void* pContext)
+{
+	PBENCH_SUITE_PROC pSuiteProc = (PBENCH_SUITE_PROC)pContext;
+	long i;
+
+	for (i = 0; i < pSuiteProc->nMsgs; i++)
+	{
+		BenchSuiteRead(pSuiteProc);
+	}
+
+	return NULL;
+}
+
+//Echoing process of the ping-pong test, every message read is written back to its source
+
+static void* BenchSuiteEchoMain(void* pContext)
+{
+	PBENCH_SUITE_PROC pSuiteProc = (PBENCH_SUITE_PROC)pContext;
+	PIPC_WIRE_HEADER pPkt;
+	long i;
+
+	//The PID of a packet read is its source, so it goes back there as it is
+
+	for (i = 0; i < pSuiteProc->nMsgs; i++)
+	{
+		pPkt = BenchSuiteRead(pSuiteProc);
+		BenchSuiteWrite(pSuiteProc->pTable, pPkt, pSuiteProc->pProc->pPort->dwPID);
+	}
+
+	return NULL;
+}
+
+//Creates the table and processes of one suite test. Every receiving port is limited to 1024
+//packets and to 64MB or 4 packets, whichever is larger
+
+static PIPC_PORT_TABLE BenchSuiteCreate(int nProcs, size_t payloadbytes, HANDLE* pPids, PBENCH_PROC* ppProcs, PBENCH_SUITE_PROC* ppSuiteProcs)
+{
+	PIPC_PORT_TABLE pTable = BenchCreateTable();
+	IPC_QUEUE_LIMIT Limit;
+	int i;
+
+	*ppSuiteProcs = (PBENCH_SUITE_PROC)calloc(nProcs, sizeof(BENCH_SUITE_PROC));
+	*ppProcs = pTable ? BenchCreateProcs(pTable, nProcs, pPids) : NULL;
+	if (!*ppProcs || !*ppSuiteProcs)
+	{
+		return NULL;
+	}
+
+	Limit.nMaxPkts = 1024;
+	Limit.uiReserved = 0;
+	Limit.cbMaxBytes = 4 * (sizeof(IPC_PACKET) + payloadbytes);
+	Limit.cbMaxBytes = Limit.cbMaxBytes > 64 << 20 ? Limit.cbMaxBytes : 64 << 20;
+
+	for (i = 0; i < nProcs; i++)
+	{
+		IPCPortSetLimit((*ppProcs)[i].pPort, &Limit);
+		(*ppSuiteProcs)[i].pTable = pTable;
+		(*ppSuiteProcs)[i].pProc = &(*ppProcs)[i];
+		(*ppSuiteProcs)[i].payloadbytes = payloadbytes;
+		(*ppSuiteProcs)[i].pRecvBuf = (char*)malloc(sizeof(IPC_WIRE_HEADER) + payloadbytes);
+		if (!(*ppSuiteProcs)[i].pRecvBuf)
+		{
+			return NULL;
+		}
+	}
+
+	return pTable;
+}
+
+static void BenchSuiteDestroy(PIPC_PORT_TABLE pTable, int nProcs, PBENCH_PROC pProcs, PBENCH_SUITE_PROC pSuiteProcs)
+{
+	int i;
+
+	for (i = 0; i < nProcs; i++)
+	{
+		free(pSuiteProcs[i].pRecvBuf);
+	}
+	free(pSuiteProcs);
+	BenchDestroyProcs(pTable, pProcs, nProcs);
+	BenchDestroyTable(pTable);
+}
+
+//Round trips between two processes, the first tenth is a warm up which is not recorded
+
+static int BenchSuitePingPong(size_t payloadbytes, long nRounds, const char* szSeparator)
+{
+	long nWarmup = nRounds / 10;
+	double* pLatency = (double*)malloc(nRounds * sizeof(double));
+	PIPC_WIRE_HEADER pUserPkt = BenchCreatePacket(payloadbytes);
+	PBENCH_SUITE_PROC pSuiteProcs;
+	PBENCH_PROC pProcs;
+	PIPC_PORT_TABLE pTable;
+	HANDLE Pids[2];
+	double dStart, dElapsed, dRound;
+	long i;
+
+	pTable = BenchSuiteCreate(2, payloadbytes, Pids, &pProcs, &pSuiteProcs);
+	if (!pTable || !pLatency || !pUserPkt)
+	{
+		return -1;
+	}
+
+	pUserPkt->dwPid = (UINT32)(ULONG_PTR)Pids[1];
+	pSuiteProcs[1].nMsgs = nWarmup + nRounds;
+	pthread_create(&pSuiteProcs[1].Thread, NULL, BenchSuiteEchoMain, &pSuiteProcs[1]);
+
+	for (i = 0; i < nWarmup; i++)
+	{
+		BenchSuiteWrite(pTable, pUserPkt, Pids[0]);
+		BenchSuiteRead(&pSuiteProcs[0]);
+	}
+
+	dStart = BenchNow();
+	for (i = 0; i < nRounds; i++)
+	{
+		dRound = BenchNow();
+		BenchSuiteWrite(pTable, pUserPkt, Pids[0]);
+		BenchSuiteRead(&pSuiteProcs[0]);
+		pLatency[i] = BenchNow() - dRound;
+	}
+	dElapsed = BenchNow() - dStart;
+	pthread_join(pSuiteProcs[1].Thread, NULL);
+
+	qsort(pLatency, nRounds, sizeof(double), BenchCompareDouble);
+	printf("%s    {\"test\":\"pingpong\",\"size\":%zu,\"senders\":1,\"receivers\":1,\"msgs\":%ld,\"seconds\":%.6f,"
+		"\"msgs_per_s\":%.0f,\"mb_per_s\":%.1f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}",
+		szSeparator, payloadbytes, 2 * nRounds, dElapsed, 2 * nRounds / dElapsed, 2 * nRounds * (double)payloadbytes / dElapsed / 1e6,
+		pLatency[nRounds / 2] * 1e6, pLatency[nRounds * 99 / 100] * 1e6, pLatency[nRounds * 999 / 1000] * 1e6, pLatency[nRounds - 1] * 1e6);
+
+	BenchSuiteDestroy(pTable, 2, pProcs, pSuiteProcs);
+	free(pLatency);
+	free(pUserPkt);
+	return 0;
+}
+
+//nSenders write to nReceivers in turn, every receiver reads its share. One sender and one
+//receiver is one-way throughput, several senders fan-in and several receivers fan-out
+
+static int BenchSuiteFlow(const char* szTest, size_t payloadbytes, int nSenders, int nReceivers, long nMsgs, const char* szSeparator)
+{
+	long nPerSender = nMsgs / nSenders / nReceivers * nReceivers;
+	PBENCH_SUITE_PROC pSuiteProcs;
+	PBENCH_PROC pProcs;
+	PIPC_PORT_TABLE pTable;
+	HANDLE* pPids = (HANDLE*)calloc(nSenders + nReceivers, sizeof(HANDLE));
+	double dStart, dElapsed;
+	int i;
+
+	nPerSender = nPerSender > nReceivers ? nPerSender : nReceivers;
+	nMsgs = nPerSender * nSenders;
+
+	pTable = pPids ? BenchSuiteCreate(nSenders + nReceivers, payloadbytes, pPids, &pProcs, &pSuiteProcs) : NULL;
+	if (!pTable)
+	{
+		return -1;
+	}
+
+	//The receivers are the first processes, the senders write to them in turn
+
+	dStart = BenchNow();
+	for (i = 0; i < nReceivers; i++)
+	{
+		pSuiteProcs[i].nMsgs = nMsgs / nReceivers;
+		pthread_create(&pSuiteProcs[i].Thread, NULL, BenchSuiteRecvMain, &pSuiteProcs[i]);
+	}
+	for (i = nReceivers; i < nReceivers + nSenders; i++)
+	{
+		pSuiteProcs[i].pDestPids = pPids;
+		pSuiteProcs[i].nDestPids = nReceivers;
+		pSuiteProcs[i].nMsgs = nPerSender;
+		pthread_create(&pSuiteProcs[i].Thread, NULL, BenchSuiteSendMain, &pSuiteProcs[i]);
+	}
+	for (i = 0; i < nReceivers + nSenders; i++)
+	{
+		pthread_join(pSuiteProcs[i].Thread, NULL);
+	}
+	dElapsed = BenchNow() - dStart;
+
+	printf("%s    {\"test\":\"%s\",\"size\":%zu,\"senders\":%d,\"receivers\":%d,\"msgs\":%ld,\"seconds\":%.6f,"
+		"\"msgs_per_s\":%.0f,\"mb_per_s\":%.1f}",
+		szSeparator, szTest, payloadbytes, nSenders, nReceivers, nMsgs, dElapsed, nMsgs / dElapsed, nMsgs * (double)payloadbytes / dElapsed / 1e6);
+
+	BenchSuiteDestroy(pTable, nSenders + nReceivers, pProcs, pSuiteProcs);
+	free(pPids);
+	return 0;
+}
+
+//Parses a comma separated list of positive numbers, returns how many were stored
+
+static int BenchParseList(const char* szList, long* pValues, int nMaxValues)
+{
+	char* pEnd;
+	int n = 0;
+
+	while (*szList && n < nMaxValues)
+	{
+		pValues[n] = strtol(szList, &pEnd, 10);
+		if (pEnd == szList || pValues[n] < 1)
+		{
+			return 0;
+		}
+		n++;
+		szList = *pEnd == ',' ? pEnd + 1 : pEnd;
+		if (*pEnd && *pEnd != ',')
+		{
+			return 0;
+		}
+	}
+
+	return n;
+}
+
+//Non interactive benchmark suite, the baseline performance changes are compared against. For
+//every message size it runs ping-pong latency, one-way throughput, fan-in from each sender count
+//and fan-out to each receiver count through the routing core, reading and writing the way the
+//driver's dispatch routines do. Each test moves about the same number of bytes, at least 64 and
+//at most 1000000 messages (50000 round trips). The results are written to stdout as one JSON document
+
+int BenchSuite(int argc, char** argv)
+{
+	long Sizes[16], Senders[16], Receivers[16];
+	int nSizes = BenchParseList(argc > 2 ? argv[2] : "16,256,4096,65536,1048576,16777216", Sizes, 16);
+	int nSenders = BenchParseList(argc > 3 ? argv[3] : "2,4,8", Senders, 16);
+	int nReceivers = BenchParseList(argc > 4 ? argv[4] : "2,4,8", Receivers, 16);
+	double cbBudget = (argc > 5 ? atof(argv[5]) : 256) * 1048576;
+	const char* szSeparator = "\n";
+	long nMsgs;
+	int i, j, iResult = 0;
+
+	if (!nSizes || !nSenders || !nReceivers || cbBudget <= 0)
+	{
+		printf("Sizes, senders and receivers are comma separated lists of positive numbers\n");
+		return 2;
+	}
+
+	printf("{\"suite\":\"IPCBench_v2\",\"transport\":\"routing core\",\"cpus\":%ld,\"mb_per_test\":%.0f,\"results\":[",
+		sysconf(_SC_NPROCESSORS_ONLN), cbBudget / 1048576);
+
+	for (i = 0; i < nSizes && !iResult; i++)
+	{
+		nMsgs = (long)(cbBudget / Sizes[i]);
+		nMsgs = nMsgs < 64 ? 64 : (nMsgs > 1000000 ? 1000000 : nMsgs);
+
+		iResult |= BenchSuitePingPong((size_t)Sizes[i], nMsgs / 2 < 50000 ? nMsgs / 2 : 50000, szSeparator);
+		szSeparator = ",\n";
+		iResult |= BenchSuiteFlow("oneway", (size_t)Sizes[i], 1, 1, nMsgs, szSeparator);
+		for (j = 0; j < nSenders && !iResult; j++)
+		{
+			iResult |= BenchSuiteFlow("fanin", (size_t)Sizes[i], (int)Senders[j], 1, nMsgs, szSeparator);
+		}
+		for (j = 0; j < nReceivers && !iResult; j++)
+		{
+			iResult |= BenchSuiteFlow("fanout", (size_t)Sizes[i], 1, (int)Receivers[j], nMsgs, szSeparator);
+		}
+		fflush(stdout);
+	}
+
+	printf("\n]}\n");
+
+	if (iResult)
+	{
+		fprintf(stderr, "Unable to allocate benchmark state\n");
+	}
+	return iResult ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	srand((unsigned)time(NULL));
+
+	if (argc > 1 && !strcmp(argv[1], "route"))
+	{
+		return BenchRoute(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "copy"))
+	{
+		return BenchCopy(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "ring"))
+	{
+		return BenchRing(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "batch"))
+	{
+		return BenchBatch(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "drain"))
+	{
+		return BenchDrain(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "multicast"))
+	{
+		return BenchMulticast(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "stream"))
+	{
+		return BenchStream(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "credit"))
+	{
+		return BenchCredit(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "lanes"))
+	{
+		return BenchLanes(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "endpoint"))
+	{
+		return BenchEndpoint(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "suite"))
+	{
+		return BenchSuite(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "call"))
+	{
+		return BenchCall(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "stats"))
+	{
+		return BenchStats(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "trace"))
+	{
+		return BenchTrace(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "gather"))
+	{
+		return BenchGather(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "fanin"))
+	{
+		return BenchFanIn(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "router"))
+	{
+		return BenchRouter(argc, argv);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "pending"))
+	{
+		return BenchPending(argc, argv);
+	}
+
+	printf("Usage: IPCBench_v2 route [ports] [messages] [payload bytes]\n");
+	printf("       IPCBench_v2 copy [max messages] [payload bytes...]\n");
+	printf("       IPCBench_v2 ring [messages] [payload bytes] [ring bytes]\n");
+	printf("       IPCBench_v2 batch [messages] [batch size] [destinations] [payload bytes]\n");
+	printf("       IPCBench_v2 drain [queue depth] [rounds] [payload bytes] [read buffer bytes]\n");
+	printf("       IPCBench_v2 pending [messages] [payload bytes] [small reader every n]\n");
+	printf("       IPCBench_v2 router [routing threads] [senders] [messages per sender] [payload bytes] [mixed]\n");
+	printf("       IPCBench_v2 fanin [max senders] [messages per sender] [payload bytes]\n");
+	printf("       IPCBench_v2 multicast [recipients] [messages] [payload bytes]\n");
+	printf("       IPCBench_v2 stream [message MB] [rounds]\n");
+	printf("       IPCBench_v2 credit [queue limit] [messages] [payload bytes] [receive ns]\n");
+	printf("       IPCBench_v2 lanes [control messages] [bulk backlog] [bulk payload bytes] [reads per control message]\n");
+	printf("       IPCBench_v2 endpoint [ports] [messages] [server shards]\n");
+	printf("       IPCBench_v2 call [round trips] [request bytes] [reply bytes]\n");
+	printf("       IPCBench_v2 stats [senders] [messages per sender] [payload bytes]\n");
+	printf("       IPCBench_v2 trace [senders] [messages per sender] [payload bytes]\n");
+	printf("       IPCBench_v2 gather [messages] [blob bytes...]\n");
+	printf("       IPCBench_v2 suite [sizes] [fan-in senders] [fan-out receivers] [MB per test]\n");
+	return 2;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include"../IPCDrv_v2/IPCRoute_v2.h"
+#include"../IPCDrv_v2/IPCRouter_v2.h"
+#include"../IPC_Dll_v2/IPC_Ring_v2.h"
+
+//Simulated User mode process, one File object and port per process
+
+typedef struct _BENCH_PROC
+{
+	FILE_OBJECT FileObj;	//File object the port hangs off, as if returned by CreateFile
+	KEVENT Kevent;			//Read notification event registered with the port
+	PIPC_PORT pPort;		//Port created for the process
+}BENCH_PROC, *PBENCH_PROC;
+
+//Simulated pending read, parked on a port the way IPCDrvRead parks a Read IRP
+
+typedef struct _BENCH_READER
+{
+	struct _BENCH_READER* pNext;	//Next reader parked on the same port
+	char* pBuffer;					//Read buffer
+	size_t cbBuffer;				//Size of the read buffer
+	size_t cbRead;					//Bytes completed into the buffer, 0 while parked or if too small
+	int bCompleted;					//Set once the reader has been completed
+}BENCH_READER, *PBENCH_READER;
+
+//Reader state kept after every port, a FIFO of parked readers
+
+typedef struct _BENCH_PENDING_READS
+{
+	PBENCH_READER pHead;
+	PBENCH_READER pTail;
+}BENCH_PENDING_READS, *PBENCH_PENDING_READS;
+
+//Simulated sending process of the router scenario, one pthread each
+
+typedef struct _BENCH_SENDER
+{
+	pthread_t Thread;			//Thread writing the packets
+	PIPC_PORT_TABLE pTable;		//Table the packets are allocated from
+	PIPC_ROUTER pRouter;		//Router the packets are queued to, NULL to route them in the sending thread
+	HANDLE SourcePid;			//PID of the sending process, the shard key
+	HANDLE DestPid;				//PID of the receiving process
+	long nMsgs;					//Packets to send
+	size_t payloadbytes;		//Payload size of each packet
+	int bMixed;					//Route every other packet in the sending thread, as IOCTL_SEND_BATCH does
+}BENCH_SENDER, *PBENCH_SENDER;
+
+//Sending process of the stream scenario, splits one large message into fragments
+
+typedef struct _BENCH_STREAM
+{
+	pthread_t Thread;			//Thread writing the fragments
+	PIPC_PORT_TABLE pTable;		//Table the fragments are routed through
+	HANDLE SourcePid;			//PID of the sending process
+	HANDLE DestPid;				//PID of the receiving process
+	const char* pData;			//Message to send
+	size_t cbData;				//Size of the message
+	size_t cbFragment;			//Payload bytes per fragment
+	volatile LONG64 cbQueued;	//Packet bytes routed so far, the receiver subtracts what it read
+}BENCH_STREAM, *PBENCH_STREAM;
+
+//Sending process of the credit scenario, sends as fast as its overflow policy lets it
+
+typedef struct _BENCH_CREDIT
+{
+	pthread_t Thread;			//Thread writing the packets
+	PIPC_PORT_TABLE pTable;		//Table the packets are routed through
+	HANDLE SourcePid;			//PID of the sending process
+	HANDLE DestPid;				//PID of the receiving process
+	IPC_OVERFLOW Overflow;		//Overflow policy of the sender
+	long nMsgs;					//Packets to send
+	size_t payloadbytes;		//Payload size of each packet
+	volatile LONG64 nDelivered;	//Packets admitted and queued to the receiver
+	volatile LONG64 nRejected;	//Packets the destination's limit turned away
+	volatile LONG bDone;		//Set once every packet has been sent or rejected
+}BENCH_CREDIT, *PBENCH_CREDIT;
+
+//Caller of the call scenario, completed by the routing core's call hook the way IPCDrvCompleteCall
+//completes an IOCTL_CALL IRP
+
+typedef struct _BENCH_CALL
+{
+	IPC_CALL Call;				//Registration with the routing core
+	char* pBuffer;				//Reply buffer, the IRP's System buffer
+	size_t cbReply;				//Bytes of the reply copied, 0 if the call was aborted
+	int bCompleted;				//Set once the call has been completed
+}BENCH_CALL, *PBENCH_CALL;
+
+//Sending, receiving or echoing process of the suite scenario, one pthread each
+
+typedef struct _BENCH_SUITE_PROC
+{
+	pthread_t Thread;			//Thread of the process
+	PIPC_PORT_TABLE pTable;		//Table the packets are routed through
+	PBENCH_PROC pProc;			//Port the process reads from
+	const HANDLE* pDestPids;	//Destinations of a sender, written to in turn
+	int nDestPids;				//Number of destinations
+	long nMsgs;					//Messages to send, or to receive
+	size_t payloadbytes;		//Payload size of every message
+	char* pRecvBuf;				//Read buffer of a receiver, packets are copied out into it
+}BENCH_SUITE_PROC, *PBENCH_SUITE_PROC;
+
+double BenchNow();
+PIPC_PORT_TABLE BenchCreateTable();
+void BenchDestroyTable(PIPC_PORT_TABLE);
+void BenchPrintPool(PIPC_PORT_TABLE);
+PBENCH_PROC BenchCreateProcs(PIPC_PORT_TABLE, int, HANDLE*);
+void BenchDestroyProcs(PIPC_PORT_TABLE, PBENCH_PROC, int);
+PIPC_WIRE_HEADER BenchCreatePacket(size_t);
+int BenchRoute(int, char**);
+int BenchCopy(int, char**);
+int BenchRing(int, char**);
+int BenchBatch(int, char**);
+int BenchDrain(int, char**);
+int BenchPending(int, char**);
+int BenchRouter(int, char**);
+int BenchFanIn(int, char**);
+int BenchMulticast(int, char**);
+int BenchStream(int, char**);
+int BenchCredit(int, char**);
+int BenchLanes(int, char**);
+int BenchEndpoint(int, char**);
+int BenchCall(int, char**);
+int BenchStats(int, char**);
+int BenchTrace(int, char**);
+int BenchGather(int, char**);
+int BenchSuite(int, char**);
@@ -0,0 +1,1732 @@
+//=====================================================================
+// IPC- Inter Process Communication Broker
+//
+// User mode stand-in for IPCDrv where there is no driver (Linux). The
+// routing core is built in user mode through IPCShim_v2.h and serves the
+// broker backend of IPC_Dll_v2 over shared memory rings with futex
+// wakeups (see IPC_Broker_v2.h). Every request is handled the way the
+// matching dispatch routine of IPCDrv_v2.c handles its IRP, so routing,
+// flow control, groups, endpoints, calls, statistics and tracing behave
+// the same on both.
+//
+// Build on Linux:
+//	cc -O2 -pthread -o IPCBroker_v2 IPCBroker_v2/IPCBroker_v2.c IPCDrv_v2/IPCRoute_v2.c IPCDrv_v2/IPCRouter_v2.c IPCDrv_v2/IPCPool_v2.c IPC_Dll_v2/IPC_Ring_v2.c
+//
+// Usage:
+//	IPCBroker_v2 [routing threads] [queue limit packets] [queue limit bytes]
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+//Include Files
+
+#include "IPCBroker_v2.h"
+
+
+//=====================================================================
+// IPCBrokerStopHandler
+//
+// SIGINT and SIGTERM handler, the accept loop and every channel thread
+// notice the flag within IPC_BROKER_POLL_MS.
+//=====================================================================
+
+static void IPCBrokerStopHandler(int iSignal)
+{
+	(void)iSignal;
+	g_bIPCBrokerStop = 1;
+}
+
+
+
+//=====================================================================
+// main
+//
+// Creates the port table and the routing threads the way DriverEntry
+// does, then accepts channels until it is stopped. Optional arguments
+// replace the registry values of the driver's service key.
+//=====================================================================
+
+int main(int argc, char** argv)
+{
+	//Locals
+
+	ULONG nThreads = argc > 1 ? (ULONG)strtoul(argv[1], NULL, 0) : 0;
+	IPC_BROKER_CONNECT Connect;
+	PIPC_RING_RECORD pRecord;
+	struct sigaction StopAction;
+	IPC_STATS TableStats;
+	NTSTATUS ntStatus;
+	int iError;
+	UINT32 i;
+
+	//Refuse to start next to a running broker, a stale accept ring is replaced below
+
+	if (IPCRingOpenNamed(&g_IPCBrokerAccept, IPC_BROKER_ACCEPT_RING) == 0)
+	{
+		uint32_t dwBrokerPid = g_IPCBrokerAccept.pHeader->dwConsumerPid;
+		IPCRingClose(&g_IPCBrokerAccept);
+		if (IPCRingPidAlive(dwBrokerPid))
+		{
+			fprintf(stderr, "IPCBroker is already running as process %u\n", dwBrokerPid);
+			return 1;
+		}
+	}
+
+	pthread_mutex_init(&g_IPCBrokerLock, NULL);
+	InitializeListHead(&g_IPCBrokerSessions);
+
+	//Allocate and Initialize the IPC_Port table
+
+	g_IPCPortTable = (PIPC_PORT_TABLE)malloc(sizeof(IPC_PORT_TABLE));
+	if (!g_IPCPortTable || !NT_SUCCESS(IPCPortTableInit(g_IPCPortTable)))
+	{
+		fprintf(stderr, "Failed to create the IPC Port table\n");
+		return 1;
+	}
+
+	//Reads finding the Incoming queue empty are parked on their port and completed by the routing core
+
+	g_IPCPortTable->ReaderOps.pfnParkReader = IPCBrokerParkRead;
+	g_IPCPortTable->ReaderOps.pfnTakeReader = IPCBrokerTakeRead;
+	g_IPCPortTable->ReaderOps.pfnCompleteReader = IPCBrokerCompleteRead;
+	g_IPCPortTable->ReaderOps.cbReaderContext = sizeof(IPC_BROKER_READERS);
+
+	//Replies are copied by the routing core straight into the response ring of the waiting channel
+
+	g_IPCPortTable->pfnCompleteCall = IPCBrokerCompleteCall;
+
+	g_IPCPortTable->DefaultLimit.nMaxPkts = argc > 2 ? (UINT32)strtoul(argv[2], NULL, 0) : 0;
+	g_IPCPortTable->DefaultLimit.cbMaxBytes = argc > 3 ? (UINT64)strtoull(argv[3], NULL, 0) : 0;
+
+	ntStatus = IPCRouterStart(&g_IPCRouter, g_IPCPortTable, nThreads);
+	if (!NT_SUCCESS(ntStatus))
+	{
+		fprintf(stderr, "Failed to start the routing threads\n");
+		IPCPortTableDelete(g_IPCPortTable);
+		return 1;
+	}
+
+	iError = IPCRingCreateNamed(&g_IPCBrokerAccept, IPC_BROKER_ACCEPT_RING, (uint32_t)getpid(), IPC_BROKER_ACCEPT_SIZE);
+	if (iError)
+	{
+		fprintf(stderr, "Failed to create the accept ring:%d\n", iError);
+		IPCRouterStop(&g_IPCRouter);
+		IPCRouterFree(&g_IPCRouter);
+		IPCPortTableDelete(g_IPCPortTable);
+		return 1;
+	}
+
+	//No SA_RESTART, a signal also cuts the current wait short
+
+	memset(&StopAction, 0, sizeof(StopAction));
+	StopAction.sa_handler = IPCBrokerStopHandler;
+	sigemptyset(&StopAction.sa_mask);
+	sigaction(SIGINT, &StopAction, NULL);
+	sigaction(SIGTERM, &StopAction, NULL);
+
+	printf("IPCBroker running as process %u, %u routing threads\n", (unsigned)getpid(), g_IPCRouter.nThreads);
+	fflush(stdout);
+
+	//Accept channels until stopped
+
+	while (!g_bIPCBrokerStop)
+	{
+		pRecord = IPCRingPeek(&g_IPCBrokerAccept, IPC_BROKER_POLL_MS);
+		if (!pRecord)
+		{
+			continue;
+		}
+
+		memset(&Connect, 0, sizeof(Connect));
+		if (pRecord->MsgSize >= sizeof(IPC_BROKER_CONNECT))
+		{
+			memcpy(&Connect, pRecord->szMsg, sizeof(IPC_BROKER_CONNECT));
+		}
+		IPCRingRelease(&g_IPCBrokerAccept, pRecord);
+
+		if (Connect.dwPid)
+		{
+			IPCBrokerConnect(&Connect);
+		}
+	}
+
+	//Channel threads clean their sessions up and exit within IPC_BROKER_POLL_MS, then the
+	//routing threads route whatever is still queued
+
+	IPCRingClose(&g_IPCBrokerAccept);
+	while (g_nIPCBrokerChannels)
+	{
+		usleep(10000);
+	}
+	IPCRouterStop(&g_IPCRouter);
+
+	IPCPortTableQueryStats(g_IPCPortTable, &TableStats, 0);
+	IPCRouterFillStats(&g_IPCRouter, &TableStats);
+	IPCRouterFree(&g_IPCRouter);
+	printf("IPC Ports: %llu packets in, %llu out, %llu undeliverable, %llu allocation failures, %llu buffers too small, %llu dropped\n",
+		(unsigned long long)TableStats.Totals.nPktsIn, (unsigned long long)TableStats.Totals.nPktsOut,
+		(unsigned long long)TableStats.Totals.nUndeliverable, (unsigned long long)TableStats.Totals.nAllocFailures,
+		(unsigned long long)TableStats.Totals.nTooSmall, (unsigned long long)TableStats.Totals.nDropped);
+	for (i = 0; i < TableStats.nRouterThreads; i++)
+	{
+		printf("IPC Routing thread %u: %llu packets, %llu drains, %llu ns average and %llu ns worst packet latency\n", i,
+			(unsigned long long)TableStats.Router[i].nPkts, (unsigned long long)TableStats.Router[i].nDrains,
+			(unsigned long long)(TableStats.Router[i].nPkts ? TableStats.Router[i].llLatencyTotal / TableStats.Router[i].nPkts : 0),
+			(unsigned long long)TableStats.Router[i].llLatencyMax);
+	}
+
+	IPCPortTableDelete(g_IPCPortTable);
+	free(g_IPCPortTable);
+	g_IPCPortTable = NULL;
+	return 0;
+}
+
+
+
+//=====================================================================
+// IPCBrokerConnect
+//
+// Opens the channel a client asked for with IPC_BROKER_CONNECT. The
+// response ring was created by the client, the request ring is created
+// here. The first channel of a session creates its port, as CreateFile
+// does. The client is answered with a response of sequence number 0
+// on the new channel, by the channel's thread once it runs, unless even
+// the response ring could not be opened.
+//=====================================================================
+
+NTSTATUS IPCBrokerConnect(const IPC_BROKER_CONNECT* pConnect)
+{
+	//Locals
+
+	PIPC_BROKER_CHANNEL pChannel;
+	PIPC_BROKER_SESSION pSession = NULL;
+	PLIST_ENTRY pEntry;
+	char szName[IPC_RING_NAME_MAX];
+	pthread_attr_t ThreadAttr;
+	NTSTATUS ntStatus = STATUS_SUCCESS;
+
+	pChannel = (PIPC_BROKER_CHANNEL)calloc(1, sizeof(IPC_BROKER_CHANNEL));
+	if (!pChannel)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	InitializeListHead(&(pChannel->Park_Entry));
+	pChannel->uiChannel = pConnect->uiChannel;
+
+	snprintf(szName, sizeof(szName), IPC_BROKER_RESPONSE_RING, pConnect->dwPid, pConnect->uiChannel);
+	if (IPCRingOpenNamed(&(pChannel->Response), szName) != 0)
+	{
+		free(pChannel);
+		return STATUS_NOT_FOUND;
+	}
+
+	snprintf(szName, sizeof(szName), IPC_BROKER_REQUEST_RING, pConnect->dwPid, pConnect->uiChannel);
+	if (IPCRingCreateNamed(&(pChannel->Request), szName, (uint32_t)getpid(), IPC_BROKER_RING_SIZE) != 0)
+	{
+		IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+		IPCRingClose(&(pChannel->Response));
+		free(pChannel);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	//Find the session, or create it and its port for its first channel
+
+	pthread_mutex_lock(&g_IPCBrokerLock);
+	for (pEntry = g_IPCBrokerSessions.Flink; pEntry != &g_IPCBrokerSessions; pEntry = pEntry->Flink)
+	{
+		PIPC_BROKER_SESSION pEntrySession = CONTAINING_RECORD(pEntry, IPC_BROKER_SESSION, list_entry);
+		if (pEntrySession->dwClientPid == pConnect->dwPid && pEntrySession->uiSession == pConnect->uiSession)
+		{
+			pSession = pEntrySession;
+			break;
+		}
+	}
+
+	if (!pSession)
+	{
+		pSession = (PIPC_BROKER_SESSION)calloc(1, sizeof(IPC_BROKER_SESSION));
+		if (!pSession)
+		{
+			ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		else
+		{
+			pSession->dwClientPid = pConnect->dwPid;
+			pSession->uiSession = pConnect->uiSession;
+			InitializeListHead(&(pSession->Channel_List));
+			ntStatus = IPCBrokerCreate(pSession);
+			if (NT_SUCCESS(ntStatus))
+			{
+				InsertTailList(&g_IPCBrokerSessions, &(pSession->list_entry));
+			}
+			else
+			{
+				free(pSession);
+				pSession = NULL;
+			}
+		}
+	}
+	else if (pSession->bCleanedUp)
+	{
+		pSession = NULL;
+		ntStatus = STATUS_CANCELLED;
+	}
+
+	if (pSession)
+	{
+		pChannel->pSession = pSession;
+		InsertTailList(&(pSession->Channel_List), &(pChannel->list_entry));
+		pSession->nChannels++;
+	}
+	pthread_mutex_unlock(&g_IPCBrokerLock);
+
+	if (!NT_SUCCESS(ntStatus))
+	{
+		IPCBrokerComplete(pChannel, ntStatus, NULL, 0);
+		IPCRingClose(&(pChannel->Request));
+		IPCRingClose(&(pChannel->Response));
+		free(pChannel);
+		return ntStatus;
+	}
+
+	InterlockedIncrement(&g_nIPCBrokerChannels);
+	pthread_attr_init(&ThreadAttr);
+	pthread_attr_setdetachstate(&ThreadAttr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&(pChannel->Thread), &ThreadAttr, IPCBrokerChannelMain, pChannel) != 0)
+	{
+		//The session goes with its last channel
+
+		IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+		IPCBrokerClose(pChannel);
+		InterlockedDecrement(&g_nIPCBrokerChannels);
+		ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pthread_attr_destroy(&ThreadAttr);
+
+	return ntStatus;
+}
+
+
+
+//=====================================================================
+// IPCBrokerChannelMain
+//
+// Thread serving one channel. Each request is copied out of the request
+// ring into the channel's System buffer and dispatched. Requests which
+// park or wait for a reply are completed later by whoever completes
+// them, the thread goes on reading the ring for a cancel. The thread
+// ends when the client closes the channel, exits or the broker stops.
+//=====================================================================
+
+void* IPCBrokerChannelMain(void* pContext)
+{
+	//Locals
+
+	PIPC_BROKER_CHANNEL pChannel = (PIPC_BROKER_CHANNEL)pContext;
+	PIPC_BROKER_SESSION pSession = pChannel->pSession;
+	IPC_BROKER_REQUEST Request;
+	PIPC_RING_RECORD pRecord;
+	uint64_t cbPayload;
+	size_t cbBuffer;
+	PCHAR pLarger;
+	BOOLEAN bClosed = FALSE;
+
+	//Answer the connect, the client sends its first request once the thread serves the channel
+
+	IPCBrokerComplete(pChannel, STATUS_SUCCESS, NULL, 0);
+
+	while (!g_bIPCBrokerStop)
+	{
+		pRecord = IPCRingPeek(&(pChannel->Request), IPC_BROKER_POLL_MS);
+		if (!pRecord)
+		{
+			if (!IPCRingPidAlive(pSession->dwClientPid))
+			{
+				break;
+			}
+			continue;
+		}
+
+		//The ring is shared with the client, every size is read once and checked against the record
+
+		cbPayload = pRecord->MsgSize;
+		if (cbPayload < sizeof(IPC_BROKER_REQUEST) || cbPayload > pRecord->cbRecord - sizeof(IPC_RING_RECORD))
+		{
+			IPCRingRelease(&(pChannel->Request), pRecord);
+			continue;
+		}
+		memcpy(&Request, pRecord->szMsg, sizeof(IPC_BROKER_REQUEST));
+
+		if (Request.dwOp == IPC_BROKER_OP_CANCEL)
+		{
+			IPCRingRelease(&(pChannel->Request), pRecord);
+			IPCBrokerCancel(pChannel, Request.uiSeq);
+			continue;
+		}
+		if (Request.dwOp == IPC_BROKER_OP_CLOSE)
+		{
+			IPCRingRelease(&(pChannel->Request), pRecord);
+			bClosed = TRUE;
+			break;
+		}
+
+		//The thread which completed the previous request may not have cleared bPending yet,
+		//although the client already has its response
+
+		while (pChannel->bPending)
+		{
+			sched_yield();
+		}
+
+		pChannel->dwOp = Request.dwOp;
+		pChannel->dwIoControlCode = Request.dwIoControlCode;
+		pChannel->uiSeq = Request.uiSeq;
+		pChannel->cbIn = (size_t)cbPayload - sizeof(IPC_BROKER_REQUEST);
+		pChannel->cbOut = Request.cbOut < IPC_BROKER_MAX_TRANSFER ? Request.cbOut : IPC_BROKER_MAX_TRANSFER;
+		InterlockedExchange(&(pChannel->bPending), 1);
+
+		//Copy the input into the System buffer, which also holds the output of buffered requests
+
+		cbBuffer = pChannel->cbIn > pChannel->cbOut ? pChannel->cbIn : pChannel->cbOut;
+		if (cbBuffer > pChannel->cbSystemBuffer)
+		{
+			pLarger = (PCHAR)realloc(pChannel->pSystemBuffer, cbBuffer);
+			if (!pLarger)
+			{
+				IPCRingRelease(&(pChannel->Request), pRecord);
+				IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+				continue;
+			}
+			pChannel->pSystemBuffer = pLarger;
+			pChannel->cbSystemBuffer = cbBuffer;
+		}
+		memcpy(pChannel->pSystemBuffer, pRecord->szMsg + sizeof(IPC_BROKER_REQUEST), pChannel->cbIn);
+		IPCRingRelease(&(pChannel->Request), pRecord);
+
+		switch (pChannel->dwOp)
+		{
+		case IPC_BROKER_OP_READ:
+			IPCBrokerRead(pChannel);
+			break;
+
+		case IPC_BROKER_OP_WRITE:
+			IPCBrokerWrite(pChannel);
+			break;
+
+		case IPC_BROKER_OP_IOCTL:
+			IPCBrokerDevIOCTL(pChannel);
+			break;
+
+		case IPC_BROKER_OP_WAIT:
+			IPCBrokerWait(pChannel);
+			break;
+
+		case IPC_BROKER_OP_CLEANUP:
+			IPCBrokerCleanup(pSession);
+			IPCBrokerComplete(pChannel, STATUS_SUCCESS, NULL, 0);
+			break;
+
+		default:
+			IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+			break;
+		}
+	}
+
+	//A client which exited or a broker which stops gets no cleanup request, clean up here.
+	//Then wait for a completion of the channel's own request which may still be under way
+
+	if (!bClosed)
+	{
+		IPCBrokerCleanup(pSession);
+	}
+	IPCBrokerCancel(pChannel, pChannel->uiSeq);
+	while (pChannel->bPending)
+	{
+		usleep(1000);
+	}
+
+	IPCBrokerClose(pChannel);
+	InterlockedDecrement(&g_nIPCBrokerChannels);
+	return NULL;
+}
+
+
+
+//=====================================================================
+// IPCBrokerCreate
+//
+// Counterpart of IPCDrvCreate, called for the first channel of a
+// session with g_IPCBrokerLock held. The port is keyed by the client's
+// translated PID and gets its Read notification event at once, the
+// broker has no IOCTL_REG_EVENT.
+//=====================================================================
+
+NTSTATUS IPCBrokerCreate(PIPC_BROKER_SESSION pSession)
+{
+	PIPC_PORT pIPCPort;
+	PIPC_BROKER_READERS pReaders;
+
+	pIPCPort = IPCPortCreate(g_IPCPortTable, IPCBrokerPidToCore(pSession->dwClientPid), &(pSession->FileObj));
+	if (!pIPCPort)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	pReaders = (PIPC_BROKER_READERS)pIPCPort->pReaderContext;
+	InitializeListHead(&(pReaders->Channel_List));
+	KeInitializeSpinLock(&(pReaders->Channel_List_Lock));
+	KeInitializeEvent(&(pReaders->Kevent), NotificationEvent, FALSE);
+	IPCPortSetEvent(pIPCPort, &(pReaders->Kevent));
+
+	IPCPortTableInsert(g_IPCPortTable, pIPCPort);
+	pSession->pPort = pIPCPort;
+
+	return STATUS_SUCCESS;
+}
+
+
+
+//=====================================================================
+// IPCBrokerDevIOCTL
+//
+// Counterpart of IPCDrvDevIOCTL. The broker registers the Read
+// notification event itself, so IOCTL_REG_EVENT is not accepted.
+//=====================================================================
+
+NTSTATUS IPCBrokerDevIOCTL(PIPC_BROKER_CHANNEL pChannel)
+{
+	switch (pChannel->dwIoControlCode)
+	{
+	case IOCTL_SEND_BATCH:    //Batch of IPC Packets sent from user mode
+
+		return IPCBrokerSendBatch(pChannel);
+
+	case IOCTL_RECV_BATCH:    //Batch read of the queued IPC Packets
+
+		return IPCBrokerRecvBatch(pChannel);
+
+	case IOCTL_SEND_MULTICAST:    //IPC Packet sent to several processes
+
+		return IPCBrokerSendMulticast(pChannel);
+
+	case IOCTL_JOIN_GROUP:    //Multicast group membership
+	case IOCTL_LEAVE_GROUP:
+
+		return IPCBrokerGroup(pChannel);
+
+	case IOCTL_REGISTER_ENDPOINT:    //Named endpoints
+	case IOCTL_RESOLVE_ENDPOINT:
+
+		return IPCBrokerEndpoint(pChannel);
+
+	case IOCTL_CALL:    //Request/response calls
+	case IOCTL_COLLECT_REPLY:
+
+		return IPCBrokerCall(pChannel);
+
+	case IOCTL_REPLY:
+
+		return IPCBrokerReply(pChannel);
+
+	case IOCTL_QUERY_STATS:    //Runtime statistics
+
+		return IPCBrokerQueryStats(pChannel);
+
+	case IOCTL_SET_TRACE:    //Latency tracing
+	case IOCTL_QUERY_TRACE:
+
+		return IPCBrokerTrace(pChannel);
+
+	case IOCTL_SET_QUEUE_LIMIT:    //Flow control of the caller's port
+	case IOCTL_SET_OVERFLOW:
+	case IOCTL_QUERY_CREDITS:
+	case IOCTL_SET_LANE_WEIGHTS:
+
+		return IPCBrokerFlowControl(pChannel);
+
+	default:
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+}
+
+
+
+//=====================================================================
+// IPCBrokerWrite
+//
+// Counterpart of IPCDrvWrite. The packet is admitted in the channel
+// thread and queued to the routing thread of the sending process.
+//=====================================================================
+
+NTSTATUS IPCBrokerWrite(PIPC_BROKER_CHANNEL pChannel)
+{
+	//Locals
+
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	PIPC_WIRE_HEADER pUserPkt = (PIPC_WIRE_HEADER)pChannel->pSystemBuffer;
+	PIPC_PACKET pTemp_Out_IPCPkt;
+	size_t uiPacketLength;
+	NTSTATUS ntStatus;
+
+	if (!NT_SUCCESS(IPCPacketCheckWire(pUserPkt, pChannel->cbIn, FALSE, &uiPacketLength)))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+
+	IPCBrokerPacketToCore(pUserPkt);
+
+	pTemp_Out_IPCPkt = IPCPacketCreate(g_IPCPortTable, pUserPkt, pIPCPort->dwPID);
+	if (!pTemp_Out_IPCPkt)
+	{
+		IPCPortCountStat(g_IPCPortTable, pIPCPort, IPC_STAT_ALLOC_FAILURES, 1);
+		return IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+	}
+
+	ntStatus = IPCRouteAdmit(g_IPCPortTable, pTemp_Out_IPCPkt, &(pIPCPort->Overflow));
+	if (!NT_SUCCESS(ntStatus))
+	{
+		IPCPacketFree(g_IPCPortTable, pTemp_Out_IPCPkt);
+		return IPCBrokerComplete(pChannel, ntStatus, NULL, 0);
+	}
+
+	IPCRouterQueuePacket(&g_IPCRouter, (ULONG_PTR)pIPCPort->dwPID, pTemp_Out_IPCPkt);
+
+	return IPCBrokerComplete(pChannel, STATUS_SUCCESS, NULL, 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerSendBatch
+//
+// Counterpart of IPCDrvSendBatch, the batch is routed in the channel
+// thread and one NTSTATUS per packet is returned.
+//=====================================================================
+
+NTSTATUS IPCBrokerSendBatch(PIPC_BROKER_CHANNEL pChannel)
+{
+	//Locals
+
+	size_t uiInLength = pChannel->cbIn;
+	PCHAR pBuffer = pChannel->pSystemBuffer;
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	PIPC_PACKET* ppIPC_Pkts;				//Packets copied out of the batch
+	NTSTATUS* pStatus;						//Status of every packet
+	PIPC_WIRE_HEADER pTemp_Pkt;
+	size_t uiOffset, uiPacketLength;
+	ULONG nPkts, i;
+	NTSTATUS ntStatus = STATUS_SUCCESS;
+
+	if (uiInLength < sizeof(IPC_BATCH_HEADER) ||
+		((PIPC_BATCH_HEADER)pBuffer)->nPackets == 0 ||
+		((PIPC_BATCH_HEADER)pBuffer)->nPackets > (uiInLength - sizeof(IPC_BATCH_HEADER)) / sizeof(IPC_WIRE_HEADER))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+
+	nPkts = ((PIPC_BATCH_HEADER)pBuffer)->nPackets;
+	if (pChannel->cbOut < nPkts * sizeof(NTSTATUS))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_BUFFER_TOO_SMALL, NULL, 0);
+	}
+
+	ppIPC_Pkts = (PIPC_PACKET*)malloc(nPkts * (sizeof(PIPC_PACKET) + sizeof(NTSTATUS)));
+	if (!ppIPC_Pkts)
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+	}
+	pStatus = (NTSTATUS*)(ppIPC_Pkts + nPkts);
+
+	//Validate every packet and copy it into the packet pool
+
+	uiOffset = sizeof(IPC_BATCH_HEADER);
+	for (i = 0; i < nPkts; i++)
+	{
+		uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+		pTemp_Pkt = (PIPC_WIRE_HEADER)(pBuffer + uiOffset);
+
+		if (uiOffset > uiInLength ||
+			!NT_SUCCESS(IPCPacketCheckWire(pTemp_Pkt, uiInLength - uiOffset, FALSE, &uiPacketLength)))
+		{
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		IPCBrokerPacketToCore(pTemp_Pkt);
+		ppIPC_Pkts[i] = IPCPacketCreate(g_IPCPortTable, pTemp_Pkt, pIPCPort->dwPID);
+		pStatus[i] = ppIPC_Pkts[i] ? STATUS_PENDING : STATUS_INSUFFICIENT_RESOURCES;
+		if (!ppIPC_Pkts[i])
+		{
+			IPCPortCountStat(g_IPCPortTable, pIPCPort, IPC_STAT_ALLOC_FAILURES, 1);
+		}
+
+		uiOffset += uiPacketLength;
+	}
+
+	if (!NT_SUCCESS(ntStatus))
+	{
+		//Malformed batch, nothing is routed
+
+		while (i-- > 0)
+		{
+			if (ppIPC_Pkts[i])
+			{
+				IPCPacketFree(g_IPCPortTable, ppIPC_Pkts[i]);
+			}
+		}
+		free(ppIPC_Pkts);
+		return IPCBrokerComplete(pChannel, ntStatus, NULL, 0);
+	}
+
+	//Behind the sender's writes still waiting for its routing thread
+
+	IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)pIPCPort->dwPID);
+	IPCRouteDeliverBatch(g_IPCPortTable, ppIPC_Pkts, nPkts, pStatus, &(pIPCPort->Overflow));
+
+	ntStatus = IPCBrokerComplete(pChannel, STATUS_SUCCESS, pStatus, nPkts * sizeof(NTSTATUS));
+	free(ppIPC_Pkts);
+	return ntStatus;
+}
+
+
+
+//=====================================================================
+// IPCBrokerSendMulticast
+//
+// Counterpart of IPCDrvSendMulticast. The PIDs of the list are
+// translated along with the packet.
+//=====================================================================
+
+NTSTATUS IPCBrokerSendMulticast(PIPC_BROKER_CHANNEL pChannel)
+{
+	//Locals
+
+	size_t uiInLength = pChannel->cbIn;
+	PCHAR pBuffer = pChannel->pSystemBuffer;
+	PIPC_MULTICAST_HEADER pHeader = (PIPC_MULTICAST_HEADER)pBuffer;
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	HANDLE* pDestPids = NULL;				//Destination PIDs of the list, as HANDLEs
+	PIPC_WIRE_HEADER pTemp_Pkt;
+	PIPC_PACKET pIPC_Pkt;
+	size_t uiOffset, uiPacketLength;
+	ULONG nDelivered = 0;
+	ULONG i;
+	NTSTATUS ntStatus;
+
+	if (uiInLength < sizeof(IPC_MULTICAST_HEADER) ||
+		pHeader->uiTarget > IPC_MULTICAST_BROADCAST ||
+		(pHeader->uiTarget != IPC_MULTICAST_PIDS && pHeader->nPids != 0) ||
+		pHeader->nPids > (uiInLength - sizeof(IPC_MULTICAST_HEADER)) / sizeof(DWORD32) ||
+		(pHeader->uiTarget == IPC_MULTICAST_GROUP && !IPCNameValid(pHeader->szGroup, IPC_GROUP_NAME_MAX)))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+
+	uiOffset = IPC_BATCH_ALIGN_UP(sizeof(IPC_MULTICAST_HEADER) + pHeader->nPids * sizeof(DWORD32));
+	pTemp_Pkt = (PIPC_WIRE_HEADER)(pBuffer + uiOffset);
+
+	if (uiOffset > uiInLength ||
+		!NT_SUCCESS(IPCPacketCheckWire(pTemp_Pkt, uiInLength - uiOffset, FALSE, &uiPacketLength)))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+
+	if (pHeader->nPids)
+	{
+		pDestPids = (HANDLE*)malloc(pHeader->nPids * sizeof(HANDLE));
+		if (!pDestPids)
+		{
+			return IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+		}
+
+		for (i = 0; i < pHeader->nPids; i++)
+		{
+			pDestPids[i] = IPCBrokerPidToCore(((DWORD32*)(pHeader + 1))[i]);
+		}
+	}
+
+	IPCBrokerPacketToCore(pTemp_Pkt);
+	IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)pIPCPort->dwPID);
+	pIPC_Pkt = IPCPacketCreate(g_IPCPortTable, pTemp_Pkt, pIPCPort->dwPID);
+	if (!pIPC_Pkt)
+	{
+		IPCPortCountStat(g_IPCPortTable, pIPCPort, IPC_STAT_ALLOC_FAILURES, 1);
+		ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else if (pHeader->uiTarget == IPC_MULTICAST_PIDS)
+	{
+		ntStatus = IPCRouteMulticast(g_IPCPortTable, pIPC_Pkt, pDestPids, pHeader->nPids, &(pIPCPort->Overflow), &nDelivered);
+	}
+	else if (pHeader->uiTarget == IPC_MULTICAST_GROUP)
+	{
+		ntStatus = IPCRouteMulticastGroup(g_IPCPortTable, pIPC_Pkt, pHeader->szGroup, pIPCPort, &(pIPCPort->Overflow), &nDelivered);
+	}
+	else
+	{
+		ntStatus = IPCRouteBroadcast(g_IPCPortTable, pIPC_Pkt, pIPCPort, &(pIPCPort->Overflow), &nDelivered);
+	}
+
+	free(pDestPids);
+
+	return IPCBrokerComplete(pChannel, ntStatus, &nDelivered,
+		NT_SUCCESS(ntStatus) && pChannel->cbOut >= sizeof(ULONG) ? sizeof(ULONG) : 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerGroup
+//
+// Counterpart of IPCDrvGroup.
+//=====================================================================
+
+NTSTATUS IPCBrokerGroup(PIPC_BROKER_CHANNEL pChannel)
+{
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	char* szGroup = pChannel->pSystemBuffer;
+	NTSTATUS ntStatus;
+
+	if (pChannel->cbIn < IPC_GROUP_NAME_MAX || !IPCNameValid(szGroup, IPC_GROUP_NAME_MAX))
+	{
+		ntStatus = STATUS_INVALID_PARAMETER;
+	}
+	else
+	{
+		ntStatus = pChannel->dwIoControlCode == IOCTL_JOIN_GROUP ?
+			IPCPortJoinGroup(g_IPCPortTable, pIPCPort, szGroup) :
+			IPCPortLeaveGroup(g_IPCPortTable, pIPCPort, szGroup);
+	}
+
+	return IPCBrokerComplete(pChannel, ntStatus, NULL, 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerEndpoint
+//
+// Counterpart of IPCDrvEndpoint, the handle is returned in the
+// client's form (IPC_BROKER_ENDPOINT_TAG).
+//=====================================================================
+
+NTSTATUS IPCBrokerEndpoint(PIPC_BROKER_CHANNEL pChannel)
+{
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	char* szName = pChannel->pSystemBuffer;
+	ULONG dwEndpoint = 0;
+	DWORD32 dwClientEndpoint;
+	NTSTATUS ntStatus;
+
+	if (pChannel->cbIn < IPC_ENDPOINT_NAME_MAX || pChannel->cbOut < sizeof(DWORD32) ||
+		!IPCNameValid(szName, IPC_ENDPOINT_NAME_MAX))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+
+	ntStatus = pChannel->dwIoControlCode == IOCTL_REGISTER_ENDPOINT ?
+		IPCPortRegisterEndpoint(g_IPCPortTable, pIPCPort, szName, &dwEndpoint) :
+		IPCPortResolveEndpoint(g_IPCPortTable, szName, &dwEndpoint);
+
+	dwClientEndpoint = IPCBrokerPidFromCore((HANDLE)(ULONG_PTR)dwEndpoint);
+	return IPCBrokerComplete(pChannel, ntStatus, &dwClientEndpoint, NT_SUCCESS(ntStatus) ? sizeof(DWORD32) : 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerCall
+//
+// Counterpart of IPCDrvCall. The channel waits for the reply in its
+// pPendingCall instead of a cancel safe queue, the reply, a cancel or
+// the cleanup claims it from there with a compare exchange.
+//=====================================================================
+
+NTSTATUS IPCBrokerCall(PIPC_BROKER_CHANNEL pChannel)
+{
+	//Locals
+
+	size_t uiInLength = pChannel->cbIn;
+	size_t uiOutLength = pChannel->cbOut;
+	PIPC_WIRE_HEADER pRequest = (PIPC_WIRE_HEADER)pChannel->pSystemBuffer;
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	PIPC_PACKET pTemp_Out_IPCPkt;
+	PIPC_BROKER_CALL pBrokerCall;
+	PIPC_CALL pCall;
+	PIPC_RING_RECORD pRecord;
+	size_t uiPacketLength;
+	NTSTATUS ntStatus;
+
+	if (pChannel->dwIoControlCode == IOCTL_COLLECT_REPLY)
+	{
+		//Only the calling port can collect the reply kept for one of its calls
+
+		pCall = uiInLength < sizeof(UINT32) ? NULL :
+			IPCCallTakeReply(g_IPCPortTable, pIPCPort, *(UINT32*)pChannel->pSystemBuffer);
+		if (!pCall)
+		{
+			return IPCBrokerComplete(pChannel, STATUS_NOT_FOUND, NULL, 0);
+		}
+
+		pBrokerCall = CONTAINING_RECORD(pCall, IPC_BROKER_CALL, Call);
+		uiPacketLength = IPCPacketReadLength(pCall->pReply);
+		if (uiOutLength < uiPacketLength)
+		{
+			if (IPCCallKeepReply(g_IPCPortTable, pCall, pCall->pReply))
+			{
+				return IPCBrokerCompleteReplyTooSmall(pChannel, pCall);
+			}
+			IPCBrokerReleaseCall(pBrokerCall);
+			return IPCBrokerComplete(pChannel, STATUS_CANCELLED, NULL, 0);
+		}
+
+		//The call is out of the registry, which held its last reference
+
+		pRecord = IPCRingReserve(&(pChannel->Response), sizeof(IPC_BROKER_RESPONSE) + uiPacketLength, IPC_RING_INFINITE);
+		uiPacketLength = IPCPacketCopyOut(g_IPCPortTable, pRecord->szMsg + sizeof(IPC_BROKER_RESPONSE), pCall->pReply);
+		IPCBrokerPacketFromCore((PIPC_WIRE_HEADER)(pRecord->szMsg + sizeof(IPC_BROKER_RESPONSE)));
+		IPCPacketFree(g_IPCPortTable, pCall->pReply);
+		IPCBrokerReleaseCall(pBrokerCall);
+
+		return IPCBrokerCommitResponse(pChannel, pRecord, STATUS_SUCCESS, uiPacketLength);
+	}
+
+	if (!NT_SUCCESS(IPCPacketCheckWire(pRequest, uiInLength, FALSE, &uiPacketLength)) ||
+		uiOutLength < sizeof(IPC_WIRE_HEADER) + sizeof(IPC_WIRE_CALL_ID))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+
+	IPCBrokerPacketToCore(pRequest);
+
+	pTemp_Out_IPCPkt = IPCPacketCreate(g_IPCPortTable, pRequest, pIPCPort->dwPID);
+	pBrokerCall = (PIPC_BROKER_CALL)IPCPoolAllocate(&(g_IPCPortTable->PktPool), sizeof(IPC_BROKER_CALL));
+	if (!pTemp_Out_IPCPkt || !pBrokerCall)
+	{
+		if (pTemp_Out_IPCPkt)
+		{
+			IPCPacketFree(g_IPCPortTable, pTemp_Out_IPCPkt);
+		}
+		else
+		{
+			IPCPortCountStat(g_IPCPortTable, pIPCPort, IPC_STAT_ALLOC_FAILURES, 1);
+		}
+		if (pBrokerCall)
+		{
+			IPCPoolFree(&(g_IPCPortTable->PktPool), pBrokerCall, sizeof(IPC_BROKER_CALL));
+		}
+		return IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+	}
+
+	//The registry, the channel and this routine each hold a reference on the call state.
+	//The call is registered before the channel waits on it so a cancel always finds it
+
+	pBrokerCall->lRefCount = 3;
+	pBrokerCall->pChannel = pChannel;
+	pBrokerCall->pPort = pIPCPort;
+	IPCPortReference(pIPCPort);
+	IPCCallRegister(g_IPCPortTable, &(pBrokerCall->Call), pIPCPort, uiOutLength);
+
+	(VOID)InterlockedExchangePointer(&(pChannel->pPendingCall), pBrokerCall);
+
+	//Route the request behind the sender's queued writes. A reply may complete the channel's request before this returns
+
+	IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)pIPCPort->dwPID);
+	ntStatus = IPCRouteCall(g_IPCPortTable, &(pBrokerCall->Call), pTemp_Out_IPCPkt, &(pIPCPort->Overflow));
+	if (!NT_SUCCESS(ntStatus) &&
+		InterlockedCompareExchangePointer(&(pChannel->pPendingCall), NULL, pBrokerCall) == pBrokerCall)
+	{
+		IPCBrokerFinishCall(pBrokerCall, ntStatus);
+	}
+
+	IPCBrokerReleaseCall(pBrokerCall);
+
+	return STATUS_PENDING;
+}
+
+
+
+//=====================================================================
+// IPCBrokerReply
+//
+// Counterpart of IPCDrvReply, the routing core copies the reply into
+// the response ring of the waiting channel.
+//=====================================================================
+
+NTSTATUS IPCBrokerReply(PIPC_BROKER_CHANNEL pChannel)
+{
+	PIPC_WIRE_HEADER pReply = (PIPC_WIRE_HEADER)pChannel->pSystemBuffer;
+	size_t uiPacketLength;
+	NTSTATUS ntStatus;
+
+	if (!NT_SUCCESS(IPCPacketCheckWire(pReply, pChannel->cbIn, TRUE, &uiPacketLength)))
+	{
+		ntStatus = STATUS_INVALID_PARAMETER;
+	}
+	else
+	{
+		IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)pChannel->pSession->pPort->dwPID);
+		ntStatus = IPCRouteReply(g_IPCPortTable, pReply, pChannel->pSession->pPort->dwPID);
+	}
+
+	return IPCBrokerComplete(pChannel, ntStatus, NULL, 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerQueryStats
+//
+// Counterpart of IPCDrvQueryStats, the PID of every port is returned
+// in the client's form.
+//=====================================================================
+
+NTSTATUS IPCBrokerQueryStats(PIPC_BROKER_CHANNEL pChannel)
+{
+	PIPC_STATS pStats = (PIPC_STATS)pChannel->pSystemBuffer;
+	UINT32 i;
+
+	if (pChannel->cbOut < sizeof(IPC_STATS))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_BUFFER_TOO_SMALL, NULL, 0);
+	}
+
+	IPCPortTableQueryStats(g_IPCPortTable, pStats, (ULONG)((pChannel->cbOut - sizeof(IPC_STATS)) / sizeof(IPC_PORT_STATS)));
+	IPCRouterFillStats(&g_IPCRouter, pStats);
+	for (i = 0; i < pStats->nReturned; i++)
+	{
+		pStats->Ports[i].dwPID = IPCBrokerPidFromCore((HANDLE)(ULONG_PTR)pStats->Ports[i].dwPID);
+	}
+
+	return IPCBrokerComplete(pChannel, STATUS_SUCCESS, pStats, sizeof(IPC_STATS) + pStats->nReturned * sizeof(IPC_PORT_STATS));
+}
+
+
+
+//=====================================================================
+// IPCBrokerTrace
+//
+// Counterpart of IPCDrvTrace.
+//=====================================================================
+
+NTSTATUS IPCBrokerTrace(PIPC_BROKER_CHANNEL pChannel)
+{
+	PVOID pBuffer = pChannel->pSystemBuffer;
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	HANDLE dwPID;
+	NTSTATUS ntStatus;
+
+	if (pChannel->dwIoControlCode == IOCTL_SET_TRACE)
+	{
+		ntStatus = pChannel->cbIn < sizeof(UINT32) || *(UINT32*)pBuffer > 1 ? STATUS_INVALID_PARAMETER :
+			IPCPortSetTrace(g_IPCPortTable, pIPCPort, (BOOLEAN)*(UINT32*)pBuffer);
+		return IPCBrokerComplete(pChannel, ntStatus, NULL, 0);
+	}
+
+	if (pChannel->cbIn < sizeof(DWORD32) || pChannel->cbOut < sizeof(IPC_TRACE_STATS))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_BUFFER_TOO_SMALL, NULL, 0);
+	}
+
+	dwPID = *(DWORD32*)pBuffer ? IPCBrokerPidToCore(*(DWORD32*)pBuffer) : pIPCPort->dwPID;
+	ntStatus = IPCPortQueryTrace(g_IPCPortTable, dwPID, (PIPC_TRACE_STATS)pBuffer);
+
+	return IPCBrokerComplete(pChannel, ntStatus, pBuffer, NT_SUCCESS(ntStatus) ? sizeof(IPC_TRACE_STATS) : 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerFlowControl
+//
+// Counterpart of IPCDrvFlowControl.
+//=====================================================================
+
+NTSTATUS IPCBrokerFlowControl(PIPC_BROKER_CHANNEL pChannel)
+{
+	PVOID pBuffer = pChannel->pSystemBuffer;
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	IPC_CREDITS Credits;
+	size_t cbReturned = 0;
+	NTSTATUS ntStatus = STATUS_SUCCESS;
+
+	switch (pChannel->dwIoControlCode)
+	{
+	case IOCTL_SET_QUEUE_LIMIT:
+
+		if (pChannel->cbIn < sizeof(IPC_QUEUE_LIMIT) || ((PIPC_QUEUE_LIMIT)pBuffer)->uiReserved != 0)
+		{
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		IPCPortSetLimit(pIPCPort, (PIPC_QUEUE_LIMIT)pBuffer);
+		break;
+
+	case IOCTL_SET_OVERFLOW:
+
+		if (pChannel->cbIn < sizeof(IPC_OVERFLOW) || ((PIPC_OVERFLOW)pBuffer)->uiPolicy > IPC_OVERFLOW_DROP_OLDEST)
+		{
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		pIPCPort->Overflow = *(PIPC_OVERFLOW)pBuffer;
+		break;
+
+	case IOCTL_QUERY_CREDITS:
+
+		if (pChannel->cbIn < sizeof(DWORD32) || pChannel->cbOut < sizeof(IPC_CREDITS))
+		{
+			ntStatus = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		ntStatus = IPCPortQueryCredits(g_IPCPortTable, IPCBrokerPidToCore(*(DWORD32*)pBuffer), &Credits);
+		if (NT_SUCCESS(ntStatus))
+		{
+			RtlCopyMemory(pBuffer, &Credits, sizeof(IPC_CREDITS));
+			cbReturned = sizeof(IPC_CREDITS);
+		}
+		break;
+
+	case IOCTL_SET_LANE_WEIGHTS:
+
+		if (pChannel->cbIn < sizeof(IPC_LANE_WEIGHTS))
+		{
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		IPCPortSetLaneWeights(pIPCPort, (PIPC_LANE_WEIGHTS)pBuffer);
+		break;
+	}
+
+	return IPCBrokerComplete(pChannel, ntStatus, pBuffer, cbReturned);
+}
+
+
+
+//=====================================================================
+// IPCBrokerRead
+//
+// Counterpart of IPCDrvRead. If no packet is queued the channel is
+// parked on its port and the next packet routed to the port completes
+// its read from the sender's thread.
+//=====================================================================
+
+NTSTATUS IPCBrokerRead(PIPC_BROKER_CHANNEL pChannel)
+{
+	PIPC_PORT pIPCPort = pChannel->pSession->pPort;
+	PIPC_PACKET pTemp_IPC_In_Pkt;
+	size_t uiPacketLength;
+	NTSTATUS ntStatus;
+
+	pTemp_IPC_In_Pkt = IPCPortDequeueOrPark(pIPCPort, pChannel->cbOut, pChannel, &ntStatus, &uiPacketLength);
+	if (!pTemp_IPC_In_Pkt)
+	{
+		if (ntStatus == STATUS_BUFFER_OVERFLOW)
+		{
+			//The packet stays at the head of the queue so message order is kept
+			return IPCBrokerCompleteTooSmall(pChannel, uiPacketLength);
+		}
+		return ntStatus;
+	}
+
+	IPCBrokerCompleteRead(g_IPCPortTable, pIPCPort, pChannel, pTemp_IPC_In_Pkt);
+	return STATUS_SUCCESS;
+}
+
+
+
+//=====================================================================
+// IPCBrokerRecvBatch
+//
+// Counterpart of IPCDrvRecvBatch. The detached packets are sized first
+// and then copied straight into the response ring, which plays the
+// part of the output buffer METHOD_OUT_DIRECT maps. With
+// IPC_RECV_BATCH_WAIT an empty port parks the channel with the reads.
+//=====================================================================
+
+NTSTATUS IPCBrokerRecvBatch(PIPC_BROKER_CHANNEL pChannel)
+{
+	//Locals
+
+	ULONG nMaxPkts = MAXULONG;
+	PVOID pReader = NULL;
+	IPC_BATCH_HEADER Batch;
+	PIPC_BATCH_HEADER pBatch;
+	PIPC_PACKET pTemp_IPC_In_Pkt;
+	PIPC_RING_RECORD pRecord;
+	LIST_ENTRY Pkt_List;
+	PLIST_ENTRY pEntry;
+	size_t uiOffset, cbNext;
+	NTSTATUS ntStatus;
+	ULONG nPkts;
+
+	if (pChannel->cbIn >= sizeof(UINT32) && *(UINT32*)pChannel->pSystemBuffer != 0)
+	{
+		nMaxPkts = *(UINT32*)pChannel->pSystemBuffer;
+	}
+	if (pChannel->cbIn >= sizeof(IPC_RECV_BATCH) && (((PIPC_RECV_BATCH)pChannel->pSystemBuffer)->uiFlags & IPC_RECV_BATCH_WAIT))
+	{
+		pReader = pChannel;
+	}
+
+	if (pChannel->cbOut < sizeof(IPC_BATCH_HEADER))
+	{
+		return IPCBrokerComplete(pChannel, STATUS_INVALID_PARAMETER, NULL, 0);
+	}
+
+	nPkts = IPCPortDequeueBatchOrPark(pChannel->pSession->pPort, nMaxPkts, pChannel->cbOut, pReader, &Pkt_List, &cbNext, &ntStatus);
+	if (ntStatus == STATUS_PENDING)
+	{
+		return ntStatus;
+	}
+
+	Batch.nPackets = nPkts;
+	Batch.cbNext = (UINT32)cbNext;
+
+	if (nPkts == 0)
+	{
+		//Either the queue is empty or the head packet alone does not fit
+
+		return IPCBrokerComplete(pChannel, cbNext ? STATUS_BUFFER_OVERFLOW : STATUS_NO_MORE_ENTRIES,
+			&Batch, cbNext ? sizeof(IPC_BATCH_HEADER) : 0);
+	}
+
+	uiOffset = sizeof(IPC_BATCH_HEADER);
+	for (pEntry = Pkt_List.Flink; pEntry != &Pkt_List; pEntry = pEntry->Flink)
+	{
+		uiOffset = IPC_BATCH_ALIGN_UP(uiOffset) + IPCPacketReadLength(CONTAINING_RECORD(pEntry, IPC_PACKET, list_entry));
+	}
+
+	pRecord = IPCRingReserve(&(pChannel->Response), sizeof(IPC_BROKER_RESPONSE) + uiOffset, IPC_RING_INFINITE);
+	pBatch = (PIPC_BATCH_HEADER)(pRecord->szMsg + sizeof(IPC_BROKER_RESPONSE));
+	*pBatch = Batch;
+
+	//Copy every detached packet out and return it to the packet pool
+
+	uiOffset = sizeof(IPC_BATCH_HEADER);
+	while (!IsListEmpty(&Pkt_List))
+	{
+		pTemp_IPC_In_Pkt = CONTAINING_RECORD(RemoveHeadList(&Pkt_List), IPC_PACKET, list_entry);
+		uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+		IPCPacketCopyOut(g_IPCPortTable, (PCHAR)pBatch + uiOffset, pTemp_IPC_In_Pkt);
+		IPCBrokerPacketFromCore((PIPC_WIRE_HEADER)((PCHAR)pBatch + uiOffset));
+		uiOffset += IPCPacketReadLength(pTemp_IPC_In_Pkt);
+		IPCPacketFree(g_IPCPortTable, pTemp_IPC_In_Pkt);
+	}
+
+	return IPCBrokerCommitResponse(pChannel, pRecord, STATUS_SUCCESS, uiOffset);
+}
+
+
+
+//=====================================================================
+// IPCBrokerWait
+//
+// Waits on the port's Read notification event the way the DLL waits on
+// the event it registers with the driver. The wait gives up when the
+// session is cleaned up, the client exits or the broker stops.
+//=====================================================================
+
+NTSTATUS IPCBrokerWait(PIPC_BROKER_CHANNEL pChannel)
+{
+	PIPC_BROKER_SESSION pSession = pChannel->pSession;
+	PIPC_BROKER_READERS pReaders = (PIPC_BROKER_READERS)pSession->pPort->pReaderContext;
+	struct timespec Deadline;
+
+	while (!g_bIPCBrokerStop && !pSession->bCleanedUp)
+	{
+		clock_gettime(CLOCK_REALTIME, &Deadline);
+		Deadline.tv_sec += IPC_BROKER_POLL_MS / 1000;
+
+		if (IPCShimWaitForEventUntil(&(pReaders->Kevent), &Deadline))
+		{
+			if (pSession->bCleanedUp)
+			{
+				break;
+			}
+			return IPCBrokerComplete(pChannel, STATUS_SUCCESS, NULL, 0);
+		}
+		if (!IPCRingPidAlive(pSession->dwClientPid))
+		{
+			break;
+		}
+	}
+
+	return IPCBrokerComplete(pChannel, STATUS_CANCELLED, NULL, 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerCancel
+//
+// Cancels the channel's request uiSeq if it is still parked or waiting
+// for its reply. A request that completed meanwhile is left alone, its
+// response is already in the ring.
+//=====================================================================
+
+VOID IPCBrokerCancel(PIPC_BROKER_CHANNEL pChannel, UINT32 uiSeq)
+{
+	PIPC_BROKER_READERS pReaders = (PIPC_BROKER_READERS)pChannel->pSession->pPort->pReaderContext;
+	PIPC_BROKER_CALL pBrokerCall;
+	BOOLEAN bParked = FALSE;
+	KIRQL Irql;
+
+	if (uiSeq != pChannel->uiSeq || !pChannel->bPending)
+	{
+		return;
+	}
+
+	KeAcquireSpinLock(&(pReaders->Channel_List_Lock), &Irql);
+	if (pChannel->Park_Entry.Flink != &(pChannel->Park_Entry))
+	{
+		RemoveEntryList(&(pChannel->Park_Entry));
+		InitializeListHead(&(pChannel->Park_Entry));
+		bParked = TRUE;
+	}
+	KeReleaseSpinLock(&(pReaders->Channel_List_Lock), Irql);
+
+	if (bParked)
+	{
+		IPCBrokerComplete(pChannel, STATUS_CANCELLED, NULL, 0);
+		return;
+	}
+
+	pBrokerCall = InterlockedExchangePointer(&(pChannel->pPendingCall), NULL);
+	if (pBrokerCall)
+	{
+		IPCBrokerFinishCall(pBrokerCall, STATUS_CANCELLED);
+	}
+}
+
+
+
+//=====================================================================
+// IPCBrokerComplete / IPCBrokerCommitResponse
+//
+// Write the response of the channel's request, which the client is
+// waiting for. Like the IO manager, no data is returned with an error
+// status, only with success and warnings. The response ring is empty
+// here as the client has one request outstanding per channel.
+//=====================================================================
+
+NTSTATUS IPCBrokerComplete(PIPC_BROKER_CHANNEL pChannel, NTSTATUS ntStatus, const VOID* pData, size_t cbData)
+{
+	PIPC_RING_RECORD pRecord;
+
+	if (((ULONG)ntStatus >> 30) == 3)
+	{
+		cbData = 0;
+	}
+
+	pRecord = IPCRingReserve(&(pChannel->Response), sizeof(IPC_BROKER_RESPONSE) + cbData, IPC_RING_INFINITE);
+	if (cbData)
+	{
+		RtlCopyMemory(pRecord->szMsg + sizeof(IPC_BROKER_RESPONSE), pData, cbData);
+	}
+
+	return IPCBrokerCommitResponse(pChannel, pRecord, ntStatus, cbData);
+}
+
+NTSTATUS IPCBrokerCommitResponse(PIPC_BROKER_CHANNEL pChannel, PIPC_RING_RECORD pRecord, NTSTATUS ntStatus, size_t cbReturned)
+{
+	PIPC_BROKER_RESPONSE pResponse = (PIPC_BROKER_RESPONSE)pRecord->szMsg;
+
+	pResponse->uiSeq = pChannel->uiSeq;
+	pResponse->lStatus = ntStatus;
+	pResponse->cbReturned = (uint32_t)cbReturned;
+	pResponse->uiReserved = 0;
+	IPCRingCommit(&(pChannel->Response), pRecord);
+
+	//The channel may be closed as soon as this is cleared
+
+	InterlockedExchange(&(pChannel->bPending), 0);
+	return ntStatus;
+}
+
+
+
+//=====================================================================
+// IPCBrokerParkRead / IPCBrokerTakeRead
+//
+// Routing core reader hooks, called with the Incoming queue lock of the
+// port held and the queue empty. The channel is queued to or removed
+// from the parked readers kept after the port.
+//=====================================================================
+
+NTSTATUS IPCBrokerParkRead(PIPC_PORT pPort, PVOID pReader)
+{
+	PIPC_BROKER_READERS pReaders = (PIPC_BROKER_READERS)pPort->pReaderContext;
+	PIPC_BROKER_CHANNEL pChannel = (PIPC_BROKER_CHANNEL)pReader;
+	KIRQL Irql;
+
+	KeAcquireSpinLock(&(pReaders->Channel_List_Lock), &Irql);
+	InsertTailList(&(pReaders->Channel_List), &(pChannel->Park_Entry));
+	KeReleaseSpinLock(&(pReaders->Channel_List_Lock), Irql);
+
+	return STATUS_PENDING;
+}
+
+PVOID IPCBrokerTakeRead(PIPC_PORT pPort)
+{
+	PIPC_BROKER_READERS pReaders = (PIPC_BROKER_READERS)pPort->pReaderContext;
+	PIPC_BROKER_CHANNEL pChannel = NULL;
+	KIRQL Irql;
+
+	KeAcquireSpinLock(&(pReaders->Channel_List_Lock), &Irql);
+	if (!IsListEmpty(&(pReaders->Channel_List)))
+	{
+		pChannel = CONTAINING_RECORD(RemoveHeadList(&(pReaders->Channel_List)), IPC_BROKER_CHANNEL, Park_Entry);
+		InitializeListHead(&(pChannel->Park_Entry));
+	}
+	KeReleaseSpinLock(&(pReaders->Channel_List_Lock), Irql);
+
+	return pChannel;
+}
+
+
+
+//=====================================================================
+// IPCBrokerCompleteTooSmall
+//
+// Counterpart of IPCDrvCompleteTooSmall, the required size is returned
+// in an int with the STATUS_BUFFER_OVERFLOW warning.
+//=====================================================================
+
+NTSTATUS IPCBrokerCompleteTooSmall(PIPC_BROKER_CHANNEL pChannel, size_t uiPacketLength)
+{
+	int iRequiredBufferSize = (int)uiPacketLength;
+
+	return IPCBrokerComplete(pChannel, STATUS_BUFFER_OVERFLOW, &iRequiredBufferSize,
+		pChannel->cbOut >= sizeof(int) ? sizeof(int) : 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerCompleteRecvBatch
+//
+// Counterpart of IPCDrvCompleteRecvBatch, the batch of one is written
+// straight into the channel's response ring.
+//=====================================================================
+
+BOOLEAN IPCBrokerCompleteRecvBatch(PIPC_PORT_TABLE pTable, PIPC_BROKER_CHANNEL pChannel, PIPC_PACKET pIPC_Pkt)
+{
+	size_t uiBatchLength = IPCPacketBatchLength(pIPC_Pkt);
+	IPC_BATCH_HEADER Batch;
+	PIPC_RING_RECORD pRecord;
+	PCHAR pOut;
+
+	if (pChannel->cbOut < uiBatchLength)
+	{
+		Batch.nPackets = 0;
+		Batch.cbNext = (UINT32)IPCPacketReadLength(pIPC_Pkt);
+		IPCBrokerComplete(pChannel, STATUS_BUFFER_OVERFLOW, &Batch, sizeof(IPC_BATCH_HEADER));
+		return FALSE;
+	}
+
+	pRecord = IPCRingReserve(&(pChannel->Response), sizeof(IPC_BROKER_RESPONSE) + uiBatchLength, IPC_RING_INFINITE);
+	pOut = pRecord->szMsg + sizeof(IPC_BROKER_RESPONSE);
+	uiBatchLength = IPCPacketCopyOutBatch(pTable, pOut, pIPC_Pkt);
+	IPCBrokerPacketFromCore((PIPC_WIRE_HEADER)(pOut + IPC_BATCH_ALIGN_UP(sizeof(IPC_BATCH_HEADER))));
+	IPCPacketFree(pTable, pIPC_Pkt);
+
+	IPCBrokerCommitResponse(pChannel, pRecord, STATUS_SUCCESS, uiBatchLength);
+	return TRUE;
+}
+
+
+
+//=====================================================================
+// IPCBrokerCompleteRead
+//
+// Routing core reader hook, completes a parked read with a packet. The
+// packet is copied straight into the channel's response ring, FALSE
+// hands it back if the client's buffer is too small. A parked batch
+// receive is completed with a batch of one.
+//=====================================================================
+
+BOOLEAN IPCBrokerCompleteRead(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, PVOID pReader, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_BROKER_CHANNEL pChannel = (PIPC_BROKER_CHANNEL)pReader;
+	size_t uiPacketLength = IPCPacketReadLength(pIPC_Pkt);
+	PIPC_RING_RECORD pRecord;
+	PIPC_WIRE_HEADER pOut;
+
+	if (pChannel->dwOp == IPC_BROKER_OP_IOCTL)
+	{
+		return IPCBrokerCompleteRecvBatch(pTable, pChannel, pIPC_Pkt);
+	}
+
+	if (pChannel->cbOut < uiPacketLength)
+	{
+		IPCBrokerCompleteTooSmall(pChannel, uiPacketLength);
+		return FALSE;
+	}
+
+	pRecord = IPCRingReserve(&(pChannel->Response), sizeof(IPC_BROKER_RESPONSE) + uiPacketLength, IPC_RING_INFINITE);
+	pOut = (PIPC_WIRE_HEADER)(pRecord->szMsg + sizeof(IPC_BROKER_RESPONSE));
+	uiPacketLength = IPCPacketCopyOut(pTable, pOut, pIPC_Pkt);
+	IPCBrokerPacketFromCore(pOut);
+	IPCPacketFree(pTable, pIPC_Pkt);
+
+	IPCBrokerCommitResponse(pChannel, pRecord, STATUS_SUCCESS, uiPacketLength);
+	return TRUE;
+}
+
+
+
+//=====================================================================
+// IPCBrokerCompleteCall
+//
+// Routing core call hook, counterpart of IPCDrvCompleteCall. The call
+// is claimed from the channel's pPendingCall, a cancel may have got to
+// it first. A reply that fits is copied straight from the replier's
+// System buffer into the caller's response ring, one that does not is
+// kept for IOCTL_COLLECT_REPLY.
+//=====================================================================
+
+VOID IPCBrokerCompleteCall(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, const IPC_WIRE_HEADER* pReply)
+{
+	PIPC_BROKER_CALL pBrokerCall = CONTAINING_RECORD(pCall, IPC_BROKER_CALL, Call);
+	PIPC_BROKER_CHANNEL pChannel = pBrokerCall->pChannel;
+	PIPC_PACKET pKeptReply;
+	PIPC_RING_RECORD pRecord;
+	PIPC_WIRE_HEADER pOut;
+	size_t uiPacketLength;
+
+	if (InterlockedCompareExchangePointer(&(pChannel->pPendingCall), NULL, pBrokerCall) != pBrokerCall)
+	{
+		IPCBrokerReleaseCall(pBrokerCall);
+		return;
+	}
+
+	if (!pReply)
+	{
+		//The callee went away before replying, or the caller itself is being cleaned up
+
+		IPCBrokerComplete(pChannel, pBrokerCall->pPort->bClosed ? STATUS_CANCELLED : STATUS_NOT_FOUND, NULL, 0);
+	}
+	else
+	{
+		uiPacketLength = IPCWireLength(pReply);
+		if (uiPacketLength <= pCall->cbReplyMax)
+		{
+			pRecord = IPCRingReserve(&(pChannel->Response), sizeof(IPC_BROKER_RESPONSE) + uiPacketLength, IPC_RING_INFINITE);
+			pOut = (PIPC_WIRE_HEADER)(pRecord->szMsg + sizeof(IPC_BROKER_RESPONSE));
+			RtlCopyMemory(pOut, pReply, uiPacketLength);
+			IPCBrokerPacketFromCore(pOut);
+			IPCBrokerCommitResponse(pChannel, pRecord, STATUS_SUCCESS, uiPacketLength);
+		}
+		else if ((pKeptReply = IPCPacketCreate(pTable, pReply, (HANDLE)(ULONG_PTR)pReply->dwPid)) == NULL)
+		{
+			IPCPortCountStat(pTable, pCall->pCaller, IPC_STAT_ALLOC_FAILURES, 1);
+			IPCBrokerComplete(pChannel, STATUS_INSUFFICIENT_RESOURCES, NULL, 0);
+		}
+		else if (IPCCallKeepReply(pTable, pCall, pKeptReply))
+		{
+			//The registry keeps its reference until the reply is collected
+
+			IPCBrokerCompleteReplyTooSmall(pChannel, pCall);
+			IPCBrokerReleaseCall(pBrokerCall);
+			return;
+		}
+		else
+		{
+			IPCBrokerComplete(pChannel, STATUS_CANCELLED, NULL, 0);
+		}
+	}
+
+	IPCBrokerReleaseCall(pBrokerCall);
+	IPCBrokerReleaseCall(pBrokerCall);
+}
+
+
+
+//=====================================================================
+// IPCBrokerCompleteReplyTooSmall
+//
+// Counterpart of IPCDrvCompleteReplyTooSmall, returns the
+// IPC_CALL_OVERFLOW of the reply kept in pCall.
+//=====================================================================
+
+NTSTATUS IPCBrokerCompleteReplyTooSmall(PIPC_BROKER_CHANNEL pChannel, PIPC_CALL pCall)
+{
+	IPC_CALL_OVERFLOW Overflow;
+
+	IPCPortCountStat(g_IPCPortTable, pCall->pCaller, IPC_STAT_TOO_SMALL, 1);
+
+	Overflow.cbReply = (UINT32)IPCPacketReadLength(pCall->pReply);
+	Overflow.uiCallId = pCall->uiCallId;
+
+	return IPCBrokerComplete(pChannel, STATUS_BUFFER_OVERFLOW, &Overflow,
+		pChannel->cbOut >= sizeof(IPC_CALL_OVERFLOW) ? sizeof(IPC_CALL_OVERFLOW) : 0);
+}
+
+
+
+//=====================================================================
+// IPCBrokerFinishCall / IPCBrokerReleaseCall
+//
+// Counterparts of IPCDrvFinishCall and IPCDrvReleaseCall. The call has
+// been claimed from its channel by a cancel, a cleanup or a failed route.
+//=====================================================================
+
+VOID IPCBrokerFinishCall(PIPC_BROKER_CALL pBrokerCall, NTSTATUS ntStatus)
+{
+	if (IPCCallCancel(g_IPCPortTable, &(pBrokerCall->Call)))
+	{
+		IPCBrokerReleaseCall(pBrokerCall);
+	}
+
+	IPCBrokerComplete(pBrokerCall->pChannel, ntStatus, NULL, 0);
+
+	IPCBrokerReleaseCall(pBrokerCall);
+}
+
+VOID IPCBrokerReleaseCall(PIPC_BROKER_CALL pBrokerCall)
+{
+	if (InterlockedDecrement(&(pBrokerCall->lRefCount)) == 0)
+	{
+		IPCPortDereference(pBrokerCall->pPort);
+		IPCPoolFree(&(g_IPCPortTable->PktPool), pBrokerCall, sizeof(IPC_BROKER_CALL));
+	}
+}
+
+
+
+//=====================================================================
+// IPCBrokerCleanup
+//
+// Counterpart of IPCDrvCleanup, run once per session. The port is
+// removed from the table, the parked reads are completed and so are
+// the calls still waiting for a reply. A wait on the Read notification
+// event is released.
+//=====================================================================
+
+VOID IPCBrokerCleanup(PIPC_BROKER_SESSION pSession)
+{
+	PIPC_PORT pIPCPort = pSession->pPort;
+	PIPC_BROKER_READERS pReaders = (PIPC_BROKER_READERS)pIPCPort->pReaderContext;
+	PIPC_BROKER_CHANNEL pChannel;
+	PIPC_BROKER_CALL pBrokerCall;
+	PLIST_ENTRY pEntry;
+
+	pthread_mutex_lock(&g_IPCBrokerLock);
+	if (pSession->bCleanedUp)
+	{
+		pthread_mutex_unlock(&g_IPCBrokerLock);
+		return;
+	}
+	pSession->bCleanedUp = TRUE;
+	pthread_mutex_unlock(&g_IPCBrokerLock);
+
+	IPCPortTableRemove(g_IPCPortTable, pIPCPort);
+
+	while ((pChannel = (PIPC_BROKER_CHANNEL)IPCBrokerTakeRead(pIPCPort)) != NULL)
+	{
+		IPCBrokerComplete(pChannel, STATUS_CANCELLED, NULL, 0);
+	}
+
+	//Removing the port aborted its calls, any call left lost a race with that
+
+	pthread_mutex_lock(&g_IPCBrokerLock);
+	for (pEntry = pSession->Channel_List.Flink; pEntry != &(pSession->Channel_List); pEntry = pEntry->Flink)
+	{
+		pChannel = CONTAINING_RECORD(pEntry, IPC_BROKER_CHANNEL, list_entry);
+		pBrokerCall = InterlockedExchangePointer(&(pChannel->pPendingCall), NULL);
+		if (pBrokerCall)
+		{
+			IPCBrokerFinishCall(pBrokerCall, STATUS_CANCELLED);
+		}
+	}
+	pthread_mutex_unlock(&g_IPCBrokerLock);
+
+	KeSetEvent(&(pReaders->Kevent), 0, FALSE);
+}
+
+
+
+//=====================================================================
+// IPCBrokerClose
+//
+// Counterpart of IPCDrvClose for one channel. The channel's rings are
+// closed, the last channel of a session also frees the session and
+// drops the reference of its File object on the port.
+//=====================================================================
+
+VOID IPCBrokerClose(PIPC_BROKER_CHANNEL pChannel)
+{
+	PIPC_BROKER_SESSION pSession = pChannel->pSession;
+	BOOLEAN bLast;
+
+	pthread_mutex_lock(&g_IPCBrokerLock);
+	RemoveEntryList(&(pChannel->list_entry));
+	bLast = --pSession->nChannels == 0;
+	if (bLast)
+	{
+		RemoveEntryList(&(pSession->list_entry));
+	}
+	pthread_mutex_unlock(&g_IPCBrokerLock);
+
+	//A client that died left the name of its response ring behind
+
+	if (!IPCRingPidAlive(pSession->dwClientPid))
+	{
+		shm_unlink(pChannel->Response.szName);
+	}
+
+	IPCRingClose(&(pChannel->Request));
+	IPCRingClose(&(pChannel->Response));
+	free(pChannel->pSystemBuffer);
+	free(pChannel);
+
+	if (bLast)
+	{
+		IPCBrokerCleanup(pSession);
+		pSession->FileObj.FsContext = NULL;
+		pSession->FileObj.FsContext2 = NULL;
+		IPCPortDereference(pSession->pPort);
+		free(pSession);
+	}
+}
+
+
+
+//=====================================================================
+// PID translation
+//
+// The routing core takes an odd PID for an endpoint handle. Client PIDs
+// are shifted left by 2 on the way in, like Windows PIDs they are then
+// multiples of 4, and endpoint handles are handed out with
+// IPC_BROKER_ENDPOINT_TAG instead, which no PID has.
+//=====================================================================
+
+HANDLE IPCBrokerPidToCore(ULONG_PTR dwPid)
+{
+	DWORD32 dwClientPid = (DWORD32)dwPid;
+
+	if (dwClientPid & IPC_BROKER_ENDPOINT_TAG)
+	{
+		return (HANDLE)(ULONG_PTR)IPCEndpointHandle(dwClientPid & 0x7FFF, (dwClientPid >> 15) & 0xFFFF);
+	}
+	return (HANDLE)((ULONG_PTR)dwClientPid << 2);
+}
+
+DWORD32 IPCBrokerPidFromCore(HANDLE dwPid)
+{
+	if (IPCIsEndpointHandle(dwPid))
+	{
+		return IPC_BROKER_ENDPOINT_TAG | (IPCEndpointGeneration(dwPid) << 15) | IPCEndpointSlot(dwPid);
+	}
+	return (DWORD32)((ULONG_PTR)dwPid >> 2);
+}
+
+VOID IPCBrokerPacketToCore(PIPC_WIRE_HEADER pWire)
+{
+	pWire->dwPid = (UINT32)(ULONG_PTR)IPCBrokerPidToCore(pWire->dwPid);
+}
+
+VOID IPCBrokerPacketFromCore(PIPC_WIRE_HEADER pWire)
+{
+	pWire->dwPid = IPCBrokerPidFromCore((HANDLE)(ULONG_PTR)pWire->dwPid);
+}
@@ -0,0 +1,249 @@
+//=====================================================================
+// IPC- Inter Process Communication Broker Header File
+//
+// This file contains Macro Definitions, structure definitions and Function declarations
+// used in the IPCBroker.c file
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+#pragma once
+
+//Include Files
+
+#include <stdio.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "../IPCDrv_v2/IPCRoute_v2.h"
+#include "../IPCDrv_v2/IPCRouter_v2.h"
+#include "../IPC_Dll_v2/IPC_Broker_v2.h"
+
+//Constants
+
+#define IPC_DEVICE_TYPE 40000							 //DeviceType used in CTL_CODE Macro, the codes are the driver's
+#define METHOD_BUFFERED 0
+#define METHOD_OUT_DIRECT 2
+#define FILE_READ_DATA 0x0001
+#define FILE_WRITE_DATA 0x0002
+#define CTL_CODE(DeviceType, Function, Method, Access) (((ULONG)(DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define IOCTL_SEND_BATCH\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA) //Batch send IOCTL, IPC_BATCH_HEADER and packets in, one NTSTATUS per packet out
+#define IOCTL_RECV_BATCH\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x802, METHOD_OUT_DIRECT, FILE_READ_DATA) //Batch read IOCTL, maximum packet count in, IPC_BATCH_HEADER and packets out
+#define IOCTL_SEND_MULTICAST\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA) //Multicast send IOCTL, IPC_MULTICAST_HEADER, PIDs and packet in, recipient count out
+#define IOCTL_JOIN_GROUP\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x804, METHOD_BUFFERED, FILE_READ_DATA) //Join a multicast group, IPC_GROUP_NAME_MAX byte group name in
+#define IOCTL_LEAVE_GROUP\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x805, METHOD_BUFFERED, FILE_READ_DATA) //Leave a multicast group, IPC_GROUP_NAME_MAX byte group name in
+#define IOCTL_SET_QUEUE_LIMIT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x806, METHOD_BUFFERED, FILE_READ_DATA) //Limit the caller's incoming queue, IPC_QUEUE_LIMIT in
+#define IOCTL_SET_OVERFLOW\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x807, METHOD_BUFFERED, FILE_WRITE_DATA) //Overflow policy of the caller's packets, IPC_OVERFLOW in
+#define IOCTL_QUERY_CREDITS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x808, METHOD_BUFFERED, FILE_WRITE_DATA) //Credits of a destination, DWORD32 PID in, IPC_CREDITS out
+#define IOCTL_SET_LANE_WEIGHTS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x809, METHOD_BUFFERED, FILE_READ_DATA) //Read order of the caller's incoming lanes, IPC_LANE_WEIGHTS in
+#define IOCTL_REGISTER_ENDPOINT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80A, METHOD_BUFFERED, FILE_READ_DATA) //Name the caller's port, IPC_ENDPOINT_NAME_MAX byte name in, DWORD32 endpoint handle out
+#define IOCTL_RESOLVE_ENDPOINT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80B, METHOD_BUFFERED, FILE_WRITE_DATA) //Endpoint handle of a name, IPC_ENDPOINT_NAME_MAX byte name in, DWORD32 endpoint handle out
+#define IOCTL_CALL\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80C, METHOD_BUFFERED, FILE_READ_DATA|FILE_WRITE_DATA) //Request/response call, request IPC Packet in, reply IPC Packet (or IPC_CALL_OVERFLOW) out
+#define IOCTL_REPLY\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80D, METHOD_BUFFERED, FILE_WRITE_DATA) //Reply to a call, IPC Packet with the request's uiCallId in
+#define IOCTL_COLLECT_REPLY\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80E, METHOD_BUFFERED, FILE_READ_DATA) //Reply of a call which did not fit, UINT32 call ID in, reply IPC Packet out
+#define IOCTL_QUERY_STATS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80F, METHOD_BUFFERED, FILE_READ_DATA) //Runtime statistics, IPC_STATS with as many IPC_PORT_STATS as fit out
+#define IOCTL_SET_TRACE\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x810, METHOD_BUFFERED, FILE_WRITE_DATA) //Per stage timestamps of the packets read by the caller, UINT32 1 on, 0 off in
+#define IOCTL_QUERY_TRACE\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x811, METHOD_BUFFERED, FILE_READ_DATA) //Latency histograms, DWORD32 PID (0 for the caller) in, IPC_TRACE_STATS out
+
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)	//Not used by the routing core, so not in IPCShim_v2.h
+
+//Structure definitions
+
+struct _IPC_BROKER_SESSION;
+
+//The IPC_BROKER_CHANNEL structure is one channel of a client, its request and response rings and the
+//thread serving them. The channel is the broker's IRP: it holds the request being served in its own
+//System buffer, copied out of the shared ring before it is looked at, and may be parked on its port
+//or wait for a reply until the request completes
+
+typedef struct _IPC_BROKER_CHANNEL
+{
+	LIST_ENTRY list_entry;				//Links the channel into its session's channel list
+	LIST_ENTRY Park_Entry;				//Links the channel into the parked readers of its port while its read is parked
+	struct _IPC_BROKER_SESSION* pSession;	//Session the channel belongs to
+	UINT32 uiChannel;					//Channel ID chosen by the client
+	IPC_RING Request;					//Request ring, created by the broker
+	IPC_RING Response;					//Response ring, created by the client
+	UINT32 dwOp;						//IPC_BROKER_OP of the request being served
+	UINT32 dwIoControlCode;				//Its IOCTL code
+	UINT32 uiSeq;						//Its sequence number
+	size_t cbIn;						//Bytes of input in the System buffer
+	size_t cbOut;						//Size of the client's output buffer
+	PCHAR pSystemBuffer;				//Buffer of MAX(cbIn, cbOut) bytes the request is served from, like Buffered IO
+	size_t cbSystemBuffer;				//Allocated size of pSystemBuffer
+	volatile LONG bPending;				//Set while a request is parked or waits for its reply, cleared when its response is written
+	struct _IPC_BROKER_CALL* volatile pPendingCall;	//Call waiting for its reply, claimed by whoever completes it
+	pthread_t Thread;					//Thread serving the channel
+}IPC_BROKER_CHANNEL, *PIPC_BROKER_CHANNEL;
+
+//The IPC_BROKER_SESSION structure is what a device handle is to the driver: the File object of a client
+//session and its port. It is freed with its last channel
+
+typedef struct _IPC_BROKER_SESSION
+{
+	LIST_ENTRY list_entry;				//Links the session into g_IPCBrokerSessions
+	UINT32 dwClientPid;					//PID of the client
+	UINT32 uiSession;					//Session ID chosen by the client
+	FILE_OBJECT FileObj;				//File object the port hangs off
+	PIPC_PORT pPort;					//Port of the session
+	LIST_ENTRY Channel_List;			//Channels of the session, protected by g_IPCBrokerLock
+	LONG nChannels;						//Entries of Channel_List, protected by g_IPCBrokerLock
+	BOOLEAN bCleanedUp;					//Set once the port has been removed, protected by g_IPCBrokerLock
+}IPC_BROKER_SESSION, *PIPC_BROKER_SESSION;
+
+//The IPC_BROKER_READERS structure is the reader state kept after every port (ReaderOps.cbReaderContext).
+//Channels whose read finds the Incoming queue empty are parked on Channel_List. The Read notification
+//event lives here too so it is freed with the port rather than the session.
+//Lock order is the Incoming queue lock, then Channel_List_Lock
+
+typedef struct _IPC_BROKER_READERS
+{
+	LIST_ENTRY Channel_List;			//Parked channels, oldest first
+	KSPIN_LOCK Channel_List_Lock;		//Lock protecting Channel_List
+	KEVENT Kevent;						//Read notification event of the port, waited on by IPC_BROKER_OP_WAIT
+}IPC_BROKER_READERS, *PIPC_BROKER_READERS;
+
+//The IPC_BROKER_CALL structure is the state of an IOCTL_CALL, the counterpart of IPC_DRV_CALL. It is freed
+//when the registry, the channel and the dispatch routine have all dropped their reference
+
+typedef struct _IPC_BROKER_CALL
+{
+	IPC_CALL Call;						//Registration with the routing core
+	PIPC_BROKER_CHANNEL pChannel;		//Channel waiting for the reply
+	PIPC_PORT pPort;					//Referenced port of the caller
+	volatile LONG lRefCount;			//References on the call state
+}IPC_BROKER_CALL, *PIPC_BROKER_CALL;
+
+//IOCTL_CALL completes with STATUS_BUFFER_OVERFLOW and this structure when the reply does not fit the
+//output buffer, as in the driver
+
+typedef struct _IPC_CALL_OVERFLOW
+{
+	UINT32 cbReply;						//Size of the reply IPC Packet
+	UINT32 uiCallId;					//Call ID to pass to IOCTL_COLLECT_REPLY
+}IPC_CALL_OVERFLOW, *PIPC_CALL_OVERFLOW;
+
+PIPC_PORT_TABLE g_IPCPortTable;			//Port table of every client session, hashed by translated PID
+IPC_ROUTER g_IPCRouter;					//Routing threads written packets are queued to
+IPC_RING g_IPCBrokerAccept;				//Accept ring clients open channels through
+pthread_mutex_t g_IPCBrokerLock;		//Lock protecting the session list and every session's channel list
+LIST_ENTRY g_IPCBrokerSessions;			//Client sessions (IPC_BROKER_SESSION)
+volatile LONG g_nIPCBrokerChannels;		//Channel threads running
+volatile sig_atomic_t g_bIPCBrokerStop;	//Set by SIGINT or SIGTERM
+
+//Function Prototypes
+
+//Opens a channel for an IPC_BROKER_CONNECT and starts its thread, creating the session on its first channel
+NTSTATUS IPCBrokerConnect(const IPC_BROKER_CONNECT* pConnect);
+
+//Thread serving the requests of one channel
+void* IPCBrokerChannelMain(void* pContext);
+
+//Called for the first channel of a session, creates its port
+NTSTATUS IPCBrokerCreate(PIPC_BROKER_SESSION pSession);
+
+//Called for IPC_BROKER_OP_CLEANUP or when the client is gone, completes the parked requests of the session
+VOID IPCBrokerCleanup(PIPC_BROKER_SESSION pSession);
+
+//Called when a channel closes, the last one frees the session and drops its port
+VOID IPCBrokerClose(PIPC_BROKER_CHANNEL pChannel);
+
+//Called when a IOCTL request is received
+NTSTATUS IPCBrokerDevIOCTL(PIPC_BROKER_CHANNEL pChannel);
+
+//Called when a Write request is received
+NTSTATUS IPCBrokerWrite(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_SEND_BATCH, routes every packet of the batch and returns their status
+NTSTATUS IPCBrokerSendBatch(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_SEND_MULTICAST, delivers one packet to a PID list, a group or every port
+NTSTATUS IPCBrokerSendMulticast(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_JOIN_GROUP and IOCTL_LEAVE_GROUP
+NTSTATUS IPCBrokerGroup(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_REGISTER_ENDPOINT and IOCTL_RESOLVE_ENDPOINT
+NTSTATUS IPCBrokerEndpoint(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_CALL and IOCTL_COLLECT_REPLY, routes a request and completes when its reply arrives
+NTSTATUS IPCBrokerCall(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_REPLY, hands the reply straight to the waiting channel
+NTSTATUS IPCBrokerReply(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_QUERY_STATS, returns the counters of the port table and of every port
+NTSTATUS IPCBrokerQueryStats(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_SET_TRACE and IOCTL_QUERY_TRACE
+NTSTATUS IPCBrokerTrace(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_SET_QUEUE_LIMIT, IOCTL_SET_OVERFLOW, IOCTL_QUERY_CREDITS and IOCTL_SET_LANE_WEIGHTS
+NTSTATUS IPCBrokerFlowControl(PIPC_BROKER_CHANNEL pChannel);
+
+//Called when a Read request is received
+NTSTATUS IPCBrokerRead(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IOCTL_RECV_BATCH, returns as many queued packets as fit in the output buffer
+NTSTATUS IPCBrokerRecvBatch(PIPC_BROKER_CHANNEL pChannel);
+
+//Completes a batch receive parked on an empty port with a batch of one packet, FALSE if its buffer is too small
+BOOLEAN IPCBrokerCompleteRecvBatch(PIPC_PORT_TABLE pTable, PIPC_BROKER_CHANNEL pChannel, PIPC_PACKET pIPC_Pkt);
+
+//Called for IPC_BROKER_OP_WAIT, completes once a packet is queued to the port
+NTSTATUS IPCBrokerWait(PIPC_BROKER_CHANNEL pChannel);
+
+//Called for IPC_BROKER_OP_CANCEL, completes the channel's parked read or waiting call with STATUS_CANCELLED
+VOID IPCBrokerCancel(PIPC_BROKER_CHANNEL pChannel, UINT32 uiSeq);
+
+//Writes the response of the channel's request with cbData bytes of pData, which error statuses do not return
+NTSTATUS IPCBrokerComplete(PIPC_BROKER_CHANNEL pChannel, NTSTATUS ntStatus, const VOID* pData, size_t cbData);
+
+//Writes the response of the channel's request whose cbReturned bytes of data were already filled into pRecord
+NTSTATUS IPCBrokerCommitResponse(PIPC_BROKER_CHANNEL pChannel, PIPC_RING_RECORD pRecord, NTSTATUS ntStatus, size_t cbReturned);
+
+//Completes a Read whose buffer is too small with the size of the packet
+NTSTATUS IPCBrokerCompleteTooSmall(PIPC_BROKER_CHANNEL pChannel, size_t uiPacketLength);
+
+//Completes a call whose buffer is too small with the IPC_CALL_OVERFLOW of its kept reply
+NTSTATUS IPCBrokerCompleteReplyTooSmall(PIPC_BROKER_CHANNEL pChannel, PIPC_CALL pCall);
+
+//Completes a call claimed from its channel by a cancel, a cleanup or a failed route
+VOID IPCBrokerFinishCall(PIPC_BROKER_CALL pBrokerCall, NTSTATUS ntStatus);
+
+//Drops a reference on a call state
+VOID IPCBrokerReleaseCall(PIPC_BROKER_CALL pBrokerCall);
+
+//Routing core reader hooks, park, take and complete the reads of channels
+IPC_PARK_READER IPCBrokerParkRead;
+IPC_TAKE_READER IPCBrokerTakeRead;
+IPC_COMPLETE_READER IPCBrokerCompleteRead;
+
+//Routing core call hook, completes an IOCTL_CALL with its reply
+IPC_COMPLETE_CALL IPCBrokerCompleteCall;
+
+//Translate PIDs and endpoint handles between the client's view and the routing core's (see IPC_BROKER_ENDPOINT_TAG).
+//A client PID p is port p << 2 to the routing core, so it never has the endpoint bit set, 0 stays 0
+HANDLE IPCBrokerPidToCore(ULONG_PTR dwPid);
+DWORD32 IPCBrokerPidFromCore(HANDLE dwPid);
+
+//Translate the PID of a wire packet received from a client (its destination), and of one copied out to a client (its source)
+VOID IPCBrokerPacketToCore(PIPC_WIRE_HEADER pWire);
+VOID IPCBrokerPacketFromCore(PIPC_WIRE_HEADER pWire);
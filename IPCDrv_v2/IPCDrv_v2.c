@@ -62,6 +62,7 @@ NTSTATUS DriverEntry(IN OUT PDRIVER_OBJECT pDriverObject,
 	//Initialize the entry points in the driver object 
 
 	pDriverObject->MajorFunction[IRP_MJ_CREATE] = IPCDrvCreate;
+	pDriverObject->MajorFunction[IRP_MJ_CLEANUP] = IPCDrvCleanup;
 	pDriverObject->MajorFunction[IRP_MJ_CLOSE] = IPCDrvClose;
 	pDriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = IPCDrvDevIOCTL;
 	pDriverObject->MajorFunction[IRP_MJ_WRITE] = IPCDrvWrite;
@@ -93,40 +94,64 @@ NTSTATUS DriverEntry(IN OUT PDRIVER_OBJECT pDriverObject,
 		return ntStatus;
 	}
 
-	//Allocate and Initialize the global IPC_Port queue ListHead and the global IPC_Port queue Spinlock
+	//Allocate and Initialize the global IPC_Port table
 
-	if (!g_IPCPort_Queue)
+	if (!g_IPCPortTable)
 	{
 		//allocate a buffer in NonPagedPool with tag 
 
-		g_IPCPort_Queue = ExAllocatePoolWithTag(NonPagedPool, sizeof(LIST_ENTRY), (LONG)'1CPI');
-		if (!g_IPCPort_Queue)
+		g_IPCPortTable = ExAllocatePoolWithTag(NonPagedPool, sizeof(IPC_PORT_TABLE), IPC_POOL_TAG);
+		if (!g_IPCPortTable)
 		{
-			DbgPrint("Failed to allocate NonPaged pool for global IPC Port queue\n");
+			DbgPrint("Failed to allocate NonPaged pool for global IPC Port table\n");
 			ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+			IoDeleteSymbolicLink(&usDosDeviceName);
+			IoDeleteDevice(pDeviceObject);
 			return ntStatus;
 		}
 
-		//initialize list head
+		//initialize hash buckets, their Spin Locks and the packet pool
 
-		InitializeListHead(g_IPCPort_Queue);
-	}
-
-	if (!g_IPCPort_Queue_SpinLock)
-	{
-		//allocate a buffer in NonPagedPool with tag
-
-		g_IPCPort_Queue_SpinLock = ExAllocatePoolWithTag(NonPagedPool, sizeof(KSPIN_LOCK), (LONG)'1CPI');
-		if (!g_IPCPort_Queue_SpinLock)
+		ntStatus = IPCPortTableInit(g_IPCPortTable);
+		if (!NT_SUCCESS(ntStatus))
 		{
-			DbgPrint("Failed to allocate Nonpaged pool for global IPC Port queue Spinlock \n");
-			ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+			DbgPrint("Failed to create the IPC Packet pool\n");
+			ExFreePoolWithTag(g_IPCPortTable, IPC_POOL_TAG);
+			g_IPCPortTable = NULL;
+			IoDeleteSymbolicLink(&usDosDeviceName);
+			IoDeleteDevice(pDeviceObject);
 			return ntStatus;
 		}
 
-		//initialize Spin Lock
+		//Read IRPs finding the Incoming queue empty are parked on their port and completed by the routing core
+
+		g_IPCPortTable->ReaderOps.pfnParkReader = IPCDrvParkRead;
+		g_IPCPortTable->ReaderOps.pfnTakeReader = IPCDrvTakeRead;
+		g_IPCPortTable->ReaderOps.pfnCompleteReader = IPCDrvCompleteRead;
+		g_IPCPortTable->ReaderOps.cbReaderContext = sizeof(IPC_PENDING_READS);
+
+		//Replies are copied by the routing core straight into the IOCTL_CALL IRP waiting for them
+
+		g_IPCPortTable->pfnCompleteCall = IPCDrvCompleteCall;
 
-		KeInitializeSpinLock(g_IPCPort_Queue_SpinLock);
+		//Ports start with the queue limit of the service key, a process may change its own
+
+		g_IPCPortTable->DefaultLimit.nMaxPkts = IPCDrvQueryParameter(pRegistryPath, IPC_QUEUE_LIMIT_PKTS_VALUE);
+		g_IPCPortTable->DefaultLimit.cbMaxBytes = IPCDrvQueryParameter(pRegistryPath, IPC_QUEUE_LIMIT_BYTES_VALUE);
+
+		//Start the routing threads written packets are handed to
+
+		ntStatus = IPCRouterStart(&g_IPCRouter, g_IPCPortTable, IPCDrvQueryParameter(pRegistryPath, IPC_ROUTING_THREADS_VALUE));
+		if (!NT_SUCCESS(ntStatus))
+		{
+			DbgPrint("Failed to start the routing threads\n");
+			IPCPortTableDelete(g_IPCPortTable);
+			ExFreePoolWithTag(g_IPCPortTable, IPC_POOL_TAG);
+			g_IPCPortTable = NULL;
+			IoDeleteSymbolicLink(&usDosDeviceName);
+			IoDeleteDevice(pDeviceObject);
+			return ntStatus;
+		}
 	}
 
 	DbgPrint("DriverEntry Succeeded\r\n");
@@ -135,6 +160,46 @@ NTSTATUS DriverEntry(IN OUT PDRIVER_OBJECT pDriverObject,
 
 
 
+//=====================================================================
+// IPCDrvQueryParameter
+//
+// Reads an optional REG_DWORD value from the service key. Returns 0,
+// meaning the default, if it is absent.
+//=====================================================================
+
+ULONG IPCDrvQueryParameter(IN PUNICODE_STRING pRegistryPath, IN PCWSTR pszValueName)
+{
+	RTL_QUERY_REGISTRY_TABLE QueryTable[2];
+	ULONG uiValue = 0;
+	PWCHAR pszRegistryPath;
+
+	//The registry path is not guaranteed to be null terminated, RtlQueryRegistryValues needs it to be
+
+	pszRegistryPath = ExAllocatePoolWithTag(PagedPool, pRegistryPath->Length + sizeof(WCHAR), IPC_POOL_TAG);
+	if (!pszRegistryPath)
+	{
+		return 0;
+	}
+	RtlCopyMemory(pszRegistryPath, pRegistryPath->Buffer, pRegistryPath->Length);
+	pszRegistryPath[pRegistryPath->Length / sizeof(WCHAR)] = L'\0';
+
+	RtlZeroMemory(QueryTable, sizeof(QueryTable));
+	QueryTable[0].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+	QueryTable[0].Name = (PWSTR)pszValueName;
+	QueryTable[0].EntryContext = &uiValue;
+	QueryTable[0].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+
+	if (!NT_SUCCESS(RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, pszRegistryPath, QueryTable, NULL, NULL)))
+	{
+		uiValue = 0;
+	}
+
+	ExFreePoolWithTag(pszRegistryPath, IPC_POOL_TAG);
+	return uiValue;
+}
+
+
+
 //=====================================================================
 // IPCDrvCreate
 //
@@ -152,46 +217,42 @@ NTSTATUS IPCDrvCreate(IN PDEVICE_OBJECT pDeviceObject,
 	NTSTATUS ntStatus;
 	PIO_STACK_LOCATION pIoStackIrp = NULL;  //pointer to IO Stack Location
 	PIPC_PORT pIPCPort;						//IPC Port structure for the user process
-	PIPC_PACKET_QUEUE pIPC_Pkt_Queue;		//Structure for incoming and outgoing queue of packets
 
-	//Allocate NPP for the user process IPC PORT Structure
-
-	pIPCPort = (PIPC_PORT)ExAllocatePoolWithTag(NonPagedPool, sizeof(IPC_PORT), (LONG)'1CPI');
-	if (!pIPCPort)
-	{
-		DbgPrint("Failed to allocate Nonpaged pool for global IPC Port queue Spinlock \n");
-		ntStatus = STATUS_INSUFFICIENT_RESOURCES;
-		return ntStatus;
-	}
+	pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp); //Get Current IRP Stack Location
 
-	//Allocate NPP for the IPC_PACKET_QUEUE structure
+	//Allocate NPP for the user process IPC PORT Structure and its packet queues.
+	//The PID of the user process which called CreateFile is the port address and the
+	//FileObject acts as the unique port identifier for each process
 
-	pIPC_Pkt_Queue = (PIPC_PACKET_QUEUE)ExAllocatePoolWithTag(NonPagedPool, sizeof(IPC_PACKET_QUEUE), (LONG)'1CPI');
-	if (!pIPC_Pkt_Queue)
+	pIPCPort = IPCPortCreate(g_IPCPortTable, PsGetCurrentProcessId(), pIoStackIrp->FileObject);
+	if (!pIPCPort)
 	{
-		DbgPrint("Failed to allocate Nonpaged pool for global IPC Port queue Spinlock \n");
+		DbgPrint("Failed to allocate Nonpaged pool for IPC Port\n");
 		ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
 		return ntStatus;
 	}
 
-	pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp); //Get Current IRP Stack Location
-
-	pIPCPort->dwPID = PsGetCurrentProcessId();  //The PID of the user process which called CreateFile
+	//Initialize the cancel safe queue for Read IRPs parked on the port
 
-	pIPCPort->pFileObj = pIoStackIrp->FileObject;  //FileObject acts as the unique port identifier for each process
+	PIPC_PENDING_READS pPendingReads = (PIPC_PENDING_READS)pIPCPort->pReaderContext;
+	InitializeListHead(&(pPendingReads->Irp_List));
+	KeInitializeSpinLock(&(pPendingReads->Irp_List_SpinLock));
+	IoCsqInitialize(&(pPendingReads->Csq), IPCCsqInsertIrp, IPCCsqRemoveIrp, IPCCsqPeekNextIrp,
+		IPCCsqAcquireLock, IPCCsqReleaseLock, IPCCsqCompleteCanceledIrp);
 
-	pIPCPort->pFileObj->FsContext2 = pIPC_Pkt_Queue; //We use the FsContext2 member of the FileObject for our IPC Packet queues
+	//and the one of IOCTL_CALL IRPs waiting for their reply
 
-	//Initialize the List Heads and Spin Locks 
+	InitializeListHead(&(pPendingReads->Call_Irp_List));
+	KeInitializeSpinLock(&(pPendingReads->Call_Irp_List_SpinLock));
+	IoCsqInitialize(&(pPendingReads->Call_Csq), IPCCallCsqInsertIrp, IPCCsqRemoveIrp, IPCCallCsqPeekNextIrp,
+		IPCCallCsqAcquireLock, IPCCallCsqReleaseLock, IPCCallCsqCompleteCanceledIrp);
 
-	InitializeListHead(&(pIPC_Pkt_Queue->Ipc_Pkt_In_Queue));
-	InitializeListHead(&(pIPC_Pkt_Queue->Ipc_Pkt_Out_Queue));
-	KeInitializeSpinLock(&(pIPC_Pkt_Queue->Ipc_Pkt_In_Queue_SpinLock));
-	KeInitializeSpinLock(&(pIPC_Pkt_Queue->Ipc_Pkt_Out_Queue_SpinLock));
+	//Add the user process IPCPort structure to our global table of IPC Ports
 
-	//Queue the user process IPCPort structure to our global list of IPC Ports
-
-	ExInterlockedInsertTailList(g_IPCPort_Queue, &(pIPCPort->list_entry), g_IPCPort_Queue_SpinLock);
+	IPCPortTableInsert(g_IPCPortTable, pIPCPort);
 
 	//Complete the IRP
 
@@ -264,29 +325,67 @@ NTSTATUS IPCDrvDevIOCTL(IN PDEVICE_OBJECT pDeviceObject,
 		}
 		break;
 
+	case IOCTL_SEND_BATCH:    //Batch of IPC Packets sent from user mode
+
+		return IPCDrvSendBatch(pDeviceObject, pIrp);
+
+	case IOCTL_RECV_BATCH:    //Batch read of the queued IPC Packets
+
+		return IPCDrvRecvBatch(pDeviceObject, pIrp);
+
+	case IOCTL_SEND_GATHER:    //IPC Packet gathered from the caller's buffers
+
+		return IPCDrvSendGather(pDeviceObject, pIrp);
+
+	case IOCTL_SEND_MULTICAST:    //IPC Packet sent to several processes
+
+		return IPCDrvSendMulticast(pDeviceObject, pIrp);
+
+	case IOCTL_JOIN_GROUP:    //Multicast group membership
+	case IOCTL_LEAVE_GROUP:
+
+		return IPCDrvGroup(pDeviceObject, pIrp);
+
+	case IOCTL_REGISTER_ENDPOINT:    //Named endpoints
+	case IOCTL_RESOLVE_ENDPOINT:
+
+		return IPCDrvEndpoint(pDeviceObject, pIrp);
+
+	case IOCTL_CALL:    //Request/response calls
+	case IOCTL_COLLECT_REPLY:
+
+		return IPCDrvCall(pDeviceObject, pIrp);
+
+	case IOCTL_REPLY:
+
+		return IPCDrvReply(pDeviceObject, pIrp);
+
+	case IOCTL_QUERY_STATS:    //Runtime statistics
+
+		return IPCDrvQueryStats(pDeviceObject, pIrp);
+
+	case IOCTL_SET_TRACE:    //Latency tracing
+	case IOCTL_QUERY_TRACE:
+
+		return IPCDrvTrace(pDeviceObject, pIrp);
+
+	case IOCTL_SET_QUEUE_LIMIT:    //Flow control of the caller's port
+	case IOCTL_SET_OVERFLOW:
+	case IOCTL_QUERY_CREDITS:
+	case IOCTL_SET_LANE_WEIGHTS:
+
+		return IPCDrvFlowControl(pDeviceObject, pIrp);
+
 	default:
 		DbgPrint("Invalid IOCTL code\n");
 		NtStatus = STATUS_INVALID_PARAMETER;
 		return NtStatus;
 	}
 
-	//Now get the User process port and update the Kevent info
-
-	PLIST_ENTRY pTemp_IPCPort_Queue = g_IPCPort_Queue->Flink;
-	PIPC_PORT pTemp_IPCPort;
-
-	while (pTemp_IPCPort_Queue != g_IPCPort_Queue)
-	{
-		pTemp_IPCPort = CONTAINING_RECORD(pTemp_IPCPort_Queue, IPC_PORT, list_entry);
-		if (pTemp_IPCPort->pFileObj == pIoStackIrp->FileObject)   //This is our user process port
-		{
-			pTemp_IPCPort->pKevent = pKevent;  //Save the kevent
-			break;
-		}
-		pTemp_IPCPort_Queue = pTemp_IPCPort_Queue->Flink;
-	}
+	//Now get the User process port through the FileObject and update the Kevent info.
+	//The port keeps the reference on the Kevent until it is replaced or the port is freed
 
-	ObDereferenceObject(pKevent);  //derefernce the object
+	IPCPortSetEvent(IPCPortFromFileObject(pIoStackIrp->FileObject), pKevent);
 
 	pIrp->IoStatus.Status = STATUS_SUCCESS;
 	pIrp->IoStatus.Information = 0;
@@ -314,8 +413,8 @@ NTSTATUS IPCDrvWrite(IN PDEVICE_OBJECT pDeviceObject,
 	size_t uiLength;                           //size of input buffer
 	PIO_STACK_LOCATION pIoStackIrp = NULL;	   //IO Stack location
 	PIPC_PACKET pTemp_Out_IPCPkt;			   //Send IPC Packet
-	PIPC_PKTCPY_WKITEM pIPC_PktCpy_WkItem;     //Work Item context
-	KIRQL Irql;								   //Irql (for use with spinlock calls) 
+	size_t uiPacketLength;					   //size of the IPC Packet described by the header
+	NTSTATUS ntStatus;
 
 	DbgPrint("IPCDrvWrite Called\r\n");
 
@@ -329,31 +428,39 @@ NTSTATUS IPCDrvWrite(IN PDEVICE_OBJECT pDeviceObject,
 
 	//Check to make sure that the input buffer size is correct
 
-	if (uiLength >= (sizeof(IPC_PACKET) + ((PIPC_PACKET)pIrp->AssociatedIrp.SystemBuffer)->header.sizeofpayload))
+	if (NT_SUCCESS(IPCPacketCheckWire(pIrp->AssociatedIrp.SystemBuffer, uiLength, FALSE, &uiPacketLength)))
 	{
-		//Allocate NPP for the IPC Packet
-
-		pTemp_Out_IPCPkt = ExAllocatePoolWithTag(NonPagedPool, uiLength, (LONG)'1CPI');
-		RtlZeroMemory(pTemp_Out_IPCPkt, uiLength);
+		//Allocate NPP for the IPC Packet and copy the payload into it. This is the only copy
+		//on the way in, the routing core hands this same packet to the destination incoming queue
 
-		//Copy the user buffer into the device/driver buffer
+		pTemp_Out_IPCPkt = IPCPacketCreate(g_IPCPortTable, (PIPC_WIRE_HEADER)pIrp->AssociatedIrp.SystemBuffer,
+			IPCPortFromFileObject(pIoStackIrp->FileObject)->dwPID);
+		if (!pTemp_Out_IPCPkt)
+		{
+			IPCPortCountStat(g_IPCPortTable, IPCPortFromFileObject(pIoStackIrp->FileObject), IPC_STAT_ALLOC_FAILURES, 1);
+			pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			pIrp->IoStatus.Information = 0;
+			IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
 
-		RtlCopyMemory(pTemp_Out_IPCPkt, pIrp->AssociatedIrp.SystemBuffer, uiLength);
-			
-		//Queue the IPC Packet to the Outgoing queue of the IPC Packet queue(Fscontext2)
+		//Charge the packet to the destination's credits here, where the sender's overflow policy may
+		//block, so the routing thread never waits on a slow receiver
 
-		KeAcquireSpinLock(&(((PIPC_PACKET_QUEUE)(pIoStackIrp->FileObject->FsContext2))->Ipc_Pkt_Out_Queue_SpinLock), &Irql);
-		InsertTailList(&(((PIPC_PACKET_QUEUE)(pIoStackIrp->FileObject->FsContext2))->Ipc_Pkt_Out_Queue), &(pTemp_Out_IPCPkt->list_entry));
-		KeReleaseSpinLock(&(((PIPC_PACKET_QUEUE)(pIoStackIrp->FileObject->FsContext2))->Ipc_Pkt_Out_Queue_SpinLock), Irql);
-		//we can also do ExInterlockedInsertTailList(&(((PIPC_PACKET_QUEUE)(pIoStackIrp->FileObject->FsContext2))->Ipc_Pkt_Out_Queue), &(pTemp_Out_IPCPkt->list_entry), &(((PIPC_PACKET_QUEUE)(pIoStackIrp->FileObject->FsContext2))->Ipc_Pkt_Out_Queue_SpinLock));
+		ntStatus = IPCRouteAdmit(g_IPCPortTable, pTemp_Out_IPCPkt, &(IPCPortFromFileObject(pIoStackIrp->FileObject)->Overflow));
+		if (!NT_SUCCESS(ntStatus))
+		{
+			IPCPacketFree(g_IPCPortTable, pTemp_Out_IPCPkt);
+			pIrp->IoStatus.Status = ntStatus;
+			pIrp->IoStatus.Information = 0;
+			IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+			return ntStatus;
+		}
 
-		//Allocate NPP for work item context and queue it. Work item will copy the IPC packet
-		//from current process ports outgoing queue to destination process port's incoming queue
+		//Queue the packet to the routing thread of the sending process. The thread moves it to
+		//the destination process port's incoming queue, packets of one sender stay in order
 
-		pIPC_PktCpy_WkItem = ExAllocatePoolWithTag(NonPagedPool, sizeof(IPC_PKTCPY_WKITEM), (LONG)'1CPI');
-		pIPC_PktCpy_WkItem->pIPC_Pkt = pTemp_Out_IPCPkt;
-		pIPC_PktCpy_WkItem->pWorkItem = IoAllocateWorkItem(pDeviceObject);
-		IoQueueWorkItem(pIPC_PktCpy_WkItem->pWorkItem, (PIO_WORKITEM_ROUTINE)WorkItemCallback, DelayedWorkQueue, pIPC_PktCpy_WkItem);
+		IPCRouterQueuePacket(&g_IPCRouter, (ULONG_PTR)PsGetCurrentProcessId(), pTemp_Out_IPCPkt);
 
 		pIrp->IoStatus.Status = STATUS_SUCCESS;
 		pIrp->IoStatus.Information = 0;
@@ -367,6 +474,9 @@ NTSTATUS IPCDrvWrite(IN PDEVICE_OBJECT pDeviceObject,
 
 	{
 		DbgPrint("Incorrect input buffer size\n");
+		pIrp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
 		return STATUS_INVALID_PARAMETER;	
 	}
 	
@@ -374,216 +484,1528 @@ NTSTATUS IPCDrvWrite(IN PDEVICE_OBJECT pDeviceObject,
 
 
 //=====================================================================
-// WorkItemCallback
+// IPCDrvSendGather
 //
-// This is the Work Item Callback function queued by (WriteFile) 
-// Worker thread copies the IPC packet from the source process Outgoing queue to
-// the destination process incoming queue and sets the read notification event
+// This routine handles IOCTL_SEND_GATHER. Only the IPC_GATHER_HEADER and
+// the segment list are buffered, the payload is copied by the routing
+// core straight from the caller's buffers into the packet, so a message
+// made of several pieces reaches the driver with a single copy. The
+// packet is then admitted and queued to the sender's routing thread like
+// a write, and stays in order with the sender's writes.
 //=====================================================================
 
-void WorkItemCallback(PDEVICE_OBJECT DeviceObject, PIPC_PKTCPY_WKITEM pIPC_PktCpy_WI)
+NTSTATUS IPCDrvSendGather(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
 {
-	DbgPrint("Worker Thread Routine Start\n");
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiInLength = pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength;
+	PIPC_PORT pPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	PIPC_PACKET pTemp_Out_IPCPkt;
+	NTSTATUS ntStatus;
 
-	//Locals 
+	DbgPrint("IPCDrvSendGather Called\r\n");
 
-	PLIST_ENTRY pTemp_IPCPort_Queue = g_IPCPort_Queue->Flink;
-	PIPC_PORT pTemp_IPCPort = NULL;
-	size_t uiLength;
-	KIRQL Irql;
+	//The segments are addresses in the caller's process, only a user mode caller can send them.
+	//This is a top level driver, so the IOCTL runs in the caller's context
 
-	//Search the Global IPC Port queue for the destination process port
-	while (pTemp_IPCPort_Queue != g_IPCPort_Queue)
+	if (pIrp->RequestorMode != UserMode ||
+		!NT_SUCCESS(IPCPacketCheckGather(pIrp->AssociatedIrp.SystemBuffer, uiInLength)))
+	{
+		DbgPrint("Incorrect gather send\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+	}
+	else
 	{
-		pTemp_IPCPort = CONTAINING_RECORD(pTemp_IPCPort_Queue, IPC_PORT, list_entry);
-		if (pTemp_IPCPort->dwPID == pIPC_PktCpy_WI->pIPC_Pkt->header.dwDestinationPid)
+		ntStatus = IPCPacketCreateGather(g_IPCPortTable, (PIPC_GATHER_HEADER)pIrp->AssociatedIrp.SystemBuffer, pPort->dwPID,
+			IPCDrvCopySegment, &pTemp_Out_IPCPkt);
+		if (ntStatus == STATUS_INSUFFICIENT_RESOURCES)
 		{
-			//We have our destination port now
-			//Create a new In IPC Packet and copy the existing IPC Packet
-			uiLength = sizeof(IPC_PACKET) + pIPC_PktCpy_WI->pIPC_Pkt->header.sizeofpayload;
-			PIPC_PACKET pIPC_In_Pkt = ExAllocatePoolWithTag(NonPagedPool, uiLength, (LONG)'1CPI');
-			RtlCopyMemory(pIPC_In_Pkt, pIPC_PktCpy_WI->pIPC_Pkt, uiLength);
+			IPCPortCountStat(g_IPCPortTable, pPort, IPC_STAT_ALLOC_FAILURES, 1);
+		}
+		else if (NT_SUCCESS(ntStatus))
+		{
+			ntStatus = IPCRouteAdmit(g_IPCPortTable, pTemp_Out_IPCPkt, &(pPort->Overflow));
+			if (NT_SUCCESS(ntStatus))
+			{
+				IPCRouterQueuePacket(&g_IPCRouter, (ULONG_PTR)PsGetCurrentProcessId(), pTemp_Out_IPCPkt);
+			}
+			else
+			{
+				IPCPacketFree(g_IPCPortTable, pTemp_Out_IPCPkt);
+			}
+		}
+	}
+
+	pIrp->IoStatus.Status = ntStatus;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return ntStatus;
+}
 
-			//Queue the In IPC packet to the Incoming queue of the destination process
 
-			KeAcquireSpinLock(&(((PIPC_PACKET_QUEUE)(pTemp_IPCPort->pFileObj->FsContext2))->Ipc_Pkt_In_Queue_SpinLock), &Irql);
-			InsertTailList(&(((PIPC_PACKET_QUEUE)(pTemp_IPCPort->pFileObj->FsContext2))->Ipc_Pkt_In_Queue), &(pIPC_In_Pkt->list_entry));
-			KeSetEvent(pTemp_IPCPort->pKevent, 0, FALSE);  //Notify the destination process Read Thread
-			KeReleaseSpinLock(&(((PIPC_PACKET_QUEUE)(pTemp_IPCPort->pFileObj->FsContext2))->Ipc_Pkt_In_Queue_SpinLock), Irql);
-			//We can also do ExInterlockedInsertTailList(&(((PIPC_PACKET_QUEUE)(pTemp_IPCPort->pFileObj->FsContext2))->Ipc_Pkt_In_Queue), &(pIPC_In_Pkt->list_entry), &(((PIPC_PACKET_QUEUE)(pTemp_IPCPort->pFileObj->FsContext2))->Ipc_Pkt_In_Queue_SpinLock)); 
+//=====================================================================
+// IPCDrvCopySegment
+//
+// Routing core gather hook. Probes a segment of the caller's address
+// space and copies it into the packet. A bad address or a page the
+// caller freed meanwhile raises an exception, which fails the send
+// instead of the system.
+//=====================================================================
 
-			break;
-		}
-		pTemp_IPCPort_Queue = pTemp_IPCPort_Queue->Flink;
+NTSTATUS IPCDrvCopySegment(PVOID pDst, const IPC_GATHER_SEGMENT* pSegment)
+{
+	PVOID pSrc = (PVOID)(ULONG_PTR)pSegment->pData;
+
+	__try
+	{
+		ProbeForRead(pSrc, pSegment->cbData, sizeof(UCHAR));
+		RtlCopyMemory(pDst, pSrc, pSegment->cbData);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		return GetExceptionCode();
 	}
-	
-	//Free and Deallocate the Work Item
-	IoFreeWorkItem(pIPC_PktCpy_WI->pWorkItem);
-	ExFreePoolWithTag(pIPC_PktCpy_WI, (LONG)'1CPI');
 
-	DbgPrint("Worker Thread Routine End\n");
+	return STATUS_SUCCESS;
 }
 
 
-
 //=====================================================================
-// IPCDrvRead
+// IPCDrvSendBatch
 //
-// This routine is called when a read (ReadFile/ReadFileEx) is 
-// issued on the device handle. This version uses Buffered I/O.
+// This routine handles IOCTL_SEND_BATCH. The input buffer holds an
+// IPC_BATCH_HEADER followed by the packets, the output buffer receives
+// one NTSTATUS per packet. Every packet is copied into the packet pool
+// and the whole batch is routed here in the caller's context rather than
+// by a routing thread, so the status of each packet is known when the IRP
+// completes. The process' routing thread is flushed first, so the batch
+// is ordered behind its single writes like every other send.
 //=====================================================================
 
-NTSTATUS IPCDrvRead(IN PDEVICE_OBJECT pDeviceObject,
-	IN PIRP pIrp)
+NTSTATUS IPCDrvSendBatch(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
 {
 	//Locals
-	unsigned int uiLength;
-	PIO_STACK_LOCATION pIoStackIrp = NULL;
-	KIRQL Irql;
-
-	DbgPrint("IPCDrvRead Called\r\n");
 
-	//Retrieve Pointer to Current IRP Stack Location
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiInLength = pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength;
+	size_t uiOutLength = pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength;
+	PCHAR pBuffer = (PCHAR)pIrp->AssociatedIrp.SystemBuffer;
+	PIPC_PACKET* ppIPC_Pkts;				//Packets copied out of the batch
+	NTSTATUS* pStatus;						//Status of every packet
+	size_t uiOffset, uiPacketLength;
+	ULONG nPkts, i;
+	NTSTATUS ntStatus = STATUS_SUCCESS;
 
-	pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	DbgPrint("IPCDrvSendBatch Called\r\n");
 
-	//Get Buffer using AssociatedIRP.SystemBuffer Parameter from IRP
+	//Check the batch header and that there is room for one status per packet
 
-	uiLength = pIoStackIrp->Parameters.Read.Length;
+	if (uiInLength < sizeof(IPC_BATCH_HEADER) ||
+		((PIPC_BATCH_HEADER)pBuffer)->nPackets == 0 ||
+		((PIPC_BATCH_HEADER)pBuffer)->nPackets > (uiInLength - sizeof(IPC_BATCH_HEADER)) / sizeof(IPC_WIRE_HEADER))
+	{
+		DbgPrint("Incorrect batch header\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
+	}
 
-	//Dequeue the IPC Packet from the Incoming queue 
-	KeAcquireSpinLock(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock), &Irql);
-	PLIST_ENTRY pTemp_ListEntry = RemoveHeadList(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue));
-	KeReleaseSpinLock(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock), Irql);
-	//PLIST_ENTRY pTemp_ListEntry = ExInterlockedRemoveHeadList(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue), &(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock));
-	PIPC_PACKET pTemp_IPC_In_Pkt = CONTAINING_RECORD(pTemp_ListEntry, IPC_PACKET, list_entry);
+	nPkts = ((PIPC_BATCH_HEADER)pBuffer)->nPackets;
+	if (uiOutLength < nPkts * sizeof(NTSTATUS))
+	{
+		DbgPrint("Batch status buffer too small\n");
+		ntStatus = STATUS_BUFFER_TOO_SMALL;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
+	}
 
-	//Check if the output buffer sent by ReadFile is correct or not
+	//The status array is built aside since the System buffer is shared by input and output
 
-	if (uiLength < (sizeof(IPC_PACKET) + (pTemp_IPC_In_Pkt->header.sizeofpayload)))
+	ppIPC_Pkts = ExAllocatePoolWithTag(NonPagedPool, nPkts * (sizeof(PIPC_PACKET) + sizeof(NTSTATUS)), IPC_POOL_TAG);
+	if (!ppIPC_Pkts)
 	{
-		//Output Buffer is small, in this case we do this
-		//1.Calculate the required buffer size
-		//2.Copy the buffer size to output buffer
-		//3.Return Warning Status - this way IO manager will copy the required size to output buffer and 
-		// user mode can reissue ReadFile with correct buffer size
-
-		pIrp->IoStatus.Status = STATUS_FLT_BUFFER_TOO_SMALL;
-		int iRequiredBufferSize = sizeof(IPC_PACKET) + (pTemp_IPC_In_Pkt->header.sizeofpayload);
-		pIrp->IoStatus.Information = sizeof(int);
-		RtlCopyMemory(pIrp->AssociatedIrp.SystemBuffer, &iRequiredBufferSize, sizeof(int));
-		
-		//Queue the packet back 
-		KeAcquireSpinLock(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock), &Irql);
-		InsertTailList(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue), pTemp_ListEntry);
-		KeReleaseSpinLock(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock), Irql);
-		//ExInterlockedInsertTailList(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue), pTemp_ListEntry, &(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock));
-		
+		ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
 		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
-		return STATUS_FLT_BUFFER_TOO_SMALL;
+		return ntStatus;
 	}
+	pStatus = (NTSTATUS*)(ppIPC_Pkts + nPkts);
+
+	//Validate every packet and copy it into the packet pool
+
+	uiOffset = sizeof(IPC_BATCH_HEADER);
+	for (i = 0; i < nPkts; i++)
+	{
+		uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
 
-	//If output buffer size is correct proceed with copy
+		if (uiOffset > uiInLength ||
+			!NT_SUCCESS(IPCPacketCheckWire(pBuffer + uiOffset, uiInLength - uiOffset, FALSE, &uiPacketLength)))
+		{
+			DbgPrint("Incorrect batch packet\n");
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
 
-	RtlCopyMemory(pIrp->AssociatedIrp.SystemBuffer, pTemp_IPC_In_Pkt, uiLength);
+		ppIPC_Pkts[i] = IPCPacketCreate(g_IPCPortTable, (PIPC_WIRE_HEADER)(pBuffer + uiOffset),
+			IPCPortFromFileObject(pIoStackIrp->FileObject)->dwPID);
+		pStatus[i] = ppIPC_Pkts[i] ? STATUS_PENDING : STATUS_INSUFFICIENT_RESOURCES;
+		if (!ppIPC_Pkts[i])
+		{
+			IPCPortCountStat(g_IPCPortTable, IPCPortFromFileObject(pIoStackIrp->FileObject), IPC_STAT_ALLOC_FAILURES, 1);
+		}
 
-	//If Incoming IPC Packet queue is empty reset the Read Event
+		uiOffset += uiPacketLength;
+	}
 
-	KeAcquireSpinLock(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock), &Irql);
-	if (IsListEmpty(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue)))
+	if (!NT_SUCCESS(ntStatus))
 	{
-		PLIST_ENTRY pTemp_IPCPort_Queue = g_IPCPort_Queue->Flink;
-		PIPC_PORT pTemp_IPCPort = NULL;
+		//Malformed batch, nothing is routed
 
-		while (pTemp_IPCPort_Queue != g_IPCPort_Queue)
+		while (i-- > 0)
 		{
-			pTemp_IPCPort = CONTAINING_RECORD(pTemp_IPCPort_Queue, IPC_PORT, list_entry);
-			if (pTemp_IPCPort->pFileObj == pIoStackIrp->FileObject)
+			if (ppIPC_Pkts[i])
 			{
-				KeClearEvent(pTemp_IPCPort->pKevent);
-				break;
+				IPCPacketFree(g_IPCPortTable, ppIPC_Pkts[i]);
 			}
-			pTemp_IPCPort_Queue = pTemp_IPCPort_Queue->Flink;
 		}
+		ExFreePoolWithTag(ppIPC_Pkts, IPC_POOL_TAG);
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
 	}
-	KeReleaseSpinLock(&(((PIPC_PACKET_QUEUE)pIoStackIrp->FileObject->FsContext2)->Ipc_Pkt_In_Queue_SpinLock), Irql);
-	
+
+	//Route the batch, each destination's incoming queue lock is taken once. The sender's writes
+	//still waiting for its routing thread are routed first, so the batch stays behind them
+
+	IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)PsGetCurrentProcessId());
+	IPCRouteDeliverBatch(g_IPCPortTable, ppIPC_Pkts, nPkts, pStatus, &(IPCPortFromFileObject(pIoStackIrp->FileObject)->Overflow));
+
+	RtlCopyMemory(pBuffer, pStatus, nPkts * sizeof(NTSTATUS));
+	ExFreePoolWithTag(ppIPC_Pkts, IPC_POOL_TAG);
+
 	pIrp->IoStatus.Status = STATUS_SUCCESS;
-	pIrp->IoStatus.Information = sizeof(IPC_PACKET) + (pTemp_IPC_In_Pkt->header.sizeofpayload); //Number of bytes IO manager should copy back to UserBuffer
+	pIrp->IoStatus.Information = nPkts * sizeof(NTSTATUS);  //Number of bytes IO manager should copy back to the status buffer
 	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
 
+	DbgPrint("IPCDrvSendBatch Succeeded\r\n");
 	return STATUS_SUCCESS;
 }
 
 
 
 //=====================================================================
-// IPCDrvClose
+// IPCDrvSendMulticast
 //
-// This routine is called by the IO system when the IPCDrv device is 
-// closed (CloseHandle).
+// This routine handles IOCTL_SEND_MULTICAST. The input buffer holds an
+// IPC_MULTICAST_HEADER, the destination PIDs and the packet. The packet
+// is copied into the packet pool once and every recipient is queued a
+// small descriptor referencing it, so the cost of a large message does
+// not grow with the number of recipients. The number of recipients is
+// returned in the output buffer if there is room for it.
 //=====================================================================
 
-NTSTATUS IPCDrvClose(IN PDEVICE_OBJECT pDeviceObject,
+NTSTATUS IPCDrvSendMulticast(IN PDEVICE_OBJECT pDeviceObject,
 	IN PIRP           pIrp)
 {
-	DbgPrint("IPCDrvClose Called\r\n");
+	//Locals
 
-	PIO_STACK_LOCATION pIoStackIrp;
-	pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
-	
-	pIoStackIrp->FileObject;
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiInLength = pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength;
+	size_t uiOutLength = pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength;
+	PCHAR pBuffer = (PCHAR)pIrp->AssociatedIrp.SystemBuffer;
+	PIPC_MULTICAST_HEADER pHeader = (PIPC_MULTICAST_HEADER)pBuffer;
+	PIPC_PORT pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	HANDLE* pDestPids = NULL;				//Destination PIDs of the list, as HANDLEs
+	PIPC_WIRE_HEADER pTemp_Pkt;
+	PIPC_PACKET pIPC_Pkt;
+	size_t uiOffset, uiPacketLength;
+	ULONG nDelivered = 0;
+	ULONG i;
+	NTSTATUS ntStatus;
 
-	pIrp->IoStatus.Status = STATUS_SUCCESS;
-	pIrp->IoStatus.Information = 0;
+	DbgPrint("IPCDrvSendMulticast Called\r\n");
+
+	//Check the header, the PID list and the packet which follows them
+
+	if (uiInLength < sizeof(IPC_MULTICAST_HEADER) ||
+		pHeader->uiTarget > IPC_MULTICAST_BROADCAST ||
+		(pHeader->uiTarget != IPC_MULTICAST_PIDS && pHeader->nPids != 0) ||
+		pHeader->nPids > (uiInLength - sizeof(IPC_MULTICAST_HEADER)) / sizeof(DWORD32) ||
+		(pHeader->uiTarget == IPC_MULTICAST_GROUP && !IPCNameValid(pHeader->szGroup, IPC_GROUP_NAME_MAX)))
+	{
+		DbgPrint("Incorrect multicast header\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
+	}
+
+	uiOffset = IPC_BATCH_ALIGN_UP(sizeof(IPC_MULTICAST_HEADER) + pHeader->nPids * sizeof(DWORD32));
+	pTemp_Pkt = (PIPC_WIRE_HEADER)(pBuffer + uiOffset);
+
+	if (uiOffset > uiInLength ||
+		!NT_SUCCESS(IPCPacketCheckWire(pTemp_Pkt, uiInLength - uiOffset, FALSE, &uiPacketLength)))
+	{
+		DbgPrint("Incorrect multicast packet\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
+	}
+
+	if (pHeader->nPids)
+	{
+		pDestPids = ExAllocatePoolWithTag(NonPagedPool, pHeader->nPids * sizeof(HANDLE), IPC_POOL_TAG);
+		if (!pDestPids)
+		{
+			ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+			pIrp->IoStatus.Status = ntStatus;
+			pIrp->IoStatus.Information = 0;
+			IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+			return ntStatus;
+		}
+
+		for (i = 0; i < pHeader->nPids; i++)
+		{
+			pDestPids[i] = (HANDLE)(ULONG_PTR)((DWORD32*)(pHeader + 1))[i];
+		}
+	}
+
+	//Copy the packet into the packet pool once, then hand a descriptor of it to every recipient,
+	//behind the sender's writes still waiting for its routing thread
+
+	IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)PsGetCurrentProcessId());
+	pIPC_Pkt = IPCPacketCreate(g_IPCPortTable, pTemp_Pkt, pIPCPort->dwPID);
+	if (!pIPC_Pkt)
+	{
+		IPCPortCountStat(g_IPCPortTable, pIPCPort, IPC_STAT_ALLOC_FAILURES, 1);
+		ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else if (pHeader->uiTarget == IPC_MULTICAST_PIDS)
+	{
+		ntStatus = IPCRouteMulticast(g_IPCPortTable, pIPC_Pkt, pDestPids, pHeader->nPids, &(pIPCPort->Overflow), &nDelivered);
+	}
+	else if (pHeader->uiTarget == IPC_MULTICAST_GROUP)
+	{
+		ntStatus = IPCRouteMulticastGroup(g_IPCPortTable, pIPC_Pkt, pHeader->szGroup, pIPCPort, &(pIPCPort->Overflow), &nDelivered);
+	}
+	else
+	{
+		ntStatus = IPCRouteBroadcast(g_IPCPortTable, pIPC_Pkt, pIPCPort, &(pIPCPort->Overflow), &nDelivered);
+	}
 
+	if (pDestPids)
+	{
+		ExFreePoolWithTag(pDestPids, IPC_POOL_TAG);
+	}
+
+	pIrp->IoStatus.Status = ntStatus;
+	pIrp->IoStatus.Information = 0;
+	if (NT_SUCCESS(ntStatus) && uiOutLength >= sizeof(ULONG))
+	{
+		*(PULONG)pBuffer = nDelivered;
+		pIrp->IoStatus.Information = sizeof(ULONG);  //Number of bytes IO manager should copy back
+	}
 	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
 
-	return STATUS_SUCCESS;
+	DbgPrint("IPCDrvSendMulticast delivered to %u processes\r\n", nDelivered);
+	return ntStatus;
 }
 
 
 
 //=====================================================================
-// IPCDrvUnloadDriver
+// IPCDrvGroup
 //
-// This routine is called by the IO system to unload the driver. Any 
-// resources previously allocated must be freed.
+// This routine handles IOCTL_JOIN_GROUP and IOCTL_LEAVE_GROUP for the
+// calling process port. The input buffer holds the group name in
+// IPC_GROUP_NAME_MAX bytes, a name not terminated within them is
+// rejected. Memberships end when the handle is cleaned up.
 //=====================================================================
 
-VOID IPCDrvUnloadDriver(IN PDRIVER_OBJECT  pDriverObject)
+NTSTATUS IPCDrvGroup(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
 {
 	//Locals
 
-	PDEVICE_OBJECT pDeviceObject = NULL;  // Pointer to device object
-	UNICODE_STRING usDeviceName;          // Device Name
-	UNICODE_STRING usDosDeviceName;       // DOS Device Name
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	PIPC_PORT pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	char* szGroup = (char*)pIrp->AssociatedIrp.SystemBuffer;
+	NTSTATUS ntStatus;
 
-	DbgPrint("BasicUnloadDriver Called\r\n");
+	DbgPrint("IPCDrvGroup Called\r\n");
 
-	//Initialize Unicode Strings for the IoDeleteSymbolicLink call
+	if (pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength < IPC_GROUP_NAME_MAX ||
+		!IPCNameValid(szGroup, IPC_GROUP_NAME_MAX))
+	{
+		DbgPrint("Group name buffer too small or name too long\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+	}
+	else
+	{
+		ntStatus = pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_JOIN_GROUP ?
+			IPCPortJoinGroup(g_IPCPortTable, pIPCPort, szGroup) :
+			IPCPortLeaveGroup(g_IPCPortTable, pIPCPort, szGroup);
+	}
 
-	RtlInitUnicodeString(&usDeviceName, NT_DEVICE_NAME);
-	RtlInitUnicodeString(&usDosDeviceName, DOS_DEVICE_NAME);
+	pIrp->IoStatus.Status = ntStatus;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
 
-	//Delete Symbolic Link
+	return ntStatus;
+}
 
-	IoDeleteSymbolicLink(&usDosDeviceName);
 
-	//Delete Device Object
 
-	pDeviceObject = pDriverObject->DeviceObject;
+//=====================================================================
+// IPCDrvEndpoint
+//
+// This routine handles IOCTL_REGISTER_ENDPOINT, which names the calling
+// process port, and IOCTL_RESOLVE_ENDPOINT, which looks a name up. Both
+// return the endpoint handle, which senders pass as destination PID. The
+// name comes in IPC_ENDPOINT_NAME_MAX bytes, a name not terminated within
+// them is rejected. A process wanting several endpoints opens the device
+// once for each of them.
+//=====================================================================
 
-	if (pDeviceObject != NULL)
-	{
-		IoDeleteDevice(pDeviceObject);
+NTSTATUS IPCDrvEndpoint(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	PIPC_PORT pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	char* szName = (char*)pIrp->AssociatedIrp.SystemBuffer;
+	ULONG dwEndpoint = 0;
+	NTSTATUS ntStatus;
+
+	DbgPrint("IPCDrvEndpoint Called\r\n");
+
+	pIrp->IoStatus.Information = 0;
+
+	if (pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength < IPC_ENDPOINT_NAME_MAX ||
+		pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(DWORD32) ||
+		!IPCNameValid(szName, IPC_ENDPOINT_NAME_MAX))
+	{
+		DbgPrint("Endpoint buffer too small or name too long\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+	}
+	else
+	{
+		ntStatus = pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_REGISTER_ENDPOINT ?
+			IPCPortRegisterEndpoint(g_IPCPortTable, pIPCPort, szName, &dwEndpoint) :
+			IPCPortResolveEndpoint(g_IPCPortTable, szName, &dwEndpoint);
+		if (NT_SUCCESS(ntStatus))
+		{
+			*(DWORD32*)pIrp->AssociatedIrp.SystemBuffer = dwEndpoint;
+			pIrp->IoStatus.Information = sizeof(DWORD32);  //Number of bytes IO manager should copy back
+		}
+	}
+
+	pIrp->IoStatus.Status = ntStatus;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return ntStatus;
+}
+
+
+
+//=====================================================================
+// IPCDrvCall
+//
+// This routine handles IOCTL_CALL. The request packet is routed in the
+// caller's context with a new call ID and the IRP waits in the Call_Csq
+// of the caller's port. The callee's IOCTL_REPLY copies the reply into
+// this IRP's System buffer and completes it, so the caller needs neither
+// a Read notification nor a second read. A reply which does not fit is
+// kept and the IRP completes with IPC_CALL_OVERFLOW, IOCTL_COLLECT_REPLY
+// then fetches it with a larger buffer.
+//=====================================================================
+
+NTSTATUS IPCDrvCall(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiInLength = pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength;
+	size_t uiOutLength = pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength;
+	PIPC_WIRE_HEADER pRequest = (PIPC_WIRE_HEADER)pIrp->AssociatedIrp.SystemBuffer;
+	PIPC_PORT pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	PIPC_PENDING_READS pPendingReads = (PIPC_PENDING_READS)pIPCPort->pReaderContext;
+	PIPC_PACKET pTemp_Out_IPCPkt;
+	PIPC_DRV_CALL pDrvCall;
+	PIPC_CALL pCall;
+	PIRP pWaitingIrp;
+	size_t uiPacketLength;
+	NTSTATUS ntStatus;
+
+	DbgPrint("IPCDrvCall Called\r\n");
+
+	pIrp->IoStatus.Information = 0;
+
+	if (pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_COLLECT_REPLY)
+	{
+		//Only the calling port can collect the reply kept for one of its calls
+
+		pCall = uiInLength < sizeof(UINT32) ? NULL :
+			IPCCallTakeReply(g_IPCPortTable, pIPCPort, *(UINT32*)pIrp->AssociatedIrp.SystemBuffer);
+		if (!pCall)
+		{
+			DbgPrint("No reply kept for the call\n");
+			pIrp->IoStatus.Status = STATUS_NOT_FOUND;
+			IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+			return STATUS_NOT_FOUND;
+		}
+
+		pDrvCall = CONTAINING_RECORD(pCall, IPC_DRV_CALL, Call);
+		uiPacketLength = IPCPacketReadLength(pCall->pReply);
+		if (uiOutLength < uiPacketLength)
+		{
+			if (IPCCallKeepReply(g_IPCPortTable, pCall, pCall->pReply))
+			{
+				return IPCDrvCompleteReplyTooSmall(pIrp, pCall);
+			}
+			IPCDrvReleaseCall(pDrvCall);
+			pIrp->IoStatus.Status = STATUS_CANCELLED;
+			IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+			return STATUS_CANCELLED;
+		}
+
+		//The call is out of the registry, which held its last reference
+
+		IPCPacketCopyOut(g_IPCPortTable, pIrp->AssociatedIrp.SystemBuffer, pCall->pReply);
+		IPCPacketFree(g_IPCPortTable, pCall->pReply);
+		IPCDrvReleaseCall(pDrvCall);
+
+		pIrp->IoStatus.Status = STATUS_SUCCESS;
+		pIrp->IoStatus.Information = uiPacketLength;  //Number of bytes IO manager should copy back
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return STATUS_SUCCESS;
+	}
+
+	//Check the request and that the output buffer can at least hold an empty reply
+
+	if (!NT_SUCCESS(IPCPacketCheckWire(pRequest, uiInLength, FALSE, &uiPacketLength)) ||
+		uiOutLength < sizeof(IPC_WIRE_HEADER) + sizeof(IPC_WIRE_CALL_ID))
+	{
+		DbgPrint("Incorrect call buffer\n");
+		pIrp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pTemp_Out_IPCPkt = IPCPacketCreate(g_IPCPortTable, pRequest, pIPCPort->dwPID);
+	pDrvCall = (PIPC_DRV_CALL)IPCPoolAllocate(&(g_IPCPortTable->PktPool), sizeof(IPC_DRV_CALL));
+	if (!pTemp_Out_IPCPkt || !pDrvCall)
+	{
+		if (pTemp_Out_IPCPkt)
+		{
+			IPCPacketFree(g_IPCPortTable, pTemp_Out_IPCPkt);
+		}
+		else
+		{
+			IPCPortCountStat(g_IPCPortTable, pIPCPort, IPC_STAT_ALLOC_FAILURES, 1);
+		}
+		if (pDrvCall)
+		{
+			IPCPoolFree(&(g_IPCPortTable->PktPool), pDrvCall, sizeof(IPC_DRV_CALL));
+		}
+		pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	//The registry, the IRP and this routine each hold a reference on the call state.
+	//The call is registered before the IRP is queued so a cancel always finds it
+
+	pDrvCall->lRefCount = 3;
+	pDrvCall->pPort = pIPCPort;
+	IPCPortReference(pIPCPort);
+	IPCCallRegister(g_IPCPortTable, &(pDrvCall->Call), pIPCPort, uiOutLength);
+
+	pIrp->Tail.Overlay.DriverContext[0] = pDrvCall;
+	IoCsqInsertIrp(&(pPendingReads->Call_Csq), pIrp, &(pDrvCall->CsqContext));
+
+	//Route the request behind the sender's queued writes. A reply may complete the IRP before this returns
+
+	IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)PsGetCurrentProcessId());
+	ntStatus = IPCRouteCall(g_IPCPortTable, &(pDrvCall->Call), pTemp_Out_IPCPkt, &(pIPCPort->Overflow));
+	if (!NT_SUCCESS(ntStatus))
+	{
+		pWaitingIrp = IoCsqRemoveIrp(&(pPendingReads->Call_Csq), &(pDrvCall->CsqContext));
+		if (pWaitingIrp)
+		{
+			IPCDrvFinishCall(pWaitingIrp, ntStatus);
+		}
+	}
+
+	IPCDrvReleaseCall(pDrvCall);
+
+	return STATUS_PENDING;
+}
+
+
+
+//=====================================================================
+// IPCDrvReply
+//
+// This routine handles IOCTL_REPLY. The input buffer is the reply packet
+// carrying the call ID of the request it answers, which the routing core
+// copies into the waiting IOCTL_CALL IRP of the caller.
+//=====================================================================
+
+NTSTATUS IPCDrvReply(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiInLength = pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength;
+	PIPC_WIRE_HEADER pReply = (PIPC_WIRE_HEADER)pIrp->AssociatedIrp.SystemBuffer;
+	size_t uiPacketLength;
+	NTSTATUS ntStatus;
+
+	DbgPrint("IPCDrvReply Called\r\n");
+
+	if (!NT_SUCCESS(IPCPacketCheckWire(pReply, uiInLength, TRUE, &uiPacketLength)))
+	{
+		DbgPrint("Incorrect reply packet\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+	}
+	else
+	{
+		IPCRouterFlush(&g_IPCRouter, (ULONG_PTR)PsGetCurrentProcessId());
+		ntStatus = IPCRouteReply(g_IPCPortTable, pReply, PsGetCurrentProcessId());
+	}
+
+	pIrp->IoStatus.Status = ntStatus;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return ntStatus;
+}
+
+
+
+//=====================================================================
+// IPCDrvQueryStats
+//
+// This routine handles IOCTL_QUERY_STATS. The output buffer receives
+// an IPC_STATS with the totals of the port table and the counters of
+// every routing thread, followed by the counters of as many ports as
+// fit. nPorts tells user mode whether a larger buffer is needed to see
+// every port. The counters are summed from the per processor blocks
+// here, senders and readers never wait for a query.
+//=====================================================================
+
+NTSTATUS IPCDrvQueryStats(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiOutLength = pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength;
+	PIPC_STATS pStats = (PIPC_STATS)pIrp->AssociatedIrp.SystemBuffer;
+	NTSTATUS ntStatus;
+
+	DbgPrint("IPCDrvQueryStats Called\r\n");
+
+	if (uiOutLength < sizeof(IPC_STATS))
+	{
+		DbgPrint("Statistics buffer too small\n");
+		ntStatus = STATUS_BUFFER_TOO_SMALL;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
+	}
+
+	IPCPortTableQueryStats(g_IPCPortTable, pStats, (ULONG)((uiOutLength - sizeof(IPC_STATS)) / sizeof(IPC_PORT_STATS)));
+	IPCRouterFillStats(&g_IPCRouter, pStats);
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = sizeof(IPC_STATS) + pStats->nReturned * sizeof(IPC_PORT_STATS);  //Number of bytes IO manager should copy back
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return STATUS_SUCCESS;
+}
+
+
+
+//=====================================================================
+// IPCDrvTrace
+//
+// This routine handles IOCTL_SET_TRACE, which switches the per stage
+// timestamps of the packets queued to the calling process port on or
+// off, and IOCTL_QUERY_TRACE, which returns the latency histograms of
+// a port. A traced packet is read with its IPC_PACKET_TRACE after the
+// payload.
+//=====================================================================
+
+NTSTATUS IPCDrvTrace(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiInLength = pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength;
+	size_t uiOutLength = pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength;
+	PVOID pBuffer = pIrp->AssociatedIrp.SystemBuffer;
+	PIPC_PORT pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	HANDLE dwPID;
+	NTSTATUS ntStatus;
+
+	DbgPrint("IPCDrvTrace Called\r\n");
+
+	pIrp->IoStatus.Information = 0;
+
+	if (pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_SET_TRACE)
+	{
+		if (uiInLength < sizeof(UINT32) || *(UINT32*)pBuffer > 1)
+		{
+			DbgPrint("Incorrect trace switch\n");
+			ntStatus = STATUS_INVALID_PARAMETER;
+		}
+		else
+		{
+			ntStatus = IPCPortSetTrace(g_IPCPortTable, pIPCPort, (BOOLEAN)*(UINT32*)pBuffer);
+		}
+	}
+	else if (uiInLength < sizeof(DWORD32) || uiOutLength < sizeof(IPC_TRACE_STATS))
+	{
+		DbgPrint("Trace buffer too small\n");
+		ntStatus = STATUS_BUFFER_TOO_SMALL;
+	}
+	else
+	{
+		dwPID = *(DWORD32*)pBuffer ? (HANDLE)(ULONG_PTR)*(DWORD32*)pBuffer : pIPCPort->dwPID;
+		ntStatus = IPCPortQueryTrace(g_IPCPortTable, dwPID, (PIPC_TRACE_STATS)pBuffer);
+		if (NT_SUCCESS(ntStatus))
+		{
+			pIrp->IoStatus.Information = sizeof(IPC_TRACE_STATS);  //Number of bytes IO manager should copy back
+		}
+	}
+
+	pIrp->IoStatus.Status = ntStatus;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return ntStatus;
+}
+
+
+
+//=====================================================================
+// IPCDrvFlowControl
+//
+// This routine handles the flow control IOCTLs. IOCTL_SET_QUEUE_LIMIT
+// bounds the incoming queue of the calling process port, IOCTL_SET_OVERFLOW
+// selects what happens to its packets when their destination is over its
+// limit and IOCTL_QUERY_CREDITS returns what a destination still accepts.
+// IOCTL_SET_LANE_WEIGHTS sets the order the port's priority lanes are read in.
+//=====================================================================
+
+NTSTATUS IPCDrvFlowControl(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiInLength = pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength;
+	size_t uiOutLength = pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength;
+	PVOID pBuffer = pIrp->AssociatedIrp.SystemBuffer;
+	PIPC_PORT pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	IPC_CREDITS Credits;
+	NTSTATUS ntStatus = STATUS_SUCCESS;
+
+	DbgPrint("IPCDrvFlowControl Called\r\n");
+
+	pIrp->IoStatus.Information = 0;
+
+	switch (pIoStackIrp->Parameters.DeviceIoControl.IoControlCode)
+	{
+	case IOCTL_SET_QUEUE_LIMIT:
+
+		if (uiInLength < sizeof(IPC_QUEUE_LIMIT) || ((PIPC_QUEUE_LIMIT)pBuffer)->uiReserved != 0)
+		{
+			DbgPrint("Incorrect queue limit\n");
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		IPCPortSetLimit(pIPCPort, (PIPC_QUEUE_LIMIT)pBuffer);
+		break;
+
+	case IOCTL_SET_OVERFLOW:
+
+		if (uiInLength < sizeof(IPC_OVERFLOW) || ((PIPC_OVERFLOW)pBuffer)->uiPolicy > IPC_OVERFLOW_DROP_OLDEST)
+		{
+			DbgPrint("Incorrect overflow policy\n");
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		pIPCPort->Overflow = *(PIPC_OVERFLOW)pBuffer;
+		break;
+
+	case IOCTL_QUERY_CREDITS:
+
+		if (uiInLength < sizeof(DWORD32) || uiOutLength < sizeof(IPC_CREDITS))
+		{
+			DbgPrint("Credits buffer too small\n");
+			ntStatus = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		ntStatus = IPCPortQueryCredits(g_IPCPortTable, (HANDLE)(ULONG_PTR)*(DWORD32*)pBuffer, &Credits);
+		if (NT_SUCCESS(ntStatus))
+		{
+			RtlCopyMemory(pBuffer, &Credits, sizeof(IPC_CREDITS));
+			pIrp->IoStatus.Information = sizeof(IPC_CREDITS);  //Number of bytes IO manager should copy back
+		}
+		break;
+
+	case IOCTL_SET_LANE_WEIGHTS:
+
+		if (uiInLength < sizeof(IPC_LANE_WEIGHTS))
+		{
+			DbgPrint("Lane weights buffer too small\n");
+			ntStatus = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		IPCPortSetLaneWeights(pIPCPort, (PIPC_LANE_WEIGHTS)pBuffer);
+		break;
+	}
+
+	pIrp->IoStatus.Status = ntStatus;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return ntStatus;
+}
+
+
+
+//=====================================================================
+// IPCDrvRead
+//
+// This routine is called when a read (ReadFile/ReadFileEx) is 
+// issued on the device handle. This version uses Buffered I/O.
+// If no packet is queued the IRP is parked and STATUS_PENDING is
+// returned, the next packet routed to the port completes it.
+//=====================================================================
+
+NTSTATUS IPCDrvRead(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP pIrp)
+{
+	//Locals
+	NTSTATUS ntStatus;
+	unsigned int uiLength;
+	size_t uiPacketLength;
+	PIO_STACK_LOCATION pIoStackIrp = NULL;
+	PIPC_PORT pIPCPort;
+	PIPC_PACKET pTemp_IPC_In_Pkt;
+
+	DbgPrint("IPCDrvRead Called\r\n");
+
+	//Retrieve Pointer to Current IRP Stack Location
+
+	pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+
+	//Get Buffer using AssociatedIRP.SystemBuffer Parameter from IRP
+
+	uiLength = pIoStackIrp->Parameters.Read.Length;
+
+	//The reading process port is reached directly through the FileObject
+
+	pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+
+	//Dequeue the IPC Packet from the Incoming queue if it fits the output buffer sent by ReadFile,
+	//this also resets the Read Event if the Incoming IPC Packet queue is now empty. If the queue
+	//is empty the IRP is parked in the cancel safe queue of the port, which also marks it pending
+
+	pTemp_IPC_In_Pkt = IPCPortDequeueOrPark(pIPCPort, uiLength, pIrp, &ntStatus, &uiPacketLength);
+	if (!pTemp_IPC_In_Pkt)
+	{
+		if (ntStatus == STATUS_BUFFER_OVERFLOW)
+		{
+			//Output Buffer is small, the packet stays at the head of the queue so message order is kept
+			return IPCDrvCompleteTooSmall(pIrp, uiLength, uiPacketLength);
+		}
+
+		DbgPrint("Incoming queue is empty, Read IRP pending\n");
+		return ntStatus;
+	}
+
+	//If output buffer size is correct proceed with copy, the packet is no longer needed afterwards
+
+	uiPacketLength = IPCPacketCopyOut(g_IPCPortTable, pIrp->AssociatedIrp.SystemBuffer, pTemp_IPC_In_Pkt);
+	IPCPacketFree(g_IPCPortTable, pTemp_IPC_In_Pkt);
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = uiPacketLength; //Number of bytes IO manager should copy back to UserBuffer
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return STATUS_SUCCESS;
+}
+
+
+
+//=====================================================================
+// IPCDrvRecvBatch
+//
+// This routine handles IOCTL_RECV_BATCH, the batch counterpart of
+// IPCDrvRead. The input buffer optionally holds the maximum number of
+// packets to return, or an IPC_RECV_BATCH. The output buffer is mapped
+// directly (METHOD_OUT_DIRECT) and receives an IPC_BATCH_HEADER followed
+// by as many queued packets as fit. The packets are detached from the
+// incoming queue under a single acquisition of its lock and copied out
+// after the lock is released. With IPC_RECV_BATCH_WAIT an empty queue
+// parks the IRP with the Read IRPs, so competing receiver threads each
+// get their own packets and only one of them wakes per packet.
+//=====================================================================
+
+NTSTATUS IPCDrvRecvBatch(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP pIrp)
+{
+	//Locals
+
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	size_t uiOutLength = pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength;
+	ULONG nMaxPkts = MAXULONG;
+	PVOID pReader = NULL;		//Parked if the queue is empty, with IPC_RECV_BATCH_WAIT
+	PIPC_BATCH_HEADER pBatch;
+	PIPC_PACKET pTemp_IPC_In_Pkt;
+	LIST_ENTRY Pkt_List;
+	size_t uiOffset, cbNext;
+	ULONG nPkts;
+	NTSTATUS ntStatus;
+
+	DbgPrint("IPCDrvRecvBatch Called\r\n");
+
+	if (pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength >= sizeof(UINT32) &&
+		*(UINT32*)pIrp->AssociatedIrp.SystemBuffer != 0)
+	{
+		nMaxPkts = *(UINT32*)pIrp->AssociatedIrp.SystemBuffer;
+	}
+	if (pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength >= sizeof(IPC_RECV_BATCH) &&
+		(((PIPC_RECV_BATCH)pIrp->AssociatedIrp.SystemBuffer)->uiFlags & IPC_RECV_BATCH_WAIT))
+	{
+		pReader = pIrp;
+	}
+
+	pBatch = uiOutLength >= sizeof(IPC_BATCH_HEADER) && pIrp->MdlAddress ?
+		MmGetSystemAddressForMdlSafe(pIrp->MdlAddress, NormalPagePriority | MdlMappingNoExecute) : NULL;
+	if (!pBatch)
+	{
+		DbgPrint("Incorrect output buffer\n");
+		ntStatus = STATUS_INVALID_PARAMETER;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
+	}
+
+	//Detach the packets which fit, this also resets the Read Event if the queue is now empty
+
+	nPkts = IPCPortDequeueBatchOrPark(IPCPortFromFileObject(pIoStackIrp->FileObject), nMaxPkts, uiOutLength, pReader,
+		&Pkt_List, &cbNext, &ntStatus);
+	if (ntStatus == STATUS_PENDING)
+	{
+		DbgPrint("Incoming queue is empty, batch receive IRP pending\n");
+		return ntStatus;
+	}
+
+	pBatch->nPackets = nPkts;
+	pBatch->cbNext = (UINT32)cbNext;
+
+	if (nPkts == 0)
+	{
+		//Either the queue is empty or the head packet alone does not fit. In the
+		//second case the header tells user mode the buffer size it needs
+
+		ntStatus = cbNext ? STATUS_BUFFER_OVERFLOW : STATUS_NO_MORE_ENTRIES;
+		pIrp->IoStatus.Status = ntStatus;
+		pIrp->IoStatus.Information = cbNext ? sizeof(IPC_BATCH_HEADER) : 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return ntStatus;
+	}
+
+	//Copy every detached packet out and return it to the packet pool
+
+	uiOffset = sizeof(IPC_BATCH_HEADER);
+	while (!IsListEmpty(&Pkt_List))
+	{
+		pTemp_IPC_In_Pkt = CONTAINING_RECORD(RemoveHeadList(&Pkt_List), IPC_PACKET, list_entry);
+		uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+		uiOffset += IPCPacketCopyOut(g_IPCPortTable, (PCHAR)pBatch + uiOffset, pTemp_IPC_In_Pkt);
+		IPCPacketFree(g_IPCPortTable, pTemp_IPC_In_Pkt);
+	}
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = uiOffset;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return STATUS_SUCCESS;
+}
+
+
+
+//=====================================================================
+// IPCDrvParkRead / IPCDrvTakeRead
+//
+// Routing core reader hooks, called with the Incoming queue lock of the
+// port held and the queue empty. The IRP is queued to or removed from
+// the cancel safe queue kept after the port.
+//=====================================================================
+
+NTSTATUS IPCDrvParkRead(PIPC_PORT pPort, PVOID pReader)
+{
+	PIPC_PENDING_READS pPendingReads = (PIPC_PENDING_READS)pPort->pReaderContext;
+
+	//IoCsqInsertIrp marks the IRP pending. If it is cancelled meanwhile the
+	//cancel safe queue completes it, either way the dispatch routine returns pending
+
+	IoCsqInsertIrp(&(pPendingReads->Csq), (PIRP)pReader, NULL);
+
+	return STATUS_PENDING;
+}
+
+PVOID IPCDrvTakeRead(PIPC_PORT pPort)
+{
+	PIPC_PENDING_READS pPendingReads = (PIPC_PENDING_READS)pPort->pReaderContext;
+
+	return IoCsqRemoveNextIrp(&(pPendingReads->Csq), NULL);
+}
+
+
+
+//=====================================================================
+// IPCDrvCompleteTooSmall
+//
+// Completes a Read IRP whose buffer cannot hold the next packet. The
+// required size is returned in the first bytes of the buffer with the
+// STATUS_BUFFER_OVERFLOW warning, which the IO manager copies back (an
+// error status would not be) and ReadFile reports as ERROR_MORE_DATA.
+//=====================================================================
+
+NTSTATUS IPCDrvCompleteTooSmall(PIRP pIrp, unsigned int uiLength, size_t uiPacketLength)
+{
+	int iRequiredBufferSize = (int)uiPacketLength;
+
+	pIrp->IoStatus.Status = STATUS_BUFFER_OVERFLOW;
+	pIrp->IoStatus.Information = 0;
+	if (uiLength >= sizeof(int))
+	{
+		RtlCopyMemory(pIrp->AssociatedIrp.SystemBuffer, &iRequiredBufferSize, sizeof(int));
+		pIrp->IoStatus.Information = sizeof(int);
+	}
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return STATUS_BUFFER_OVERFLOW;
+}
+
+
+
+//=====================================================================
+// IPCDrvCompleteRecvBatch
+//
+// Completes an IOCTL_RECV_BATCH IRP parked on an empty port with the
+// packet routed to it, as a batch of one. A buffer too small for it gets
+// the batch header alone with the packet size in cbNext, the same way
+// IPCDrvRecvBatch answers, and FALSE hands the packet back.
+//=====================================================================
+
+BOOLEAN IPCDrvCompleteRecvBatch(PIPC_PORT_TABLE pTable, PIRP pIrp, PIPC_PACKET pIPC_Pkt)
+{
+	size_t uiOutLength = IoGetCurrentIrpStackLocation(pIrp)->Parameters.DeviceIoControl.OutputBufferLength;
+	size_t uiBatchLength = IPCPacketBatchLength(pIPC_Pkt);
+	PIPC_BATCH_HEADER pBatch;
+
+	//The output buffer was checked before the IRP was parked, mapping it can still fail
+
+	pBatch = MmGetSystemAddressForMdlSafe(pIrp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (!pBatch)
+	{
+		pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return FALSE;
+	}
+
+	if (uiOutLength < uiBatchLength)
+	{
+		pBatch->nPackets = 0;
+		pBatch->cbNext = (UINT32)IPCPacketReadLength(pIPC_Pkt);
+		pIrp->IoStatus.Status = STATUS_BUFFER_OVERFLOW;
+		pIrp->IoStatus.Information = sizeof(IPC_BATCH_HEADER);
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return FALSE;
 	}
 
-	//Free the buffer
+	uiBatchLength = IPCPacketCopyOutBatch(pTable, pBatch, pIPC_Pkt);
+	IPCPacketFree(pTable, pIPC_Pkt);
 
-	if (g_IPCPort_Queue)
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = uiBatchLength;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return TRUE;
+}
+
+
+
+//=====================================================================
+// IPCDrvCompleteRead
+//
+// Routing core reader hook, completes a parked Read IRP with a packet.
+// This runs in the sender's context (a routing thread or IOCTL_SEND_BATCH),
+// so the packet is copied straight into the reader's System buffer.
+// If the buffer is too small the IRP is completed with the required
+// size the same way IPCDrvRead does, and FALSE hands the packet back.
+// A parked IOCTL_RECV_BATCH IRP is completed with a batch of one.
+//=====================================================================
+
+BOOLEAN IPCDrvCompleteRead(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, PVOID pReader, PIPC_PACKET pIPC_Pkt)
+{
+	PIRP pIrp = (PIRP)pReader;
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	unsigned int uiLength = pIoStackIrp->Parameters.Read.Length;
+	size_t uiPacketLength = IPCPacketReadLength(pIPC_Pkt);
+
+	if (pIoStackIrp->MajorFunction == IRP_MJ_DEVICE_CONTROL)
+	{
+		return IPCDrvCompleteRecvBatch(pTable, pIrp, pIPC_Pkt);
+	}
+
+	if (uiLength < uiPacketLength)
+	{
+		IPCDrvCompleteTooSmall(pIrp, uiLength, uiPacketLength);
+		return FALSE;
+	}
+
+	uiPacketLength = IPCPacketCopyOut(pTable, pIrp->AssociatedIrp.SystemBuffer, pIPC_Pkt);
+	IPCPacketFree(pTable, pIPC_Pkt);
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = uiPacketLength;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return TRUE;
+}
+
+
+
+//=====================================================================
+// Cancel safe queue callbacks
+//
+// The parked Read IRPs of a port are linked through
+// Tail.Overlay.ListEntry on the Irp_List of its IPC_PENDING_READS.
+//=====================================================================
+
+VOID IPCCsqInsertIrp(PIO_CSQ Csq, PIRP Irp)
+{
+	PIPC_PENDING_READS pPendingReads = CONTAINING_RECORD(Csq, IPC_PENDING_READS, Csq);
+
+	InsertTailList(&(pPendingReads->Irp_List), &(Irp->Tail.Overlay.ListEntry));
+}
+
+VOID IPCCsqRemoveIrp(PIO_CSQ Csq, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	RemoveEntryList(&(Irp->Tail.Overlay.ListEntry));
+}
+
+PIRP IPCCsqPeekNextIrp(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext)
+{
+	PIPC_PENDING_READS pPendingReads = CONTAINING_RECORD(Csq, IPC_PENDING_READS, Csq);
+	PLIST_ENTRY pNext;
+
+	UNREFERENCED_PARAMETER(PeekContext);
+
+	pNext = Irp ? Irp->Tail.Overlay.ListEntry.Flink : pPendingReads->Irp_List.Flink;
+	if (pNext == &(pPendingReads->Irp_List))
+	{
+		return NULL;
+	}
+
+	return CONTAINING_RECORD(pNext, IRP, Tail.Overlay.ListEntry);
+}
+
+VOID IPCCsqAcquireLock(PIO_CSQ Csq, PKIRQL Irql)
+{
+	KeAcquireSpinLock(&(CONTAINING_RECORD(Csq, IPC_PENDING_READS, Csq)->Irp_List_SpinLock), Irql);
+}
+
+VOID IPCCsqReleaseLock(PIO_CSQ Csq, KIRQL Irql)
+{
+	KeReleaseSpinLock(&(CONTAINING_RECORD(Csq, IPC_PENDING_READS, Csq)->Irp_List_SpinLock), Irql);
+}
+
+VOID IPCCsqCompleteCanceledIrp(PIO_CSQ Csq, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+
+
+//=====================================================================
+// IPCDrvCompleteCall
+//
+// Routing core call hook. Whoever removes a call from the registry owns
+// its completion, the IRP is then claimed from the Call_Csq. If it was
+// cancelled first the cancel safe queue completes it. The reply is
+// copied straight from the replier's System buffer. One that does not
+// fit is copied to the packet pool and kept for IOCTL_COLLECT_REPLY,
+// the call then stays registered with that reference.
+//=====================================================================
+
+VOID IPCDrvCompleteCall(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, const IPC_WIRE_HEADER* pReply)
+{
+	PIPC_DRV_CALL pDrvCall = CONTAINING_RECORD(pCall, IPC_DRV_CALL, Call);
+	PIPC_PENDING_READS pPendingReads = (PIPC_PENDING_READS)pDrvCall->pPort->pReaderContext;
+	PIPC_PACKET pKeptReply;
+	size_t uiPacketLength;
+	PIRP pIrp;
+
+	pIrp = IoCsqRemoveIrp(&(pPendingReads->Call_Csq), &(pDrvCall->CsqContext));
+	if (!pIrp)
+	{
+		IPCDrvReleaseCall(pDrvCall);
+		return;
+	}
+
+	pIrp->IoStatus.Information = 0;
+
+	if (!pReply)
+	{
+		//The callee went away before replying, or the caller itself is being cleaned up
+
+		pIrp->IoStatus.Status = pDrvCall->pPort->bClosed ? STATUS_CANCELLED : STATUS_NOT_FOUND;
+	}
+	else
+	{
+		uiPacketLength = IPCWireLength(pReply);
+		if (uiPacketLength <= pCall->cbReplyMax)
+		{
+			RtlCopyMemory(pIrp->AssociatedIrp.SystemBuffer, pReply, uiPacketLength);
+			pIrp->IoStatus.Status = STATUS_SUCCESS;
+			pIrp->IoStatus.Information = uiPacketLength;
+		}
+		else if ((pKeptReply = IPCPacketCreate(pTable, pReply, (HANDLE)(ULONG_PTR)pReply->dwPid)) == NULL)
+		{
+			IPCPortCountStat(pTable, pCall->pCaller, IPC_STAT_ALLOC_FAILURES, 1);
+			pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		else if (IPCCallKeepReply(pTable, pCall, pKeptReply))
+		{
+			//The registry keeps its reference until the reply is collected
+
+			IPCDrvCompleteReplyTooSmall(pIrp, pCall);
+			IPCDrvReleaseCall(pDrvCall);
+			return;
+		}
+		else
+		{
+			pIrp->IoStatus.Status = STATUS_CANCELLED;
+		}
+	}
+
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+	IPCDrvReleaseCall(pDrvCall);
+	IPCDrvReleaseCall(pDrvCall);
+}
+
+
+
+//=====================================================================
+// IPCDrvCompleteReplyTooSmall
+//
+// Completes an IRP whose buffer cannot hold the reply kept in pCall.
+// Like IPCDrvCompleteTooSmall it uses the STATUS_BUFFER_OVERFLOW warning
+// so the IO manager copies back the IPC_CALL_OVERFLOW, which gives the
+// size of the reply and the call ID to collect it with. The retry this
+// forces is counted against the caller.
+//=====================================================================
+
+NTSTATUS IPCDrvCompleteReplyTooSmall(PIRP pIrp, PIPC_CALL pCall)
+{
+	PIO_STACK_LOCATION pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	PIPC_CALL_OVERFLOW pOverflow = (PIPC_CALL_OVERFLOW)pIrp->AssociatedIrp.SystemBuffer;
+
+	IPCPortCountStat(g_IPCPortTable, pCall->pCaller, IPC_STAT_TOO_SMALL, 1);
+
+	pIrp->IoStatus.Status = STATUS_BUFFER_OVERFLOW;
+	pIrp->IoStatus.Information = 0;
+	if (pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(IPC_CALL_OVERFLOW))
+	{
+		pOverflow->cbReply = (UINT32)IPCPacketReadLength(pCall->pReply);
+		pOverflow->uiCallId = pCall->uiCallId;
+		pIrp->IoStatus.Information = sizeof(IPC_CALL_OVERFLOW);
+	}
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return STATUS_BUFFER_OVERFLOW;
+}
+
+
+
+//=====================================================================
+// IPCDrvFinishCall / IPCDrvReleaseCall
+//
+// IPCDrvFinishCall completes an IOCTL_CALL IRP claimed from the Call_Csq
+// by a cancel, a cleanup or a failed route. The call is removed from the
+// registry unless a reply or IPCCallAbortPort got to it first, which
+// then finds no IRP and only drops the registry reference.
+//=====================================================================
+
+VOID IPCDrvFinishCall(PIRP pIrp, NTSTATUS ntStatus)
+{
+	PIPC_DRV_CALL pDrvCall = (PIPC_DRV_CALL)pIrp->Tail.Overlay.DriverContext[0];
+
+	if (IPCCallCancel(g_IPCPortTable, &(pDrvCall->Call)))
+	{
+		IPCDrvReleaseCall(pDrvCall);
+	}
+
+	pIrp->IoStatus.Status = ntStatus;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	IPCDrvReleaseCall(pDrvCall);
+}
+
+VOID IPCDrvReleaseCall(PIPC_DRV_CALL pDrvCall)
+{
+	if (InterlockedDecrement(&(pDrvCall->lRefCount)) == 0)
+	{
+		IPCPortDereference(pDrvCall->pPort);
+		IPCPoolFree(&(g_IPCPortTable->PktPool), pDrvCall, sizeof(IPC_DRV_CALL));
+	}
+}
+
+
+
+//=====================================================================
+// Call cancel safe queue callbacks
+//
+// The IOCTL_CALL IRPs of a port are linked the same way as its Read
+// IRPs, on the Call_Irp_List of its IPC_PENDING_READS. A cancelled call
+// is completed through IPCDrvFinishCall.
+//=====================================================================
+
+VOID IPCCallCsqInsertIrp(PIO_CSQ Csq, PIRP Irp)
+{
+	PIPC_PENDING_READS pPendingReads = CONTAINING_RECORD(Csq, IPC_PENDING_READS, Call_Csq);
+
+	InsertTailList(&(pPendingReads->Call_Irp_List), &(Irp->Tail.Overlay.ListEntry));
+}
+
+PIRP IPCCallCsqPeekNextIrp(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext)
+{
+	PIPC_PENDING_READS pPendingReads = CONTAINING_RECORD(Csq, IPC_PENDING_READS, Call_Csq);
+	PLIST_ENTRY pNext;
+
+	UNREFERENCED_PARAMETER(PeekContext);
+
+	pNext = Irp ? Irp->Tail.Overlay.ListEntry.Flink : pPendingReads->Call_Irp_List.Flink;
+	if (pNext == &(pPendingReads->Call_Irp_List))
+	{
+		return NULL;
+	}
+
+	return CONTAINING_RECORD(pNext, IRP, Tail.Overlay.ListEntry);
+}
+
+VOID IPCCallCsqAcquireLock(PIO_CSQ Csq, PKIRQL Irql)
+{
+	KeAcquireSpinLock(&(CONTAINING_RECORD(Csq, IPC_PENDING_READS, Call_Csq)->Call_Irp_List_SpinLock), Irql);
+}
+
+VOID IPCCallCsqReleaseLock(PIO_CSQ Csq, KIRQL Irql)
+{
+	KeReleaseSpinLock(&(CONTAINING_RECORD(Csq, IPC_PENDING_READS, Call_Csq)->Call_Irp_List_SpinLock), Irql);
+}
+
+VOID IPCCallCsqCompleteCanceledIrp(PIO_CSQ Csq, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	IPCDrvFinishCall(Irp, STATUS_CANCELLED);
+}
+
+
+
+//=====================================================================
+// IPCDrvCleanup
+//
+// This routine is called by the IO system when the last handle to the
+// File object is closed. The port is removed from the global table so
+// nothing is routed to it any more and the parked Read IRPs are
+// completed, which the IO manager requires before it sends the Close.
+// So are the IOCTL_CALL IRPs still waiting for a reply.
+//=====================================================================
+
+NTSTATUS IPCDrvCleanup(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	DbgPrint("IPCDrvCleanup Called\r\n");
+
+	PIO_STACK_LOCATION pIoStackIrp;
+	PIPC_PORT pIPCPort;
+	PIPC_PENDING_READS pPendingReads;
+	PIRP pPendingIrp;
+	pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+
+	pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	if (pIPCPort)
+	{
+		IPCPortTableRemove(g_IPCPortTable, pIPCPort);
+
+		pPendingReads = (PIPC_PENDING_READS)pIPCPort->pReaderContext;
+		while ((pPendingIrp = IoCsqRemoveNextIrp(&(pPendingReads->Csq), NULL)) != NULL)
+		{
+			pPendingIrp->IoStatus.Status = STATUS_CANCELLED;
+			pPendingIrp->IoStatus.Information = 0;
+			IoCompleteRequest(pPendingIrp, IO_NO_INCREMENT);
+		}
+
+		//Removing the port aborted its calls, any IOCTL_CALL IRP left lost a race with that
+
+		while ((pPendingIrp = IoCsqRemoveNextIrp(&(pPendingReads->Call_Csq), NULL)) != NULL)
+		{
+			IPCDrvFinishCall(pPendingIrp, STATUS_CANCELLED);
+		}
+	}
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return STATUS_SUCCESS;
+}
+
+
+
+//=====================================================================
+// IPCDrvClose
+//
+// This routine is called by the IO system when the IPCDrv device is 
+// closed (CloseHandle).
+//=====================================================================
+
+NTSTATUS IPCDrvClose(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp)
+{
+	DbgPrint("IPCDrvClose Called\r\n");
+
+	PIO_STACK_LOCATION pIoStackIrp;
+	PIPC_PORT pIPCPort;
+	pIoStackIrp = IoGetCurrentIrpStackLocation(pIrp);
+	
+	//The port was removed from the global table at cleanup, drop the FileObject's reference.
+	//The port and any packets still queued on it are freed once in-flight deliveries
+	//release their references
+
+	pIPCPort = IPCPortFromFileObject(pIoStackIrp->FileObject);
+	if (pIPCPort)
+	{
+		pIoStackIrp->FileObject->FsContext = NULL;
+		pIoStackIrp->FileObject->FsContext2 = NULL;
+		IPCPortDereference(pIPCPort);
+	}
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = 0;
+
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	return STATUS_SUCCESS;
+}
+
+
+
+//=====================================================================
+// IPCDrvUnloadDriver
+//
+// This routine is called by the IO system to unload the driver. Any 
+// resources previously allocated must be freed.
+//=====================================================================
+
+VOID IPCDrvUnloadDriver(IN PDRIVER_OBJECT  pDriverObject)
+{
+	//Locals
+
+	PDEVICE_OBJECT pDeviceObject = NULL;  // Pointer to device object
+	UNICODE_STRING usDeviceName;          // Device Name
+	UNICODE_STRING usDosDeviceName;       // DOS Device Name
+
+	DbgPrint("BasicUnloadDriver Called\r\n");
+
+	//Initialize Unicode Strings for the IoDeleteSymbolicLink call
+
+	RtlInitUnicodeString(&usDeviceName, NT_DEVICE_NAME);
+	RtlInitUnicodeString(&usDosDeviceName, DOS_DEVICE_NAME);
+
+	//Delete Symbolic Link
+
+	IoDeleteSymbolicLink(&usDosDeviceName);
+
+	//Delete Device Object
+
+	pDeviceObject = pDriverObject->DeviceObject;
+
+	if (pDeviceObject != NULL)
+	{
+		IoDeleteDevice(pDeviceObject);
+	}
+
+	//Report the pool counters, then delete the pools and free the buffer
+
+	if (g_IPCPortTable)
 	{
-		ExFreePoolWithTag(g_IPCPort_Queue, (LONG)'1CPI');
+		IPC_POOL_STATS PoolStats;
+		IPC_ROUTER_THREAD_STATS RouterStats;
+		IPC_STATS TableStats;
+		ULONG i;
+
+		//Stop the routing threads first, they route whatever is still queued
+
+		IPCRouterStop(&g_IPCRouter);
+		for (i = 0; i < g_IPCRouter.nThreads; i++)
+		{
+			IPCRouterQueryStats(&g_IPCRouter, i, &RouterStats);
+			DbgPrint("IPC Routing thread %u: %lld packets, %lld drains, %lld ns average and %lld ns worst packet latency\r\n",
+				i, RouterStats.nPkts, RouterStats.nDrains,
+				RouterStats.nPkts ? RouterStats.llLatencyTotal / RouterStats.nPkts : 0, RouterStats.llLatencyMax);
+		}
+		IPCRouterFree(&g_IPCRouter);
+
+		IPCPoolQueryStats(&(g_IPCPortTable->PktPool), &PoolStats);
+		DbgPrint("IPC Packet pool: %lld allocs, %lld hits, %lld misses, %lld large\r\n",
+			PoolStats.nAllocs, PoolStats.nHits, PoolStats.nMisses, PoolStats.nLargeAllocs);
+
+		IPCPortTableQueryStats(g_IPCPortTable, &TableStats, 0);
+		DbgPrint("IPC Ports: %llu packets in, %llu out, %llu undeliverable, %llu allocation failures, %llu buffers too small, %llu dropped\r\n",
+			TableStats.Totals.nPktsIn, TableStats.Totals.nPktsOut, TableStats.Totals.nUndeliverable,
+			TableStats.Totals.nAllocFailures, TableStats.Totals.nTooSmall, TableStats.Totals.nDropped);
+
+		IPCPortTableDelete(g_IPCPortTable);
+		ExFreePoolWithTag(g_IPCPortTable, IPC_POOL_TAG);
+		g_IPCPortTable = NULL;
 	}
 }
 
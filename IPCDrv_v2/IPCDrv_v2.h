@@ -13,66 +13,99 @@
 //Include Files
 
 #include <ntddk.h>
+#include "IPCRoute_v2.h"
+#include "IPCRouter_v2.h"
 
 //Constants
 
 #define NT_DEVICE_NAME      L"\\Device\\IPCDrv"          //Our Device Name(NT)
 #define DOS_DEVICE_NAME     L"\\DosDevices\\IPCDrv"      //Our Device Name(DOS)
 #define IPC_DEVICE_TYPE 40000							 //DeviceType used in CTL_CODE Macro
+#define IPC_ROUTING_THREADS_VALUE L"RoutingThreads"	 //REG_DWORD under the service key, number of routing threads (0 or absent for one per processor)
+#define IPC_QUEUE_LIMIT_PKTS_VALUE L"QueueLimitPackets"	 //REG_DWORD under the service key, default packet limit of a port's incoming queue (0 or absent for none)
+#define IPC_QUEUE_LIMIT_BYTES_VALUE L"QueueLimitBytes"	 //REG_DWORD under the service key, default byte limit of a port's incoming queue (0 or absent for none)
 #define IOCTL_REG_EVENT\
  CTL_CODE(IPC_DEVICE_TYPE, 0x800, METHOD_BUFFERED, FILE_READ_DATA|FILE_WRITE_DATA) //Read Notification Event IOCTL
+#define IOCTL_SEND_BATCH\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA) //Batch send IOCTL, IPC_BATCH_HEADER and packets in, one NTSTATUS per packet out
+#define IOCTL_RECV_BATCH\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x802, METHOD_OUT_DIRECT, FILE_READ_DATA) //Batch read IOCTL, maximum packet count in, IPC_BATCH_HEADER and packets out
+#define IOCTL_SEND_MULTICAST\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA) //Multicast send IOCTL, IPC_MULTICAST_HEADER, PIDs and packet in, recipient count out
+#define IOCTL_JOIN_GROUP\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x804, METHOD_BUFFERED, FILE_READ_DATA) //Join a multicast group, IPC_GROUP_NAME_MAX byte group name in
+#define IOCTL_LEAVE_GROUP\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x805, METHOD_BUFFERED, FILE_READ_DATA) //Leave a multicast group, IPC_GROUP_NAME_MAX byte group name in
+#define IOCTL_SET_QUEUE_LIMIT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x806, METHOD_BUFFERED, FILE_READ_DATA) //Limit the caller's incoming queue, IPC_QUEUE_LIMIT in
+#define IOCTL_SET_OVERFLOW\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x807, METHOD_BUFFERED, FILE_WRITE_DATA) //Overflow policy of the caller's packets, IPC_OVERFLOW in
+#define IOCTL_QUERY_CREDITS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x808, METHOD_BUFFERED, FILE_WRITE_DATA) //Credits of a destination, DWORD32 PID in, IPC_CREDITS out
+#define IOCTL_SET_LANE_WEIGHTS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x809, METHOD_BUFFERED, FILE_READ_DATA) //Read order of the caller's incoming lanes, IPC_LANE_WEIGHTS in
+#define IOCTL_REGISTER_ENDPOINT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80A, METHOD_BUFFERED, FILE_READ_DATA) //Name the caller's port, IPC_ENDPOINT_NAME_MAX byte name in, DWORD32 endpoint handle out
+#define IOCTL_RESOLVE_ENDPOINT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80B, METHOD_BUFFERED, FILE_WRITE_DATA) //Endpoint handle of a name, IPC_ENDPOINT_NAME_MAX byte name in, DWORD32 endpoint handle out
+#define IOCTL_CALL\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80C, METHOD_BUFFERED, FILE_READ_DATA|FILE_WRITE_DATA) //Request/response call, request IPC Packet in, reply IPC Packet (or IPC_CALL_OVERFLOW) out
+#define IOCTL_REPLY\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80D, METHOD_BUFFERED, FILE_WRITE_DATA) //Reply to a call, IPC Packet with the request's uiCallId in
+#define IOCTL_COLLECT_REPLY\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80E, METHOD_BUFFERED, FILE_READ_DATA) //Reply of a call which did not fit, UINT32 call ID in, reply IPC Packet out
+#define IOCTL_QUERY_STATS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80F, METHOD_BUFFERED, FILE_READ_DATA) //Runtime statistics, IPC_STATS with as many IPC_PORT_STATS as fit out
+#define IOCTL_SET_TRACE\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x810, METHOD_BUFFERED, FILE_WRITE_DATA) //Per stage timestamps of the packets read by the caller, UINT32 1 on, 0 off in
+#define IOCTL_QUERY_TRACE\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x811, METHOD_BUFFERED, FILE_READ_DATA) //Latency histograms, DWORD32 PID (0 for the caller) in, IPC_TRACE_STATS out
+#define IOCTL_SEND_GATHER\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x812, METHOD_BUFFERED, FILE_WRITE_DATA) //Gather send, IPC_GATHER_HEADER and segments in, the payload is read from the caller's memory
 
 
 //Structure definitions
 
-//The IPC_PORT structure acts as a port which the driver maintains 
-//for every User mode process which interfaces with the driver
+//IPC_PORT, IPC_PACKET_QUEUE and IPC_PACKET are defined by the routing core in IPCRoute_v2.h
 
-typedef struct _IPC_PORT
+//The IPC_PENDING_READS structure is the reader state kept after every port (ReaderOps.cbReaderContext).
+//Read IRPs which find the Incoming queue empty are parked in its cancel safe queue until a packet
+//is routed to the port, the IRP is cancelled or the handle is cleaned up.
+//Lock order is the Incoming queue lock, then Irp_List_SpinLock.
+//IOCTL_CALL IRPs wait for their reply in a second cancel safe queue
+
+typedef struct _IPC_PENDING_READS
 {
-	HANDLE dwPID;			//PID of the User mode process which calls CreateFile to get a handle to the Device
-	PKEVENT pKevent;		//Read Notification event which is registered by the User mode process
-	LIST_ENTRY list_entry;  //Doubly linked List Entry, the driver maintains a list of User mode Ports
-	PFILE_OBJECT pFileObj;  //Pointer to File object which is unique to every User mode process, our driver uses this to maintain packet queues for this process
-}IPC_PORT, *PIPC_PORT;
+	IO_CSQ Csq;							//Cancel safe queue of parked Read IRPs
+	LIST_ENTRY Irp_List;				//Parked Read IRPs, oldest first
+	KSPIN_LOCK Irp_List_SpinLock;		//Lock protecting Irp_List, acquired by the cancel safe queue
+	IO_CSQ Call_Csq;					//Cancel safe queue of IOCTL_CALL IRPs waiting for their reply
+	LIST_ENTRY Call_Irp_List;			//Waiting IOCTL_CALL IRPs
+	KSPIN_LOCK Call_Irp_List_SpinLock;	//Lock protecting Call_Irp_List, acquired by its cancel safe queue
+}IPC_PENDING_READS, *PIPC_PENDING_READS;
 
-//The IPC_PACKET_QUEUE structure contains the ListHead for the Incoming and Outgoing Packet queues
-//It also contains the Spin Lock used for Synchronizing List Access
+//The IPC_DRV_CALL structure is the state of an IOCTL_CALL IRP, pointed at by DriverContext[0] of the IRP.
+//It is freed when the registry, the IRP and the dispatch routine have all dropped their reference
 
-typedef struct _IPC_PACKET_QUEUE
+typedef struct _IPC_DRV_CALL
 {
-	LIST_ENTRY Ipc_Pkt_In_Queue;			//ListHead for Incoming Packet Queue
-	LIST_ENTRY Ipc_Pkt_Out_Queue;			//ListHead for Outgoing Packet Queue
-	KSPIN_LOCK Ipc_Pkt_In_Queue_SpinLock;	//Spinlock for synchronizing Incoming Packet Queue Access
-	KSPIN_LOCK Ipc_Pkt_Out_Queue_SpinLock;	//Spinlock for synchronizing Outgoing Packet Queue Access
-}IPC_PACKET_QUEUE, *PIPC_PACKET_QUEUE;
-
-//The IPC_PACKET struct definition of the actual message/packet
-//passed between 2 UserMode processes
-
-typedef struct _IPC_PACKET {
-	struct _header {					//Packet Header which contains some metadata about the message
-		DWORD32 dwSourcePid;			//Source process PID which initiated the message
-		HANDLE dwDestinationPid;		//Destination process PID to which the message is targetted
-		size_t sizeofpayload;			//Size of the payload(buffer)
-		UINT32 nPacketid;				//Packet ID
-		UINT32 EndofPacket;				//1 indicates End of this Packet
-	}header;
-	LIST_ENTRY list_entry;				//List entry used to queue the packets
-	char szbuffer[];					//Flexible Array Member buffer,can contain variable size of chars
-}IPC_PACKET, *PIPC_PACKET;
-
-//The IPC_PKTCPY_WKITEM structure definition of the context 
-//passed to the Worker Thread Callback routine
-
-typedef struct _IPC_PKTCPY_WKITEM
+	IPC_CALL Call;						//Registration with the routing core
+	IO_CSQ_IRP_CONTEXT CsqContext;		//Context of the IRP in the caller's Call_Csq
+	PIPC_PORT pPort;					//Referenced port of the caller, its reader state holds Call_Csq
+	volatile LONG lRefCount;			//References on the call state
+}IPC_DRV_CALL, *PIPC_DRV_CALL;
+
+//IOCTL_CALL completes with STATUS_BUFFER_OVERFLOW and this structure when the reply does not fit the
+//output buffer. The reply is kept until IOCTL_COLLECT_REPLY fetches it or the handle is cleaned up
+
+typedef struct _IPC_CALL_OVERFLOW
 {
-	PIPC_PACKET pIPC_Pkt;				//IPC Packet which needs to be copied
-	PIO_WORKITEM pWorkItem;				//WorkItem
-}IPC_PKTCPY_WKITEM, *PIPC_PKTCPY_WKITEM;
+	UINT32 cbReply;						//Size of the reply IPC Packet
+	UINT32 uiCallId;					//Call ID to pass to IOCTL_COLLECT_REPLY
+}IPC_CALL_OVERFLOW, *PIPC_CALL_OVERFLOW;
 
-PLIST_ENTRY g_IPCPort_Queue;			//Global IPCPort queue maintained by our driver which is a Doubly linked list of Ports for every User mode process
-PKSPIN_LOCK g_IPCPort_Queue_SpinLock;   //Global Spinlock to synchronize access to the global IPCPort queue
+PIPC_PORT_TABLE g_IPCPortTable;			//Global IPCPort table maintained by our driver, Ports for every User mode process hashed by PID
+IPC_ROUTER g_IPCRouter;					//Routing threads written packets are queued to
 
 //Function Prototypes
 
@@ -87,6 +120,10 @@ VOID IPCDrvUnloadDriver(IN PDRIVER_OBJECT  pDriverObject);
 NTSTATUS IPCDrvCreate(IN PDEVICE_OBJECT pDeviceObject,
 	IN PIRP           pIrp);
 
+//Called when the last handle to a File object is closed, completes the parked Read IRPs
+NTSTATUS IPCDrvCleanup(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
 //Called when a Close IRP is sent to the driver
 NTSTATUS IPCDrvClose(IN PDEVICE_OBJECT pDeviceObject,
 	IN PIRP           pIrp);
@@ -99,12 +136,97 @@ NTSTATUS IPCDrvDevIOCTL(IN PDEVICE_OBJECT pDeviceObject,
 NTSTATUS IPCDrvWrite(IN PDEVICE_OBJECT pDeviceObject,
 	IN PIRP           pIrp);
 
+//Called for IOCTL_SEND_BATCH, routes every packet of the batch and returns their status
+NTSTATUS IPCDrvSendBatch(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_SEND_GATHER, routes a packet whose payload is copied straight from the caller's segments
+NTSTATUS IPCDrvSendGather(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Routing core gather hook, copies a segment from the caller's address space
+IPC_GATHER_COPY IPCDrvCopySegment;
+
+//Called for IOCTL_SEND_MULTICAST, delivers one packet to a PID list, a group or every port
+NTSTATUS IPCDrvSendMulticast(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_JOIN_GROUP and IOCTL_LEAVE_GROUP
+NTSTATUS IPCDrvGroup(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_REGISTER_ENDPOINT and IOCTL_RESOLVE_ENDPOINT
+NTSTATUS IPCDrvEndpoint(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_CALL and IOCTL_COLLECT_REPLY, routes a request and completes when its reply arrives
+NTSTATUS IPCDrvCall(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_REPLY, hands the reply straight to the waiting IOCTL_CALL IRP
+NTSTATUS IPCDrvReply(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_QUERY_STATS, returns the counters of the port table and of every port
+NTSTATUS IPCDrvQueryStats(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_SET_TRACE and IOCTL_QUERY_TRACE
+NTSTATUS IPCDrvTrace(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Called for IOCTL_SET_QUEUE_LIMIT, IOCTL_SET_OVERFLOW, IOCTL_QUERY_CREDITS and IOCTL_SET_LANE_WEIGHTS
+NTSTATUS IPCDrvFlowControl(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
 //Called when a Read IRP is sent to the driver
 NTSTATUS IPCDrvRead(IN PDEVICE_OBJECT pDeviceObject,
 	IN PIRP           pIrp);
 
-//System Worker Thread Workitem callback routine
-IO_WORKITEM_ROUTINE WorkItemCallback;
+//Called for IOCTL_RECV_BATCH, returns as many queued packets as fit in the output buffer
+NTSTATUS IPCDrvRecvBatch(IN PDEVICE_OBJECT pDeviceObject,
+	IN PIRP           pIrp);
+
+//Completes a Read IRP whose buffer is too small with the size of the packet
+NTSTATUS IPCDrvCompleteTooSmall(PIRP pIrp, unsigned int uiLength, size_t uiPacketLength);
+
+//Completes a parked IOCTL_RECV_BATCH IRP with a batch of one packet, FALSE if its buffer is too small
+BOOLEAN IPCDrvCompleteRecvBatch(PIPC_PORT_TABLE pTable, PIRP pIrp, PIPC_PACKET pIPC_Pkt);
+
+//Cancel safe queue callbacks of the parked Read and IOCTL_RECV_BATCH IRPs
+IO_CSQ_INSERT_IRP IPCCsqInsertIrp;
+IO_CSQ_REMOVE_IRP IPCCsqRemoveIrp;
+IO_CSQ_PEEK_NEXT_IRP IPCCsqPeekNextIrp;
+IO_CSQ_ACQUIRE_LOCK IPCCsqAcquireLock;
+IO_CSQ_RELEASE_LOCK IPCCsqReleaseLock;
+IO_CSQ_COMPLETE_CANCELED_IRP IPCCsqCompleteCanceledIrp;
+
+//Cancel safe queue callbacks of the IOCTL_CALL IRPs, removal is shared with the Read IRPs
+IO_CSQ_INSERT_IRP IPCCallCsqInsertIrp;
+IO_CSQ_PEEK_NEXT_IRP IPCCallCsqPeekNextIrp;
+IO_CSQ_ACQUIRE_LOCK IPCCallCsqAcquireLock;
+IO_CSQ_RELEASE_LOCK IPCCallCsqReleaseLock;
+IO_CSQ_COMPLETE_CANCELED_IRP IPCCallCsqCompleteCanceledIrp;
+
+//Routing core call hook, completes an IOCTL_CALL IRP with its reply
+IPC_COMPLETE_CALL IPCDrvCompleteCall;
+
+//Completes an IOCTL_CALL IRP without a reply, removing its call from the registry
+VOID IPCDrvFinishCall(PIRP pIrp, NTSTATUS ntStatus);
+
+//Completes an IOCTL_CALL or IOCTL_COLLECT_REPLY IRP whose buffer cannot hold the kept reply of pCall
+NTSTATUS IPCDrvCompleteReplyTooSmall(PIRP pIrp, PIPC_CALL pCall);
+
+//Drops a reference on the state of an IOCTL_CALL IRP, freeing it with the last one
+VOID IPCDrvReleaseCall(PIPC_DRV_CALL pDrvCall);
+
+//Routing core reader hooks, park a Read or IOCTL_RECV_BATCH IRP, take the oldest one and complete it with a packet
+IPC_PARK_READER IPCDrvParkRead;
+IPC_TAKE_READER IPCDrvTakeRead;
+IPC_COMPLETE_READER IPCDrvCompleteRead;
+
+//Reads an optional REG_DWORD value from the service key
+ULONG IPCDrvQueryParameter(IN PUNICODE_STRING pRegistryPath, IN PCWSTR pszValueName);
 
 /*Compiler Directives
 * These compiler directives tell the OS how to load the driver into memory.
@@ -114,9 +236,22 @@ IO_WORKITEM_ROUTINE WorkItemCallback;
 #pragma alloc_text( INIT, DriverEntry )
 #pragma alloc_text( PAGE, IPCDrvUnloadDriver)
 #pragma alloc_text( PAGE, IPCDrvCreate)
+#pragma alloc_text( PAGE, IPCDrvCleanup)
 #pragma alloc_text( PAGE, IPCDrvClose)
 #pragma alloc_text( PAGE, IPCDrvDevIOCTL)
 #pragma alloc_text( PAGE, IPCDrvWrite)
+#pragma alloc_text( PAGE, IPCDrvSendBatch)
+#pragma alloc_text( PAGE, IPCDrvSendGather)
+#pragma alloc_text( PAGE, IPCDrvCopySegment)
+#pragma alloc_text( PAGE, IPCDrvSendMulticast)
+#pragma alloc_text( PAGE, IPCDrvGroup)
+#pragma alloc_text( PAGE, IPCDrvEndpoint)
+#pragma alloc_text( PAGE, IPCDrvCall)
+#pragma alloc_text( PAGE, IPCDrvReply)
+#pragma alloc_text( PAGE, IPCDrvQueryStats)
+#pragma alloc_text( PAGE, IPCDrvTrace)
+#pragma alloc_text( PAGE, IPCDrvFlowControl)
 #pragma alloc_text( PAGE, IPCDrvRead)
-#pragma alloc_text( PAGE, WorkItemCallback)
+#pragma alloc_text( PAGE, IPCDrvRecvBatch)
+#pragma alloc_text( INIT, IPCDrvQueryParameter)
 
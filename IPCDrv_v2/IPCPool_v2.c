@@ -0,0 +1,241 @@
+//=====================================================================
+// IPC- Inter Process Communication Packet Pool
+//
+// This file implements the size class pool. A block is taken from the
+// lookaside list of the smallest class that fits, on the processor the
+// caller is running on. Only when that list is empty does the allocation
+// reach ExAllocatePoolWithTag, which is counted as a miss.
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+//Include Files
+
+#include "IPCPool_v2.h"
+#include "IPCRoute_v2.h"
+
+
+//=====================================================================
+// IPCPoolAllocateMiss
+//
+// Allocate routine of every lookaside list. It is only called when the
+// list is empty so it counts a miss for the processor owning the list.
+//=====================================================================
+
+static PVOID IPCPoolAllocateMiss(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag, PLOOKASIDE_LIST_EX Lookaside)
+{
+	PIPC_POOL_CLASS pClass = CONTAINING_RECORD(Lookaside, IPC_POOL_CLASS, Lookaside);
+
+	InterlockedIncrement64(&(pClass->pCpu->nMisses));
+
+	return ExAllocatePoolWithTag(PoolType, NumberOfBytes, Tag);
+}
+
+
+//=====================================================================
+// IPCPoolFindClass
+//
+// Returns the smallest size class which can hold cbSize bytes, or
+// nClasses if the request is larger than every class.
+//=====================================================================
+
+static ULONG IPCPoolFindClass(PIPC_POOL pPool, SIZE_T cbSize)
+{
+	ULONG i;
+
+	for (i = 0; i < pPool->nClasses; i++)
+	{
+		if (cbSize <= pPool->ClassSizes[i])
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+
+//=====================================================================
+// IPCPoolCurrentCpu
+//
+// Returns the per processor lists of the calling processor. The caller
+// may be moved to another processor afterwards, which is harmless since
+// lookaside lists can be used from any processor.
+//=====================================================================
+
+static PIPC_POOL_CPU IPCPoolCurrentCpu(PIPC_POOL pPool)
+{
+	ULONG uiCpu = KeGetCurrentProcessorNumberEx(NULL);
+
+	return &(pPool->pCpus[uiCpu % pPool->nCpus]);
+}
+
+
+//=====================================================================
+// IPCPoolInit
+//
+// Allocates the per processor structures and initializes a lookaside
+// list for every size class on every processor.
+//=====================================================================
+
+NTSTATUS IPCPoolInit(PIPC_POOL pPool, const SIZE_T* pClassSizes, ULONG nClasses)
+{
+	NTSTATUS ntStatus;
+	ULONG uiCpu;
+	ULONG i;
+
+	if (nClasses == 0 || nClasses > IPC_POOL_MAX_CLASSES)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pPool->nClasses = nClasses;
+	for (i = 0; i < nClasses; i++)
+	{
+		pPool->ClassSizes[i] = pClassSizes[i];
+	}
+	pPool->nLargeAllocs = 0;
+
+	pPool->nCpus = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	if (pPool->nCpus == 0)
+	{
+		pPool->nCpus = 1;
+	}
+
+	pPool->pCpus = ExAllocatePoolWithTag(NonPagedPool, pPool->nCpus * sizeof(IPC_POOL_CPU), IPC_POOL_TAG);
+	if (!pPool->pCpus)
+	{
+		DbgPrint("Failed to allocate Nonpaged pool for the packet pool\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	for (uiCpu = 0; uiCpu < pPool->nCpus; uiCpu++)
+	{
+		PIPC_POOL_CPU pCpu = &(pPool->pCpus[uiCpu]);
+
+		pCpu->nAllocs = 0;
+		pCpu->nMisses = 0;
+
+		for (i = 0; i < nClasses; i++)
+		{
+			pCpu->Classes[i].pCpu = pCpu;
+
+			ntStatus = ExInitializeLookasideListEx(&(pCpu->Classes[i].Lookaside), IPCPoolAllocateMiss, NULL,
+				NonPagedPool, 0, pPool->ClassSizes[i], IPC_POOL_TAG, 0);
+			if (!NT_SUCCESS(ntStatus))
+			{
+				//Delete the lists created so far
+
+				while (i-- > 0)
+				{
+					ExDeleteLookasideListEx(&(pCpu->Classes[i].Lookaside));
+				}
+				while (uiCpu-- > 0)
+				{
+					for (i = 0; i < nClasses; i++)
+					{
+						ExDeleteLookasideListEx(&(pPool->pCpus[uiCpu].Classes[i].Lookaside));
+					}
+				}
+				ExFreePoolWithTag(pPool->pCpus, IPC_POOL_TAG);
+				pPool->pCpus = NULL;
+				return ntStatus;
+			}
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCPoolDelete
+//
+// Deletes every lookaside list, which frees the blocks cached in them.
+//=====================================================================
+
+VOID IPCPoolDelete(PIPC_POOL pPool)
+{
+	ULONG uiCpu;
+	ULONG i;
+
+	if (!pPool->pCpus)
+	{
+		return;
+	}
+
+	for (uiCpu = 0; uiCpu < pPool->nCpus; uiCpu++)
+	{
+		for (i = 0; i < pPool->nClasses; i++)
+		{
+			ExDeleteLookasideListEx(&(pPool->pCpus[uiCpu].Classes[i].Lookaside));
+		}
+	}
+
+	ExFreePoolWithTag(pPool->pCpus, IPC_POOL_TAG);
+	pPool->pCpus = NULL;
+}
+
+
+//=====================================================================
+// IPCPoolAllocate / IPCPoolFree
+//
+// The size class is derived from the requested size on both calls, so
+// blocks carry no header. A block freed on another processor simply
+// joins that processor's list.
+//=====================================================================
+
+PVOID IPCPoolAllocate(PIPC_POOL pPool, SIZE_T cbSize)
+{
+	PIPC_POOL_CPU pCpu;
+	ULONG uiClass = IPCPoolFindClass(pPool, cbSize);
+
+	if (uiClass == pPool->nClasses)
+	{
+		InterlockedIncrement64(&(pPool->nLargeAllocs));
+		return ExAllocatePoolWithTag(NonPagedPool, cbSize, IPC_POOL_TAG);
+	}
+
+	pCpu = IPCPoolCurrentCpu(pPool);
+	InterlockedIncrement64(&(pCpu->nAllocs));
+
+	return ExAllocateFromLookasideListEx(&(pCpu->Classes[uiClass].Lookaside));
+}
+
+VOID IPCPoolFree(PIPC_POOL pPool, PVOID pBlock, SIZE_T cbSize)
+{
+	ULONG uiClass = IPCPoolFindClass(pPool, cbSize);
+
+	if (uiClass == pPool->nClasses)
+	{
+		ExFreePoolWithTag(pBlock, IPC_POOL_TAG);
+		return;
+	}
+
+	ExFreeToLookasideListEx(&(IPCPoolCurrentCpu(pPool)->Classes[uiClass].Lookaside), pBlock);
+}
+
+
+//=====================================================================
+// IPCPoolQueryStats
+//
+// Sums the per processor counters. The counters are read without any
+// lock so the result is a snapshot.
+//=====================================================================
+
+VOID IPCPoolQueryStats(PIPC_POOL pPool, PIPC_POOL_STATS pStats)
+{
+	ULONG uiCpu;
+
+	pStats->nAllocs = 0;
+	pStats->nMisses = 0;
+
+	for (uiCpu = 0; uiCpu < pPool->nCpus; uiCpu++)
+	{
+		pStats->nAllocs += pPool->pCpus[uiCpu].nAllocs;
+		pStats->nMisses += pPool->pCpus[uiCpu].nMisses;
+	}
+
+	pStats->nHits = pStats->nAllocs - pStats->nMisses;
+	pStats->nLargeAllocs = pPool->nLargeAllocs;
+}
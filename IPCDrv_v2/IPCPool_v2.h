@@ -0,0 +1,81 @@
+//=====================================================================
+// IPC- Inter Process Communication Packet Pool Header File
+//
+// This file contains the structure definitions and Function declarations
+// of the size class pool used for IPC Packets.
+// Each size class is a lookaside list and every processor has its own set
+// of lookaside lists, so the hot path neither calls the pool allocator nor
+// shares a cache line with other processors.
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+#pragma once
+
+//Include Files
+
+#include "IPCShim_v2.h"
+
+//Constants
+
+#define IPC_POOL_MAX_CLASSES 12			//Maximum number of size classes in a pool
+
+//Structure definitions
+
+struct _IPC_POOL_CPU;
+
+//The IPC_POOL_CLASS structure is the lookaside list of one size class on one processor
+
+typedef struct _IPC_POOL_CLASS
+{
+	LOOKASIDE_LIST_EX Lookaside;		//Lookaside list of free blocks of this class
+	struct _IPC_POOL_CPU* pCpu;			//Processor the list belongs to, used to count misses
+}IPC_POOL_CLASS, *PIPC_POOL_CLASS;
+
+//The IPC_POOL_CPU structure holds the lookaside lists and counters of one processor
+
+typedef struct _IPC_POOL_CPU
+{
+	volatile LONG64 nAllocs;						//Blocks handed out from a size class
+	volatile LONG64 nMisses;						//Allocations the lookaside lists could not satisfy
+	IPC_POOL_CLASS Classes[IPC_POOL_MAX_CLASSES];	//One lookaside list per size class
+}IPC_POOL_CPU, *PIPC_POOL_CPU;
+
+//The IPC_POOL structure is a set of size classes with per processor lookaside lists.
+//Requests larger than the largest class go straight to the pool allocator
+
+typedef struct _IPC_POOL
+{
+	ULONG nClasses;								//Number of size classes in use
+	SIZE_T ClassSizes[IPC_POOL_MAX_CLASSES];	//Block size of each class, ascending
+	ULONG nCpus;								//Number of entries in pCpus
+	PIPC_POOL_CPU pCpus;						//Per processor lookaside lists
+	volatile LONG64 nLargeAllocs;				//Allocations above the largest size class
+}IPC_POOL, *PIPC_POOL;
+
+//The IPC_POOL_STATS structure returns the counters of a pool summed over all processors
+
+typedef struct _IPC_POOL_STATS
+{
+	LONG64 nAllocs;			//Allocations served by a size class
+	LONG64 nHits;			//Allocations served from a lookaside list
+	LONG64 nMisses;			//Allocations that fell through to the pool allocator
+	LONG64 nLargeAllocs;	//Allocations above the largest size class
+}IPC_POOL_STATS, *PIPC_POOL_STATS;
+
+//Function Prototypes
+
+//Creates the per processor lookaside lists for nClasses ascending block sizes
+NTSTATUS IPCPoolInit(PIPC_POOL pPool, const SIZE_T* pClassSizes, ULONG nClasses);
+
+//Deletes the lookaside lists of a pool, every block must have been freed
+VOID IPCPoolDelete(PIPC_POOL pPool);
+
+//Allocates a block of at least cbSize bytes
+PVOID IPCPoolAllocate(PIPC_POOL pPool, SIZE_T cbSize);
+
+//Frees a block, cbSize must be the size passed to IPCPoolAllocate
+VOID IPCPoolFree(PIPC_POOL pPool, PVOID pBlock, SIZE_T cbSize);
+
+//Sums the hit/miss counters of all processors
+VOID IPCPoolQueryStats(PIPC_POOL pPool, PIPC_POOL_STATS pStats);
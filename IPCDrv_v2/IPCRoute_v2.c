@@ -0,0 +1,3119 @@
+//=====================================================================
+// IPC- Inter Process Communication Routing Core
+//
+// This file maintains the hash indexed registry of User mode ports and
+// moves packets from a sender into the incoming queue of the destination
+// port. Destination ports are found in O(1) by hashing the destination PID,
+// the sender's own port is reached directly through the File object.
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+//Include Files
+
+#include "IPCRoute_v2.h"
+
+//Block sizes of the packet pool size classes. A packet is allocated from the smallest
+//class that holds its header and payload, larger packets come straight from the pool
+
+static const SIZE_T g_IPCPacketClassSizes[IPC_PACKET_SIZE_CLASSES] =
+{
+	128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536
+};
+
+
+//=====================================================================
+// IPCPortHashPid
+//
+// Returns the port table bucket index for a PID. Windows PIDs are
+// multiples of 4 so the low bits are dropped before mixing.
+//=====================================================================
+
+static ULONG IPCPortHashPid(HANDLE dwPID)
+{
+	ULONG uiHash = (ULONG)((ULONG_PTR)dwPID >> 2);
+
+	uiHash ^= uiHash >> 16;
+	uiHash *= 0x45d9f3b;
+	uiHash ^= uiHash >> 16;
+
+	return uiHash & (IPC_PORT_HASH_BUCKETS - 1);
+}
+
+
+//=====================================================================
+// IPCCallHash
+//
+// Returns the call registry bucket of a call ID. Call IDs are handed out
+// in sequence so the low bits spread them evenly.
+//=====================================================================
+
+static PIPC_CALL_BUCKET IPCCallHash(PIPC_PORT_TABLE pTable, UINT32 uiCallId)
+{
+	return &(pTable->Calls[uiCallId & (IPC_CALL_BUCKETS - 1)]);
+}
+
+
+//=====================================================================
+// IPCPortTableInit
+//
+// Initializes the list heads and spin locks of every bucket, allocates
+// the table's per processor counters and creates the packet pool.
+//=====================================================================
+
+NTSTATUS IPCPortTableInit(PIPC_PORT_TABLE pTable)
+{
+	LARGE_INTEGER Frequency;
+	NTSTATUS ntStatus;
+	ULONG i;
+
+	for (i = 0; i < IPC_PORT_HASH_BUCKETS; i++)
+	{
+		InitializeListHead(&(pTable->Buckets[i].Port_List));
+		KeInitializeSpinLock(&(pTable->Buckets[i].Port_List_SpinLock));
+	}
+
+	pTable->nPorts = 0;
+	pTable->RouteMode = IPC_ROUTE_TRANSFER;
+	pTable->nPktCopies = 0;
+	pTable->nPktBytesCopied = 0;
+	RtlZeroMemory(&(pTable->ReaderOps), sizeof(IPC_READER_OPS));
+	InitializeListHead(&(pTable->Group_List));
+	KeInitializeSpinLock(&(pTable->Group_List_SpinLock));
+	RtlZeroMemory(&(pTable->DefaultLimit), sizeof(IPC_QUEUE_LIMIT));
+
+	for (i = 0; i < IPC_ENDPOINT_SLOTS; i++)
+	{
+		pTable->Endpoints[i].pPort = NULL;
+		pTable->Endpoints[i].uiGeneration = 0;
+		KeInitializeSpinLock(&(pTable->Endpoints[i].Slot_SpinLock));
+	}
+	KeInitializeSpinLock(&(pTable->Endpoint_SpinLock));
+
+	for (i = 0; i < IPC_CALL_BUCKETS; i++)
+	{
+		InitializeListHead(&(pTable->Calls[i].Call_List));
+		KeInitializeSpinLock(&(pTable->Calls[i].Call_List_SpinLock));
+	}
+	pTable->lLastCallId = 0;
+	pTable->pfnCompleteCall = NULL;
+
+	//Every port and the table get one counter block per processor
+
+	pTable->nStatsCpus = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	if (pTable->nStatsCpus == 0)
+	{
+		pTable->nStatsCpus = 1;
+	}
+	pTable->nFreedDropped = 0;
+	pTable->nFreedPeakDepth = 0;
+
+	pTable->nTracePorts = 0;
+	KeQueryPerformanceCounter(&Frequency);
+	pTable->llTraceFrequency = Frequency.QuadPart;
+
+	pTable->pStatsBlock = ExAllocatePoolWithTag(NonPagedPool, IPC_CACHE_LINE - 1 + pTable->nStatsCpus * sizeof(IPC_STATS_CPU), IPC_POOL_TAG);
+	if (!pTable->pStatsBlock)
+	{
+		DbgPrint("Failed to allocate Nonpaged pool for the statistics\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pTable->pStats = IPCStatsAlign(pTable->pStatsBlock);
+	RtlZeroMemory(pTable->pStats, pTable->nStatsCpus * sizeof(IPC_STATS_CPU));
+
+	ntStatus = IPCPoolInit(&(pTable->PktPool), g_IPCPacketClassSizes, IPC_PACKET_SIZE_CLASSES);
+	if (!NT_SUCCESS(ntStatus))
+	{
+		ExFreePoolWithTag(pTable->pStatsBlock, IPC_POOL_TAG);
+		pTable->pStatsBlock = NULL;
+	}
+
+	return ntStatus;
+}
+
+
+//=====================================================================
+// IPCPortTableDelete
+//
+// Deletes the packet pool and frees the table's counters. Called once
+// every port has been closed.
+//=====================================================================
+
+VOID IPCPortTableDelete(PIPC_PORT_TABLE pTable)
+{
+	IPCPoolDelete(&(pTable->PktPool));
+
+	if (pTable->pStatsBlock)
+	{
+		ExFreePoolWithTag(pTable->pStatsBlock, IPC_POOL_TAG);
+		pTable->pStatsBlock = NULL;
+	}
+}
+
+
+//=====================================================================
+// IPCPortCreate
+//
+// Allocates a port for the calling process and initializes its packet
+// queues. The port starts with the single reference owned by the File object.
+// The reader state and the per processor counters share the allocation,
+// the counters rounded up to the next cache line.
+//=====================================================================
+
+PIPC_PORT IPCPortCreate(PIPC_PORT_TABLE pTable, HANDLE dwPID, PFILE_OBJECT pFileObj)
+{
+	SIZE_T cbPort = sizeof(IPC_PORT) + pTable->ReaderOps.cbReaderContext;
+	PIPC_PORT pIPCPort;
+	ULONG uiLane;
+
+	//Allocate NPP for the user process IPC PORT Structure
+
+	pIPCPort = (PIPC_PORT)ExAllocatePoolWithTag(NonPagedPool, cbPort + IPC_CACHE_LINE - 1 + pTable->nStatsCpus * sizeof(IPC_STATS_CPU), IPC_POOL_TAG);
+	if (!pIPCPort)
+	{
+		DbgPrint("Failed to allocate Nonpaged pool for IPC Port\n");
+		return NULL;
+	}
+
+	pIPCPort->dwPID = dwPID;
+	pIPCPort->pKevent = NULL;
+	pIPCPort->pFileObj = pFileObj;
+	pIPCPort->lRefCount = 1;
+	pIPCPort->pTable = pTable;
+	pIPCPort->pReaderContext = pTable->ReaderOps.cbReaderContext ? (PVOID)(pIPCPort + 1) : NULL;
+	pIPCPort->pStats = IPCStatsAlign((PCHAR)pIPCPort + cbPort);
+	RtlZeroMemory(pIPCPort->pStats, pTable->nStatsCpus * sizeof(IPC_STATS_CPU));
+
+	//Initialize the List Heads and Spin Locks
+
+	InitializeListHead(&(pIPCPort->list_entry));
+	InitializeListHead(&(pIPCPort->Group_List));
+	for (uiLane = 0; uiLane < IPC_PRIORITY_LANES; uiLane++)
+	{
+		InitializeListHead(&(pIPCPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane]));
+		pIPCPort->Pkt_Queue.LaneWeights[uiLane] = 0;
+		pIPCPort->Pkt_Queue.LaneCredits[uiLane] = 0;
+	}
+	KeInitializeSpinLock(&(pIPCPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock));
+	pIPCPort->Pkt_Queue.bWeighted = FALSE;
+	pIPCPort->Pkt_Queue.nDepth = 0;
+	pIPCPort->Pkt_Queue.nPeakDepth = 0;
+
+	//Flow control starts with the table's default limit and the fail fast overflow policy
+
+	pIPCPort->Limit = pTable->DefaultLimit;
+	pIPCPort->nQueuedPkts = 0;
+	pIPCPort->cbQueuedBytes = 0;
+	pIPCPort->nDropped = 0;
+	pIPCPort->nCreditWaiters = 0;
+	pIPCPort->bClosed = FALSE;
+	KeInitializeEvent(&(pIPCPort->CreditEvent), NotificationEvent, FALSE);
+	pIPCPort->Overflow.uiPolicy = IPC_OVERFLOW_FAIL;
+	pIPCPort->Overflow.uiTimeoutMs = 0;
+	pIPCPort->dwEndpoint = 0;
+	RtlZeroMemory(pIPCPort->szEndpoint, IPC_ENDPOINT_NAME_MAX);
+	pIPCPort->lTrace = 0;
+	pIPCPort->pTrace = NULL;
+
+	//FsContext gives direct access to the port, FsContext2 to its packet queue
+
+	pFileObj->FsContext = pIPCPort;
+	pFileObj->FsContext2 = &(pIPCPort->Pkt_Queue);
+
+	return pIPCPort;
+}
+
+
+//=====================================================================
+// IPCPortTableInsert
+//
+// Links a port into the bucket for its PID. A reference is held on
+// behalf of the table until the port is removed.
+//=====================================================================
+
+VOID IPCPortTableInsert(PIPC_PORT_TABLE pTable, PIPC_PORT pPort)
+{
+	PIPC_PORT_BUCKET pBucket = &(pTable->Buckets[IPCPortHashPid(pPort->dwPID)]);
+	KIRQL Irql;
+
+	IPCPortReference(pPort);
+
+	KeAcquireSpinLock(&(pBucket->Port_List_SpinLock), &Irql);
+	InsertTailList(&(pBucket->Port_List), &(pPort->list_entry));
+	KeReleaseSpinLock(&(pBucket->Port_List_SpinLock), Irql);
+
+	InterlockedIncrement(&(pTable->nPorts));
+}
+
+
+//=====================================================================
+// IPCGroupRemoveMember
+//
+// Unlinks a member from its group and its port and frees it. The group
+// is deleted along with its last member. Called with the group lock held.
+//=====================================================================
+
+static VOID IPCGroupRemoveMember(PIPC_GROUP_MEMBER pMember)
+{
+	PIPC_GROUP pGroup = pMember->pGroup;
+
+	RemoveEntryList(&(pMember->group_entry));
+	RemoveEntryList(&(pMember->port_entry));
+	ExFreePoolWithTag(pMember, IPC_POOL_TAG);
+
+	if (--pGroup->nMembers == 0)
+	{
+		RemoveEntryList(&(pGroup->list_entry));
+		ExFreePoolWithTag(pGroup, IPC_POOL_TAG);
+	}
+}
+
+
+//=====================================================================
+// IPCCallAbortPort
+//
+// Removes from the registry the calls made by a port being removed and
+// the calls waiting for a reply from it, and completes them without a
+// reply. A call whose reply is already kept only waits for its caller,
+// it stays registered with pCallee cleared so nothing reads the port
+// after it is freed. The port is marked closed first, so IPCRouteCall
+// either sees that or has set pCallee by the time its bucket is searched
+// here.
+//=====================================================================
+
+static VOID IPCCallAbortPort(PIPC_PORT_TABLE pTable, PIPC_PORT pPort)
+{
+	PIPC_CALL_BUCKET pBucket;
+	PLIST_ENTRY pTemp_ListEntry;
+	PLIST_ENTRY pNext;
+	PIPC_CALL pCall;
+	LIST_ENTRY Abort_List;
+	KIRQL Irql;
+	ULONG i;
+
+	if (!pTable->pfnCompleteCall)
+	{
+		return;
+	}
+
+	InitializeListHead(&Abort_List);
+
+	for (i = 0; i < IPC_CALL_BUCKETS; i++)
+	{
+		pBucket = &(pTable->Calls[i]);
+
+		KeAcquireSpinLock(&(pBucket->Call_List_SpinLock), &Irql);
+		for (pTemp_ListEntry = pBucket->Call_List.Flink; pTemp_ListEntry != &(pBucket->Call_List); pTemp_ListEntry = pNext)
+		{
+			pNext = pTemp_ListEntry->Flink;
+			pCall = CONTAINING_RECORD(pTemp_ListEntry, IPC_CALL, list_entry);
+			if (pCall->pCaller == pPort || (pCall->pCallee == pPort && !pCall->pReply))
+			{
+				RemoveEntryList(pTemp_ListEntry);
+				InsertTailList(&Abort_List, pTemp_ListEntry);
+			}
+			else if (pCall->pCallee == pPort)
+			{
+				pCall->pCallee = NULL;
+			}
+		}
+		KeReleaseSpinLock(&(pBucket->Call_List_SpinLock), Irql);
+	}
+
+	while (!IsListEmpty(&Abort_List))
+	{
+		pTemp_ListEntry = RemoveHeadList(&Abort_List);
+		InitializeListHead(pTemp_ListEntry);
+		pCall = CONTAINING_RECORD(pTemp_ListEntry, IPC_CALL, list_entry);
+
+		if (pCall->pReply)
+		{
+			IPCPacketFree(pTable, pCall->pReply);
+			pCall->pReply = NULL;
+		}
+		pTable->pfnCompleteCall(pTable, pCall, NULL);
+	}
+}
+
+
+//=====================================================================
+// IPCPortTableRemove
+//
+// Unlinks a port from its bucket, its endpoint and every group it
+// joined, then drops the table's reference. Senders waiting for credits
+// of the port are woken up and give up.
+//=====================================================================
+
+VOID IPCPortTableRemove(PIPC_PORT_TABLE pTable, PIPC_PORT pPort)
+{
+	PIPC_PORT_BUCKET pBucket = &(pTable->Buckets[IPCPortHashPid(pPort->dwPID)]);
+	PIPC_ENDPOINT_SLOT pSlot;
+	KIRQL Irql;
+	KIRQL SlotIrql;
+
+	KeAcquireSpinLock(&(pBucket->Port_List_SpinLock), &Irql);
+	RemoveEntryList(&(pPort->list_entry));
+	InitializeListHead(&(pPort->list_entry));
+	KeReleaseSpinLock(&(pBucket->Port_List_SpinLock), Irql);
+
+	pPort->bClosed = TRUE;
+	KeSetEvent(&(pPort->CreditEvent), 0, FALSE);
+
+	//Nobody can reply to the port's calls or to the calls waiting on it any more
+
+	IPCCallAbortPort(pTable, pPort);
+
+	//Free the endpoint slot, bumping its generation so the handle goes stale. The port is
+	//already marked closed so it cannot register again
+
+	KeAcquireSpinLock(&(pTable->Endpoint_SpinLock), &Irql);
+	pSlot = pPort->dwEndpoint ? &(pTable->Endpoints[IPCEndpointSlot(pPort->dwEndpoint)]) : NULL;
+	if (pSlot)
+	{
+		KeAcquireSpinLock(&(pSlot->Slot_SpinLock), &SlotIrql);
+		pSlot->pPort = NULL;
+		pSlot->uiGeneration++;
+		KeReleaseSpinLock(&(pSlot->Slot_SpinLock), SlotIrql);
+		pPort->dwEndpoint = 0;
+	}
+	KeReleaseSpinLock(&(pTable->Endpoint_SpinLock), Irql);
+
+	if (pSlot)
+	{
+		IPCPortDereference(pPort);
+	}
+
+	KeAcquireSpinLock(&(pTable->Group_List_SpinLock), &Irql);
+	while (!IsListEmpty(&(pPort->Group_List)))
+	{
+		IPCGroupRemoveMember(CONTAINING_RECORD(pPort->Group_List.Flink, IPC_GROUP_MEMBER, port_entry));
+	}
+	KeReleaseSpinLock(&(pTable->Group_List_SpinLock), Irql);
+
+	InterlockedDecrement(&(pTable->nPorts));
+
+	IPCPortDereference(pPort);
+}
+
+
+//=====================================================================
+// IPCPortTableLookup
+//
+// Searches only the bucket the PID hashes to. The first port registered
+// for the PID wins, as with the original linear walk of the port queue.
+// An endpoint handle goes straight to its slot instead, and only finds
+// the port if the slot's generation still matches the handle.
+//=====================================================================
+
+PIPC_PORT IPCPortTableLookup(PIPC_PORT_TABLE pTable, HANDLE dwPID)
+{
+	PIPC_PORT_BUCKET pBucket = &(pTable->Buckets[IPCPortHashPid(dwPID)]);
+	PIPC_ENDPOINT_SLOT pSlot;
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_PORT pTemp_IPCPort;
+	PIPC_PORT pFoundPort = NULL;
+	KIRQL Irql;
+
+	if (IPCIsEndpointHandle(dwPID))
+	{
+		pSlot = &(pTable->Endpoints[IPCEndpointSlot(dwPID)]);
+
+		KeAcquireSpinLock(&(pSlot->Slot_SpinLock), &Irql);
+		if (pSlot->pPort && (pSlot->uiGeneration & 0xFFFF) == IPCEndpointGeneration(dwPID))
+		{
+			IPCPortReference(pSlot->pPort);
+			pFoundPort = pSlot->pPort;
+		}
+		KeReleaseSpinLock(&(pSlot->Slot_SpinLock), Irql);
+
+		return pFoundPort;
+	}
+
+	KeAcquireSpinLock(&(pBucket->Port_List_SpinLock), &Irql);
+
+	for (pTemp_ListEntry = pBucket->Port_List.Flink; pTemp_ListEntry != &(pBucket->Port_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+	{
+		pTemp_IPCPort = CONTAINING_RECORD(pTemp_ListEntry, IPC_PORT, list_entry);
+		if (pTemp_IPCPort->dwPID == dwPID)
+		{
+			IPCPortReference(pTemp_IPCPort);
+			pFoundPort = pTemp_IPCPort;
+			break;
+		}
+	}
+
+	KeReleaseSpinLock(&(pBucket->Port_List_SpinLock), Irql);
+
+	return pFoundPort;
+}
+
+
+//=====================================================================
+// IPCStatsCurrentCpu
+//
+// Returns the counter block of the calling processor. The caller may be
+// moved to another processor afterwards, which is harmless since the
+// counters are only changed with interlocked additions.
+//=====================================================================
+
+static PIPC_STATS_CPU IPCStatsCurrentCpu(PIPC_PORT_TABLE pTable, PIPC_STATS_CPU pStats)
+{
+	ULONG uiCpu = KeGetCurrentProcessorNumberEx(NULL);
+
+	return &(pStats[uiCpu % pTable->nStatsCpus]);
+}
+
+
+//=====================================================================
+// IPCStatsSum
+//
+// Adds the counters of every processor block to pSums. The counters
+// are read without any lock so the result is a snapshot.
+//=====================================================================
+
+static VOID IPCStatsSum(PIPC_PORT_TABLE pTable, PIPC_STATS_CPU pStats, LONG64* pSums)
+{
+	ULONG uiCpu;
+	ULONG uiStat;
+
+	for (uiCpu = 0; uiCpu < pTable->nStatsCpus; uiCpu++)
+	{
+		for (uiStat = 0; uiStat < IPC_STAT_COUNTERS; uiStat++)
+		{
+			pSums[uiStat] += pStats[uiCpu].Counters[uiStat];
+		}
+	}
+}
+
+
+//=====================================================================
+// IPCPortCountStat / IPCPortCountTraffic
+//
+// Count on the calling processor's cache line of the port. Traffic is
+// counted in packets and payload bytes, uiStat is IPC_STAT_PKTS_IN or
+// IPC_STAT_PKTS_OUT and the byte counter follows it.
+//=====================================================================
+
+VOID IPCPortCountStat(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, ULONG uiStat, LONG64 nValue)
+{
+	PIPC_STATS_CPU pCpu = IPCStatsCurrentCpu(pTable, pPort ? pPort->pStats : pTable->pStats);
+
+	InterlockedExchangeAdd64(&(pCpu->Counters[uiStat]), nValue);
+}
+
+static VOID IPCPortCountTraffic(PIPC_PORT pPort, ULONG uiStat, LONG64 nPkts, LONG64 cbPayload)
+{
+	PIPC_STATS_CPU pCpu = IPCStatsCurrentCpu(pPort->pTable, pPort->pStats);
+
+	InterlockedExchangeAdd64(&(pCpu->Counters[uiStat]), nPkts);
+	InterlockedExchangeAdd64(&(pCpu->Counters[uiStat + 1]), cbPayload);
+}
+
+
+//=====================================================================
+// IPCPortCountSource
+//
+// Counts a failure against the port registered for the source PID of a
+// packet, or against the table if there is none. Only called when a
+// packet is given up, so the extra lookup stays off the hot path.
+//=====================================================================
+
+static VOID IPCPortCountSource(PIPC_PORT_TABLE pTable, const IPC_PACKET* pIPC_Pkt, ULONG uiStat)
+{
+	PIPC_PORT pSourcePort = IPCPortTableLookup(pTable, (HANDLE)(ULONG_PTR)pIPC_Pkt->header.dwSourcePid);
+
+	IPCPortCountStat(pTable, pSourcePort, uiStat, 1);
+
+	if (pSourcePort)
+	{
+		IPCPortDereference(pSourcePort);
+	}
+}
+
+
+//=====================================================================
+// IPCPortAddDepth
+//
+// Adds packets moved into the incoming lanes to the lane depth and
+// records a new peak. Called with the incoming queue lock held, so the
+// depth needs no interlocked operation.
+//=====================================================================
+
+static VOID IPCPortAddDepth(PIPC_PORT pPort, ULONG nPkts)
+{
+	pPort->Pkt_Queue.nDepth += nPkts;
+	if (pPort->Pkt_Queue.nDepth > pPort->Pkt_Queue.nPeakDepth)
+	{
+		pPort->Pkt_Queue.nPeakDepth = pPort->Pkt_Queue.nDepth;
+	}
+}
+
+
+//=====================================================================
+// IPCPortFoldStats
+//
+// Adds the counters of a port being freed to the table's counters, so
+// the totals still include the traffic of closed ports.
+//=====================================================================
+
+static VOID IPCPortFoldStats(PIPC_PORT_TABLE pTable, PIPC_PORT pPort)
+{
+	LONG64 Sums[IPC_STAT_COUNTERS];
+	ULONG uiStat;
+	LONG lPeak;
+
+	RtlZeroMemory(Sums, sizeof(Sums));
+	IPCStatsSum(pTable, pPort->pStats, Sums);
+
+	for (uiStat = 0; uiStat < IPC_STAT_COUNTERS; uiStat++)
+	{
+		if (Sums[uiStat])
+		{
+			IPCPortCountStat(pTable, NULL, uiStat, Sums[uiStat]);
+		}
+	}
+
+	InterlockedExchangeAdd64(&(pTable->nFreedDropped), pPort->nDropped);
+
+	do
+	{
+		lPeak = pTable->nFreedPeakDepth;
+	} while ((ULONG)lPeak < pPort->Pkt_Queue.nPeakDepth &&
+		InterlockedCompareExchange(&(pTable->nFreedPeakDepth), (LONG)pPort->Pkt_Queue.nPeakDepth, lPeak) != lPeak);
+}
+
+
+//=====================================================================
+// IPCPortFillStats
+//
+// Fills the statistics entry of a port and adds its counters to the
+// totals. The depth is what has come in and not gone out or been
+// dropped. Called with the port's bucket lock held, the endpoint lock is
+// taken inside it.
+//=====================================================================
+
+static VOID IPCPortFillStats(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, PIPC_PORT_STATS pPortStats, PIPC_PORT_STATS pTotals)
+{
+	LONG64 Sums[IPC_STAT_COUNTERS];
+	LONG64 nDepth;
+	KIRQL Irql;
+
+	RtlZeroMemory(Sums, sizeof(Sums));
+	IPCStatsSum(pTable, pPort->pStats, Sums);
+
+	nDepth = Sums[IPC_STAT_PKTS_IN] - Sums[IPC_STAT_PKTS_OUT] - pPort->nDropped;
+	if (nDepth < 0)
+	{
+		nDepth = 0;	//Counters read while packets moved
+	}
+
+	pTotals->nDepth += (UINT32)nDepth;
+	if (pPort->Pkt_Queue.nPeakDepth > pTotals->nPeakDepth)
+	{
+		pTotals->nPeakDepth = pPort->Pkt_Queue.nPeakDepth;
+	}
+	pTotals->nPktsIn += Sums[IPC_STAT_PKTS_IN];
+	pTotals->cbBytesIn += Sums[IPC_STAT_BYTES_IN];
+	pTotals->nPktsOut += Sums[IPC_STAT_PKTS_OUT];
+	pTotals->cbBytesOut += Sums[IPC_STAT_BYTES_OUT];
+	pTotals->nUndeliverable += Sums[IPC_STAT_UNDELIVERABLE];
+	pTotals->nAllocFailures += Sums[IPC_STAT_ALLOC_FAILURES];
+	pTotals->nTooSmall += Sums[IPC_STAT_TOO_SMALL];
+	pTotals->nDropped += pPort->nDropped;
+
+	if (!pPortStats)
+	{
+		return;
+	}
+
+	RtlZeroMemory(pPortStats, sizeof(IPC_PORT_STATS));
+	pPortStats->dwPID = (DWORD32)(ULONG_PTR)pPort->dwPID;
+	pPortStats->nDepth = (UINT32)nDepth;
+	pPortStats->nPeakDepth = pPort->Pkt_Queue.nPeakDepth;
+	pPortStats->nPktsIn = Sums[IPC_STAT_PKTS_IN];
+	pPortStats->cbBytesIn = Sums[IPC_STAT_BYTES_IN];
+	pPortStats->nPktsOut = Sums[IPC_STAT_PKTS_OUT];
+	pPortStats->cbBytesOut = Sums[IPC_STAT_BYTES_OUT];
+	pPortStats->nUndeliverable = Sums[IPC_STAT_UNDELIVERABLE];
+	pPortStats->nAllocFailures = Sums[IPC_STAT_ALLOC_FAILURES];
+	pPortStats->nTooSmall = Sums[IPC_STAT_TOO_SMALL];
+	pPortStats->nDropped = pPort->nDropped;
+
+	if (pPort->dwEndpoint)
+	{
+		KeAcquireSpinLock(&(pTable->Endpoint_SpinLock), &Irql);
+		RtlCopyMemory(pPortStats->szEndpoint, pPort->szEndpoint, IPC_ENDPOINT_NAME_MAX);
+		KeReleaseSpinLock(&(pTable->Endpoint_SpinLock), Irql);
+	}
+}
+
+
+//=====================================================================
+// IPCPortTableQueryStats
+//
+// Walks every bucket of the port table under its lock. Every registered
+// port is added to the totals, the first nMaxPorts also get an entry.
+// The totals start from the table's own counters, which hold the counts
+// charged to no port and those of the ports freed so far.
+//=====================================================================
+
+VOID IPCPortTableQueryStats(PIPC_PORT_TABLE pTable, PIPC_STATS pStats, ULONG nMaxPorts)
+{
+	PIPC_PORT_STATS pTotals = &(pStats->Totals);
+	LONG64 Sums[IPC_STAT_COUNTERS];
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_PORT_BUCKET pBucket;
+	KIRQL Irql;
+	ULONG i;
+
+	RtlZeroMemory(Sums, sizeof(Sums));
+	IPCStatsSum(pTable, pTable->pStats, Sums);
+
+	RtlZeroMemory(pTotals, sizeof(IPC_PORT_STATS));
+	pTotals->nPeakDepth = (UINT32)pTable->nFreedPeakDepth;
+	pTotals->nPktsIn = Sums[IPC_STAT_PKTS_IN];
+	pTotals->cbBytesIn = Sums[IPC_STAT_BYTES_IN];
+	pTotals->nPktsOut = Sums[IPC_STAT_PKTS_OUT];
+	pTotals->cbBytesOut = Sums[IPC_STAT_BYTES_OUT];
+	pTotals->nUndeliverable = Sums[IPC_STAT_UNDELIVERABLE];
+	pTotals->nAllocFailures = Sums[IPC_STAT_ALLOC_FAILURES];
+	pTotals->nTooSmall = Sums[IPC_STAT_TOO_SMALL];
+	pTotals->nDropped = pTable->nFreedDropped;
+
+	pStats->nPorts = 0;
+	pStats->nReturned = 0;
+	pStats->nRouterThreads = 0;
+	pStats->uiReserved = 0;
+	RtlZeroMemory(pStats->Router, sizeof(pStats->Router));
+
+	for (i = 0; i < IPC_PORT_HASH_BUCKETS; i++)
+	{
+		pBucket = &(pTable->Buckets[i]);
+
+		KeAcquireSpinLock(&(pBucket->Port_List_SpinLock), &Irql);
+		for (pTemp_ListEntry = pBucket->Port_List.Flink; pTemp_ListEntry != &(pBucket->Port_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+		{
+			IPCPortFillStats(pTable, CONTAINING_RECORD(pTemp_ListEntry, IPC_PORT, list_entry),
+				pStats->nReturned < nMaxPorts ? &(pStats->Ports[pStats->nReturned]) : NULL, pTotals);
+			if (pStats->nReturned < nMaxPorts)
+			{
+				pStats->nReturned++;
+			}
+			pStats->nPorts++;
+		}
+		KeReleaseSpinLock(&(pBucket->Port_List_SpinLock), Irql);
+	}
+}
+
+
+//=====================================================================
+// IPCNameValid
+//
+// Returns TRUE if a group or endpoint name coming in a buffer of cbName
+// bytes is terminated within it. Longer names are rejected rather than
+// cut short, two of them could otherwise end up under the same name.
+//=====================================================================
+
+BOOLEAN IPCNameValid(const char* szName, size_t cbName)
+{
+	size_t i;
+
+	for (i = 0; i < cbName; i++)
+	{
+		if (!szName[i])
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+//=====================================================================
+// IPCCopyName
+//
+// Copies a group or endpoint name into a NUL padded buffer of cbName
+// bytes so names can be compared as a whole. The name has been checked
+// with IPCNameValid. Returns the length of the name.
+//=====================================================================
+
+static size_t IPCCopyName(char* pDst, const char* szName, size_t cbName)
+{
+	size_t i;
+
+	RtlZeroMemory(pDst, cbName);
+	for (i = 0; i < cbName - 1 && szName[i]; i++)
+	{
+		pDst[i] = szName[i];
+	}
+
+	return i;
+}
+
+
+//=====================================================================
+// IPCEndpointFind
+//
+// Returns the port registered under the given NUL padded endpoint name,
+// or NULL. Called with the endpoint lock held, which keeps every slot's
+// port registered while the slots are walked.
+//=====================================================================
+
+static PIPC_PORT IPCEndpointFind(PIPC_PORT_TABLE pTable, const char* pName)
+{
+	ULONG i;
+
+	for (i = 0; i < IPC_ENDPOINT_SLOTS; i++)
+	{
+		if (pTable->Endpoints[i].pPort && RtlEqualMemory(pTable->Endpoints[i].pPort->szEndpoint, pName, IPC_ENDPOINT_NAME_MAX))
+		{
+			return pTable->Endpoints[i].pPort;
+		}
+	}
+
+	return NULL;
+}
+
+
+//=====================================================================
+// IPCPortRegisterEndpoint
+//
+// Binds a port to a free endpoint slot under a unique name. Registering
+// the name the port already has returns its handle again. The slot holds
+// a reference on the port until IPCPortTableRemove frees it.
+//=====================================================================
+
+NTSTATUS IPCPortRegisterEndpoint(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, const char* szName, PULONG pdwEndpoint)
+{
+	char Name[IPC_ENDPOINT_NAME_MAX];
+	PIPC_ENDPOINT_SLOT pSlot = NULL;
+	PIPC_PORT pOwner;
+	NTSTATUS ntStatus = STATUS_SUCCESS;
+	ULONG i;
+	KIRQL Irql;
+	KIRQL SlotIrql;
+
+	if (IPCCopyName(Name, szName, IPC_ENDPOINT_NAME_MAX) == 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	KeAcquireSpinLock(&(pTable->Endpoint_SpinLock), &Irql);
+
+	pOwner = IPCEndpointFind(pTable, Name);
+	if (pOwner)
+	{
+		ntStatus = pOwner == pPort ? STATUS_SUCCESS : STATUS_OBJECT_NAME_COLLISION;
+	}
+	else if (pPort->dwEndpoint || pPort->bClosed)
+	{
+		ntStatus = STATUS_INVALID_PARAMETER;	//A port has a single name, and a closed port none
+	}
+	else
+	{
+		for (i = 0; i < IPC_ENDPOINT_SLOTS; i++)
+		{
+			if (!pTable->Endpoints[i].pPort)
+			{
+				pSlot = &(pTable->Endpoints[i]);
+				break;
+			}
+		}
+
+		if (!pSlot)
+		{
+			DbgPrint("No free endpoint slot\n");
+			ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		else
+		{
+			RtlCopyMemory(pPort->szEndpoint, Name, IPC_ENDPOINT_NAME_MAX);
+			pPort->dwEndpoint = IPCEndpointHandle(i, pSlot->uiGeneration);
+			IPCPortReference(pPort);
+
+			KeAcquireSpinLock(&(pSlot->Slot_SpinLock), &SlotIrql);
+			pSlot->pPort = pPort;
+			KeReleaseSpinLock(&(pSlot->Slot_SpinLock), SlotIrql);
+		}
+	}
+
+	*pdwEndpoint = pPort->dwEndpoint;
+
+	KeReleaseSpinLock(&(pTable->Endpoint_SpinLock), Irql);
+
+	return ntStatus;
+}
+
+
+//=====================================================================
+// IPCPortResolveEndpoint
+//
+// Returns the handle of a named endpoint. Senders resolve a name once
+// and pass the handle as destination PID, so routing does not compare
+// names. The handle is only valid while the endpoint stays registered.
+//=====================================================================
+
+NTSTATUS IPCPortResolveEndpoint(PIPC_PORT_TABLE pTable, const char* szName, PULONG pdwEndpoint)
+{
+	char Name[IPC_ENDPOINT_NAME_MAX];
+	PIPC_PORT pOwner;
+	KIRQL Irql;
+
+	IPCCopyName(Name, szName, IPC_ENDPOINT_NAME_MAX);
+
+	KeAcquireSpinLock(&(pTable->Endpoint_SpinLock), &Irql);
+	pOwner = IPCEndpointFind(pTable, Name);
+	*pdwEndpoint = pOwner ? pOwner->dwEndpoint : 0;
+	KeReleaseSpinLock(&(pTable->Endpoint_SpinLock), Irql);
+
+	return pOwner ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+
+//=====================================================================
+// IPCGroupFind
+//
+// Returns the group with the given NUL padded name, or NULL. Called with
+// the group lock held. Groups are few, a list is enough.
+//=====================================================================
+
+static PIPC_GROUP IPCGroupFind(PIPC_PORT_TABLE pTable, const char* pName)
+{
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_GROUP pGroup;
+
+	for (pTemp_ListEntry = pTable->Group_List.Flink; pTemp_ListEntry != &(pTable->Group_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+	{
+		pGroup = CONTAINING_RECORD(pTemp_ListEntry, IPC_GROUP, list_entry);
+		if (RtlEqualMemory(pGroup->szName, pName, IPC_GROUP_NAME_MAX))
+		{
+			return pGroup;
+		}
+	}
+
+	return NULL;
+}
+
+
+//=====================================================================
+// IPCPortJoinGroup
+//
+// Adds a port to a group. The member, and the group in case it does not
+// exist yet, are allocated before the group lock is taken and freed again
+// if they turn out not to be needed.
+//=====================================================================
+
+NTSTATUS IPCPortJoinGroup(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, const char* szName)
+{
+	char Name[IPC_GROUP_NAME_MAX];
+	PIPC_GROUP pGroup;
+	PIPC_GROUP pNewGroup;
+	PIPC_GROUP_MEMBER pMember;
+	PLIST_ENTRY pTemp_ListEntry;
+	KIRQL Irql;
+
+	if (IPCCopyName(Name, szName, IPC_GROUP_NAME_MAX) == 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pMember = ExAllocatePoolWithTag(NonPagedPool, sizeof(IPC_GROUP_MEMBER), IPC_POOL_TAG);
+	pNewGroup = ExAllocatePoolWithTag(NonPagedPool, sizeof(IPC_GROUP), IPC_POOL_TAG);
+	if (!pMember || !pNewGroup)
+	{
+		DbgPrint("Failed to allocate Nonpaged pool for the group member\n");
+		if (pMember)
+		{
+			ExFreePoolWithTag(pMember, IPC_POOL_TAG);
+		}
+		if (pNewGroup)
+		{
+			ExFreePoolWithTag(pNewGroup, IPC_POOL_TAG);
+		}
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	KeAcquireSpinLock(&(pTable->Group_List_SpinLock), &Irql);
+
+	//Nothing to do if the port is already a member
+
+	for (pTemp_ListEntry = pPort->Group_List.Flink; pTemp_ListEntry != &(pPort->Group_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+	{
+		if (RtlEqualMemory(CONTAINING_RECORD(pTemp_ListEntry, IPC_GROUP_MEMBER, port_entry)->pGroup->szName, Name, IPC_GROUP_NAME_MAX))
+		{
+			KeReleaseSpinLock(&(pTable->Group_List_SpinLock), Irql);
+			ExFreePoolWithTag(pMember, IPC_POOL_TAG);
+			ExFreePoolWithTag(pNewGroup, IPC_POOL_TAG);
+			return STATUS_SUCCESS;
+		}
+	}
+
+	pGroup = IPCGroupFind(pTable, Name);
+	if (!pGroup)
+	{
+		pGroup = pNewGroup;
+		pNewGroup = NULL;
+		RtlCopyMemory(pGroup->szName, Name, IPC_GROUP_NAME_MAX);
+		InitializeListHead(&(pGroup->Member_List));
+		pGroup->nMembers = 0;
+		InsertTailList(&(pTable->Group_List), &(pGroup->list_entry));
+	}
+
+	pMember->pPort = pPort;
+	pMember->pGroup = pGroup;
+	InsertTailList(&(pGroup->Member_List), &(pMember->group_entry));
+	InsertTailList(&(pPort->Group_List), &(pMember->port_entry));
+	pGroup->nMembers++;
+
+	KeReleaseSpinLock(&(pTable->Group_List_SpinLock), Irql);
+
+	if (pNewGroup)
+	{
+		ExFreePoolWithTag(pNewGroup, IPC_POOL_TAG);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCPortLeaveGroup
+//
+// Removes a port from a group it joined. Returns STATUS_NOT_FOUND if the
+// port is not a member of the group.
+//=====================================================================
+
+NTSTATUS IPCPortLeaveGroup(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, const char* szName)
+{
+	char Name[IPC_GROUP_NAME_MAX];
+	PIPC_GROUP_MEMBER pMember;
+	PLIST_ENTRY pTemp_ListEntry;
+	NTSTATUS ntStatus = STATUS_NOT_FOUND;
+	KIRQL Irql;
+
+	IPCCopyName(Name, szName, IPC_GROUP_NAME_MAX);
+
+	KeAcquireSpinLock(&(pTable->Group_List_SpinLock), &Irql);
+
+	for (pTemp_ListEntry = pPort->Group_List.Flink; pTemp_ListEntry != &(pPort->Group_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+	{
+		pMember = CONTAINING_RECORD(pTemp_ListEntry, IPC_GROUP_MEMBER, port_entry);
+		if (RtlEqualMemory(pMember->pGroup->szName, Name, IPC_GROUP_NAME_MAX))
+		{
+			IPCGroupRemoveMember(pMember);
+			ntStatus = STATUS_SUCCESS;
+			break;
+		}
+	}
+
+	KeReleaseSpinLock(&(pTable->Group_List_SpinLock), Irql);
+
+	return ntStatus;
+}
+
+
+//=====================================================================
+// IPCPortReference / IPCPortDereference
+//
+// Ports are reference counted so that a packet being routed to a port
+// cannot race with the port's File object being closed. The last
+// dereference frees every packet still queued on the port and adds the
+// port's counters to the table's.
+//=====================================================================
+
+VOID IPCPortReference(PIPC_PORT pPort)
+{
+	InterlockedIncrement(&(pPort->lRefCount));
+}
+
+VOID IPCPortDereference(PIPC_PORT pPort)
+{
+	PLIST_ENTRY pTemp_ListEntry;
+	ULONG uiLane;
+
+	if (InterlockedDecrement(&(pPort->lRefCount)) != 0)
+	{
+		return;
+	}
+
+	for (uiLane = 0; uiLane < IPC_PRIORITY_LANES; uiLane++)
+	{
+		while (!IsListEmpty(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane])))
+		{
+			pTemp_ListEntry = RemoveHeadList(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane]));
+			IPCPacketFree(pPort->pTable, CONTAINING_RECORD(pTemp_ListEntry, IPC_PACKET, list_entry));
+		}
+	}
+
+	if (pPort->pKevent)
+	{
+		IPC_RELEASE_EVENT(pPort->pKevent);
+	}
+
+	IPCPortFoldStats(pPort->pTable, pPort);
+
+	if (pPort->lTrace)
+	{
+		InterlockedDecrement(&(pPort->pTable->nTracePorts));
+	}
+	if (pPort->pTrace)
+	{
+		ExFreePoolWithTag(pPort->pTrace, IPC_POOL_TAG);
+	}
+
+	ExFreePoolWithTag(pPort, IPC_POOL_TAG);
+}
+
+
+//=====================================================================
+// IPCPortReturnCredit / IPCPortReserveCredit
+//
+// Credits are what is left of a port's limit. A packet takes one packet
+// and its size in bytes with interlocked additions, and gives them back
+// if that puts the port over its limit. A packet is always admitted to a
+// port with nothing else charged, so a packet larger than the byte limit
+// still gets through one at a time. Waiting senders are only signalled
+// once the port has drained to half of its limit, so a blocked sender and
+// the receiver do not take turns one packet at a time.
+//=====================================================================
+
+static VOID IPCPortReturnCredit(PIPC_PORT pPort, LONG64 cbPacket)
+{
+	LONG64 cbBytes = InterlockedExchangeAdd64(&(pPort->cbQueuedBytes), -cbPacket) - cbPacket;
+	LONG nPkts = InterlockedDecrement(&(pPort->nQueuedPkts));
+
+	if (pPort->nCreditWaiters &&
+		(!pPort->Limit.nMaxPkts || (ULONG)nPkts <= pPort->Limit.nMaxPkts / 2) &&
+		(!pPort->Limit.cbMaxBytes || (UINT64)cbBytes <= pPort->Limit.cbMaxBytes / 2))
+	{
+		KeSetEvent(&(pPort->CreditEvent), 0, FALSE);
+	}
+}
+
+static BOOLEAN IPCPortReserveCredit(PIPC_PORT pPort, LONG64 cbPacket)
+{
+	LONG nPkts = InterlockedIncrement(&(pPort->nQueuedPkts));
+	LONG64 cbBytes = InterlockedExchangeAdd64(&(pPort->cbQueuedBytes), cbPacket) + cbPacket;
+
+	if (nPkts == 1 ||
+		((!pPort->Limit.nMaxPkts || (ULONG)nPkts <= pPort->Limit.nMaxPkts) &&
+		 (!pPort->Limit.cbMaxBytes || (UINT64)cbBytes <= pPort->Limit.cbMaxBytes)))
+	{
+		return TRUE;
+	}
+
+	IPCPortReturnCredit(pPort, cbPacket);
+
+	return FALSE;
+}
+
+
+//=====================================================================
+// IPCPortCharge
+//
+// Charges a packet to the credits of its destination port, so they are
+// returned when the packet is freed. Nothing is counted for a port with
+// no limit. A port over its limit is handled according to the sender's
+// overflow policy: IPC_OVERFLOW_DROP_OLDEST frees the oldest packets of
+// the port's lowest priority lanes until there is room, IPC_OVERFLOW_BLOCK waits on the port's credit
+// event for as long as credits keep coming back within the timeout. The
+// wait is alertable in the sender's context so a terminating sender is
+// not held up. If bCanWait is FALSE STATUS_CANT_WAIT is returned instead
+// of waiting, or of failing for want of a packet to drop, so the caller
+// can queue the packets it holds first and try again.
+//=====================================================================
+
+static NTSTATUS IPCPortCharge(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, PIPC_PACKET pIPC_Pkt, const IPC_OVERFLOW* pOverflow, BOOLEAN bCanWait)
+{
+	LONG64 cbPacket = sizeof(IPC_PACKET) + pIPC_Pkt->header.sizeofpayload;
+	PIPC_PACKET pOldest;
+	LARGE_INTEGER Timeout;
+	NTSTATUS ntStatus;
+
+	if (!pPort->Limit.nMaxPkts && !pPort->Limit.cbMaxBytes)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	while (!IPCPortReserveCredit(pPort, cbPacket))
+	{
+		if (pPort->bClosed)
+		{
+			return STATUS_NOT_FOUND;
+		}
+
+		switch (pOverflow ? pOverflow->uiPolicy : IPC_OVERFLOW_FAIL)
+		{
+		case IPC_OVERFLOW_DROP_OLDEST:
+
+			//The credits may all be held by packets still on their way to the queue
+
+			pOldest = IPCPortDequeueOldest(pPort);
+			if (!pOldest)
+			{
+				return bCanWait ? STATUS_QUOTA_EXCEEDED : STATUS_CANT_WAIT;
+			}
+			InterlockedIncrement64(&(pPort->nDropped));
+			IPCPacketFree(pTable, pOldest);
+			break;
+
+		case IPC_OVERFLOW_BLOCK:
+
+			if (!bCanWait)
+			{
+				return STATUS_CANT_WAIT;
+			}
+
+			//Announce the waiter before the last check, a credit returned after it signals the event
+
+			InterlockedIncrement(&(pPort->nCreditWaiters));
+			KeClearEvent(&(pPort->CreditEvent));
+			if (IPCPortReserveCredit(pPort, cbPacket))
+			{
+				InterlockedDecrement(&(pPort->nCreditWaiters));
+				IPCPacketBlock(pIPC_Pkt)->pCharged = pPort;
+				return STATUS_SUCCESS;
+			}
+
+			Timeout.QuadPart = -10000LL * pOverflow->uiTimeoutMs;
+			ntStatus = pPort->bClosed ? STATUS_SUCCESS : KeWaitForSingleObject(&(pPort->CreditEvent), Executive, UserMode, TRUE,
+				pOverflow->uiTimeoutMs == MAXULONG ? NULL : &Timeout);
+			InterlockedDecrement(&(pPort->nCreditWaiters));
+
+			if (ntStatus == STATUS_TIMEOUT)
+			{
+				return STATUS_IO_TIMEOUT;
+			}
+			if (ntStatus != STATUS_SUCCESS)
+			{
+				return STATUS_CANCELLED;	//Alerted or an APC is pending for the sender
+			}
+			break;
+
+		default:
+			return STATUS_QUOTA_EXCEEDED;
+		}
+	}
+
+	IPCPacketBlock(pIPC_Pkt)->pCharged = pPort;
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCPortSetLimit
+//
+// Sets the limit of a port's incoming queue. Waiting senders are woken
+// up to try again against the new limit.
+//=====================================================================
+
+VOID IPCPortSetLimit(PIPC_PORT pPort, const IPC_QUEUE_LIMIT* pLimit)
+{
+	pPort->Limit.nMaxPkts = pLimit->nMaxPkts;
+	pPort->Limit.cbMaxBytes = pLimit->cbMaxBytes;
+
+	if (pPort->nCreditWaiters)
+	{
+		KeSetEvent(&(pPort->CreditEvent), 0, FALSE);
+	}
+}
+
+
+//=====================================================================
+// IPCPortQueryCredits
+//
+// Returns what the port registered for a PID still accepts. The counters
+// are read without any lock, so the result is a snapshot.
+//=====================================================================
+
+NTSTATUS IPCPortQueryCredits(PIPC_PORT_TABLE pTable, HANDLE dwPID, PIPC_CREDITS pCredits)
+{
+	PIPC_PORT pPort = IPCPortTableLookup(pTable, dwPID);
+	LONG nQueuedPkts;
+	LONG64 cbQueuedBytes;
+
+	if (!pPort)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	nQueuedPkts = pPort->nQueuedPkts;
+	cbQueuedBytes = pPort->cbQueuedBytes;
+
+	pCredits->nQueuedPkts = (UINT32)nQueuedPkts;
+	pCredits->cbQueuedBytes = (UINT64)cbQueuedBytes;
+	pCredits->nDropped = (UINT64)pPort->nDropped;
+
+	if (!pPort->Limit.nMaxPkts)
+	{
+		pCredits->nPkts = MAXULONG;
+	}
+	else
+	{
+		pCredits->nPkts = (ULONG)nQueuedPkts < pPort->Limit.nMaxPkts ? pPort->Limit.nMaxPkts - (ULONG)nQueuedPkts : 0;
+	}
+
+	if (!pPort->Limit.cbMaxBytes)
+	{
+		pCredits->cbBytes = (UINT64)-1;
+	}
+	else
+	{
+		pCredits->cbBytes = (UINT64)cbQueuedBytes < pPort->Limit.cbMaxBytes ? pPort->Limit.cbMaxBytes - (UINT64)cbQueuedBytes : 0;
+	}
+
+	IPCPortDereference(pPort);
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCTraceStart / IPCTraceCopied / IPCTraceInherit
+//
+// Stamp a packet as it is created. Nothing is stamped while no port
+// traces, IPCTraceStart then returns 0 and the stamps are cleared. A
+// copy or a multicast descriptor keeps the stamps of the original.
+//=====================================================================
+
+#if IPC_TRACE
+
+static LONG64 IPCTraceStart(PIPC_PORT_TABLE pTable)
+{
+	return pTable->nTracePorts ? KeQueryPerformanceCounter(NULL).QuadPart : 0;
+}
+
+static VOID IPCTraceCopied(PIPC_PACKET_BLOCK pBlock, LONG64 llWrite)
+{
+	pBlock->TraceStamps[IPC_TRACE_WRITE] = llWrite;
+	pBlock->TraceStamps[IPC_TRACE_COPIED] = llWrite ? KeQueryPerformanceCounter(NULL).QuadPart : 0;
+	pBlock->TraceStamps[IPC_TRACE_QUEUED] = 0;
+	pBlock->pTracePort = NULL;
+}
+
+static VOID IPCTraceInherit(PIPC_PACKET_BLOCK pBlock, const IPC_PACKET_BLOCK* pOriginal)
+{
+	RtlCopyMemory(pBlock->TraceStamps, pOriginal->TraceStamps, sizeof(pBlock->TraceStamps));
+	pBlock->pTracePort = NULL;
+}
+
+
+//=====================================================================
+// IPCTraceQueued
+//
+// Stamps a packet being queued to a port which traces and flags it, so
+// its stamps are copied out with it. Called before the packet can be
+// seen by a reader. Costs a read of the port's flag otherwise.
+//=====================================================================
+
+static VOID IPCTraceQueued(PIPC_PORT pPort, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_PACKET_BLOCK pBlock;
+
+	if (!pPort->lTrace)
+	{
+		return;
+	}
+
+	pBlock = IPCPacketBlock(pIPC_Pkt);
+	pBlock->TraceStamps[IPC_TRACE_QUEUED] = KeQueryPerformanceCounter(NULL).QuadPart;
+	pBlock->pTracePort = pPort;
+	pIPC_Pkt->header.uiFlags |= IPC_PACKET_TRACED;
+}
+
+
+//=====================================================================
+// IPCTraceBucket
+//
+// Returns the histogram bucket of a span given in performance counter
+// ticks, the base 2 logarithm of its length in nanoseconds. Spans of
+// 4 seconds or more all go to the last bucket, which also keeps the
+// conversion from overflowing.
+//=====================================================================
+
+static ULONG IPCTraceBucket(PIPC_PORT_TABLE pTable, LONG64 llTicks)
+{
+	LONG64 llNs;
+	ULONG uiBucket = 0;
+
+	if (llTicks <= 0)
+	{
+		return 0;
+	}
+	if (llTicks >= pTable->llTraceFrequency * 4)
+	{
+		return IPC_TRACE_BUCKETS - 1;
+	}
+
+	llNs = llTicks * 1000000000 / pTable->llTraceFrequency;
+	while ((llNs >>= 1) != 0 && uiBucket < IPC_TRACE_BUCKETS - 1)
+	{
+		uiBucket++;
+	}
+
+	return uiBucket;
+}
+
+
+//=====================================================================
+// IPCTraceCopyOut
+//
+// Called as a flagged packet is copied out. Takes the read stamp, writes
+// the stamps after the payload in the reader's buffer and counts the
+// spans in the histograms of the port the packet was queued to. A span
+// is skipped if tracing was switched on while the packet was on its way
+// and its first stage was not stamped. Returns the bytes written.
+//=====================================================================
+
+static size_t IPCTraceCopyOut(PIPC_PORT_TABLE pTable, PVOID pDst, PIPC_PACKET pIPC_Pkt)
+{
+	static const UCHAR SpanStart[IPC_TRACE_SPANS] = { IPC_TRACE_WRITE, IPC_TRACE_COPIED, IPC_TRACE_QUEUED, IPC_TRACE_WRITE };
+	static const UCHAR SpanEnd[IPC_TRACE_SPANS] = { IPC_TRACE_COPIED, IPC_TRACE_QUEUED, IPC_TRACE_READ, IPC_TRACE_READ };
+	PIPC_PACKET_BLOCK pBlock = IPCPacketBlock(pIPC_Pkt);
+	PIPC_TRACE_STATS pTrace;
+	IPC_PACKET_TRACE Trace;
+	ULONG uiSpan;
+
+	if (!(pIPC_Pkt->header.uiFlags & IPC_PACKET_TRACED))
+	{
+		return 0;
+	}
+
+	RtlCopyMemory(Trace.Stamps, pBlock->TraceStamps, sizeof(pBlock->TraceStamps));
+	Trace.Stamps[IPC_TRACE_READ] = KeQueryPerformanceCounter(NULL).QuadPart;
+	Trace.Stamps[IPC_TRACE_RECEIVED] = 0;
+	Trace.llFrequency = pTable->llTraceFrequency;
+
+	//The payload has any length, the stamps may not be aligned in the reader's buffer
+
+	RtlCopyMemory(pDst, &Trace, sizeof(IPC_PACKET_TRACE));
+
+	pTrace = pBlock->pTracePort->pTrace;
+	for (uiSpan = 0; uiSpan < IPC_TRACE_SPANS; uiSpan++)
+	{
+		if (Trace.Stamps[SpanStart[uiSpan]])
+		{
+			InterlockedIncrement64((volatile LONG64*)&(pTrace->Counts[uiSpan][IPCTraceBucket(pTable, Trace.Stamps[SpanEnd[uiSpan]] - Trace.Stamps[SpanStart[uiSpan]])]));
+		}
+	}
+
+	return sizeof(IPC_PACKET_TRACE);
+}
+
+#else
+
+#define IPCTraceStart(pTable) 0
+#define IPCTraceCopied(pBlock, llWrite) UNREFERENCED_PARAMETER(llWrite)
+#define IPCTraceInherit(pBlock, pOriginal)
+#define IPCTraceQueued(pPort, pIPC_Pkt)
+#define IPCTraceCopyOut(pTable, pDst, pIPC_Pkt) 0
+
+#endif
+
+
+//=====================================================================
+// IPCPortSetTrace
+//
+// Switches the stamps on or off for the packets queued to a port. The
+// histograms are allocated the first time and kept until the port is
+// freed, so switching tracing back on continues the same histograms.
+// The table counts the tracing ports, packets are only stamped on the
+// write path while there is one.
+//=====================================================================
+
+NTSTATUS IPCPortSetTrace(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, BOOLEAN bEnable)
+{
+#if IPC_TRACE
+	PIPC_TRACE_STATS pTrace;
+	LONG lTrace = bEnable ? 1 : 0;
+
+	if (bEnable && !pPort->pTrace)
+	{
+		pTrace = (PIPC_TRACE_STATS)ExAllocatePoolWithTag(NonPagedPool, sizeof(IPC_TRACE_STATS), IPC_POOL_TAG);
+		if (!pTrace)
+		{
+			DbgPrint("Failed to allocate Nonpaged pool for the trace histograms\n");
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		RtlZeroMemory(pTrace, sizeof(IPC_TRACE_STATS));
+
+		if (InterlockedCompareExchangePointer((PVOID*)&(pPort->pTrace), pTrace, NULL) != NULL)
+		{
+			ExFreePoolWithTag(pTrace, IPC_POOL_TAG);
+		}
+	}
+
+	if (InterlockedExchange(&(pPort->lTrace), lTrace) != lTrace)
+	{
+		if (bEnable)
+		{
+			InterlockedIncrement(&(pTable->nTracePorts));
+		}
+		else
+		{
+			InterlockedDecrement(&(pTable->nTracePorts));
+		}
+	}
+
+	return STATUS_SUCCESS;
+#else
+	UNREFERENCED_PARAMETER(pTable);
+	UNREFERENCED_PARAMETER(pPort);
+	UNREFERENCED_PARAMETER(bEnable);
+
+	return STATUS_NOT_SUPPORTED;
+#endif
+}
+
+
+//=====================================================================
+// IPCPortQueryTrace
+//
+// Returns the histograms of the port registered for a PID, all 0 if it
+// has never traced. The counts are read while packets are being counted,
+// the result is a snapshot.
+//=====================================================================
+
+NTSTATUS IPCPortQueryTrace(PIPC_PORT_TABLE pTable, HANDLE dwPID, PIPC_TRACE_STATS pTraceStats)
+{
+#if IPC_TRACE
+	PIPC_PORT pPort = IPCPortTableLookup(pTable, dwPID);
+
+	if (!pPort)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	RtlZeroMemory(pTraceStats, sizeof(IPC_TRACE_STATS));
+	pTraceStats->bEnabled = pPort->lTrace != 0;
+	if (pPort->pTrace)
+	{
+		RtlCopyMemory(pTraceStats->Counts, pPort->pTrace->Counts, sizeof(pTraceStats->Counts));
+	}
+
+	IPCPortDereference(pPort);
+	return STATUS_SUCCESS;
+#else
+	UNREFERENCED_PARAMETER(pTable);
+	UNREFERENCED_PARAMETER(dwPID);
+	UNREFERENCED_PARAMETER(pTraceStats);
+
+	return STATUS_NOT_SUPPORTED;
+#endif
+}
+
+
+//=====================================================================
+// IPCPacketCheckWire
+//
+// Checks a wire packet written by a process before anything is taken
+// from it: its version, the flags a writer may set and that the header,
+// call ID and payload fit in the bytes written.
+//=====================================================================
+
+NTSTATUS IPCPacketCheckWire(const VOID* pSrc, size_t cbAvailable, BOOLEAN bReply, size_t* pcbWire)
+{
+	IPC_WIRE_HEADER Wire;
+	size_t cbWire;
+
+	if (cbAvailable < sizeof(IPC_WIRE_HEADER))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	RtlCopyMemory(&Wire, pSrc, sizeof(IPC_WIRE_HEADER));
+
+	if (Wire.bVersion != IPC_WIRE_VERSION ||
+		(Wire.bFlags & ~(bReply ? (IPC_WIRE_END_OF_MSG | IPC_WIRE_CALL) : IPC_WIRE_END_OF_MSG)) ||
+		(bReply && !(Wire.bFlags & IPC_WIRE_CALL)))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	cbWire = sizeof(IPC_WIRE_HEADER) + IPCWireCallLength(&Wire);
+	if (cbAvailable < cbWire || Wire.cbPayload > cbAvailable - cbWire)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	*pcbWire = cbWire + Wire.cbPayload;
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCPacketAllocate
+//
+// Allocates a packet from the packet pool and fills its descriptor from
+// the header of a written wire packet. The payload is left to the
+// caller, the packet is not zeroed first since every byte is written.
+//=====================================================================
+
+static PIPC_PACKET IPCPacketAllocate(PIPC_PORT_TABLE pTable, const IPC_WIRE_HEADER* pWire, HANDLE dwSourcePid)
+{
+	PIPC_PACKET_BLOCK pBlock;
+	PIPC_PACKET pIPC_Pkt;
+
+	pBlock = IPCPoolAllocate(&(pTable->PktPool), sizeof(IPC_PACKET_BLOCK) + sizeof(IPC_PACKET) + pWire->cbPayload);
+	if (!pBlock)
+	{
+		DbgPrint("Failed to allocate Nonpaged pool for IPC Packet\n");
+		return NULL;
+	}
+
+	pBlock->lRefCount = 1;
+	pBlock->pShared = NULL;
+	pBlock->pDestPort = NULL;
+	pBlock->pCharged = NULL;
+	pIPC_Pkt = (PIPC_PACKET)(pBlock + 1);
+
+	pIPC_Pkt->header.dwSourcePid = (DWORD32)(ULONG_PTR)dwSourcePid;
+	pIPC_Pkt->header.uiPriority = pWire->bPriority;
+	pIPC_Pkt->header.dwDestinationPid = (HANDLE)(ULONG_PTR)pWire->dwPid;
+	pIPC_Pkt->header.sizeofpayload = pWire->cbPayload;
+	pIPC_Pkt->header.nPacketid = pWire->uiMsgID;
+	pIPC_Pkt->header.EndofPacket = (pWire->bFlags & IPC_WIRE_END_OF_MSG) != 0;
+	pIPC_Pkt->header.uiCallId = IPCWireCallId(pWire);
+	pIPC_Pkt->header.uiFlags = 0;
+
+	return pIPC_Pkt;
+}
+
+
+//=====================================================================
+// IPCPacketCreate
+//
+// Creates a packet from a written wire packet. The payload copy is the
+// only copy made on the way in.
+//=====================================================================
+
+PIPC_PACKET IPCPacketCreate(PIPC_PORT_TABLE pTable, const IPC_WIRE_HEADER* pWire, HANDLE dwSourcePid)
+{
+	LONG64 llWrite = IPCTraceStart(pTable);
+	PIPC_PACKET pIPC_Pkt = IPCPacketAllocate(pTable, pWire, dwSourcePid);
+
+	if (!pIPC_Pkt)
+	{
+		return NULL;
+	}
+
+	RtlCopyMemory(pIPC_Pkt->szbuffer, IPCWirePayload(pWire), pWire->cbPayload);
+	IPCTraceCopied(IPCPacketBlock(pIPC_Pkt), llWrite);
+
+	InterlockedIncrement64(&(pTable->nPktCopies));
+	InterlockedExchangeAdd64(&(pTable->nPktBytesCopied), (LONG64)IPCWireLength(pWire));
+
+	return pIPC_Pkt;
+}
+
+
+//=====================================================================
+// IPCPacketCheckGather
+//
+// Checks the header and segment list of a gather send. The segment
+// lengths are added in 64 bits so they cannot wrap around to the
+// payload size, and an address a pointer cannot hold is rejected.
+//=====================================================================
+
+NTSTATUS IPCPacketCheckGather(const VOID* pSrc, size_t cbAvailable)
+{
+	const IPC_GATHER_HEADER* pGather = (const IPC_GATHER_HEADER*)pSrc;
+	const IPC_GATHER_SEGMENT* pSegments = (const IPC_GATHER_SEGMENT*)(pGather + 1);
+	UINT64 cbTotal = 0;
+	ULONG i;
+
+	if (cbAvailable < sizeof(IPC_GATHER_HEADER) ||
+		pGather->Wire.bVersion != IPC_WIRE_VERSION ||
+		(pGather->Wire.bFlags & ~IPC_WIRE_END_OF_MSG) ||
+		pGather->nSegments > IPC_GATHER_MAX_SEGMENTS ||
+		cbAvailable < sizeof(IPC_GATHER_HEADER) + pGather->nSegments * sizeof(IPC_GATHER_SEGMENT))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (i = 0; i < pGather->nSegments; i++)
+	{
+		if ((UINT64)(ULONG_PTR)pSegments[i].pData != pSegments[i].pData)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+		cbTotal += pSegments[i].cbData;
+	}
+
+	return cbTotal == pGather->Wire.cbPayload ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+
+//=====================================================================
+// IPCPacketCreateGather
+//
+// Creates a packet from a gather send. Each segment is copied by the
+// caller's hook straight from the sender's memory to its place in the
+// payload, which is the only copy made on the way in. A packet whose
+// copy fails is freed.
+//=====================================================================
+
+NTSTATUS IPCPacketCreateGather(PIPC_PORT_TABLE pTable, const IPC_GATHER_HEADER* pGather, HANDLE dwSourcePid,
+	IPC_GATHER_COPY* pfnCopy, PIPC_PACKET* ppIPC_Pkt)
+{
+	LONG64 llWrite = IPCTraceStart(pTable);
+	const IPC_GATHER_SEGMENT* pSegments = (const IPC_GATHER_SEGMENT*)(pGather + 1);
+	PIPC_PACKET pIPC_Pkt = IPCPacketAllocate(pTable, &(pGather->Wire), dwSourcePid);
+	size_t uiOffset = 0;
+	NTSTATUS ntStatus;
+	ULONG i;
+
+	*ppIPC_Pkt = NULL;
+	if (!pIPC_Pkt)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	for (i = 0; i < pGather->nSegments; i++)
+	{
+		ntStatus = pfnCopy(pIPC_Pkt->szbuffer + uiOffset, &pSegments[i]);
+		if (!NT_SUCCESS(ntStatus))
+		{
+			IPCPacketFree(pTable, pIPC_Pkt);
+			return ntStatus;
+		}
+		uiOffset += pSegments[i].cbData;
+	}
+	IPCTraceCopied(IPCPacketBlock(pIPC_Pkt), llWrite);
+
+	InterlockedIncrement64(&(pTable->nPktCopies));
+	InterlockedExchangeAdd64(&(pTable->nPktBytesCopied), (LONG64)IPCWireLength(&(pGather->Wire)));
+
+	*ppIPC_Pkt = pIPC_Pkt;
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCPacketCopyOutBatch
+//
+// Writes a packet to the buffer of a batch receive as a batch of one,
+// for a batch reader parked on an empty port. The caller has checked
+// that IPCPacketBatchLength bytes fit. Returns the bytes written.
+//=====================================================================
+
+size_t IPCPacketCopyOutBatch(PIPC_PORT_TABLE pTable, PVOID pDst, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_BATCH_HEADER pBatch = (PIPC_BATCH_HEADER)pDst;
+	size_t uiOffset = IPC_BATCH_ALIGN_UP(sizeof(IPC_BATCH_HEADER));
+
+	pBatch->nPackets = 1;
+	pBatch->cbNext = 0;
+
+	return uiOffset + IPCPacketCopyOut(pTable, (PCHAR)pDst + uiOffset, pIPC_Pkt);
+}
+
+
+//=====================================================================
+// IPCPacketCopyOut
+//
+// Writes the wire packet of a packet to the buffer of the reading
+// process. The caller has already checked that the buffer is large
+// enough. Only the wire header is built from the descriptor, kernel
+// addresses are never handed to user mode. The payload of a multicast
+// descriptor comes from the shared packet. A packet traced on its way
+// is followed by its IPC_PACKET_TRACE.
+//=====================================================================
+
+size_t IPCPacketCopyOut(PIPC_PORT_TABLE pTable, PVOID pDst, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_PACKET pShared = IPCPacketBlock(pIPC_Pkt)->pShared;
+	PIPC_WIRE_HEADER pWire = (PIPC_WIRE_HEADER)pDst;
+	size_t uiLength = IPCPacketWireLength(pIPC_Pkt);
+
+	pWire->bVersion = IPC_WIRE_VERSION;
+	pWire->bFlags = (pIPC_Pkt->header.EndofPacket ? IPC_WIRE_END_OF_MSG : 0) |
+		((pIPC_Pkt->header.uiFlags & IPC_PACKET_TRACED) ? IPC_WIRE_TRACED : 0) |
+		(pIPC_Pkt->header.uiCallId ? IPC_WIRE_CALL : 0);
+	pWire->bPriority = (UINT8)pIPC_Pkt->header.uiPriority;
+	pWire->bReserved = 0;
+	pWire->dwPid = pIPC_Pkt->header.dwSourcePid;
+	pWire->uiMsgID = pIPC_Pkt->header.nPacketid;
+	pWire->cbPayload = (UINT32)pIPC_Pkt->header.sizeofpayload;
+	if (pIPC_Pkt->header.uiCallId)
+	{
+		((PIPC_WIRE_CALL_ID)(pWire + 1))->uiCallId = pIPC_Pkt->header.uiCallId;
+		((PIPC_WIRE_CALL_ID)(pWire + 1))->uiReserved = 0;
+	}
+	RtlCopyMemory(IPCWirePayload(pWire), pShared ? pShared->szbuffer : pIPC_Pkt->szbuffer, pIPC_Pkt->header.sizeofpayload);
+	uiLength += IPCTraceCopyOut(pTable, (PCHAR)pDst + uiLength, pIPC_Pkt);
+
+	InterlockedIncrement64(&(pTable->nPktCopies));
+	InterlockedExchangeAdd64(&(pTable->nPktBytesCopied), (LONG64)uiLength);
+
+	return uiLength;
+}
+
+
+//=====================================================================
+// IPCPacketFree
+//
+// Drops a reference on a packet and returns it to the packet pool with
+// the last one. The size class is recomputed from the packet header,
+// which the routing core never changes. A packet with a single reference
+// can only be held by the caller, so it is freed without an interlocked
+// operation. Freeing a multicast descriptor drops its shared packet.
+// The credits the packet holds go back to the port it was charged to.
+//=====================================================================
+
+VOID IPCPacketFree(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_PACKET_BLOCK pBlock = IPCPacketBlock(pIPC_Pkt);
+	PIPC_PACKET pShared = pBlock->pShared;
+
+	if (pBlock->lRefCount != 1 && InterlockedDecrement(&(pBlock->lRefCount)) != 0)
+	{
+		return;
+	}
+
+	if (pBlock->pCharged)
+	{
+		IPCPortReturnCredit(pBlock->pCharged, sizeof(IPC_PACKET) + pIPC_Pkt->header.sizeofpayload);
+	}
+	if (pBlock->pDestPort)
+	{
+		IPCPortDereference(pBlock->pDestPort);
+	}
+
+	IPCPoolFree(&(pTable->PktPool), pBlock,
+		sizeof(IPC_PACKET_BLOCK) + sizeof(IPC_PACKET) + (pShared ? 0 : pIPC_Pkt->header.sizeofpayload));
+
+	if (pShared)
+	{
+		IPCPacketFree(pTable, pShared);
+	}
+}
+
+
+//=====================================================================
+// IPCPacketCreateRef
+//
+// Allocates the descriptor of a multicast packet for one recipient. It
+// carries a copy of the header addressed to the recipient and a reference
+// on the shared packet, whatever the size of the payload.
+//=====================================================================
+
+static PIPC_PACKET IPCPacketCreateRef(PIPC_PORT_TABLE pTable, PIPC_PACKET pShared, HANDLE dwDestPID)
+{
+	PIPC_PACKET_BLOCK pBlock;
+	PIPC_PACKET pIPC_Pkt;
+
+	pBlock = IPCPoolAllocate(&(pTable->PktPool), sizeof(IPC_PACKET_BLOCK) + sizeof(IPC_PACKET));
+	if (!pBlock)
+	{
+		DbgPrint("Failed to allocate Nonpaged pool for IPC Packet descriptor\n");
+		return NULL;
+	}
+
+	InterlockedIncrement(&(IPCPacketBlock(pShared)->lRefCount));
+	pBlock->lRefCount = 1;
+	pBlock->pShared = pShared;
+	pBlock->pDestPort = NULL;
+	pBlock->pCharged = NULL;
+	IPCTraceInherit(pBlock, IPCPacketBlock(pShared));
+
+	pIPC_Pkt = (PIPC_PACKET)(pBlock + 1);
+	pIPC_Pkt->header = pShared->header;
+	pIPC_Pkt->header.dwDestinationPid = dwDestPID;
+
+	return pIPC_Pkt;
+}
+
+
+//=====================================================================
+// IPCPortLanesEmpty
+//
+// Returns TRUE if no incoming lane of the port holds a packet. Called
+// with the incoming queue lock held.
+//=====================================================================
+
+static BOOLEAN IPCPortLanesEmpty(PIPC_PORT pPort)
+{
+	ULONG uiLane;
+
+	for (uiLane = 0; uiLane < IPC_PRIORITY_LANES; uiLane++)
+	{
+		if (!IsListEmpty(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane])))
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+//=====================================================================
+// IPCPortNextLane
+//
+// Returns the lane the next packet is read from, or IPC_PRIORITY_LANES
+// if every lane is empty. Called with the incoming queue lock held.
+// Without lane weights this is the highest priority lane holding a
+// packet. With weights it is the highest priority lane holding a packet
+// with credit left in the current round, and a new round starts once no
+// such lane is left. Only lanes holding packets get credit for a round
+// and a lane which runs empty forfeits what it has left, so idle lanes
+// do not save up credit.
+//=====================================================================
+
+static ULONG IPCPortNextLane(PIPC_PORT pPort)
+{
+	PIPC_PACKET_QUEUE pQueue = &(pPort->Pkt_Queue);
+	ULONG uiLane;
+	ULONG uiNext;
+
+	for (uiLane = IPC_PRIORITY_LANES; uiLane-- > 0;)
+	{
+		if (!IsListEmpty(&(pQueue->Ipc_Pkt_In_Queue[uiLane])) && (!pQueue->bWeighted || pQueue->LaneCredits[uiLane]))
+		{
+			return uiLane;
+		}
+	}
+
+	if (!pQueue->bWeighted)
+	{
+		return IPC_PRIORITY_LANES;
+	}
+
+	//Start a new round among the lanes holding packets, every weight is at least 1
+
+	uiNext = IPC_PRIORITY_LANES;
+	for (uiLane = IPC_PRIORITY_LANES; uiLane-- > 0;)
+	{
+		if (IsListEmpty(&(pQueue->Ipc_Pkt_In_Queue[uiLane])))
+		{
+			pQueue->LaneCredits[uiLane] = 0;
+			continue;
+		}
+
+		pQueue->LaneCredits[uiLane] = pQueue->LaneWeights[uiLane];
+		if (uiNext == IPC_PRIORITY_LANES)
+		{
+			uiNext = uiLane;
+		}
+	}
+
+	return uiNext;
+}
+
+
+//=====================================================================
+// IPCPortRemoveLaneHead
+//
+// Removes the head packet of a lane returned by IPCPortNextLane and
+// charges it to the lane's credit, which is forfeited if the lane is
+// empty afterwards. Called with the incoming queue lock held.
+//=====================================================================
+
+static PLIST_ENTRY IPCPortRemoveLaneHead(PIPC_PORT pPort, ULONG uiLane)
+{
+	PLIST_ENTRY pTemp_ListEntry = RemoveHeadList(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane]));
+
+	pPort->Pkt_Queue.nDepth--;
+	if (pPort->Pkt_Queue.LaneCredits[uiLane])
+	{
+		pPort->Pkt_Queue.LaneCredits[uiLane]--;
+	}
+	if (IsListEmpty(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane])))
+	{
+		pPort->Pkt_Queue.LaneCredits[uiLane] = 0;
+	}
+
+	return pTemp_ListEntry;
+}
+
+
+//=====================================================================
+// IPCRouteTakeReader
+//
+// Returns a parked reader of the port if every incoming lane is empty,
+// otherwise NULL. Called with the incoming queue lock held. Packets only
+// bypass the lanes when they are empty so they are never reordered.
+//=====================================================================
+
+static PVOID IPCRouteTakeReader(PIPC_PORT_TABLE pTable, PIPC_PORT pPort)
+{
+	if (!pTable->ReaderOps.pfnTakeReader || !IPCPortLanesEmpty(pPort))
+	{
+		return NULL;
+	}
+
+	return pTable->ReaderOps.pfnTakeReader(pPort);
+}
+
+
+//=====================================================================
+// IPCRouteQueuePacket
+//
+// Completes a parked reader of the port with the packet, or queues the
+// packet to the tail of its lane and signals the Read notification event.
+// A reader whose buffer is too small is completed by pfnCompleteReader
+// without the packet, and the next reader (or the queue) is tried.
+// The packet is counted in before it is queued, a reader may free it
+// as soon as it is.
+//=====================================================================
+
+static VOID IPCRouteQueuePacket(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, PIPC_PACKET pIPC_Pkt)
+{
+	size_t cbPayload = pIPC_Pkt->header.sizeofpayload;
+	PVOID pReader;
+	KIRQL Irql;
+
+	IPCTraceQueued(pPort, pIPC_Pkt);
+	IPCPortCountTraffic(pPort, IPC_STAT_PKTS_IN, 1, cbPayload);
+
+	for (;;)
+	{
+		KeAcquireSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+
+		pReader = IPCRouteTakeReader(pTable, pPort);
+		if (!pReader)
+		{
+			InsertTailList(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[IPCPacketLane(pIPC_Pkt)]), &(pIPC_Pkt->list_entry));
+			IPCPortAddDepth(pPort, 1);
+			if (pPort->pKevent)
+			{
+				KeSetEvent(pPort->pKevent, 0, FALSE);  //Notify the destination process Read Thread
+			}
+			KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+			return;
+		}
+
+		KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+
+		if (pTable->ReaderOps.pfnCompleteReader(pTable, pPort, pReader, pIPC_Pkt))
+		{
+			IPCPortCountTraffic(pPort, IPC_STAT_PKTS_OUT, 1, cbPayload);
+			return;
+		}
+		IPCPortCountStat(pTable, pPort, IPC_STAT_TOO_SMALL, 1);
+	}
+}
+
+
+//=====================================================================
+// IPCRouteCopyPacket
+//
+// IPC_ROUTE_COPY mode: copies a packet into a new In IPC Packet, which
+// takes over the credits of the original, and frees the original.
+// Returns NULL if the copy cannot be allocated.
+//=====================================================================
+
+static PIPC_PACKET IPCRouteCopyPacket(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt)
+{
+	size_t uiLength = sizeof(IPC_PACKET) + pIPC_Pkt->header.sizeofpayload;
+	PIPC_PACKET_BLOCK pBlock;
+	PIPC_PACKET pIPC_In_Pkt = NULL;
+
+	pBlock = IPCPoolAllocate(&(pTable->PktPool), sizeof(IPC_PACKET_BLOCK) + uiLength);
+	if (pBlock)
+	{
+		pBlock->lRefCount = 1;
+		pBlock->pShared = NULL;
+		pBlock->pDestPort = NULL;
+		pIPC_In_Pkt = (PIPC_PACKET)(pBlock + 1);
+		RtlCopyMemory(pIPC_In_Pkt, pIPC_Pkt, uiLength);
+		pIPC_In_Pkt->header.uiFlags = 0;
+
+		InterlockedIncrement64(&(pTable->nPktCopies));
+		InterlockedExchangeAdd64(&(pTable->nPktBytesCopied), (LONG64)uiLength);
+
+		IPCPacketBlock(pIPC_In_Pkt)->pCharged = IPCPacketBlock(pIPC_Pkt)->pCharged;
+		IPCPacketBlock(pIPC_Pkt)->pCharged = NULL;
+		IPCTraceInherit(IPCPacketBlock(pIPC_In_Pkt), IPCPacketBlock(pIPC_Pkt));
+	}
+	else
+	{
+		IPCPortCountSource(pTable, pIPC_Pkt, IPC_STAT_ALLOC_FAILURES);
+	}
+	IPCPacketFree(pTable, pIPC_Pkt);
+
+	return pIPC_In_Pkt;
+}
+
+
+//=====================================================================
+// IPCRouteAdmit
+//
+// Looks up the destination port and charges the packet to its credits
+// in the sender's context, where IPC_OVERFLOW_BLOCK may wait. The lookup
+// reference is kept in the packet block so the packet is queued to the
+// port it was charged to, even if it is routed later by another thread.
+//=====================================================================
+
+NTSTATUS IPCRouteAdmit(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, const IPC_OVERFLOW* pOverflow)
+{
+	PIPC_PORT pDestPort;
+	NTSTATUS ntStatus;
+
+	pDestPort = IPCPortTableLookup(pTable, pIPC_Pkt->header.dwDestinationPid);
+	if (!pDestPort)
+	{
+		IPCPortCountSource(pTable, pIPC_Pkt, IPC_STAT_UNDELIVERABLE);
+		return STATUS_NOT_FOUND;
+	}
+
+	ntStatus = IPCPortCharge(pTable, pDestPort, pIPC_Pkt, pOverflow, TRUE);
+	if (!NT_SUCCESS(ntStatus))
+	{
+		IPCPortDereference(pDestPort);
+		return ntStatus;
+	}
+
+	IPCPacketBlock(pIPC_Pkt)->pDestPort = pDestPort;
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCRouteDeliver
+//
+// Looks up the destination port by PID or endpoint handle and queues
+// the packet to the destination incoming queue. In IPC_ROUTE_TRANSFER
+// mode the packet allocated by the write path is linked in as is. In
+// IPC_ROUTE_COPY mode it is first copied into a new In IPC Packet. A
+// packet admitted by IPCRouteAdmit goes to the port it was charged to,
+// any other packet is charged here and fails fast if the port is over
+// its limit. Returns STATUS_NOT_FOUND if no port is registered for the
+// destination PID or the endpoint handle is stale, the packet is then
+// counted as undeliverable against its sender.
+//=====================================================================
+
+NTSTATUS IPCRouteDeliver(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_PORT pDestPort = IPCPacketBlock(pIPC_Pkt)->pDestPort;
+	PIPC_PACKET pIPC_In_Pkt = pIPC_Pkt;
+	NTSTATUS ntStatus;
+
+	if (pDestPort)
+	{
+		IPCPacketBlock(pIPC_Pkt)->pDestPort = NULL;	//The admission reference is dropped below
+	}
+	else
+	{
+		pDestPort = IPCPortTableLookup(pTable, pIPC_Pkt->header.dwDestinationPid);
+		if (!pDestPort)
+		{
+			DbgPrint("No port registered for destination PID\n");
+			IPCPortCountSource(pTable, pIPC_Pkt, IPC_STAT_UNDELIVERABLE);
+			IPCPacketFree(pTable, pIPC_Pkt);
+			return STATUS_NOT_FOUND;
+		}
+
+		ntStatus = IPCPortCharge(pTable, pDestPort, pIPC_Pkt, NULL, FALSE);
+		if (!NT_SUCCESS(ntStatus))
+		{
+			IPCPacketFree(pTable, pIPC_Pkt);
+			IPCPortDereference(pDestPort);
+			return ntStatus;
+		}
+	}
+
+	if (pTable->RouteMode == IPC_ROUTE_COPY)
+	{
+		//Create a new In IPC Packet and copy the existing IPC Packet
+
+		pIPC_In_Pkt = IPCRouteCopyPacket(pTable, pIPC_Pkt);
+		if (!pIPC_In_Pkt)
+		{
+			IPCPortDereference(pDestPort);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	//Hand the In IPC packet to a parked reader of the destination process, or queue it to its Incoming queue
+
+	IPCRouteQueuePacket(pTable, pDestPort, pIPC_In_Pkt);
+
+	IPCPortDereference(pDestPort);
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCRouteFlushGroup
+//
+// Moves the packets gathered for one destination onto the tails of its
+// incoming lanes under a single lock acquisition, signals its Read
+// notification event once and drops the lookup reference. Readers parked
+// on the port are completed with the first packets of the group. The
+// group is counted in as a whole.
+//=====================================================================
+
+static VOID IPCRouteFlushGroup(PIPC_PORT_TABLE pTable, PIPC_ROUTE_GROUP pGroup)
+{
+	PIPC_PORT pDestPort = pGroup->pDestPort;
+	PIPC_PACKET pIPC_Pkt;
+	size_t cbPayload;
+	PVOID pReader;
+	KIRQL Irql;
+
+	if (!pDestPort)
+	{
+		return;
+	}
+
+	IPCPortCountTraffic(pDestPort, IPC_STAT_PKTS_IN, pGroup->nPkts, pGroup->cbPayload);
+
+	while (!IsListEmpty(&(pGroup->Pkt_List)))
+	{
+		KeAcquireSpinLock(&(pDestPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+
+		//Parked readers get the head packets of the group one at a time
+
+		pReader = IPCRouteTakeReader(pTable, pDestPort);
+		if (pReader)
+		{
+			KeReleaseSpinLock(&(pDestPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+
+			pIPC_Pkt = CONTAINING_RECORD(RemoveHeadList(&(pGroup->Pkt_List)), IPC_PACKET, list_entry);
+			cbPayload = pIPC_Pkt->header.sizeofpayload;
+			if (pTable->ReaderOps.pfnCompleteReader(pTable, pDestPort, pReader, pIPC_Pkt))
+			{
+				IPCPortCountTraffic(pDestPort, IPC_STAT_PKTS_OUT, 1, cbPayload);
+			}
+			else
+			{
+				IPCPortCountStat(pTable, pDestPort, IPC_STAT_TOO_SMALL, 1);
+				InsertHeadList(&(pGroup->Pkt_List), &(pIPC_Pkt->list_entry));
+			}
+			continue;
+		}
+
+		//Move the rest onto the tails of their Incoming lanes
+
+		while (!IsListEmpty(&(pGroup->Pkt_List)))
+		{
+			pIPC_Pkt = CONTAINING_RECORD(RemoveHeadList(&(pGroup->Pkt_List)), IPC_PACKET, list_entry);
+			InsertTailList(&(pDestPort->Pkt_Queue.Ipc_Pkt_In_Queue[IPCPacketLane(pIPC_Pkt)]), &(pIPC_Pkt->list_entry));
+			IPCPortAddDepth(pDestPort, 1);
+		}
+		if (pDestPort->pKevent)
+		{
+			KeSetEvent(pDestPort->pKevent, 0, FALSE);  //Notify the destination process Read Thread
+		}
+		KeReleaseSpinLock(&(pDestPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+	}
+
+	IPCPortDereference(pDestPort);
+}
+
+
+//=====================================================================
+// IPCRouteFlushGroups
+//
+// Flushes every open group of a batch.
+//=====================================================================
+
+static VOID IPCRouteFlushGroups(PIPC_PORT_TABLE pTable, PIPC_ROUTE_GROUP pGroups, PULONG pnGroups)
+{
+	ULONG g;
+
+	for (g = 0; g < *pnGroups; g++)
+	{
+		IPCRouteFlushGroup(pTable, &pGroups[g]);
+	}
+	*pnGroups = 0;
+}
+
+
+//=====================================================================
+// IPCRouteOpenGroup
+//
+// Returns the open group of a packet's destination, or opens a new one
+// once every group slot is free again. A packet admitted by IPCRouteAdmit
+// joins the group of the port it was charged to, which is not necessarily
+// the port registered for its PID by now.
+//=====================================================================
+
+static PIPC_ROUTE_GROUP IPCRouteOpenGroup(PIPC_PORT_TABLE pTable, PIPC_ROUTE_GROUP pGroups, PULONG pnGroups, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_PORT pAdmitted = IPCPacketBlock(pIPC_Pkt)->pDestPort;
+	PIPC_ROUTE_GROUP pGroup;
+	ULONG g;
+
+	for (g = 0; g < *pnGroups; g++)
+	{
+		if (pAdmitted ? pGroups[g].pDestPort == pAdmitted : pGroups[g].dwPID == pIPC_Pkt->header.dwDestinationPid)
+		{
+			return &pGroups[g];
+		}
+	}
+
+	if (*pnGroups == IPC_ROUTE_BATCH_GROUPS)
+	{
+		IPCRouteFlushGroups(pTable, pGroups, pnGroups);
+	}
+
+	pGroup = &pGroups[(*pnGroups)++];
+	pGroup->dwPID = pIPC_Pkt->header.dwDestinationPid;
+	if (pAdmitted)
+	{
+		IPCPortReference(pAdmitted);
+		pGroup->pDestPort = pAdmitted;
+	}
+	else
+	{
+		pGroup->pDestPort = IPCPortTableLookup(pTable, pGroup->dwPID);
+	}
+	InitializeListHead(&(pGroup->Pkt_List));
+	pGroup->nPkts = 0;
+	pGroup->cbPayload = 0;
+
+	return pGroup;
+}
+
+
+//=====================================================================
+// IPCRouteDeliverBatch
+//
+// Makes a single pass over the batch. Packets are gathered on a local
+// list per destination, with up to IPC_ROUTE_BATCH_GROUPS destinations
+// open at a time. Each destination is looked up once per group and its
+// packets are spliced onto its incoming queue in one go, so the lock and
+// the Read notification event are touched once per destination instead
+// of once per packet. When every group slot is taken the open groups are
+// flushed; later packets for the same destination still queue behind the
+// earlier ones, so per destination order is kept. A sender blocked by a
+// destination over its limit flushes the open groups before it waits,
+// the receivers it waits on may be the ones its gathered packets go to.
+//=====================================================================
+
+VOID IPCRouteDeliverBatch(PIPC_PORT_TABLE pTable, PIPC_PACKET* ppIPC_Pkts, ULONG nPkts, NTSTATUS* pStatus, const IPC_OVERFLOW* pOverflow)
+{
+	IPC_ROUTE_GROUP Groups[IPC_ROUTE_BATCH_GROUPS];
+	PIPC_ROUTE_GROUP pGroup;
+	PIPC_PACKET_BLOCK pBlock;
+	PIPC_PACKET pIPC_In_Pkt;
+	NTSTATUS ntStatus;
+	ULONG nGroups = 0;
+	ULONG i;
+
+	for (i = 0; i < nPkts; i++)
+	{
+		if (pStatus[i] != STATUS_PENDING)
+		{
+			continue;
+		}
+
+		//Find the open group of the destination, or open a new one
+
+		pBlock = IPCPacketBlock(ppIPC_Pkts[i]);
+		pGroup = IPCRouteOpenGroup(pTable, Groups, &nGroups, ppIPC_Pkts[i]);
+
+		if (!pGroup->pDestPort)
+		{
+			DbgPrint("No port registered for destination PID\n");
+			IPCPortCountSource(pTable, ppIPC_Pkts[i], IPC_STAT_UNDELIVERABLE);
+			IPCPacketFree(pTable, ppIPC_Pkts[i]);
+			pStatus[i] = STATUS_NOT_FOUND;
+			continue;
+		}
+
+		if (pBlock->pDestPort)
+		{
+			//Already charged by IPCRouteAdmit, the group holds its own reference on the port
+
+			IPCPortDereference(pBlock->pDestPort);
+			pBlock->pDestPort = NULL;
+		}
+		else
+		{
+			ntStatus = IPCPortCharge(pTable, pGroup->pDestPort, ppIPC_Pkts[i], pOverflow, FALSE);
+			if (ntStatus == STATUS_CANT_WAIT)
+			{
+				IPCRouteFlushGroups(pTable, Groups, &nGroups);
+				pGroup = IPCRouteOpenGroup(pTable, Groups, &nGroups, ppIPC_Pkts[i]);
+				ntStatus = pGroup->pDestPort ? IPCPortCharge(pTable, pGroup->pDestPort, ppIPC_Pkts[i], pOverflow, TRUE) : STATUS_NOT_FOUND;
+			}
+			if (!NT_SUCCESS(ntStatus))
+			{
+				if (!pGroup->pDestPort)
+				{
+					IPCPortCountSource(pTable, ppIPC_Pkts[i], IPC_STAT_UNDELIVERABLE);
+				}
+				IPCPacketFree(pTable, ppIPC_Pkts[i]);
+				pStatus[i] = ntStatus;
+				continue;
+			}
+		}
+
+		pIPC_In_Pkt = ppIPC_Pkts[i];
+		if (pTable->RouteMode == IPC_ROUTE_COPY)
+		{
+			pIPC_In_Pkt = IPCRouteCopyPacket(pTable, ppIPC_Pkts[i]);
+			if (!pIPC_In_Pkt)
+			{
+				pStatus[i] = STATUS_INSUFFICIENT_RESOURCES;
+				continue;
+			}
+		}
+
+		IPCTraceQueued(pGroup->pDestPort, pIPC_In_Pkt);
+		InsertTailList(&(pGroup->Pkt_List), &(pIPC_In_Pkt->list_entry));
+		pGroup->nPkts++;
+		pGroup->cbPayload += pIPC_In_Pkt->header.sizeofpayload;
+		pStatus[i] = STATUS_SUCCESS;
+	}
+
+	IPCRouteFlushGroups(pTable, Groups, &nGroups);
+}
+
+
+//=====================================================================
+// IPCRouteFanOut
+//
+// Queues a descriptor of the shared packet to every port of the array
+// and drops the references on the ports. The caller keeps its own
+// reference on the packet and drops it once every recipient has been
+// handed a descriptor. Each descriptor is charged to its recipient, a
+// recipient the overflow policy cannot make room on is skipped.
+// Returns the number of recipients.
+//=====================================================================
+
+static ULONG IPCRouteFanOut(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, PIPC_PORT* ppDestPorts, ULONG nDestPorts, const IPC_OVERFLOW* pOverflow)
+{
+	PIPC_PACKET pIPC_Ref;
+	ULONG nDelivered = 0;
+	ULONG i;
+
+	for (i = 0; i < nDestPorts; i++)
+	{
+		pIPC_Ref = IPCPacketCreateRef(pTable, pIPC_Pkt, ppDestPorts[i]->dwPID);
+		if (!pIPC_Ref)
+		{
+			IPCPortCountSource(pTable, pIPC_Pkt, IPC_STAT_ALLOC_FAILURES);
+		}
+		if (pIPC_Ref && !NT_SUCCESS(IPCPortCharge(pTable, ppDestPorts[i], pIPC_Ref, pOverflow, TRUE)))
+		{
+			IPCPacketFree(pTable, pIPC_Ref);
+			pIPC_Ref = NULL;
+		}
+		if (pIPC_Ref)
+		{
+			IPCRouteQueuePacket(pTable, ppDestPorts[i], pIPC_Ref);
+			nDelivered++;
+		}
+		IPCPortDereference(ppDestPorts[i]);
+	}
+
+	return nDelivered;
+}
+
+
+//=====================================================================
+// IPCRouteMulticast
+//
+// Delivers a packet to each PID of a list. Every destination is looked
+// up and handed its descriptor in turn, so no port array is needed.
+//=====================================================================
+
+NTSTATUS IPCRouteMulticast(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, const HANDLE* pDestPids, ULONG nDestPids, const IPC_OVERFLOW* pOverflow, PULONG pnDelivered)
+{
+	PIPC_PORT pDestPort;
+	ULONG i;
+
+	*pnDelivered = 0;
+
+	for (i = 0; i < nDestPids; i++)
+	{
+		pDestPort = IPCPortTableLookup(pTable, pDestPids[i]);
+		if (pDestPort)
+		{
+			*pnDelivered += IPCRouteFanOut(pTable, pIPC_Pkt, &pDestPort, 1, pOverflow);
+		}
+		else
+		{
+			IPCPortCountSource(pTable, pIPC_Pkt, IPC_STAT_UNDELIVERABLE);
+		}
+	}
+
+	IPCPacketFree(pTable, pIPC_Pkt);
+
+	return *pnDelivered ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+
+//=====================================================================
+// IPCRouteMulticastGroup
+//
+// Delivers a packet to the members of a group. The member ports are
+// referenced under the group lock and the descriptors are queued after
+// it is released, since queueing may complete a parked reader.
+//=====================================================================
+
+NTSTATUS IPCRouteMulticastGroup(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, const char* szGroup, PIPC_PORT pExclude, const IPC_OVERFLOW* pOverflow, PULONG pnDelivered)
+{
+	char Name[IPC_GROUP_NAME_MAX];
+	PIPC_PORT* ppDestPorts = NULL;
+	PIPC_GROUP_MEMBER pMember;
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_GROUP pGroup;
+	ULONG nDestPorts = 0;
+	NTSTATUS ntStatus = STATUS_NOT_FOUND;
+	KIRQL Irql;
+
+	*pnDelivered = 0;
+	IPCCopyName(Name, szGroup, IPC_GROUP_NAME_MAX);
+
+	KeAcquireSpinLock(&(pTable->Group_List_SpinLock), &Irql);
+
+	pGroup = IPCGroupFind(pTable, Name);
+	if (pGroup)
+	{
+		ppDestPorts = ExAllocatePoolWithTag(NonPagedPool, pGroup->nMembers * sizeof(PIPC_PORT), IPC_POOL_TAG);
+		if (!ppDestPorts)
+		{
+			ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		else
+		{
+			for (pTemp_ListEntry = pGroup->Member_List.Flink; pTemp_ListEntry != &(pGroup->Member_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+			{
+				pMember = CONTAINING_RECORD(pTemp_ListEntry, IPC_GROUP_MEMBER, group_entry);
+				if (pMember->pPort != pExclude)
+				{
+					IPCPortReference(pMember->pPort);
+					ppDestPorts[nDestPorts++] = pMember->pPort;
+				}
+			}
+		}
+	}
+
+	KeReleaseSpinLock(&(pTable->Group_List_SpinLock), Irql);
+
+	if (ppDestPorts)
+	{
+		*pnDelivered = IPCRouteFanOut(pTable, pIPC_Pkt, ppDestPorts, nDestPorts, pOverflow);
+		ExFreePoolWithTag(ppDestPorts, IPC_POOL_TAG);
+		ntStatus = *pnDelivered ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+	}
+
+	IPCPacketFree(pTable, pIPC_Pkt);
+
+	return ntStatus;
+}
+
+
+//=====================================================================
+// IPCRouteBroadcast
+//
+// Delivers a packet to every registered port. The ports are referenced
+// one bucket lock at a time into an array sized from the port count, a
+// port registered while the buckets are walked may be left out.
+//=====================================================================
+
+NTSTATUS IPCRouteBroadcast(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, PIPC_PORT pExclude, const IPC_OVERFLOW* pOverflow, PULONG pnDelivered)
+{
+	PIPC_PORT* ppDestPorts;
+	PIPC_PORT_BUCKET pBucket;
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_PORT pTemp_IPCPort;
+	ULONG nMaxPorts = (ULONG)pTable->nPorts;
+	ULONG nDestPorts = 0;
+	KIRQL Irql;
+	ULONG i;
+
+	*pnDelivered = 0;
+
+	ppDestPorts = nMaxPorts ? ExAllocatePoolWithTag(NonPagedPool, nMaxPorts * sizeof(PIPC_PORT), IPC_POOL_TAG) : NULL;
+	if (!ppDestPorts)
+	{
+		IPCPacketFree(pTable, pIPC_Pkt);
+		return nMaxPorts ? STATUS_INSUFFICIENT_RESOURCES : STATUS_NOT_FOUND;
+	}
+
+	for (i = 0; i < IPC_PORT_HASH_BUCKETS && nDestPorts < nMaxPorts; i++)
+	{
+		pBucket = &(pTable->Buckets[i]);
+		if (IsListEmpty(&(pBucket->Port_List)))
+		{
+			continue;	//Unlocked peek, a port registering right now may be missed anyway
+		}
+
+		KeAcquireSpinLock(&(pBucket->Port_List_SpinLock), &Irql);
+		for (pTemp_ListEntry = pBucket->Port_List.Flink; pTemp_ListEntry != &(pBucket->Port_List) && nDestPorts < nMaxPorts; pTemp_ListEntry = pTemp_ListEntry->Flink)
+		{
+			pTemp_IPCPort = CONTAINING_RECORD(pTemp_ListEntry, IPC_PORT, list_entry);
+			if (pTemp_IPCPort != pExclude)
+			{
+				IPCPortReference(pTemp_IPCPort);
+				ppDestPorts[nDestPorts++] = pTemp_IPCPort;
+			}
+		}
+		KeReleaseSpinLock(&(pBucket->Port_List_SpinLock), Irql);
+	}
+
+	*pnDelivered = IPCRouteFanOut(pTable, pIPC_Pkt, ppDestPorts, nDestPorts, pOverflow);
+	ExFreePoolWithTag(ppDestPorts, IPC_POOL_TAG);
+	IPCPacketFree(pTable, pIPC_Pkt);
+
+	return *pnDelivered ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+
+//=====================================================================
+// IPCCallRegister
+//
+// Gives a call the next call ID, skipping 0, and links it into its
+// bucket. The request has not been routed yet so no reply can match.
+//=====================================================================
+
+VOID IPCCallRegister(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, PIPC_PORT pCaller, size_t cbReplyMax)
+{
+	PIPC_CALL_BUCKET pBucket;
+	KIRQL Irql;
+
+	do
+	{
+		pCall->uiCallId = (UINT32)InterlockedIncrement(&(pTable->lLastCallId));
+	} while (pCall->uiCallId == 0);
+
+	pCall->pCaller = pCaller;
+	pCall->pCallee = NULL;
+	pCall->cbReplyMax = cbReplyMax;
+	pCall->pReply = NULL;
+
+	pBucket = IPCCallHash(pTable, pCall->uiCallId);
+	KeAcquireSpinLock(&(pBucket->Call_List_SpinLock), &Irql);
+	InsertTailList(&(pBucket->Call_List), &(pCall->list_entry));
+	KeReleaseSpinLock(&(pBucket->Call_List_SpinLock), Irql);
+}
+
+
+//=====================================================================
+// IPCCallCancel
+//
+// Removes a call from the registry unless it has been removed already.
+// A removed call's list entry points at itself.
+//=====================================================================
+
+BOOLEAN IPCCallCancel(PIPC_PORT_TABLE pTable, PIPC_CALL pCall)
+{
+	PIPC_CALL_BUCKET pBucket = IPCCallHash(pTable, pCall->uiCallId);
+	BOOLEAN bRemoved = FALSE;
+	KIRQL Irql;
+
+	KeAcquireSpinLock(&(pBucket->Call_List_SpinLock), &Irql);
+	if (!IsListEmpty(&(pCall->list_entry)))
+	{
+		RemoveEntryList(&(pCall->list_entry));
+		InitializeListHead(&(pCall->list_entry));
+		bRemoved = TRUE;
+	}
+	KeReleaseSpinLock(&(pBucket->Call_List_SpinLock), Irql);
+
+	return bRemoved;
+}
+
+
+//=====================================================================
+// IPCCallKeepReply / IPCCallTakeReply
+//
+// A reply larger than the caller's buffer is kept in the call, which
+// goes back into the registry, and the caller comes back for it with a
+// buffer that fits. Only the caller's port can take it. The callee is
+// done with the call, pCallee is cleared as its port holds no reference
+// and may be freed while the reply waits. If the caller is being removed
+// its IPCCallAbortPort may already have searched the bucket, so the call
+// is taken out again and the reply freed.
+//=====================================================================
+
+BOOLEAN IPCCallKeepReply(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, PIPC_PACKET pReply)
+{
+	PIPC_CALL_BUCKET pBucket = IPCCallHash(pTable, pCall->uiCallId);
+	KIRQL Irql;
+
+	pCall->pReply = pReply;
+	pCall->pCallee = NULL;
+
+	KeAcquireSpinLock(&(pBucket->Call_List_SpinLock), &Irql);
+	InsertTailList(&(pBucket->Call_List), &(pCall->list_entry));
+	KeReleaseSpinLock(&(pBucket->Call_List_SpinLock), Irql);
+
+	if (pCall->pCaller->bClosed && IPCCallCancel(pTable, pCall))
+	{
+		IPCPacketFree(pTable, pCall->pReply);
+		pCall->pReply = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+PIPC_CALL IPCCallTakeReply(PIPC_PORT_TABLE pTable, PIPC_PORT pCaller, UINT32 uiCallId)
+{
+	PIPC_CALL_BUCKET pBucket = IPCCallHash(pTable, uiCallId);
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_CALL pCall;
+	PIPC_CALL pFoundCall = NULL;
+	KIRQL Irql;
+
+	KeAcquireSpinLock(&(pBucket->Call_List_SpinLock), &Irql);
+	for (pTemp_ListEntry = pBucket->Call_List.Flink; pTemp_ListEntry != &(pBucket->Call_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+	{
+		pCall = CONTAINING_RECORD(pTemp_ListEntry, IPC_CALL, list_entry);
+		if (pCall->uiCallId == uiCallId && pCall->pCaller == pCaller && pCall->pReply)
+		{
+			RemoveEntryList(pTemp_ListEntry);
+			InitializeListHead(pTemp_ListEntry);
+			pFoundCall = pCall;
+			break;
+		}
+	}
+	KeReleaseSpinLock(&(pBucket->Call_List_SpinLock), Irql);
+
+	return pFoundCall;
+}
+
+
+//=====================================================================
+// IPCRouteCall
+//
+// Routes the request of a registered call in the caller's context, so a
+// reader parked on the callee is completed without a routing thread.
+// The callee is recorded under the bucket lock before the request is
+// queued. If the callee is already closed the call fails here, otherwise
+// IPCCallAbortPort will find the call when the callee goes away.
+//=====================================================================
+
+NTSTATUS IPCRouteCall(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, PIPC_PACKET pIPC_Pkt, const IPC_OVERFLOW* pOverflow)
+{
+	PIPC_CALL_BUCKET pBucket = IPCCallHash(pTable, pCall->uiCallId);
+	PIPC_PORT pDestPort;
+	BOOLEAN bClosed;
+	NTSTATUS ntStatus;
+	KIRQL Irql;
+
+	pIPC_Pkt->header.uiCallId = pCall->uiCallId;
+
+	ntStatus = IPCRouteAdmit(pTable, pIPC_Pkt, pOverflow);
+	if (!NT_SUCCESS(ntStatus))
+	{
+		IPCPacketFree(pTable, pIPC_Pkt);
+		return ntStatus;
+	}
+
+	pDestPort = IPCPacketBlock(pIPC_Pkt)->pDestPort;
+
+	KeAcquireSpinLock(&(pBucket->Call_List_SpinLock), &Irql);
+	bClosed = pDestPort->bClosed;
+	pCall->pCallee = bClosed ? NULL : pDestPort;
+	KeReleaseSpinLock(&(pBucket->Call_List_SpinLock), Irql);
+
+	if (bClosed)
+	{
+		IPCPacketFree(pTable, pIPC_Pkt);
+		return STATUS_NOT_FOUND;
+	}
+
+	return IPCRouteDeliver(pTable, pIPC_Pkt);
+}
+
+
+//=====================================================================
+// IPCRouteReply
+//
+// Matches a reply to its call by call ID. Only the process the request
+// was delivered to may reply, and only once. The call is removed from
+// the registry and completed through pfnCompleteCall in the replier's
+// context, which copies the reply straight to the caller: no packet is
+// allocated, queued or read back, and no event is signalled.
+//=====================================================================
+
+NTSTATUS IPCRouteReply(PIPC_PORT_TABLE pTable, PIPC_WIRE_HEADER pReply, HANDLE dwReplierPid)
+{
+	UINT32 uiCallId = IPCWireCallId(pReply);
+	PIPC_CALL_BUCKET pBucket = IPCCallHash(pTable, uiCallId);
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_CALL pCall;
+	PIPC_CALL pFoundCall = NULL;
+	KIRQL Irql;
+
+	if (!pTable->pfnCompleteCall || uiCallId == 0)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	KeAcquireSpinLock(&(pBucket->Call_List_SpinLock), &Irql);
+	for (pTemp_ListEntry = pBucket->Call_List.Flink; pTemp_ListEntry != &(pBucket->Call_List); pTemp_ListEntry = pTemp_ListEntry->Flink)
+	{
+		pCall = CONTAINING_RECORD(pTemp_ListEntry, IPC_CALL, list_entry);
+		if (pCall->uiCallId == uiCallId)
+		{
+			//A kept reply means the callee already replied and pCallee may be gone, test it first
+
+			if (!pCall->pReply && pCall->pCallee && pCall->pCallee->dwPID == dwReplierPid)
+			{
+				RemoveEntryList(pTemp_ListEntry);
+				InitializeListHead(pTemp_ListEntry);
+				pFoundCall = pCall;
+			}
+			break;
+		}
+	}
+	KeReleaseSpinLock(&(pBucket->Call_List_SpinLock), Irql);
+
+	if (!pFoundCall)
+	{
+		DbgPrint("No call waiting for the reply\n");
+		return STATUS_NOT_FOUND;
+	}
+
+	pReply->dwPid = (UINT32)(ULONG_PTR)dwReplierPid;
+	pTable->pfnCompleteCall(pTable, pFoundCall, pReply);
+
+	InterlockedIncrement64(&(pTable->nPktCopies));
+	InterlockedExchangeAdd64(&(pTable->nPktBytesCopied), (LONG64)IPCWireLength(pReply));
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCPortSetEvent
+//
+// Saves the Read notification event of a port. Any previously registered
+// event is released. The swap happens under the incoming queue lock so that
+// a concurrent delivery never signals an event that is being released.
+//=====================================================================
+
+VOID IPCPortSetEvent(PIPC_PORT pPort, PKEVENT pKevent)
+{
+	PKEVENT pOldKevent;
+	KIRQL Irql;
+
+	KeAcquireSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+	pOldKevent = pPort->pKevent;
+	pPort->pKevent = pKevent;
+	KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+
+	if (pOldKevent)
+	{
+		IPC_RELEASE_EVENT(pOldKevent);
+	}
+}
+
+
+//=====================================================================
+// IPCPortDequeue
+//
+// Removes the next packet of the incoming lanes, see IPCPortNextLane. If
+// the lanes are empty afterwards the Read notification event is reset.
+//=====================================================================
+
+PIPC_PACKET IPCPortDequeue(PIPC_PORT pPort)
+{
+	PLIST_ENTRY pTemp_ListEntry = NULL;
+	PIPC_PACKET pIPC_Pkt;
+	KIRQL Irql;
+
+	KeAcquireSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+
+	if (!IPCPortLanesEmpty(pPort))
+	{
+		pTemp_ListEntry = IPCPortRemoveLaneHead(pPort, IPCPortNextLane(pPort));
+	}
+
+	//If Incoming IPC Packet queue is empty reset the Read Event
+
+	if (IPCPortLanesEmpty(pPort) && pPort->pKevent)
+	{
+		KeClearEvent(pPort->pKevent);
+	}
+
+	KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+
+	if (!pTemp_ListEntry)
+	{
+		return NULL;
+	}
+
+	pIPC_Pkt = CONTAINING_RECORD(pTemp_ListEntry, IPC_PACKET, list_entry);
+	IPCPortCountTraffic(pPort, IPC_STAT_PKTS_OUT, 1, pIPC_Pkt->header.sizeofpayload);
+
+	return pIPC_Pkt;
+}
+
+
+//=====================================================================
+// IPCPortDequeueOldest
+//
+// Removes the oldest packet of the lowest priority lane holding one, the
+// packet IPC_OVERFLOW_DROP_OLDEST gives up first. If the lanes are empty
+// afterwards the Read notification event is reset.
+//=====================================================================
+
+PIPC_PACKET IPCPortDequeueOldest(PIPC_PORT pPort)
+{
+	PLIST_ENTRY pTemp_ListEntry = NULL;
+	ULONG uiLane;
+	KIRQL Irql;
+
+	KeAcquireSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+
+	for (uiLane = 0; uiLane < IPC_PRIORITY_LANES; uiLane++)
+	{
+		if (!IsListEmpty(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane])))
+		{
+			pTemp_ListEntry = RemoveHeadList(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane]));
+			pPort->Pkt_Queue.nDepth--;
+			break;
+		}
+	}
+
+	if (IPCPortLanesEmpty(pPort) && pPort->pKevent)
+	{
+		KeClearEvent(pPort->pKevent);
+	}
+
+	KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+
+	return pTemp_ListEntry ? CONTAINING_RECORD(pTemp_ListEntry, IPC_PACKET, list_entry) : NULL;
+}
+
+
+//=====================================================================
+// IPCPortSetLaneWeights
+//
+// Sets the read order of a port's lanes. All weights 0 selects strict
+// priority, otherwise a weight of 0 counts as 1 so every lane is read
+// at least once per round. The new weights take effect with a new round.
+//=====================================================================
+
+VOID IPCPortSetLaneWeights(PIPC_PORT pPort, const IPC_LANE_WEIGHTS* pWeights)
+{
+	BOOLEAN bWeighted = FALSE;
+	ULONG uiLane;
+	KIRQL Irql;
+
+	for (uiLane = 0; uiLane < IPC_PRIORITY_LANES; uiLane++)
+	{
+		if (pWeights->Weights[uiLane])
+		{
+			bWeighted = TRUE;
+		}
+	}
+
+	KeAcquireSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+
+	for (uiLane = 0; uiLane < IPC_PRIORITY_LANES; uiLane++)
+	{
+		pPort->Pkt_Queue.LaneWeights[uiLane] = bWeighted && !pWeights->Weights[uiLane] ? 1 : pWeights->Weights[uiLane];
+		pPort->Pkt_Queue.LaneCredits[uiLane] = 0;
+	}
+	pPort->Pkt_Queue.bWeighted = bWeighted;
+
+	KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+}
+
+
+//=====================================================================
+// IPCPortDequeueOrPark
+//
+// Same as IPCPortDequeue, except that a reader finding the lanes empty
+// is parked under the incoming queue lock. A packet routed afterwards
+// sees the parked reader and is handed to it directly. The next packet
+// is only removed if it fits the reader's buffer, so a reader retrying
+// with a larger buffer gets the same packet and the order is kept.
+//=====================================================================
+
+PIPC_PACKET IPCPortDequeueOrPark(PIPC_PORT pPort, size_t cbBuffer, PVOID pReader, NTSTATUS* pStatus, size_t* pcbRequired)
+{
+	PIPC_PORT_TABLE pTable = pPort->pTable;
+	PLIST_ENTRY pTemp_ListEntry = NULL;
+	PIPC_PACKET pIPC_Pkt;
+	size_t uiPacketLength;
+	ULONG uiLane;
+	KIRQL Irql;
+
+	*pcbRequired = 0;
+
+	KeAcquireSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+
+	if (!IPCPortLanesEmpty(pPort))
+	{
+		uiLane = IPCPortNextLane(pPort);
+		uiPacketLength = IPCPacketReadLength(CONTAINING_RECORD(pPort->Pkt_Queue.Ipc_Pkt_In_Queue[uiLane].Flink, IPC_PACKET, list_entry));
+		if (uiPacketLength <= cbBuffer)
+		{
+			pTemp_ListEntry = IPCPortRemoveLaneHead(pPort, uiLane);
+			*pStatus = STATUS_SUCCESS;
+		}
+		else
+		{
+			*pcbRequired = uiPacketLength;
+			*pStatus = STATUS_BUFFER_OVERFLOW;
+		}
+	}
+	else
+	{
+		*pStatus = pTable->ReaderOps.pfnParkReader ? pTable->ReaderOps.pfnParkReader(pPort, pReader) : STATUS_NO_MORE_ENTRIES;
+	}
+
+	//If Incoming IPC Packet queue is empty reset the Read Event
+
+	if (IPCPortLanesEmpty(pPort) && pPort->pKevent)
+	{
+		KeClearEvent(pPort->pKevent);
+	}
+
+	KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+
+	if (!pTemp_ListEntry)
+	{
+		if (*pStatus == STATUS_BUFFER_OVERFLOW)
+		{
+			IPCPortCountStat(pTable, pPort, IPC_STAT_TOO_SMALL, 1);
+		}
+		return NULL;
+	}
+
+	pIPC_Pkt = CONTAINING_RECORD(pTemp_ListEntry, IPC_PACKET, list_entry);
+	IPCPortCountTraffic(pPort, IPC_STAT_PKTS_OUT, 1, pIPC_Pkt->header.sizeofpayload);
+
+	return pIPC_Pkt;
+}
+
+
+//=====================================================================
+// IPCPortDequeueBatchOrPark
+//
+// Takes packets off the incoming lanes in the order IPCPortDequeue would,
+// adding up the batch layout size of each, until the next one does not
+// fit. The packets taken from a lane in one go, the rest of the lane or
+// its remaining credit, are cut off the lane as a whole. Only list links
+// are changed under the lock, the packets are copied out by the caller
+// after it is released. If the lanes are empty and pReader is set, the
+// reader is parked under the same lock acquisition.
+//=====================================================================
+
+ULONG IPCPortDequeueBatchOrPark(PIPC_PORT pPort, ULONG nMaxPkts, size_t cbBatch, PVOID pReader, PLIST_ENTRY pList,
+	size_t* pcbNext, NTSTATUS* pStatus)
+{
+	PIPC_PACKET_QUEUE pQueue = &(pPort->Pkt_Queue);
+	PLIST_ENTRY pInQueue;
+	PLIST_ENTRY pTemp_ListEntry;
+	PIPC_PACKET pTemp_IPC_Pkt;
+	size_t uiUsed = sizeof(IPC_BATCH_HEADER);
+	size_t uiPacketLength;
+	size_t cbPayload = 0;
+	BOOLEAN bFull = FALSE;
+	ULONG nPkts = 0;
+	ULONG nRun;
+	ULONG uiLane;
+	KIRQL Irql;
+
+	InitializeListHead(pList);
+	*pcbNext = 0;
+	*pStatus = STATUS_NO_MORE_ENTRIES;
+
+	KeAcquireSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), &Irql);
+
+	while (!bFull && nPkts < nMaxPkts && (uiLane = IPCPortNextLane(pPort)) < IPC_PRIORITY_LANES)
+	{
+		//Find the last packet of the lane which fits
+
+		pInQueue = &(pQueue->Ipc_Pkt_In_Queue[uiLane]);
+		nRun = 0;
+
+		for (pTemp_ListEntry = pInQueue->Flink; pTemp_ListEntry != pInQueue && nPkts < nMaxPkts; pTemp_ListEntry = pTemp_ListEntry->Flink)
+		{
+			if (pQueue->bWeighted && nRun == pQueue->LaneCredits[uiLane])
+			{
+				break;
+			}
+
+			pTemp_IPC_Pkt = CONTAINING_RECORD(pTemp_ListEntry, IPC_PACKET, list_entry);
+			uiPacketLength = IPCPacketReadLength(pTemp_IPC_Pkt);
+
+			if (IPC_BATCH_ALIGN_UP(uiUsed) + uiPacketLength > cbBatch)
+			{
+				if (nPkts == 0)
+				{
+					*pcbNext = uiPacketLength;
+				}
+				bFull = TRUE;
+				break;
+			}
+
+			uiUsed = IPC_BATCH_ALIGN_UP(uiUsed) + uiPacketLength;
+			cbPayload += pTemp_IPC_Pkt->header.sizeofpayload;
+			nPkts++;
+			nRun++;
+		}
+
+		//Move the packets in front of pTemp_ListEntry to the tail of the caller's list
+
+		if (nRun)
+		{
+			pInQueue->Flink->Blink = pList->Blink;
+			pList->Blink->Flink = pInQueue->Flink;
+			pTemp_ListEntry->Blink->Flink = pList;
+			pList->Blink = pTemp_ListEntry->Blink;
+			pInQueue->Flink = pTemp_ListEntry;
+			pTemp_ListEntry->Blink = pInQueue;
+			pQueue->nDepth -= nRun;
+
+			if (pQueue->bWeighted)
+			{
+				pQueue->LaneCredits[uiLane] = IsListEmpty(pInQueue) ? 0 : pQueue->LaneCredits[uiLane] - nRun;
+			}
+		}
+	}
+
+	if (nPkts)
+	{
+		*pStatus = STATUS_SUCCESS;
+	}
+	else if (*pcbNext)
+	{
+		*pStatus = STATUS_BUFFER_OVERFLOW;
+	}
+	else if (pReader && pPort->pTable->ReaderOps.pfnParkReader && IPCPortLanesEmpty(pPort))
+	{
+		*pStatus = pPort->pTable->ReaderOps.pfnParkReader(pPort, pReader);
+	}
+
+	//If Incoming IPC Packet queue is empty reset the Read Event
+
+	if (IPCPortLanesEmpty(pPort) && pPort->pKevent)
+	{
+		KeClearEvent(pPort->pKevent);
+	}
+
+	KeReleaseSpinLock(&(pPort->Pkt_Queue.Ipc_Pkt_In_Queue_SpinLock), Irql);
+
+	if (nPkts)
+	{
+		IPCPortCountTraffic(pPort, IPC_STAT_PKTS_OUT, nPkts, cbPayload);
+	}
+	else if (*pcbNext)
+	{
+		IPCPortCountStat(pPort->pTable, pPort, IPC_STAT_TOO_SMALL, 1);
+	}
+
+	return nPkts;
+}
+
+
+//=====================================================================
+// IPCPortDequeueBatch
+//
+// IPCPortDequeueBatchOrPark without a reader, an empty port returns 0.
+//=====================================================================
+
+ULONG IPCPortDequeueBatch(PIPC_PORT pPort, ULONG nMaxPkts, size_t cbBatch, PLIST_ENTRY pList, size_t* pcbNext)
+{
+	NTSTATUS ntStatus;
+
+	return IPCPortDequeueBatchOrPark(pPort, nMaxPkts, cbBatch, NULL, pList, pcbNext, &ntStatus);
+}
@@ -0,0 +1,663 @@
+//=====================================================================
+// IPC- Inter Process Communication Routing Core Header File
+//
+// This file contains the structure definitions and Function declarations
+// of the routing core used by IPCDrv.c. The routing core keeps the registry
+// of User mode ports and moves packets between them. It has no dependency on
+// IRPs or device objects so it can also be built in user mode (see IPCShim_v2.h)
+// and load tested against thousands of simulated ports.
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+#pragma once
+
+//Include Files
+
+#include "IPCShim_v2.h"
+#include "IPCPool_v2.h"
+#include "../IPC_Dll_v2/IPC_Wire_v2.h"
+
+//Constants
+
+#define IPC_POOL_TAG (LONG)0x31435049		//Pool tag used for all driver allocations, '1CPI' as a character constant
+#define IPC_PORT_HASH_BUCKETS 1024		//Number of buckets in the port table, must be a power of 2
+#define IPC_PACKET_SIZE_CLASSES 10		//Packet pool size classes, 128 bytes up to 64KB in powers of 2
+#define IPC_GROUP_NAME_MAX 32			//Size of a multicast group name including the terminating NUL
+#define IPC_PRIORITY_LANES 4			//Incoming lanes of a port, one per packet priority, 0 is the lowest
+#define IPC_ENDPOINT_NAME_MAX 32		//Size of an endpoint name including the terminating NUL
+#define IPC_ENDPOINT_SLOTS 1024			//Endpoints registered at a time, must be a power of 2 no larger than 32768
+#define IPC_CALL_BUCKETS 256			//Buckets of the pending call registry, must be a power of 2
+#define IPC_CACHE_LINE 64				//Alignment of the per processor counter blocks
+
+//An endpoint handle is passed wherever a destination PID is. Windows PIDs are multiples of 4, so the
+//low bit marks a handle, bits 1-15 hold the slot of the endpoint and bits 16-31 the slot's generation
+
+#define IPC_ENDPOINT_TAG 1
+#define IPCIsEndpointHandle(dwPID) (((ULONG_PTR)(dwPID) & IPC_ENDPOINT_TAG) != 0)
+#define IPCEndpointHandle(uiSlot, uiGeneration) ((((ULONG)(uiGeneration) & 0xFFFF) << 16) | ((ULONG)(uiSlot) << 1) | IPC_ENDPOINT_TAG)
+#define IPCEndpointSlot(dwHandle) ((ULONG)(((ULONG_PTR)(dwHandle) >> 1) & (IPC_ENDPOINT_SLOTS - 1)))
+#define IPCEndpointGeneration(dwHandle) ((ULONG)(((ULONG_PTR)(dwHandle) >> 16) & 0xFFFF))
+
+//Structure definitions
+
+struct _IPC_PORT_TABLE;
+
+//IPC_OVERFLOW_POLICY selects what happens to a sender's packet when the destination port is over its queue limit
+
+typedef enum _IPC_OVERFLOW_POLICY
+{
+	IPC_OVERFLOW_FAIL,					//The packet is rejected with STATUS_QUOTA_EXCEEDED
+	IPC_OVERFLOW_BLOCK,					//The sender waits for the receiver to free credits
+	IPC_OVERFLOW_DROP_OLDEST			//The oldest packets queued to the destination are dropped to make room
+}IPC_OVERFLOW_POLICY;
+
+//The IPC_OVERFLOW structure is the overflow policy of the packets a port sends
+
+typedef struct _IPC_OVERFLOW
+{
+	UINT32 uiPolicy;					//IPC_OVERFLOW_POLICY
+	UINT32 uiTimeoutMs;					//IPC_OVERFLOW_BLOCK: longest wait without a credit being returned, MAXULONG for no limit
+}IPC_OVERFLOW, *PIPC_OVERFLOW;
+
+//The IPC_QUEUE_LIMIT structure bounds what may be queued to a port, 0 means no limit
+
+typedef struct _IPC_QUEUE_LIMIT
+{
+	UINT32 nMaxPkts;					//Packets
+	UINT32 uiReserved;					//Must be 0
+	UINT64 cbMaxBytes;					//Bytes of packet header and payload
+}IPC_QUEUE_LIMIT, *PIPC_QUEUE_LIMIT;
+
+//The IPC_CREDITS structure tells a sender how much more a port accepts before it is over its limit
+
+typedef struct _IPC_CREDITS
+{
+	UINT32 nPkts;						//Packets the port still accepts, MAXULONG if it has no packet limit
+	UINT32 nQueuedPkts;					//Packets charged to the port, 0 if it has no limit
+	UINT64 cbBytes;						//Bytes the port still accepts, all ones if it has no byte limit
+	UINT64 cbQueuedBytes;				//Bytes charged to the port, 0 if it has no limit
+	UINT64 nDropped;					//Packets dropped from the port's queue for IPC_OVERFLOW_DROP_OLDEST senders
+}IPC_CREDITS, *PIPC_CREDITS;
+
+//The IPC_PACKET_QUEUE structure contains the ListHeads for the Incoming Packet queue, one lane per
+//packet priority. It also contains the Spin Lock used for Synchronizing List Access.
+//Written packets are handed straight to the destination so there is no Outgoing queue.
+//Readers take the head of the highest priority lane holding a packet, or follow the lane
+//weights if the port has any, so packets are kept in order within a lane only
+
+typedef struct _IPC_PACKET_QUEUE
+{
+	LIST_ENTRY Ipc_Pkt_In_Queue[IPC_PRIORITY_LANES];	//ListHeads for the Incoming Packet lanes, indexed by priority
+	KSPIN_LOCK Ipc_Pkt_In_Queue_SpinLock;	//Spinlock for synchronizing Incoming Packet Queue Access
+	BOOLEAN bWeighted;						//Lanes are read in weighted round robin order instead of strict priority
+	ULONG LaneWeights[IPC_PRIORITY_LANES];	//Packets each lane may give per round while bWeighted is set
+	ULONG LaneCredits[IPC_PRIORITY_LANES];	//Packets each lane may still give in the current round
+	ULONG nDepth;							//Packets in the lanes
+	ULONG nPeakDepth;						//Highest nDepth seen
+}IPC_PACKET_QUEUE, *PIPC_PACKET_QUEUE;
+
+//The IPC_LANE_WEIGHTS structure sets the read order of a port's lanes. With every weight 0 the
+//lanes are read in strict priority order, otherwise each round a lane gives up to its weight in
+//packets, higher priority lanes first, and a weight of 0 counts as 1 so no lane is starved
+
+typedef struct _IPC_LANE_WEIGHTS
+{
+	UINT32 Weights[IPC_PRIORITY_LANES];		//Weight of each lane, indexed by priority
+}IPC_LANE_WEIGHTS, *PIPC_LANE_WEIGHTS;
+
+//IPC_STAT indexes the counters a port keeps per processor. Traffic counters count payload bytes.
+//A count that cannot be charged to a port goes to the port table's own counters
+
+typedef enum _IPC_STAT
+{
+	IPC_STAT_PKTS_IN,					//Packets queued to the port or handed straight to one of its readers
+	IPC_STAT_BYTES_IN,					//Payload bytes of those packets
+	IPC_STAT_PKTS_OUT,					//Packets taken by the port's readers
+	IPC_STAT_BYTES_OUT,					//Payload bytes of those packets
+	IPC_STAT_UNDELIVERABLE,				//Packets sent by the port which had no destination port and were dropped
+	IPC_STAT_ALLOC_FAILURES,			//Packets of the port the packet pool could not allocate
+	IPC_STAT_TOO_SMALL,					//Reads and calls of the port completed without the packet, their buffer was too small
+	IPC_STAT_COUNTERS
+}IPC_STAT;
+
+//The IPC_STATS_CPU structure holds the counters of one processor. It fills a cache line and
+//every block starts on one, so processors counting for the same port never share a line
+
+#define IPC_STATS_SLOTS (IPC_CACHE_LINE / sizeof(LONG64))
+
+typedef struct _IPC_STATS_CPU
+{
+	volatile LONG64 Counters[IPC_STATS_SLOTS];	//Indexed by IPC_STAT, the rest is padding
+}IPC_STATS_CPU, *PIPC_STATS_CPU;
+
+#define IPCStatsAlign(p) ((PIPC_STATS_CPU)(((ULONG_PTR)(p) + IPC_CACHE_LINE - 1) & ~((ULONG_PTR)IPC_CACHE_LINE - 1)))
+
+//The IPC_PORT structure acts as a port which the driver maintains
+//for every User mode process which interfaces with the driver.
+//FsContext of the File object points back to the port and FsContext2 to its packet queues
+
+typedef struct _IPC_PORT
+{
+	HANDLE dwPID;			//PID of the User mode process which calls CreateFile to get a handle to the Device
+	PKEVENT pKevent;		//Read Notification event which is registered by the User mode process
+	LIST_ENTRY list_entry;  //Doubly linked List Entry, links the port into its port table hash bucket
+	PFILE_OBJECT pFileObj;  //Pointer to File object which is unique to every User mode process, our driver uses this to maintain packet queues for this process
+	volatile LONG lRefCount;			//Reference count, the port is freed when the last reference is dropped
+	struct _IPC_PORT_TABLE* pTable;		//Port table the port belongs to, queued packets are returned to its packet pool
+	PVOID pReaderContext;				//Pending reader state of the driver, stored right after the port (NULL if none)
+	LIST_ENTRY Group_List;				//Multicast groups the port has joined (IPC_GROUP_MEMBER), protected by the table's group lock
+	IPC_PACKET_QUEUE Pkt_Queue;			//Incoming packet queue of this port
+	IPC_QUEUE_LIMIT Limit;				//Limit of the incoming queue, packets are only charged to the port while it has one
+	volatile LONG nQueuedPkts;			//Packets charged to the port and not yet freed
+	volatile LONG64 cbQueuedBytes;		//Bytes charged to the port and not yet freed
+	volatile LONG64 nDropped;			//Packets dropped from the incoming queue for IPC_OVERFLOW_DROP_OLDEST senders
+	volatile LONG nCreditWaiters;		//IPC_OVERFLOW_BLOCK senders waiting for credits
+	volatile BOOLEAN bClosed;			//Set when the port is removed from the port table, waiting senders give up
+	KEVENT CreditEvent;					//Notification event signalled when credits are returned to waiting senders
+	IPC_OVERFLOW Overflow;				//Overflow policy of the packets this port sends
+	ULONG dwEndpoint;					//Handle of the endpoint registered for the port, 0 if none
+	char szEndpoint[IPC_ENDPOINT_NAME_MAX];	//Name of that endpoint, NUL padded, protected by the table's endpoint lock
+	PIPC_STATS_CPU pStats;				//Per processor counters, allocated with the port after the reader state
+	volatile LONG lTrace;				//Packets queued to the port are flagged IPC_PACKET_TRACED while set
+	struct _IPC_TRACE_STATS* pTrace;	//Latency histograms, allocated when tracing is first switched on, else NULL
+}IPC_PORT, *PIPC_PORT;
+
+//The IPC_PORT_STATS structure returns the counters of a port summed over all processors, or the
+//totals of the port table (ports already freed included) with dwPID 0
+
+typedef struct _IPC_PORT_STATS
+{
+	DWORD32 dwPID;						//PID of the port's process, 0 for the totals
+	UINT32 nDepth;						//Packets queued to the port and not yet read or dropped, summed for the totals
+	UINT32 nPeakDepth;					//Most packets its incoming lanes held at once, the highest of any port for the totals
+	UINT32 uiReserved;					//0
+	char szEndpoint[IPC_ENDPOINT_NAME_MAX];	//Endpoint name of the port, empty if it has none
+	UINT64 nPktsIn;						//IPC_STAT_PKTS_IN
+	UINT64 cbBytesIn;					//IPC_STAT_BYTES_IN
+	UINT64 nPktsOut;					//IPC_STAT_PKTS_OUT
+	UINT64 cbBytesOut;					//IPC_STAT_BYTES_OUT
+	UINT64 nUndeliverable;				//IPC_STAT_UNDELIVERABLE
+	UINT64 nAllocFailures;				//IPC_STAT_ALLOC_FAILURES
+	UINT64 nTooSmall;					//IPC_STAT_TOO_SMALL
+	UINT64 nDropped;					//Packets dropped from the incoming queue for IPC_OVERFLOW_DROP_OLDEST senders
+}IPC_PORT_STATS, *PIPC_PORT_STATS;
+
+//The IPC_ROUTER_STATS structure returns the counters of one routing thread (IPCRouter_v2.h). The latency
+//of a packet runs from the write queueing it to the end of the routing call which delivered it
+
+#define IPC_STATS_ROUTER_THREADS 64		//Entries of IPC_STATS.Router, the most routing threads a router starts
+
+typedef struct _IPC_ROUTER_STATS
+{
+	UINT64 nPkts;						//Packets routed
+	UINT64 nDrains;						//Wake ups which found packets queued
+	UINT64 llLatencyTotal;				//Sum of the packets' latencies, in nanoseconds
+	UINT64 llLatencyMax;				//Largest latency of a packet, in nanoseconds
+	UINT32 nBacklog;					//Packets queued to the thread and not yet routed
+	UINT32 uiCpu;						//Processor the thread is bound to
+}IPC_ROUTER_STATS, *PIPC_ROUTER_STATS;
+
+//The IPC_STATS structure is returned by a statistics query, the totals and nReturned ports follow nPorts
+
+typedef struct _IPC_STATS
+{
+	UINT32 nPorts;						//Ports registered, more than nReturned if the buffer was too small for all of them
+	UINT32 nReturned;					//Entries of Ports
+	IPC_PORT_STATS Totals;				//Counters of the whole table
+	UINT32 nRouterThreads;				//Entries of Router, 0 if packets are not routed by routing threads
+	UINT32 uiReserved;					//0
+	IPC_ROUTER_STATS Router[IPC_STATS_ROUTER_THREADS];	//Counters of each routing thread
+	IPC_PORT_STATS Ports[];				//Counters of each port
+}IPC_STATS, *PIPC_STATS;
+
+//The IPC_PACKET struct is the routing core's descriptor of a message passed between 2 UserMode
+//processes. It never crosses the user/kernel boundary: IPCPacketCreate builds it from the
+//IPC_WIRE_HEADER of a written packet and IPCPacketCopyOut writes one back for the reader
+
+typedef struct _IPC_PACKET {
+	struct _header {					//Packet Header which contains some metadata about the message
+		DWORD32 dwSourcePid;			//PID of the sending process, taken from its port rather than from the packet
+		UINT32 uiPriority;				//Incoming lane of the destination, priorities above the highest lane use the highest lane
+		HANDLE dwDestinationPid;		//Destination process PID to which the message is targetted
+		size_t sizeofpayload;			//Size of the payload(buffer)
+		UINT32 nPacketid;				//Packet ID
+		UINT32 EndofPacket;				//1 indicates End of this Packet
+		UINT32 uiCallId;				//Call the request belongs to or the reply answers, set by the routing core, 0 for other packets
+		UINT32 uiFlags;					//IPC_PACKET_TRACED if an IPC_PACKET_TRACE follows the payload when read, set by the routing core
+	}header;
+	LIST_ENTRY list_entry;				//List entry used to queue the packets
+	char szbuffer[];					//Flexible Array Member buffer,can contain variable size of chars
+}IPC_PACKET, *PIPC_PACKET;
+
+//Per stage timestamps (IPC_PACKET_TRACE of IPC_Wire_v2.h), compiled out with IPC_TRACE 0. A port
+//switches them on for the packets it receives with IPCPortSetTrace. While any port traces, packets
+//are stamped as they are written and copied in, and a packet queued to a tracing port is flagged
+//IPC_PACKET_TRACED. When it is read its stamps follow the payload, and the spans between them go
+//into the port's histograms
+
+#ifndef IPC_TRACE
+#define IPC_TRACE 1
+#endif
+
+#define IPC_PACKET_TRACED 0x1		//uiFlags: an IPC_PACKET_TRACE follows the payload
+
+//A histogram is kept per span of a packet's life. Bucket i counts spans of 2^i to 2^(i+1)-1
+//nanoseconds, bucket 0 also counts 0 and the last bucket everything longer
+
+typedef enum _IPC_TRACE_SPAN
+{
+	IPC_TRACE_SPAN_COPY,				//IPC_TRACE_WRITE to IPC_TRACE_COPIED, allocating and copying the packet in
+	IPC_TRACE_SPAN_ROUTE,				//IPC_TRACE_COPIED to IPC_TRACE_QUEUED, waiting for and being routed by a routing thread
+	IPC_TRACE_SPAN_QUEUE,				//IPC_TRACE_QUEUED to IPC_TRACE_READ, waiting in the queue, the reader's wake up included
+	IPC_TRACE_SPAN_TOTAL,				//IPC_TRACE_WRITE to IPC_TRACE_READ
+	IPC_TRACE_SPANS
+}IPC_TRACE_SPAN;
+
+#define IPC_TRACE_BUCKETS 32
+
+typedef struct _IPC_TRACE_STATS
+{
+	UINT32 bEnabled;					//Tracing is switched on for the port
+	UINT32 uiReserved;					//0
+	UINT64 Counts[IPC_TRACE_SPANS][IPC_TRACE_BUCKETS];	//Packets read per span and bucket
+}IPC_TRACE_STATS, *PIPC_TRACE_STATS;
+
+//Bytes of the wire packet of a descriptor (IPCPacketWireLength) and the bytes a reader needs for it,
+//its stamps included if it is traced
+
+#define IPCPacketWireLength(pIPC_Pkt) (sizeof(IPC_WIRE_HEADER) + ((pIPC_Pkt)->header.uiCallId ? sizeof(IPC_WIRE_CALL_ID) : 0) + \
+	(pIPC_Pkt)->header.sizeofpayload)
+
+#if IPC_TRACE
+#define IPCPacketReadLength(pIPC_Pkt) (IPCPacketWireLength(pIPC_Pkt) + \
+	(((pIPC_Pkt)->header.uiFlags & IPC_PACKET_TRACED) ? sizeof(IPC_PACKET_TRACE) : 0))
+#else
+#define IPCPacketReadLength(pIPC_Pkt) IPCPacketWireLength(pIPC_Pkt)
+#endif
+
+//The IPC_PACKET_BLOCK structure precedes every IPC Packet allocated by the routing core and is
+//never copied in from or out to user mode. A multicast packet is stored once and referenced by a
+//descriptor per recipient: a header only IPC Packet whose pShared points at the stored packet
+
+typedef struct _IPC_PACKET_BLOCK
+{
+	volatile LONG lRefCount;			//References on the packet, more than 1 only while it is shared by descriptors
+	struct _IPC_PACKET* pShared;		//Packet the payload is read from, NULL if the payload follows the header
+	PIPC_PORT pDestPort;				//Referenced destination port from IPCRouteAdmit until the packet is queued, else NULL
+	PIPC_PORT pCharged;					//Port whose credits the packet holds until it is freed, NULL if none
+	LONG64 llRouterQueued;				//Performance counter when the packet was queued to a routing thread
+#if IPC_TRACE
+	LONG64 TraceStamps[IPC_TRACE_READ];	//IPC_TRACE_WRITE to IPC_TRACE_QUEUED, all 0 if the packet was created while no port traced
+	PIPC_PORT pTracePort;				//Tracing port the packet was queued to, its histograms count the packet when it is read
+#endif
+}IPC_PACKET_BLOCK, *PIPC_PACKET_BLOCK;
+
+#define IPCPacketBlock(pIPC_Pkt) (((PIPC_PACKET_BLOCK)(pIPC_Pkt)) - 1)
+
+//Returns the incoming lane of an IPC Packet
+
+#define IPCPacketLane(pIPC_Pkt) ((pIPC_Pkt)->header.uiPriority < IPC_PRIORITY_LANES ? (ULONG)(pIPC_Pkt)->header.uiPriority : IPC_PRIORITY_LANES - 1)
+
+//The IPC_BATCH_HEADER structure starts a batch of packets sent or received with one request.
+//nPackets IPC Packets follow it back to back, each starting on an IPC_BATCH_ALIGN boundary
+
+#define IPC_BATCH_ALIGN 8
+#define IPC_BATCH_ALIGN_UP(uiLength) (((uiLength) + IPC_BATCH_ALIGN - 1) & ~((size_t)IPC_BATCH_ALIGN - 1))
+
+typedef struct _IPC_BATCH_HEADER {
+	UINT32 nPackets;					//Number of IPC Packets in the batch
+	UINT32 cbNext;						//Receive: size of the next queued packet if it did not fit, else 0. Send: must be 0
+}IPC_BATCH_HEADER, *PIPC_BATCH_HEADER;
+
+//The IPC_RECV_BATCH structure is the optional input of a batch receive. With IPC_RECV_BATCH_WAIT a receive
+//finding the port empty is parked like a read, and the next packet routed to the port completes it as a batch
+//of one. Any number of threads can so wait on one port, and each packet goes to exactly one of them
+
+#define IPC_RECV_BATCH_WAIT 0x1		//Park the receive on an empty port
+
+typedef struct _IPC_RECV_BATCH {
+	UINT32 nMaxPkts;					//Most packets to return, 0 for no limit
+	UINT32 uiFlags;						//IPC_RECV_BATCH_* flags
+}IPC_RECV_BATCH, *PIPC_RECV_BATCH;
+
+//Bytes a packet takes when a parked batch receive is completed with it
+
+#define IPCPacketBatchLength(pIPC_Pkt) (IPC_BATCH_ALIGN_UP(sizeof(IPC_BATCH_HEADER)) + IPCPacketReadLength(pIPC_Pkt))
+
+//The IPC_MULTICAST_HEADER structure starts a multicast send. nPids destination PIDs (DWORD32)
+//follow it for IPC_MULTICAST_PIDS, then the IPC Packet on an IPC_BATCH_ALIGN boundary
+
+typedef enum _IPC_MULTICAST_TARGET
+{
+	IPC_MULTICAST_PIDS,					//Every PID of the list
+	IPC_MULTICAST_GROUP,				//Every member of the group named szGroup except the sender
+	IPC_MULTICAST_BROADCAST				//Every port except the sender's
+}IPC_MULTICAST_TARGET;
+
+typedef struct _IPC_MULTICAST_HEADER {
+	UINT32 uiTarget;					//IPC_MULTICAST_TARGET
+	UINT32 nPids;						//Number of PIDs following the header, IPC_MULTICAST_PIDS only
+	char szGroup[IPC_GROUP_NAME_MAX];	//Group name, IPC_MULTICAST_GROUP only
+}IPC_MULTICAST_HEADER, *PIPC_MULTICAST_HEADER;
+
+//The IPC_GROUP structure is a named multicast group, it exists while it has members
+
+typedef struct _IPC_GROUP
+{
+	LIST_ENTRY list_entry;				//Links the group into the port table's group list
+	LIST_ENTRY Member_List;				//Members of the group (IPC_GROUP_MEMBER)
+	ULONG nMembers;						//Number of entries in Member_List
+	char szName[IPC_GROUP_NAME_MAX];	//Name of the group, NUL padded
+}IPC_GROUP, *PIPC_GROUP;
+
+//The IPC_GROUP_MEMBER structure links a port into a group. It is on the group's member list and
+//on the port's group list, and lives no longer than the port's registration in the port table
+
+typedef struct _IPC_GROUP_MEMBER
+{
+	LIST_ENTRY group_entry;				//Entry in IPC_GROUP.Member_List
+	LIST_ENTRY port_entry;				//Entry in IPC_PORT.Group_List
+	PIPC_PORT pPort;					//Member port
+	PIPC_GROUP pGroup;					//Group joined
+}IPC_GROUP_MEMBER, *PIPC_GROUP_MEMBER;
+
+//The IPC_PORT_BUCKET structure is one hash chain of the port table with its own lock
+//so that lookups for different destinations do not serialize on a single spinlock
+
+typedef struct _IPC_PORT_BUCKET
+{
+	LIST_ENTRY Port_List;					//ListHead of the ports hashed to this bucket
+	KSPIN_LOCK Port_List_SpinLock;			//Spinlock for synchronizing bucket access
+}IPC_PORT_BUCKET, *PIPC_PORT_BUCKET;
+
+//The IPC_ENDPOINT_SLOT structure binds an endpoint handle to a port. Resolving a handle only takes
+//the slot's own lock, so senders to different endpoints do not serialize. A slot's generation is
+//bumped when its endpoint goes away, so a stale handle never reaches a later endpoint in the slot
+
+typedef struct _IPC_ENDPOINT_SLOT
+{
+	PIPC_PORT pPort;						//Port registered in the slot with a reference held, NULL if the slot is free
+	ULONG uiGeneration;						//Generation of the slot, part of the handle
+	KSPIN_LOCK Slot_SpinLock;				//Spinlock for synchronizing slot access
+}IPC_ENDPOINT_SLOT, *PIPC_ENDPOINT_SLOT;
+
+//The IPC_CALL structure is a request waiting for its reply. The driver embeds it in the state of the
+//waiting request and registers it before the request is routed. A reply is matched to the call by
+//uiCallId and handed straight to the caller through pfnCompleteCall, it never enters a queue.
+//Whoever removes the call from the registry (reply, cancel or port removal) owns its completion
+
+typedef struct _IPC_CALL
+{
+	LIST_ENTRY list_entry;				//Links the call into its bucket of the registry, points at itself once removed
+	UINT32 uiCallId;					//Correlation ID stamped on the request and echoed by the reply
+	PIPC_PORT pCaller;					//Port of the caller, the caller holds a reference
+	PIPC_PORT pCallee;					//Port the request was delivered to, NULL until then and once the reply is kept. Only its process may reply
+	size_t cbReplyMax;					//Largest reply packet the caller's buffer holds
+	PIPC_PACKET pReply;					//Reply kept for the caller because it did not fit, NULL otherwise
+}IPC_CALL, *PIPC_CALL;
+
+//The IPC_CALL_BUCKET structure is one hash chain of the pending call registry, indexed by call ID
+
+typedef struct _IPC_CALL_BUCKET
+{
+	LIST_ENTRY Call_List;					//Calls registered in this bucket
+	KSPIN_LOCK Call_List_SpinLock;			//Spinlock for synchronizing bucket access
+}IPC_CALL_BUCKET, *PIPC_CALL_BUCKET;
+
+//Completes a call removed from the registry. pReply is the wire packet of the reply, its PID already the
+//replier's (only read during the hook, it may be larger than cbReplyMax), or NULL if the callee or the
+//caller went away first. Called without locks
+
+typedef VOID IPC_COMPLETE_CALL(struct _IPC_PORT_TABLE* pTable, PIPC_CALL pCall, const IPC_WIRE_HEADER* pReply);
+
+//IPC_ROUTE_MODE selects how a routed packet reaches the destination incoming queue
+
+typedef enum _IPC_ROUTE_MODE
+{
+	IPC_ROUTE_TRANSFER,		//The written packet itself is queued to the destination (one copy in, one copy out)
+	IPC_ROUTE_COPY			//The written packet is copied into a new In IPC Packet (original double copy behaviour)
+}IPC_ROUTE_MODE;
+
+//The IPC_ROUTE_GROUP structure gathers the packets of one destination while a batch is routed
+
+#define IPC_ROUTE_BATCH_GROUPS 16		//Destinations a batch keeps open at a time
+
+typedef struct _IPC_ROUTE_GROUP
+{
+	HANDLE dwPID;			//Destination PID of the group
+	PIPC_PORT pDestPort;	//Referenced destination port, NULL if no port is registered for the PID
+	LIST_ENTRY Pkt_List;	//Packets gathered for the destination, in batch order
+	ULONG nPkts;			//Packets gathered, counted in once the group is flushed
+	size_t cbPayload;		//Payload bytes of those packets
+}IPC_ROUTE_GROUP, *PIPC_ROUTE_GROUP;
+
+//Pending reader hooks. A reader (a read IRP in the driver) that finds the incoming queue empty is
+//parked instead of failing, and the routing core hands the next packet for the port straight to it.
+//The routing core only ever sees readers as opaque pointers
+
+typedef NTSTATUS IPC_PARK_READER(PIPC_PORT pPort, PVOID pReader);
+typedef PVOID IPC_TAKE_READER(PIPC_PORT pPort);
+typedef BOOLEAN IPC_COMPLETE_READER(struct _IPC_PORT_TABLE* pTable, PIPC_PORT pPort, PVOID pReader, PIPC_PACKET pIPC_Pkt);
+
+typedef struct _IPC_READER_OPS
+{
+	IPC_PARK_READER* pfnParkReader;			//Parks a reader, called with the incoming queue lock held and the queue empty
+	IPC_TAKE_READER* pfnTakeReader;			//Removes the oldest parked reader or returns NULL, called with the incoming queue lock held
+	IPC_COMPLETE_READER* pfnCompleteReader;	//Hands a packet to a reader, called without locks. Returns FALSE if the reader's buffer is too small
+	SIZE_T cbReaderContext;					//Bytes of reader state the driver keeps after every port
+}IPC_READER_OPS, *PIPC_READER_OPS;
+
+//The IPC_PORT_TABLE structure is the registry of all User mode ports, hashed by PID
+
+typedef struct _IPC_PORT_TABLE
+{
+	IPC_PORT_BUCKET Buckets[IPC_PORT_HASH_BUCKETS];	//Hash chains indexed by IPCPortHashPid
+	volatile LONG nPorts;							//Number of ports currently registered
+	IPC_ROUTE_MODE RouteMode;						//How packets are handed to the destination port
+	volatile LONG64 nPktCopies;						//Number of packet copies made (write, route and read)
+	volatile LONG64 nPktBytesCopied;				//Number of bytes moved by those copies
+	IPC_POOL PktPool;								//Size class pool the IPC Packets are allocated from
+	IPC_READER_OPS ReaderOps;						//Pending reader hooks, all NULL if readers are never parked
+	LIST_ENTRY Group_List;							//Multicast groups (IPC_GROUP)
+	KSPIN_LOCK Group_List_SpinLock;					//Lock protecting the groups, their members and the ports' group lists
+	IPC_QUEUE_LIMIT DefaultLimit;					//Queue limit new ports start with, none by default
+	IPC_ENDPOINT_SLOT Endpoints[IPC_ENDPOINT_SLOTS];	//Named endpoints indexed by handle slot
+	KSPIN_LOCK Endpoint_SpinLock;					//Lock serializing endpoint registration, removal and resolution by name
+	IPC_CALL_BUCKET Calls[IPC_CALL_BUCKETS];		//Registry of the calls waiting for a reply
+	volatile LONG lLastCallId;						//Last call ID handed out
+	IPC_COMPLETE_CALL* pfnCompleteCall;				//Call completion hook, NULL if calls are not supported
+	ULONG nStatsCpus;								//Number of IPC_STATS_CPU blocks of every port and of the table
+	PIPC_STATS_CPU pStats;							//Counters of the table: counts charged to no port and those of freed ports
+	PVOID pStatsBlock;								//Allocation pStats was aligned in
+	volatile LONG64 nFreedDropped;					//Packets dropped from the queues of freed ports
+	volatile LONG nFreedPeakDepth;					//Highest peak depth of the freed ports
+	volatile LONG nTracePorts;						//Ports with tracing switched on, packets are only stamped while there are any
+	LONG64 llTraceFrequency;						//Performance counter ticks per second
+}IPC_PORT_TABLE, *PIPC_PORT_TABLE;
+
+//Function Prototypes
+
+//Initializes the buckets and the packet pool of a port table, packets are routed by ownership transfer by default
+NTSTATUS IPCPortTableInit(PIPC_PORT_TABLE pTable);
+
+//Deletes the packet pool of a port table, every port must have been freed
+VOID IPCPortTableDelete(PIPC_PORT_TABLE pTable);
+
+//Allocates a port for the given PID and File object and initializes its packet queues.
+//The File object's FsContext and FsContext2 are pointed at the port and its queues.
+//ReaderOps.cbReaderContext bytes of reader state are allocated along with the port
+PIPC_PORT IPCPortCreate(PIPC_PORT_TABLE pTable, HANDLE dwPID, PFILE_OBJECT pFileObj);
+
+//Links a port into the port table so packets can be routed to it
+VOID IPCPortTableInsert(PIPC_PORT_TABLE pTable, PIPC_PORT pPort);
+
+//Unlinks a port from the port table and from every group it joined, no new packets are routed to it afterwards
+VOID IPCPortTableRemove(PIPC_PORT_TABLE pTable, PIPC_PORT pPort);
+
+//Returns the first port registered for the PID, or the port of an endpoint handle, with a reference held, or NULL
+PIPC_PORT IPCPortTableLookup(PIPC_PORT_TABLE pTable, HANDLE dwPID);
+
+//Returns TRUE if a group or endpoint name is NUL terminated within the cbName bytes it comes in
+BOOLEAN IPCNameValid(const char* szName, size_t cbName);
+
+//Registers a port under the endpoint name szName and returns its handle in *pdwEndpoint. Names are unique
+//across the table, a port has at most one and keeps it until it is removed from the table
+NTSTATUS IPCPortRegisterEndpoint(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, const char* szName, PULONG pdwEndpoint);
+
+//Returns the handle of the endpoint named szName in *pdwEndpoint, STATUS_NOT_FOUND if there is none
+NTSTATUS IPCPortResolveEndpoint(PIPC_PORT_TABLE pTable, const char* szName, PULONG pdwEndpoint);
+
+//Takes an additional reference on a port
+VOID IPCPortReference(PIPC_PORT pPort);
+
+//Drops a reference on a port, the last reference frees the port and any queued packets
+VOID IPCPortDereference(PIPC_PORT pPort);
+
+//Saves the Read notification event registered by the User mode process, releasing any previous one
+VOID IPCPortSetEvent(PIPC_PORT pPort, PKEVENT pKevent);
+
+//Sets the queue limit of a port. Packets queued while the port had no limit are not charged to it
+VOID IPCPortSetLimit(PIPC_PORT pPort, const IPC_QUEUE_LIMIT* pLimit);
+
+//Sets the read order of a port's lanes
+VOID IPCPortSetLaneWeights(PIPC_PORT pPort, const IPC_LANE_WEIGHTS* pWeights);
+
+//Returns the credits of the port registered for a PID, STATUS_NOT_FOUND if there is none
+NTSTATUS IPCPortQueryCredits(PIPC_PORT_TABLE pTable, HANDLE dwPID, PIPC_CREDITS pCredits);
+
+//Adds nValue to counter uiStat (IPC_STAT) of a port, or of the table if pPort is NULL. Costs an interlocked
+//addition on a cache line of the calling processor
+VOID IPCPortCountStat(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, ULONG uiStat, LONG64 nValue);
+
+//Returns in pStats the totals of the table and the counters of the registered ports, as many as
+//nMaxPorts entries of pStats->Ports hold. The counters are read without stopping senders or readers.
+//The routing thread entries are left empty, IPCRouterFillStats fills them
+VOID IPCPortTableQueryStats(PIPC_PORT_TABLE pTable, PIPC_STATS pStats, ULONG nMaxPorts);
+
+//Switches the per stage timestamps of the packets queued to a port on or off. STATUS_NOT_SUPPORTED if
+//they are compiled out
+NTSTATUS IPCPortSetTrace(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, BOOLEAN bEnable);
+
+//Returns the latency histograms of the port registered for a PID, STATUS_NOT_FOUND if there is none
+NTSTATUS IPCPortQueryTrace(PIPC_PORT_TABLE pTable, HANDLE dwPID, PIPC_TRACE_STATS pTraceStats);
+
+//Returns the port of a File object opened on the device
+#define IPCPortFromFileObject(pFileObj) ((PIPC_PORT)((pFileObj)->FsContext))
+
+//Adds a port to the multicast group named szName, creating the group if needed. Joining twice is not an error
+NTSTATUS IPCPortJoinGroup(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, const char* szName);
+
+//Removes a port from a multicast group, the group is deleted with its last member
+NTSTATUS IPCPortLeaveGroup(PIPC_PORT_TABLE pTable, PIPC_PORT pPort, const char* szName);
+
+//Checks a written wire packet of at most cbAvailable bytes and returns its length in *pcbWire.
+//STATUS_INVALID_PARAMETER if it is truncated, of another version or carries flags a writer may not set.
+//bReply allows IPC_WIRE_CALL, which only a reply carries
+NTSTATUS IPCPacketCheckWire(const VOID* pSrc, size_t cbAvailable, BOOLEAN bReply, size_t* pcbWire);
+
+//Allocates a packet from the packet pool and fills it from a wire packet checked by IPCPacketCheckWire,
+//sent by dwSourcePid
+PIPC_PACKET IPCPacketCreate(PIPC_PORT_TABLE pTable, const IPC_WIRE_HEADER* pWire, HANDLE dwSourcePid);
+
+//Copies one segment of a gather send, its cbData bytes, to pDst. Returns an error status if the segment cannot
+//be read. Called in the sender's context
+typedef NTSTATUS IPC_GATHER_COPY(PVOID pDst, const IPC_GATHER_SEGMENT* pSegment);
+
+//Checks a gather send of at most cbAvailable bytes: its wire header as IPCPacketCheckWire does, the segment count
+//and that the segments add up to the payload. STATUS_INVALID_PARAMETER if not. The segments' memory is not touched
+NTSTATUS IPCPacketCheckGather(const VOID* pSrc, size_t cbAvailable);
+
+//Allocates a packet from the packet pool for a gather send checked by IPCPacketCheckGather, sent by dwSourcePid,
+//and fills its payload from the segments with pfnCopy. Returns the packet in *ppIPC_Pkt, or the status of a
+//segment which could not be copied or STATUS_INSUFFICIENT_RESOURCES with nothing allocated
+NTSTATUS IPCPacketCreateGather(PIPC_PORT_TABLE pTable, const IPC_GATHER_HEADER* pGather, HANDLE dwSourcePid,
+	IPC_GATHER_COPY* pfnCopy, PIPC_PACKET* ppIPC_Pkt);
+
+//Writes the wire packet of a packet to a reader's buffer and returns the number of bytes written
+size_t IPCPacketCopyOut(PIPC_PORT_TABLE pTable, PVOID pDst, PIPC_PACKET pIPC_Pkt);
+
+//Writes a packet as a batch of one, IPCPacketBatchLength bytes, for a parked batch receive. Returns the bytes written
+size_t IPCPacketCopyOutBatch(PIPC_PORT_TABLE pTable, PVOID pDst, PIPC_PACKET pIPC_Pkt);
+
+//Drops a reference on a packet, the last one returns it (and the packet it shares, if any) to the packet pool
+VOID IPCPacketFree(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt);
+
+//Looks up the destination port of a packet and charges the packet to its credits, applying pOverflow (fail
+//if NULL) when the port is over its limit. IPC_OVERFLOW_BLOCK waits, so this is called at PASSIVE_LEVEL in
+//the sender's context. On success the packet holds a reference on the port until it is queued to it by
+//IPCRouteDeliver or IPCRouteDeliverBatch, on failure the caller still owns the packet
+NTSTATUS IPCRouteAdmit(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, const IPC_OVERFLOW* pOverflow);
+
+//Queues a packet to the incoming queue of the destination port and signals its Read notification event.
+//A packet not admitted by IPCRouteAdmit is charged here and fails if the port is over its limit.
+//The routing core takes ownership of the packet, it is freed if it cannot be delivered
+NTSTATUS IPCRouteDeliver(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt);
+
+//Routes a batch of packets. Packets for the same destination are queued together under a single
+//acquisition of its incoming queue lock, in batch order. Only entries whose status is STATUS_PENDING
+//on entry are routed, each one receives its own status. The routing core takes ownership of those packets.
+//Packets not admitted by IPCRouteAdmit are charged with pOverflow (fail if NULL), the gathered packets are
+//queued before an IPC_OVERFLOW_BLOCK sender waits
+VOID IPCRouteDeliverBatch(PIPC_PORT_TABLE pTable, PIPC_PACKET* ppIPC_Pkts, ULONG nPkts, NTSTATUS* pStatus, const IPC_OVERFLOW* pOverflow);
+
+//Delivers one packet to several ports. The packet is stored once and every recipient's incoming queue gets
+//a descriptor referencing it, with the recipient's PID as destination. The routing core takes ownership of
+//the packet. *pnDelivered receives the number of recipients, STATUS_NOT_FOUND is returned if there were none.
+//IPCRouteMulticast delivers once per PID of the list, IPCRouteMulticastGroup to every member of a group and
+//IPCRouteBroadcast to every registered port, pExclude (the sender, may be NULL) excepted for the last two.
+//Each descriptor is charged to its recipient with pOverflow (fail if NULL), recipients over their limit are skipped
+NTSTATUS IPCRouteMulticast(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, const HANDLE* pDestPids, ULONG nDestPids, const IPC_OVERFLOW* pOverflow, PULONG pnDelivered);
+NTSTATUS IPCRouteMulticastGroup(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, const char* szGroup, PIPC_PORT pExclude, const IPC_OVERFLOW* pOverflow, PULONG pnDelivered);
+NTSTATUS IPCRouteBroadcast(PIPC_PORT_TABLE pTable, PIPC_PACKET pIPC_Pkt, PIPC_PORT pExclude, const IPC_OVERFLOW* pOverflow, PULONG pnDelivered);
+
+//Registers a call of pCaller whose reply buffer holds cbReplyMax bytes and gives it a call ID.
+//The call must be registered before its waiter can be cancelled
+VOID IPCCallRegister(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, PIPC_PORT pCaller, size_t cbReplyMax);
+
+//Removes a registered call from the registry. Returns FALSE if a reply or a port removal got to it first,
+//its completion is then under way
+BOOLEAN IPCCallCancel(PIPC_PORT_TABLE pTable, PIPC_CALL pCall);
+
+//Registers again a call whose reply did not fit the caller's buffer, with the reply kept in it until
+//the caller collects it with IPCCallTakeReply. Called by pfnCompleteCall, which then completes the waiter.
+//Returns FALSE, with the reply freed and the call not registered, if the caller is being removed
+BOOLEAN IPCCallKeepReply(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, PIPC_PACKET pReply);
+
+//Removes the call uiCallId of pCaller if its reply has been kept, NULL otherwise. The caller frees the reply
+PIPC_CALL IPCCallTakeReply(PIPC_PORT_TABLE pTable, PIPC_PORT pCaller, UINT32 uiCallId);
+
+//Stamps a request with the call ID of a registered call and routes it like IPCRouteAdmit and IPCRouteDeliver
+//in the caller's context. The routing core takes ownership of the packet, it is freed if it cannot be delivered
+NTSTATUS IPCRouteCall(PIPC_PORT_TABLE pTable, PIPC_CALL pCall, PIPC_PACKET pIPC_Pkt, const IPC_OVERFLOW* pOverflow);
+
+//Hands the wire packet of a reply, checked by IPCPacketCheckWire, to the call named by its IPC_WIRE_CALL_ID in
+//the replier's context, through pfnCompleteCall. Its PID is set to the replier's, the caller reads it as
+//it is. Returns STATUS_NOT_FOUND if no such call waits for a reply from dwReplierPid
+NTSTATUS IPCRouteReply(PIPC_PORT_TABLE pTable, PIPC_WIRE_HEADER pReply, HANDLE dwReplierPid);
+
+//Removes the next packet of the incoming lanes of a port, or returns NULL if the lanes are empty.
+//The Read notification event is cleared once the queue has been drained
+PIPC_PACKET IPCPortDequeue(PIPC_PORT pPort);
+
+//Removes the oldest packet of the lowest priority lane holding one, NULL if the port has none
+PIPC_PACKET IPCPortDequeueOldest(PIPC_PORT pPort);
+
+//Detaches, under a single acquisition of the incoming queue lock, the packets at the head of the
+//incoming lanes that fit into a batch of cbBatch bytes, at most nMaxPkts of them. They are moved
+//to pList in the order IPCPortDequeue would return them and their count is returned. If the head packet alone does not fit, nothing
+//is detached and *pcbNext receives its size. The Read notification event is cleared once the queue is drained
+ULONG IPCPortDequeueBatch(PIPC_PORT pPort, ULONG nMaxPkts, size_t cbBatch, PLIST_ENTRY pList, size_t* pcbNext);
+
+//Same as IPCPortDequeueBatch, with *pStatus set to STATUS_SUCCESS or STATUS_BUFFER_OVERFLOW. If the lanes are
+//empty and pReader is set, the reader is parked with ReaderOps.pfnParkReader under the same lock acquisition
+//and *pStatus is the park status, else it is STATUS_NO_MORE_ENTRIES
+ULONG IPCPortDequeueBatchOrPark(PIPC_PORT pPort, ULONG nMaxPkts, size_t cbBatch, PVOID pReader, PLIST_ENTRY pList,
+	size_t* pcbNext, NTSTATUS* pStatus);
+
+//Removes the packet at the head of the incoming queue if it fits in cbBuffer bytes. A packet which
+//does not fit stays at the head, NULL is returned with *pStatus set to STATUS_BUFFER_OVERFLOW and its
+//size in *pcbRequired. If the queue is empty the reader is parked with ReaderOps.pfnParkReader under
+//the same lock acquisition, so no packet can slip in between, and NULL is returned with *pStatus set
+//to the park status (STATUS_NO_MORE_ENTRIES without hooks)
+PIPC_PACKET IPCPortDequeueOrPark(PIPC_PORT pPort, size_t cbBuffer, PVOID pReader, NTSTATUS* pStatus, size_t* pcbRequired);
@@ -0,0 +1,402 @@
+//=====================================================================
+// IPC- Inter Process Communication Routing Threads
+//
+// This file implements the routing threads. IPCDrvWrite queues a packet
+// to the thread its sending process maps to and completes the Write IRP.
+// The thread is only woken when its queue goes from empty to non empty.
+// It then takes the whole queue under one lock acquisition and routes it
+// in batches of IPC_ROUTER_BATCH packets. Sends the driver routes in the
+// caller's thread (batch, multicast, call and reply) call IPCRouterFlush
+// first, so per sender order holds across every send path.
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+//Include Files
+
+#include "IPCRouter_v2.h"
+
+
+//=====================================================================
+// IPCRouterShard
+//
+// Maps a shard key (the sending process ID) to a routing thread. Process
+// IDs are multiples of 4, so the low bits are dropped before mixing.
+//=====================================================================
+
+static ULONG IPCRouterShard(PIPC_ROUTER pRouter, ULONG_PTR ShardKey)
+{
+	ULONG uiHash = (ULONG)(ShardKey >> 2);
+
+	uiHash ^= uiHash >> 16;
+	uiHash *= 0x45d9f3b;
+	uiHash ^= uiHash >> 16;
+
+	return uiHash % pRouter->nThreads;
+}
+
+
+//=====================================================================
+// IPCRouterThreadMain
+//
+// Body of a routing thread. Binds itself to its processor, then waits
+// for packets, routes everything queued and records the latency of every
+// packet until IPCRouterStop asks it to exit. The queue stamps are kept
+// aside before a batch is routed, a delivered packet may already be
+// freed by its reader.
+//=====================================================================
+
+static VOID IPCRouterThreadMain(PVOID pContext)
+{
+	PIPC_ROUTER_THREAD pThread = (PIPC_ROUTER_THREAD)pContext;
+	PIPC_ROUTER pRouter = pThread->pRouter;
+	PIPC_PACKET Pkts[IPC_ROUTER_BATCH];
+	NTSTATUS Status[IPC_ROUTER_BATCH];
+	LONG64 Queued[IPC_ROUTER_BATCH];
+	PROCESSOR_NUMBER ProcNumber;
+	GROUP_AFFINITY Affinity;
+	LIST_ENTRY Pkt_List;
+	LONG64 llNow, llTicks, llMaxTicks;
+	BOOLEAN bStop;
+	ULONG nPkts, nDrained, j;
+	KIRQL Irql;
+
+	//Bind the thread to its processor so its queue and the packets it routes stay in that processor's cache
+
+	if (NT_SUCCESS(KeGetProcessorNumberFromIndex(pThread->uiCpu, &ProcNumber)))
+	{
+		RtlZeroMemory(&Affinity, sizeof(GROUP_AFFINITY));
+		Affinity.Group = ProcNumber.Group;
+		Affinity.Mask = (ULONG_PTR)1 << ProcNumber.Number;
+		KeSetSystemGroupAffinityThread(&Affinity, NULL);
+	}
+
+	do
+	{
+		KeWaitForSingleObject(&(pThread->Wakeup), Executive, KernelMode, FALSE, NULL);
+
+		//Take the whole queue
+
+		KeAcquireSpinLock(&(pThread->Pkt_Queue_SpinLock), &Irql);
+		if (IsListEmpty(&(pThread->Pkt_Queue)))
+		{
+			InitializeListHead(&Pkt_List);
+		}
+		else
+		{
+			Pkt_List.Flink = pThread->Pkt_Queue.Flink;
+			Pkt_List.Blink = pThread->Pkt_Queue.Blink;
+			Pkt_List.Flink->Blink = &Pkt_List;
+			Pkt_List.Blink->Flink = &Pkt_List;
+			InitializeListHead(&(pThread->Pkt_Queue));
+		}
+		bStop = pThread->bStop;
+		KeReleaseSpinLock(&(pThread->Pkt_Queue_SpinLock), Irql);
+
+		//Route it in batches, in queue order
+
+		nPkts = 0;
+		nDrained = 0;
+		while (!IsListEmpty(&Pkt_List))
+		{
+			Pkts[nPkts] = CONTAINING_RECORD(RemoveHeadList(&Pkt_List), IPC_PACKET, list_entry);
+			Queued[nPkts] = IPCPacketBlock(Pkts[nPkts])->llRouterQueued;
+			Status[nPkts] = STATUS_PENDING;
+			nPkts++;
+
+			if (nPkts == IPC_ROUTER_BATCH || IsListEmpty(&Pkt_List))
+			{
+				IPCRouteDeliverBatch(pRouter->pTable, Pkts, nPkts, Status, NULL);
+
+				llNow = KeQueryPerformanceCounter(NULL).QuadPart;
+				llTicks = 0;
+				llMaxTicks = 0;
+				for (j = 0; j < nPkts; j++)
+				{
+					llTicks += llNow - Queued[j];
+					if (llNow - Queued[j] > llMaxTicks)
+					{
+						llMaxTicks = llNow - Queued[j];
+					}
+				}
+				pThread->Stats.llLatencyTotal += llTicks * 1000000000 / pRouter->llFrequency;
+				if (llMaxTicks * 1000000000 / pRouter->llFrequency > pThread->Stats.llLatencyMax)
+				{
+					pThread->Stats.llLatencyMax = llMaxTicks * 1000000000 / pRouter->llFrequency;
+				}
+
+				nDrained += nPkts;
+				nPkts = 0;
+			}
+		}
+
+		if (nDrained)
+		{
+			pThread->Stats.nPkts += nDrained;
+			pThread->Stats.nDrains++;
+
+			KeAcquireSpinLock(&(pThread->Pkt_Queue_SpinLock), &Irql);
+			pThread->nRouted += nDrained;
+			KeReleaseSpinLock(&(pThread->Pkt_Queue_SpinLock), Irql);
+			KeSetEvent(&(pThread->Drained), 0, FALSE);
+		}
+	} while (!bStop);
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+
+//=====================================================================
+// IPCRouterStart
+//
+// Allocates the routing threads, initializes their queues and creates
+// them. If a thread cannot be created the ones already running are
+// stopped again.
+//=====================================================================
+
+NTSTATUS IPCRouterStart(PIPC_ROUTER pRouter, PIPC_PORT_TABLE pTable, ULONG nThreads)
+{
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	LARGE_INTEGER Frequency;
+	PIPC_ROUTER_THREAD pThread;
+	ULONG nCpus;
+	NTSTATUS ntStatus;
+	ULONG i;
+
+	nCpus = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	if (nCpus == 0)
+	{
+		nCpus = 1;
+	}
+	if (nThreads == 0)
+	{
+		nThreads = nCpus;
+	}
+	if (nThreads > IPC_ROUTER_MAX_THREADS)
+	{
+		nThreads = IPC_ROUTER_MAX_THREADS;
+	}
+
+	pRouter->pTable = pTable;
+	pRouter->nThreads = 0;
+	KeQueryPerformanceCounter(&Frequency);
+	pRouter->llFrequency = Frequency.QuadPart;
+
+	pRouter->pThreads = ExAllocatePoolWithTag(NonPagedPool, nThreads * sizeof(IPC_ROUTER_THREAD), IPC_POOL_TAG);
+	if (!pRouter->pThreads)
+	{
+		DbgPrint("Failed to allocate Nonpaged pool for the routing threads\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(pRouter->pThreads, nThreads * sizeof(IPC_ROUTER_THREAD));
+
+	for (i = 0; i < nThreads; i++)
+	{
+		pThread = &(pRouter->pThreads[i]);
+
+		InitializeListHead(&(pThread->Pkt_Queue));
+		KeInitializeSpinLock(&(pThread->Pkt_Queue_SpinLock));
+		KeInitializeEvent(&(pThread->Wakeup), SynchronizationEvent, FALSE);
+		KeInitializeEvent(&(pThread->Drained), NotificationEvent, FALSE);
+		pThread->uiCpu = i % nCpus;
+		pThread->pRouter = pRouter;
+
+		InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+		ntStatus = PsCreateSystemThread(&(pThread->hThread), THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL,
+			IPCRouterThreadMain, pThread);
+		if (!NT_SUCCESS(ntStatus))
+		{
+			DbgPrint("Failed to create routing thread %u\n", i);
+			IPCRouterStop(pRouter);
+			IPCRouterFree(pRouter);
+			return ntStatus;
+		}
+
+		pRouter->nThreads++;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+
+//=====================================================================
+// IPCRouterStop
+//
+// Asks every routing thread to exit and waits for it. A thread routes
+// what is still queued before it exits. The threads' counters stay
+// readable until IPCRouterFree, so the final drains are reported too.
+//=====================================================================
+
+VOID IPCRouterStop(PIPC_ROUTER pRouter)
+{
+	PIPC_ROUTER_THREAD pThread;
+	KIRQL Irql;
+	ULONG i;
+
+	if (!pRouter->pThreads)
+	{
+		return;
+	}
+
+	for (i = 0; i < pRouter->nThreads; i++)
+	{
+		pThread = &(pRouter->pThreads[i]);
+
+		KeAcquireSpinLock(&(pThread->Pkt_Queue_SpinLock), &Irql);
+		pThread->bStop = TRUE;
+		KeReleaseSpinLock(&(pThread->Pkt_Queue_SpinLock), Irql);
+		KeSetEvent(&(pThread->Wakeup), 0, FALSE);
+	}
+
+	for (i = 0; i < pRouter->nThreads; i++)
+	{
+		pThread = &(pRouter->pThreads[i]);
+
+		if (pThread->hThread)
+		{
+			ZwWaitForSingleObject(pThread->hThread, FALSE, NULL);
+			ZwClose(pThread->hThread);
+			pThread->hThread = NULL;
+		}
+	}
+}
+
+
+//=====================================================================
+// IPCRouterFree
+//
+// Frees the routing threads once IPCRouterStop has stopped them.
+//=====================================================================
+
+VOID IPCRouterFree(PIPC_ROUTER pRouter)
+{
+	if (!pRouter->pThreads)
+	{
+		return;
+	}
+
+	ExFreePoolWithTag(pRouter->pThreads, IPC_POOL_TAG);
+	pRouter->pThreads = NULL;
+	pRouter->nThreads = 0;
+}
+
+
+//=====================================================================
+// IPCRouterQueuePacket
+//
+// Appends a packet to the queue of its routing thread. The thread is
+// only signalled when the queue was empty, a non empty queue means a
+// wake up is already pending or the thread is draining it.
+//=====================================================================
+
+VOID IPCRouterQueuePacket(PIPC_ROUTER pRouter, ULONG_PTR ShardKey, PIPC_PACKET pIPC_Pkt)
+{
+	PIPC_ROUTER_THREAD pThread = &(pRouter->pThreads[IPCRouterShard(pRouter, ShardKey)]);
+	BOOLEAN bWake;
+	KIRQL Irql;
+
+	IPCPacketBlock(pIPC_Pkt)->llRouterQueued = KeQueryPerformanceCounter(NULL).QuadPart;
+
+	KeAcquireSpinLock(&(pThread->Pkt_Queue_SpinLock), &Irql);
+	bWake = IsListEmpty(&(pThread->Pkt_Queue));
+	InsertTailList(&(pThread->Pkt_Queue), &(pIPC_Pkt->list_entry));
+	pThread->nQueued++;
+	KeReleaseSpinLock(&(pThread->Pkt_Queue_SpinLock), Irql);
+
+	if (bWake)
+	{
+		KeSetEvent(&(pThread->Wakeup), 0, FALSE);
+	}
+}
+
+
+//=====================================================================
+// IPCRouterFlush
+//
+// Waits for the routing thread of a shard key to route everything that
+// was queued to it before the call. The event is cleared under the lock
+// the thread updates nRouted with, so the thread's next KeSetEvent is
+// never missed. Returns at once when the thread is idle, the common case
+// for a sender which does not mix writes with other sends.
+//=====================================================================
+
+VOID IPCRouterFlush(PIPC_ROUTER pRouter, ULONG_PTR ShardKey)
+{
+	PIPC_ROUTER_THREAD pThread;
+	ULONG64 nTarget;
+	KIRQL Irql;
+
+	if (!pRouter->pThreads)
+	{
+		return;
+	}
+
+	pThread = &(pRouter->pThreads[IPCRouterShard(pRouter, ShardKey)]);
+
+	KeAcquireSpinLock(&(pThread->Pkt_Queue_SpinLock), &Irql);
+	nTarget = pThread->nQueued;
+	while (pThread->nRouted < nTarget)
+	{
+		KeClearEvent(&(pThread->Drained));
+		KeReleaseSpinLock(&(pThread->Pkt_Queue_SpinLock), Irql);
+
+		KeWaitForSingleObject(&(pThread->Drained), Executive, KernelMode, FALSE, NULL);
+
+		KeAcquireSpinLock(&(pThread->Pkt_Queue_SpinLock), &Irql);
+	}
+	KeReleaseSpinLock(&(pThread->Pkt_Queue_SpinLock), Irql);
+}
+
+
+//=====================================================================
+// IPCRouterQueryStats
+//
+// Copies the counters of one routing thread. They are written by the
+// thread without a lock, so the result is a snapshot.
+//=====================================================================
+
+VOID IPCRouterQueryStats(PIPC_ROUTER pRouter, ULONG uiThread, PIPC_ROUTER_THREAD_STATS pStats)
+{
+	RtlZeroMemory(pStats, sizeof(IPC_ROUTER_THREAD_STATS));
+
+	if (uiThread < pRouter->nThreads)
+	{
+		*pStats = pRouter->pThreads[uiThread].Stats;
+	}
+}
+
+
+//=====================================================================
+// IPCRouterFillStats
+//
+// Fills the routing thread entries of a statistics query with a
+// snapshot of every thread's counters and its current backlog.
+//=====================================================================
+
+VOID IPCRouterFillStats(PIPC_ROUTER pRouter, PIPC_STATS pStats)
+{
+	PIPC_ROUTER_THREAD pThread;
+	PIPC_ROUTER_STATS pOut;
+	KIRQL Irql;
+	ULONG i;
+
+	pStats->nRouterThreads = 0;
+
+	for (i = 0; i < pRouter->nThreads && i < IPC_STATS_ROUTER_THREADS; i++)
+	{
+		pThread = &(pRouter->pThreads[i]);
+		pOut = &(pStats->Router[i]);
+
+		pOut->nPkts = pThread->Stats.nPkts;
+		pOut->nDrains = pThread->Stats.nDrains;
+		pOut->llLatencyTotal = pThread->Stats.llLatencyTotal;
+		pOut->llLatencyMax = pThread->Stats.llLatencyMax;
+		pOut->uiCpu = pThread->uiCpu;
+
+		KeAcquireSpinLock(&(pThread->Pkt_Queue_SpinLock), &Irql);
+		pOut->nBacklog = (UINT32)(pThread->nQueued - pThread->nRouted);
+		KeReleaseSpinLock(&(pThread->Pkt_Queue_SpinLock), Irql);
+
+		pStats->nRouterThreads++;
+	}
+}
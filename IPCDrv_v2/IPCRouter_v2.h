@@ -0,0 +1,96 @@
+//=====================================================================
+// IPC- Inter Process Communication Routing Threads Header File
+//
+// This file contains the structure definitions and Function declarations
+// of the routing threads. Written packets are handed to one of a small set
+// of threads owned by the driver instead of a system work item each. The
+// thread is picked by the sending process, so packets of one sender are
+// routed in the order they were written, and every thread drains its queue
+// in batches through IPCRouteDeliverBatch. Sends routed in the caller's
+// thread flush the sender's routing thread first to stay behind its writes.
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+#pragma once
+
+//Include Files
+
+#include "IPCShim_v2.h"
+#include "IPCRoute_v2.h"
+
+//Constants
+
+#define IPC_ROUTER_MAX_THREADS IPC_STATS_ROUTER_THREADS	//Maximum number of routing threads, each one is reported by a statistics query
+#define IPC_ROUTER_BATCH 64				//Packets routed per IPCRouteDeliverBatch call
+
+//Structure definitions
+
+//The IPC_ROUTER_THREAD_STATS structure holds the counters of one routing thread.
+//A drain is one wake up of the thread, routing everything queued at that point.
+//The latency of a packet runs from IPCRouterQueuePacket to the end of the
+//IPCRouteDeliverBatch call which routed it
+
+typedef struct _IPC_ROUTER_THREAD_STATS
+{
+	LONG64 nPkts;				//Packets routed
+	LONG64 nDrains;				//Wake ups which found packets queued
+	LONG64 llLatencyTotal;		//Sum of the packet latencies, in nanoseconds
+	LONG64 llLatencyMax;		//Largest packet latency, in nanoseconds
+}IPC_ROUTER_THREAD_STATS, *PIPC_ROUTER_THREAD_STATS;
+
+struct _IPC_ROUTER;
+
+//The IPC_ROUTER_THREAD structure is one routing thread with its packet queue
+
+typedef struct _IPC_ROUTER_THREAD
+{
+	LIST_ENTRY Pkt_Queue;					//Packets waiting to be routed, in the order they were written
+	KSPIN_LOCK Pkt_Queue_SpinLock;			//Lock protecting Pkt_Queue, nQueued, nRouted and bStop
+	ULONG64 nQueued;						//Packets ever queued to the thread
+	ULONG64 nRouted;						//Packets ever routed by the thread, nQueued once it is idle
+	BOOLEAN bStop;							//Set by IPCRouterStop, the thread exits after its next drain
+	KEVENT Wakeup;							//Synchronization event set when the queue goes non empty or on stop
+	KEVENT Drained;							//Notification event set after every drain, waited on by IPCRouterFlush
+	HANDLE hThread;							//Kernel handle of the thread
+	ULONG uiCpu;							//Processor index the thread is bound to
+	struct _IPC_ROUTER* pRouter;			//Router the thread belongs to
+	IPC_ROUTER_THREAD_STATS Stats;			//Counters, only written by the thread itself
+}IPC_ROUTER_THREAD, *PIPC_ROUTER_THREAD;
+
+//The IPC_ROUTER structure is the set of routing threads of a port table
+
+typedef struct _IPC_ROUTER
+{
+	PIPC_PORT_TABLE pTable;					//Port table packets are routed through
+	ULONG nThreads;							//Number of routing threads
+	PIPC_ROUTER_THREAD pThreads;			//Routing threads
+	LONG64 llFrequency;						//Performance counter frequency, ticks per second
+}IPC_ROUTER, *PIPC_ROUTER;
+
+//Function Prototypes
+
+//Starts nThreads routing threads (0 for one per processor, at most IPC_ROUTER_MAX_THREADS)
+//for the port table, thread i is bound to processor i modulo the processor count
+NTSTATUS IPCRouterStart(PIPC_ROUTER pRouter, PIPC_PORT_TABLE pTable, ULONG nThreads);
+
+//Routes whatever is still queued, then stops and waits for every routing thread. Their counters
+//can still be queried until IPCRouterFree
+VOID IPCRouterStop(PIPC_ROUTER pRouter);
+
+//Frees the routing threads of a stopped router
+VOID IPCRouterFree(PIPC_ROUTER pRouter);
+
+//Queues a packet to the routing thread ShardKey maps to and returns. Packets queued with
+//the same key are routed in order. The router takes ownership of the packet
+VOID IPCRouterQueuePacket(PIPC_ROUTER pRouter, ULONG_PTR ShardKey, PIPC_PACKET pIPC_Pkt);
+
+//Waits until every packet queued so far to the routing thread ShardKey maps to is routed. Called
+//before a packet of that sender is routed in the caller's thread, so it stays behind the sender's writes
+VOID IPCRouterFlush(PIPC_ROUTER pRouter, ULONG_PTR ShardKey);
+
+//Returns a snapshot of the counters of one routing thread
+VOID IPCRouterQueryStats(PIPC_ROUTER pRouter, ULONG uiThread, PIPC_ROUTER_THREAD_STATS pStats);
+
+//Fills the routing thread entries of a statistics query
+VOID IPCRouterFillStats(PIPC_ROUTER pRouter, PIPC_STATS pStats);
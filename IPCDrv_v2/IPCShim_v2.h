@@ -0,0 +1,533 @@
+//=====================================================================
+// IPC- Inter Process Communication Driver Portability Shim
+//
+// The routing core (IPCRoute_v2.c) is written against the small subset of
+// the WDK that it needs. When built as part of the driver (_KERNEL_MODE)
+// this header simply pulls in ntddk.h. When built in user mode (Linux, for
+// load testing and benchmarking) it provides user mode stand-ins for the
+// same types and routines on top of pthreads and the C runtime.
+//
+//  Last Modified : 01 Jan 2020 ashokh
+//=====================================================================
+
+#pragma once
+
+#ifdef _KERNEL_MODE
+
+//Include Files
+
+#include <ntddk.h>
+
+//Release the reference taken on the Read notification event by ObReferenceObjectByHandle
+
+#define IPC_RELEASE_EVENT(pKevent) ObDereferenceObject(pKevent)
+
+#else //User mode build of the routing core
+
+//Include Files
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+
+//Basic types
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef uint8_t UINT8;
+typedef unsigned char BOOLEAN, *PBOOLEAN;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONG64, *PLONG64;
+typedef uint64_t ULONG64, *PULONG64;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T;
+typedef uint32_t DWORD32;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef void* HANDLE;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define TRUE  1
+#define FALSE 0
+
+#define IN
+#define OUT
+
+//Status codes used by the routing core
+
+#define STATUS_SUCCESS                 ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                 ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                 ((NTSTATUS)0x00000103L)
+#define STATUS_UNSUCCESSFUL            ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER       ((NTSTATUS)0xC000000DL)
+#define STATUS_QUOTA_EXCEEDED          ((NTSTATUS)0xC0000044L)
+#define STATUS_INSUFFICIENT_RESOURCES  ((NTSTATUS)0xC000009AL)
+#define STATUS_IO_TIMEOUT              ((NTSTATUS)0xC00000B5L)
+#define STATUS_CANT_WAIT               ((NTSTATUS)0xC00000D8L)
+#define STATUS_CANCELLED               ((NTSTATUS)0xC0000120L)
+#define STATUS_OBJECT_NAME_COLLISION   ((NTSTATUS)0xC0000035L)
+#define STATUS_NOT_FOUND               ((NTSTATUS)0xC0000225L)
+#define STATUS_BUFFER_OVERFLOW         ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES         ((NTSTATUS)0x8000001AL)
+#define STATUS_NOT_SUPPORTED           ((NTSTATUS)0xC00000BBL)
+
+#define MAXULONG 0xffffffff
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+#define CONTAINING_RECORD(address, type, field) \
+	((type *)((PCHAR)(address) - offsetof(type, field)))
+
+#define DbgPrint(...) do{}while(0)
+
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlEqualMemory(Destination, Source, Length) (!memcmp((Destination), (Source), (Length)))
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+//Doubly linked lists
+
+typedef struct _LIST_ENTRY
+{
+	struct _LIST_ENTRY* Flink;
+	struct _LIST_ENTRY* Blink;
+}LIST_ENTRY, *PLIST_ENTRY;
+
+static inline VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+	ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+static inline BOOLEAN IsListEmpty(const LIST_ENTRY* ListHead)
+{
+	return (BOOLEAN)(ListHead->Flink == ListHead);
+}
+
+static inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+	PLIST_ENTRY Flink = Entry->Flink;
+	PLIST_ENTRY Blink = Entry->Blink;
+	Blink->Flink = Flink;
+	Flink->Blink = Blink;
+	return (BOOLEAN)(Flink == Blink);
+}
+
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+	PLIST_ENTRY Entry = ListHead->Flink;
+	RemoveEntryList(Entry);
+	return Entry;
+}
+
+static inline VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+	PLIST_ENTRY Blink = ListHead->Blink;
+	Entry->Flink = ListHead;
+	Entry->Blink = Blink;
+	Blink->Flink = Entry;
+	ListHead->Blink = Entry;
+}
+
+static inline VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+	PLIST_ENTRY Flink = ListHead->Flink;
+	Entry->Flink = Flink;
+	Entry->Blink = ListHead;
+	Flink->Blink = Entry;
+	ListHead->Flink = Entry;
+}
+
+//Pool allocation, user mode simply uses the C runtime heap
+
+typedef enum _POOL_TYPE { NonPagedPool, PagedPool } POOL_TYPE;
+
+#define ExAllocatePoolWithTag(PoolType, NumberOfBytes, Tag) malloc(NumberOfBytes)
+#define ExFreePoolWithTag(P, Tag) free(P)
+
+//Interlocked operations
+
+#define InterlockedIncrement(Addend) __atomic_add_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Addend) __atomic_sub_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(Addend, Value) __atomic_fetch_add((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(Addend, Value) __atomic_fetch_add((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(Addend) __atomic_add_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchangePointer(Destination, Exchange, Comperand) \
+	__sync_val_compare_and_swap((Destination), (Comperand), (Exchange))
+#define InterlockedCompareExchange(Destination, Exchange, Comperand) \
+	__sync_val_compare_and_swap((Destination), (Comperand), (Exchange))
+
+//Spin locks, user mode uses a mutex. The IRQL out parameter is kept for source compatibility
+
+typedef pthread_mutex_t KSPIN_LOCK, *PKSPIN_LOCK;
+
+static inline VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+	pthread_mutex_init(SpinLock, NULL);
+}
+
+static inline VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql)
+{
+	pthread_mutex_lock(SpinLock);
+	*OldIrql = 0;
+}
+
+static inline VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+{
+	(void)NewIrql;
+	pthread_mutex_unlock(SpinLock);
+}
+
+//Kernel events
+
+typedef enum _EVENT_TYPE { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+
+typedef struct _KEVENT
+{
+	pthread_mutex_t Mutex;
+	pthread_cond_t Cond;
+	LONG Signaled;
+	ULONG Generation;	//Counts KeSetEvent calls, a notification event releases every current waiter even if cleared at once
+	EVENT_TYPE Type;
+}KEVENT, *PKEVENT;
+
+static inline VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+	pthread_mutex_init(&Event->Mutex, NULL);
+	pthread_cond_init(&Event->Cond, NULL);
+	Event->Signaled = State;
+	Event->Generation = 0;
+	Event->Type = Type;
+}
+
+static inline LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait)
+{
+	LONG PreviousState;
+	(void)Increment; (void)Wait;
+	pthread_mutex_lock(&Event->Mutex);
+	PreviousState = Event->Signaled;
+	Event->Signaled = 1;
+	Event->Generation++;
+	if (Event->Type == NotificationEvent)
+		pthread_cond_broadcast(&Event->Cond);
+	else
+		pthread_cond_signal(&Event->Cond);
+	pthread_mutex_unlock(&Event->Mutex);
+	return PreviousState;
+}
+
+static inline VOID KeClearEvent(PKEVENT Event)
+{
+	pthread_mutex_lock(&Event->Mutex);
+	Event->Signaled = 0;
+	pthread_mutex_unlock(&Event->Mutex);
+}
+
+//Waits until the event is signalled, synchronization events are reset on a satisfied wait.
+//pDeadline is an absolute CLOCK_REALTIME time, NULL to wait forever. Returns FALSE on timeout
+
+static inline BOOLEAN IPCShimWaitForEventUntil(PKEVENT Event, const struct timespec* pDeadline)
+{
+	ULONG Generation;
+	BOOLEAN bSignaled = TRUE;
+
+	pthread_mutex_lock(&Event->Mutex);
+	Generation = Event->Generation;
+	while (!Event->Signaled && (Event->Type == SynchronizationEvent || Event->Generation == Generation))
+	{
+		if (!pDeadline)
+		{
+			pthread_cond_wait(&Event->Cond, &Event->Mutex);
+		}
+		else if (pthread_cond_timedwait(&Event->Cond, &Event->Mutex, pDeadline) == ETIMEDOUT)
+		{
+			bSignaled = Event->Signaled || (Event->Type == NotificationEvent && Event->Generation != Generation);
+			break;
+		}
+	}
+	if (bSignaled && Event->Type == SynchronizationEvent)
+		Event->Signaled = 0;
+	pthread_mutex_unlock(&Event->Mutex);
+	return bSignaled;
+}
+
+static inline VOID IPCShimWaitForEvent(PKEVENT Event)
+{
+	IPCShimWaitForEventUntil(Event, NULL);
+}
+
+//Processors
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+int sched_getcpu(void);		//glibc, only declared by sched.h under _GNU_SOURCE
+
+typedef struct _PROCESSOR_NUMBER
+{
+	unsigned short Group;
+	UCHAR Number;
+	UCHAR Reserved;
+}PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+static inline ULONG KeQueryActiveProcessorCountEx(unsigned short GroupNumber)
+{
+	(void)GroupNumber;
+	return (ULONG)sysconf(_SC_NPROCESSORS_CONF);
+}
+
+static inline ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+	int Cpu = sched_getcpu();
+	(void)ProcNumber;
+	return Cpu < 0 ? 0 : (ULONG)Cpu;
+}
+
+static inline NTSTATUS KeGetProcessorNumberFromIndex(ULONG ProcIndex, PPROCESSOR_NUMBER ProcNumber)
+{
+	ProcNumber->Group = 0;
+	ProcNumber->Number = (UCHAR)ProcIndex;
+	ProcNumber->Reserved = 0;
+	return STATUS_SUCCESS;
+}
+
+//Thread affinity, user mode leaves thread placement to the scheduler
+
+typedef struct _GROUP_AFFINITY
+{
+	ULONG_PTR Mask;
+	unsigned short Group;
+}GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+#define KeSetSystemGroupAffinityThread(Affinity, PreviousAffinity) ((void)(Affinity), (void)(PreviousAffinity))
+
+//Performance counter, user mode counts nanoseconds of the monotonic clock
+
+typedef union _LARGE_INTEGER
+{
+	LONG64 QuadPart;
+}LARGE_INTEGER, *PLARGE_INTEGER;
+
+static inline LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+	struct timespec Now;
+	LARGE_INTEGER Counter;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	Counter.QuadPart = (LONG64)Now.tv_sec * 1000000000 + Now.tv_nsec;
+	if (PerformanceFrequency)
+	{
+		PerformanceFrequency->QuadPart = 1000000000;
+	}
+	return Counter;
+}
+
+//System threads, user mode runs them on pthreads. The thread handle is the IPC_SHIM_THREAD,
+//it is only waited on with ZwWaitForSingleObject and released with ZwClose
+
+typedef VOID KSTART_ROUTINE(PVOID StartContext);
+typedef KSTART_ROUTINE *PKSTART_ROUTINE;
+
+typedef struct _OBJECT_ATTRIBUTES
+{
+	ULONG Attributes;
+}OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define OBJ_KERNEL_HANDLE 0x00000200L
+#define THREAD_ALL_ACCESS 0x001FFFFFL
+#define InitializeObjectAttributes(p, n, a, r, s) ((p)->Attributes = (a))
+
+typedef struct _IPC_SHIM_THREAD
+{
+	pthread_t Thread;
+	PKSTART_ROUTINE StartRoutine;
+	PVOID StartContext;
+}IPC_SHIM_THREAD, *PIPC_SHIM_THREAD;
+
+static inline void* IPCShimThreadStart(void* Context)
+{
+	PIPC_SHIM_THREAD ShimThread = (PIPC_SHIM_THREAD)Context;
+	ShimThread->StartRoutine(ShimThread->StartContext);
+	return NULL;
+}
+
+static inline NTSTATUS PsCreateSystemThread(HANDLE* ThreadHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+	HANDLE ProcessHandle, PVOID ClientId, PKSTART_ROUTINE StartRoutine, PVOID StartContext)
+{
+	PIPC_SHIM_THREAD ShimThread = (PIPC_SHIM_THREAD)malloc(sizeof(IPC_SHIM_THREAD));
+	(void)DesiredAccess; (void)ObjectAttributes; (void)ProcessHandle; (void)ClientId;
+	if (!ShimThread)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	ShimThread->StartRoutine = StartRoutine;
+	ShimThread->StartContext = StartContext;
+	if (pthread_create(&ShimThread->Thread, NULL, IPCShimThreadStart, ShimThread))
+	{
+		free(ShimThread);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	*ThreadHandle = ShimThread;
+	return STATUS_SUCCESS;
+}
+
+static inline NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus)
+{
+	(void)ExitStatus;
+	return STATUS_SUCCESS;	//The routine returns to IPCShimThreadStart, which ends the pthread
+}
+
+static inline NTSTATUS ZwWaitForSingleObject(HANDLE Handle, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+	(void)Alertable; (void)Timeout;
+	pthread_join(((PIPC_SHIM_THREAD)Handle)->Thread, NULL);
+	return STATUS_SUCCESS;
+}
+
+static inline NTSTATUS ZwClose(HANDLE Handle)
+{
+	free(Handle);
+	return STATUS_SUCCESS;
+}
+
+//Waits on kernel events. Only relative timeouts (negative, in 100ns units) are provided,
+//user mode threads are never alerted
+
+#define Executive 0
+#define KernelMode 0
+#define UserMode 1
+static inline NTSTATUS KeWaitForSingleObject(PVOID Object, int WaitReason, int WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+	struct timespec Deadline;
+	LONG64 Nanoseconds;
+
+	(void)WaitReason; (void)WaitMode; (void)Alertable;
+	if (!Timeout)
+	{
+		IPCShimWaitForEvent((PKEVENT)Object);
+		return STATUS_SUCCESS;
+	}
+
+	Nanoseconds = -Timeout->QuadPart * 100;
+	clock_gettime(CLOCK_REALTIME, &Deadline);
+	Deadline.tv_sec += (time_t)(Nanoseconds / 1000000000 + (Deadline.tv_nsec + Nanoseconds % 1000000000) / 1000000000);
+	Deadline.tv_nsec = (long)((Deadline.tv_nsec + Nanoseconds % 1000000000) % 1000000000);
+
+	return IPCShimWaitForEventUntil((PKEVENT)Object, &Deadline) ? STATUS_SUCCESS : STATUS_TIMEOUT;
+}
+
+//Lookaside lists, user mode keeps a mutex protected free list of up to IPC_SHIM_LOOKASIDE_DEPTH blocks
+
+#define IPC_SHIM_LOOKASIDE_DEPTH 256
+
+struct _LOOKASIDE_LIST_EX;
+typedef PVOID ALLOCATE_FUNCTION_EX(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag, struct _LOOKASIDE_LIST_EX* Lookaside);
+typedef ALLOCATE_FUNCTION_EX *PALLOCATE_FUNCTION_EX;
+typedef VOID FREE_FUNCTION_EX(PVOID Buffer, struct _LOOKASIDE_LIST_EX* Lookaside);
+typedef FREE_FUNCTION_EX *PFREE_FUNCTION_EX;
+
+typedef struct _LOOKASIDE_LIST_EX
+{
+	pthread_mutex_t Mutex;
+	PVOID* FreeList;
+	ULONG Depth;
+	SIZE_T Size;
+	ULONG Tag;
+	POOL_TYPE Type;
+	PALLOCATE_FUNCTION_EX Allocate;
+	PFREE_FUNCTION_EX Free;
+}LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+
+static inline NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PALLOCATE_FUNCTION_EX Allocate, PFREE_FUNCTION_EX Free,
+	POOL_TYPE PoolType, ULONG Flags, SIZE_T Size, ULONG Tag, unsigned short Depth)
+{
+	(void)Flags; (void)Depth;
+	pthread_mutex_init(&Lookaside->Mutex, NULL);
+	Lookaside->FreeList = NULL;
+	Lookaside->Depth = 0;
+	Lookaside->Size = Size;
+	Lookaside->Tag = Tag;
+	Lookaside->Type = PoolType;
+	Lookaside->Allocate = Allocate;
+	Lookaside->Free = Free;
+	return STATUS_SUCCESS;
+}
+
+static inline PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+	PVOID Entry = NULL;
+
+	pthread_mutex_lock(&Lookaside->Mutex);
+	if (Lookaside->FreeList)
+	{
+		Entry = Lookaside->FreeList;
+		Lookaside->FreeList = (PVOID*)*Lookaside->FreeList;
+		Lookaside->Depth--;
+	}
+	pthread_mutex_unlock(&Lookaside->Mutex);
+
+	if (!Entry)
+	{
+		Entry = Lookaside->Allocate ? Lookaside->Allocate(Lookaside->Type, Lookaside->Size, Lookaside->Tag, Lookaside)
+			: malloc(Lookaside->Size);
+	}
+	return Entry;
+}
+
+static inline VOID ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry)
+{
+	pthread_mutex_lock(&Lookaside->Mutex);
+	if (Lookaside->Depth < IPC_SHIM_LOOKASIDE_DEPTH)
+	{
+		*(PVOID*)Entry = Lookaside->FreeList;
+		Lookaside->FreeList = (PVOID*)Entry;
+		Lookaside->Depth++;
+		Entry = NULL;
+	}
+	pthread_mutex_unlock(&Lookaside->Mutex);
+
+	if (Entry)
+	{
+		if (Lookaside->Free)
+			Lookaside->Free(Entry, Lookaside);
+		else
+			free(Entry);
+	}
+}
+
+static inline VOID ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+	while (Lookaside->FreeList)
+	{
+		PVOID Entry = Lookaside->FreeList;
+		Lookaside->FreeList = (PVOID*)*Lookaside->FreeList;
+		if (Lookaside->Free)
+			Lookaside->Free(Entry, Lookaside);
+		else
+			free(Entry);
+	}
+	Lookaside->Depth = 0;
+	pthread_mutex_destroy(&Lookaside->Mutex);
+}
+
+//File objects, only the driver defined context fields are used by the routing core
+
+typedef struct _FILE_OBJECT
+{
+	PVOID FsContext;
+	PVOID FsContext2;
+}FILE_OBJECT, *PFILE_OBJECT;
+
+//Events are owned by the simulated processes in user mode, nothing to release
+
+#define IPC_RELEASE_EVENT(pKevent) do{}while(0)
+
+#endif //_KERNEL_MODE
@@ -0,0 +1,271 @@
+/*
+IPCStat_v2.c
+Author:ashokh@microsoft.com
+Last modified date: 07-01-2020
+
+Console monitor of the IPC driver's runtime statistics. It polls QueryIPCStats at an interval
+and redraws the driver totals and every process, busiest first, the way top does
+
+Usage: IPCStat_v2 [interval ms] [refreshes, 0 until q is pressed]
+*/
+
+#include"IPCStat_v2.h"
+
+/*
+Queries the statistics into pStats, a buffer of *pcbStats bytes. The buffer is grown until it holds
+every process, so the pointer returned may differ from pStats. Returns NULL if the query failed
+*/
+
+PIPC_STATS IPCStatQuery(PIPC_STATS pStats, DWORD* pcbStats)
+{
+	PIPC_STATS pLarger;
+
+	while (1)
+	{
+		if (!_QueryIPCStats(pStats, *pcbStats))
+		{
+			printf("Unable to query the IPC statistics:%d\n", GetLastError());
+			return NULL;
+		}
+		if (pStats->nReturned >= pStats->nPorts)
+		{
+			return pStats;
+		}
+
+		//More processes than the buffer holds, make room for a few more than are there now
+
+		*pcbStats = sizeof(IPC_STATS) + (pStats->nPorts + IPCSTAT_INITIAL_PORTS / 4) * sizeof(IPC_PORT_STATS);
+		pLarger = (PIPC_STATS)realloc(pStats, *pcbStats);
+		if (!pLarger)
+		{
+			printf("Unable to grow the statistics buffer\n");
+			return NULL;
+		}
+		pStats = pLarger;
+	}
+}
+
+//Returns the counters of dwPID in pStats, NULL if the process was not open then
+PIPC_PORT_STATS IPCStatFindPort(PIPC_STATS pStats, DWORD32 dwPID)
+{
+	UINT32 i;
+
+	for (i = 0; i < pStats->nReturned; i++)
+	{
+		if (pStats->Ports[i].dwPID == dwPID)
+		{
+			return &(pStats->Ports[i]);
+		}
+	}
+	return NULL;
+}
+
+//Derives the rates of a row from two snapshots dSeconds apart, a process without an earlier snapshot counts from 0
+void IPCStatRates(PIPCSTAT_ROW pRow, PIPC_PORT_STATS pNow, PIPC_PORT_STATS pBefore, double dSeconds)
+{
+	pRow->pNow = pNow;
+	pRow->dPktsInRate = (double)(pNow->nPktsIn - (pBefore ? pBefore->nPktsIn : 0)) / dSeconds;
+	pRow->dPktsOutRate = (double)(pNow->nPktsOut - (pBefore ? pBefore->nPktsOut : 0)) / dSeconds;
+	pRow->dBytesInRate = (double)(pNow->cbBytesIn - (pBefore ? pBefore->cbBytesIn : 0)) / dSeconds;
+	pRow->dBytesOutRate = (double)(pNow->cbBytesOut - (pBefore ? pBefore->cbBytesOut : 0)) / dSeconds;
+}
+
+//qsort order of the process rows, most messages in and out first, then the deepest queue
+int IPCStatCompareRows(const void* pLeft, const void* pRight)
+{
+	const IPCSTAT_ROW* pA = (const IPCSTAT_ROW*)pLeft;
+	const IPCSTAT_ROW* pB = (const IPCSTAT_ROW*)pRight;
+	double dA = pA->dPktsInRate + pA->dPktsOutRate;
+	double dB = pB->dPktsInRate + pB->dPktsOutRate;
+
+	if (dA != dB)
+	{
+		return dA < dB ? 1 : -1;
+	}
+	if (pA->pNow->nDepth != pB->pNow->nDepth)
+	{
+		return pA->pNow->nDepth < pB->pNow->nDepth ? 1 : -1;
+	}
+	return pA->pNow->dwPID < pB->pNow->dwPID ? -1 : (pA->pNow->dwPID > pB->pNow->dwPID);
+}
+
+static void IPCStatPrintRow(const char* szName, const char* szEndpoint, PIPCSTAT_ROW pRow)
+{
+	PIPC_PORT_STATS pNow = pRow->pNow;
+
+	printf("%-8s %-16.16s %10.0f %10.0f %10.1f %10.1f %7u %7u %9llu %9llu %9llu %9llu\n",
+		szName, szEndpoint, pRow->dPktsInRate, pRow->dPktsOutRate, pRow->dBytesInRate / 1024, pRow->dBytesOutRate / 1024,
+		pNow->nDepth, pNow->nPeakDepth, pNow->nUndeliverable, pNow->nAllocFailures, pNow->nTooSmall, pNow->nDropped);
+}
+
+/*
+Prints one row per routing thread of the driver. The message rate and the average latency are
+over the last dSeconds, the worst latency is the largest since the driver started
+*/
+
+static void IPCStatPrintRouter(PIPC_STATS pNow, PIPC_STATS pBefore, double dSeconds)
+{
+	PIPC_ROUTER_STATS pThread;
+	UINT64 nPkts;
+	UINT64 llLatency;
+	UINT32 i;
+
+	if (pNow->nRouterThreads == 0)
+	{
+		return;
+	}
+	printf("\n%-8s %-8s %10s %10s %12s %12s\n", "ROUTER", "CPU", "MSG/s", "BACKLOG", "AVG us", "WORST us");
+	for (i = 0; i < pNow->nRouterThreads && i < IPC_STATS_ROUTER_THREADS; i++)
+	{
+		pThread = &(pNow->Router[i]);
+		nPkts = pThread->nPkts;
+		llLatency = pThread->llLatencyTotal;
+		if (pBefore && i < pBefore->nRouterThreads)
+		{
+			nPkts -= pBefore->Router[i].nPkts;
+			llLatency -= pBefore->Router[i].llLatencyTotal;
+		}
+		printf("%-8u %-8u %10.0f %10u %12.1f %12.1f\n", i, pThread->uiCpu, (double)nPkts / dSeconds, pThread->nBacklog,
+			nPkts ? (double)llLatency / nPkts / 1000 : 0.0, (double)pThread->llLatencyMax / 1000);
+	}
+}
+
+/*
+Redraws the screen with the totals, one row per process and one per routing thread. Rates are per second over the last
+dSeconds, the error columns are totals since the driver or the process started
+*/
+
+void IPCStatPrint(PIPC_STATS pNow, PIPC_STATS pBefore, double dSeconds)
+{
+	IPCSTAT_ROW Totals;
+	PIPCSTAT_ROW pRows;
+	char szPID[16];
+	UINT32 i;
+
+	IPCStatRates(&Totals, &(pNow->Totals), pBefore ? &(pBefore->Totals) : NULL, dSeconds);
+
+	pRows = (PIPCSTAT_ROW)malloc((pNow->nReturned + 1) * sizeof(IPCSTAT_ROW));
+	if (!pRows)
+	{
+		return;
+	}
+	for (i = 0; i < pNow->nReturned; i++)
+	{
+		IPCStatRates(&(pRows[i]), &(pNow->Ports[i]), pBefore ? IPCStatFindPort(pBefore, pNow->Ports[i].dwPID) : NULL, dSeconds);
+	}
+	qsort(pRows, pNow->nReturned, sizeof(IPCSTAT_ROW), IPCStatCompareRows);
+
+	printf("\x1b[H\x1b[J");
+	printf("IPCStat - %u processes, %.1f s interval, q to quit\n\n", pNow->nPorts, dSeconds);
+	printf("%-8s %-16s %10s %10s %10s %10s %7s %7s %9s %9s %9s %9s\n",
+		"PID", "ENDPOINT", "MSG/s IN", "MSG/s OUT", "KB/s IN", "KB/s OUT", "DEPTH", "PEAK", "UNDELIV", "ALLOCFAIL", "TOOSMALL", "DROPPED");
+	IPCStatPrintRow("TOTAL", "", &Totals);
+	for (i = 0; i < pNow->nReturned; i++)
+	{
+		sprintf_s(szPID, sizeof(szPID), "%u", pRows[i].pNow->dwPID);
+		IPCStatPrintRow(szPID, pRows[i].pNow->szEndpoint, &(pRows[i]));
+	}
+	IPCStatPrintRouter(pNow, pBefore, dSeconds);
+
+	free(pRows);
+}
+
+int main(int argc, char** argv)
+{
+	//locals
+
+	DWORD dwIntervalMs = argc > 1 ? (DWORD)atoi(argv[1]) : IPCSTAT_INTERVAL_MS;	//Refresh interval
+	long nRefreshes = argc > 2 ? atol(argv[2]) : 0;				//Refreshes left, 0 until q is pressed
+	DWORD cbNow = sizeof(IPC_STATS) + IPCSTAT_INITIAL_PORTS * sizeof(IPC_PORT_STATS);
+	DWORD cbBefore = cbNow;
+	PIPC_STATS pNow;											//Statistics of this refresh
+	PIPC_STATS pBefore;											//Statistics of the previous refresh
+	PIPC_STATS pSwap;
+	DWORD cbSwap;
+	ULONGLONG ullBefore;										//Tick count of the previous refresh
+	ULONGLONG ullNow;
+	DWORD dwMode;
+	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+
+	if (dwIntervalMs == 0)
+	{
+		dwIntervalMs = IPCSTAT_INTERVAL_MS;
+	}
+
+	//The screen is redrawn with VT sequences
+
+	if (GetConsoleMode(hConsole, &dwMode))
+	{
+		SetConsoleMode(hConsole, dwMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+	}
+
+	//Loading IPC_DLL_v2.dll explicitly and getting the relevant function pointers
+	hIPCDll = LoadLibraryExW(L"IPC_DLL_v2", NULL, 0);
+	if (hIPCDll == NULL)
+	{
+		printf("Unable to load IPC_DLL_v2.dll:%d\n", GetLastError());
+		return -1;
+	}
+
+	_InitDeviceforIPC = (MYPROC)GetProcAddress(hIPCDll, "InitDeviceforIPC");
+	_CloseDeviceforIPC = (MYPROC)GetProcAddress(hIPCDll, "CloseDeviceforIPC");
+	_QueryIPCStats = (MYPROC3)GetProcAddress(hIPCDll, "QueryIPCStats");
+	if (!_InitDeviceforIPC || !_CloseDeviceforIPC || !_QueryIPCStats)
+	{
+		printf("IPC_DLL_v2.dll does not export QueryIPCStats\n");
+		return -1;
+	}
+
+	//The device is opened like any client, so IPCStat shows up as a process with no traffic
+
+	if (!_InitDeviceforIPC())
+	{
+		printf("Unable to Initialize Device for IPC:%d\n", GetLastError());
+		return -1;
+	}
+
+	pNow = (PIPC_STATS)malloc(cbNow);
+	pBefore = (PIPC_STATS)malloc(cbBefore);
+	if (!pNow || !pBefore || !(pBefore = IPCStatQuery(pBefore, &cbBefore)))
+	{
+		free(pNow);
+		_CloseDeviceforIPC();
+		return -1;
+	}
+	ullBefore = GetTickCount64();
+
+	while (1)
+	{
+		Sleep(dwIntervalMs);
+
+		if (!(pNow = IPCStatQuery(pNow, &cbNow)))
+		{
+			break;
+		}
+		ullNow = GetTickCount64();
+
+		IPCStatPrint(pNow, pBefore, (double)(ullNow - ullBefore) / 1000);
+
+		pSwap = pBefore;
+		pBefore = pNow;
+		pNow = pSwap;
+		cbSwap = cbBefore;
+		cbBefore = cbNow;
+		cbNow = cbSwap;
+		ullBefore = ullNow;
+
+		if (nRefreshes > 0 && --nRefreshes == 0)
+		{
+			break;
+		}
+		if (_kbhit() && (_getch() | 0x20) == 'q')
+		{
+			break;
+		}
+	}
+
+	free(pNow);
+	free(pBefore);
+	_CloseDeviceforIPC();
+	return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include<stdio.h>
+#include<stdlib.h>
+#include<Windows.h>
+#include<conio.h>
+#include"../IPC_Dll_v2/IPC_Dll_v2.h"
+
+#define IPCSTAT_INTERVAL_MS 1000	//Default refresh interval
+#define IPCSTAT_INITIAL_PORTS 64	//Ports the first query makes room for, the buffer grows to fit all of them
+
+typedef BOOL(*MYPROC)();
+typedef BOOL(*MYPROC3)(PIPC_STATS, DWORD);
+
+MYPROC _InitDeviceforIPC;
+MYPROC _CloseDeviceforIPC;
+MYPROC3 _QueryIPCStats;
+
+HMODULE hIPCDll;
+
+//Counters of one process between two refreshes, sorted by traffic before they are printed
+
+typedef struct _IPCSTAT_ROW
+{
+	PIPC_PORT_STATS pNow;		//Counters of this refresh
+	double dPktsInRate;			//Messages queued to the process per second
+	double dPktsOutRate;		//Messages read by the process per second
+	double dBytesInRate;		//Payload bytes queued per second
+	double dBytesOutRate;		//Payload bytes read per second
+}IPCSTAT_ROW, *PIPCSTAT_ROW;
+
+PIPC_STATS IPCStatQuery(PIPC_STATS, DWORD*);
+PIPC_PORT_STATS IPCStatFindPort(PIPC_STATS, DWORD32);
+void IPCStatRates(PIPCSTAT_ROW, PIPC_PORT_STATS, PIPC_PORT_STATS, double);
+int IPCStatCompareRows(const void*, const void*);
+void IPCStatPrint(PIPC_STATS, PIPC_STATS, double);
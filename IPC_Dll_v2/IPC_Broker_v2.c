@@ -0,0 +1,538 @@
+/*
+IPC_Broker_v2.c
+Author:ashokh@microsoft.com
+Last modified date: 07-01-2020
+
+This file contains the broker backend of the IPC dll. The requests the device
+backend sends to IPCDrv are written to the IPCBroker process over shared memory
+rings instead (see IPC_Broker_v2.h), so the dll runs where the driver cannot.
+*/
+
+#include"IPC_Dll_v2.h"
+#include"IPC_Broker_v2.h"
+#include<stdio.h>
+#ifndef _WIN32
+#include<errno.h>
+#endif
+
+#ifdef _WIN32
+#define IPC_BROKER_RING_BUSY ERROR_BUSY
+#else
+#define IPC_BROKER_RING_BUSY EBUSY
+#endif
+
+#define IPC_BROKER_CONNECT_MS 5000		//How long a connect waits for the accept ring other clients are writing to
+
+//A channel to the broker, used by one request at a time
+
+typedef struct _IPC_BROKER_LINK
+{
+	struct _IPC_BROKER_LINK* pNextIdle;	//Next channel with no request outstanding
+	struct _IPC_BROKER_LINK* pNextAll;	//Next channel of the session
+	UINT32 uiChannel;					//Channel ID, unique within the process
+	UINT32 uiSeq;						//Sequence number of the last request
+	IPC_RING Request;					//Request ring, created by the broker
+	IPC_RING Response;					//Response ring, created here
+}IPC_BROKER_LINK, *PIPC_BROKER_LINK;
+
+//Backend context of a session
+
+typedef struct _IPC_BROKER_CLIENT
+{
+	CRITICAL_SECTION csLinks;			//Protects the lists
+	PIPC_BROKER_LINK pIdle;				//Channels with no request outstanding
+	PIPC_BROKER_LINK pAll;				//Every channel of the session
+	UINT32 uiSession;					//Session ID, the broker's port key with the PID
+	DWORD dwBrokerPid;					//PID of the broker, checked while waiting for it
+}IPC_BROKER_CLIENT, *PIPC_BROKER_CLIENT;
+
+//Channel and session IDs of the process
+
+static volatile LONG g_lIPCBrokerChannelId;
+static volatile LONG g_lIPCBrokerSessionId;
+
+//Serializes the connects of every session, the accept ring takes one producer per process
+
+static CRITICAL_SECTION g_csIPCBrokerConnect;
+
+VOID IPCBrokerProcessAttach()
+{
+	InitializeCriticalSection(&g_csIPCBrokerConnect);
+}
+
+/*
+Unmaps the rings of a channel and frees it. The caller has taken it off the lists
+*/
+
+static VOID IPCBrokerFreeLink(PIPC_BROKER_LINK pLink)
+{
+	IPCRingClose(&pLink->Request);
+	IPCRingClose(&pLink->Response);
+	HeapFree(GetProcessHeap(), 0, pLink);
+}
+
+/*
+Waits for the response to request uiSeq of the channel and copies its data to pOutBuffer.
+The broker is checked every IPC_BROKER_POLL_MS; once dwTimeoutMs elapsed the request is
+cancelled and its response, completed with STATUS_CANCELLED unless it raced the cancel,
+is still waited for. Returns ERROR_SUCCESS with the request's status in *plStatus, or
+ERROR_BROKEN_PIPE if the broker exited
+*/
+
+static DWORD IPCBrokerWaitResponse(PIPC_BROKER_CLIENT pClient, PIPC_BROKER_LINK pLink, UINT32 uiSeq, DWORD dwTimeoutMs,
+	PVOID pOutBuffer, DWORD cbOutBuffer, DWORD* pdwBytes, LONG* plStatus)
+{
+	DWORD dwStart = GetTickCount();
+	BOOL bCancelled = (dwTimeoutMs == INFINITE);
+	PIPC_RING_RECORD pRecord;
+	PIPC_BROKER_RESPONSE pResponse;
+	DWORD dwWait;
+	DWORD dwElapsed;
+	size_t cbData;
+
+	for (;;)
+	{
+		dwWait = IPC_BROKER_POLL_MS;
+		if (!bCancelled)
+		{
+			dwElapsed = GetTickCount() - dwStart;
+			if (dwElapsed >= dwTimeoutMs)
+			{
+				PIPC_RING_RECORD pCancel = IPCRingReserve(&pLink->Request, sizeof(IPC_BROKER_REQUEST), IPC_BROKER_POLL_MS);
+
+				if (pCancel)
+				{
+					PIPC_BROKER_REQUEST pRequest = (PIPC_BROKER_REQUEST)pCancel->szMsg;
+
+					memset(pRequest, 0, sizeof(IPC_BROKER_REQUEST));
+					pRequest->dwOp = IPC_BROKER_OP_CANCEL;
+					pRequest->uiSeq = uiSeq;
+					IPCRingCommit(&pLink->Request, pCancel);
+					bCancelled = TRUE;
+				}
+			}
+			else if (dwTimeoutMs - dwElapsed < dwWait)
+			{
+				dwWait = dwTimeoutMs - dwElapsed;
+			}
+		}
+
+		pRecord = IPCRingPeek(&pLink->Response, dwWait);
+		if (!pRecord)
+		{
+			if (!IPCRingPidAlive(pClient->dwBrokerPid))
+			{
+				LOG_ERROR("IPCBroker %u exited\n", pClient->dwBrokerPid);
+				return ERROR_BROKEN_PIPE;
+			}
+			continue;
+		}
+
+		pResponse = (PIPC_BROKER_RESPONSE)pRecord->szMsg;
+		if (pRecord->MsgSize < sizeof(IPC_BROKER_RESPONSE) || pResponse->uiSeq != uiSeq)
+		{
+			//Not ours, the answer to a request an earlier wait gave up on
+
+			IPCRingRelease(&pLink->Response, pRecord);
+			continue;
+		}
+
+		cbData = pRecord->MsgSize - sizeof(IPC_BROKER_RESPONSE);
+		if (cbData > pResponse->cbReturned)
+		{
+			cbData = pResponse->cbReturned;
+		}
+		if (cbData > cbOutBuffer)
+		{
+			cbData = cbOutBuffer;
+		}
+		if (cbData)
+		{
+			memcpy(pOutBuffer, pResponse + 1, cbData);
+		}
+		if (pdwBytes)
+		{
+			*pdwBytes = (DWORD)cbData;
+		}
+		*plStatus = pResponse->lStatus;
+
+		IPCRingRelease(&pLink->Response, pRecord);
+		return ERROR_SUCCESS;
+	}
+}
+
+/*
+Opens a new channel of the session: creates its response ring, asks the broker for
+it over the accept ring and maps the request ring the broker created once it answered
+*/
+
+static DWORD IPCBrokerConnect(PIPC_BROKER_CLIENT pClient, PIPC_BROKER_LINK* ppLink)
+{
+	DWORD dwPid = GetCurrentProcessId();
+	PIPC_BROKER_LINK pLink;
+	PIPC_RING_RECORD pRecord;
+	PIPC_BROKER_CONNECT pConnect;
+	IPC_RING Accept;
+	char szName[IPC_RING_NAME_MAX];
+	DWORD dwStart;
+	DWORD dwError;
+	LONG lStatus;
+	int iError;
+
+	pLink = (PIPC_BROKER_LINK)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_BROKER_LINK));
+	if (!pLink)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	pLink->uiChannel = (UINT32)InterlockedIncrement(&g_lIPCBrokerChannelId);
+
+	snprintf(szName, sizeof(szName), IPC_BROKER_RESPONSE_RING, dwPid, pLink->uiChannel);
+	iError = IPCRingCreateNamed(&pLink->Response, szName, dwPid, IPC_BROKER_RING_SIZE);
+	if (iError)
+	{
+		LOG_ERROR("Unable to create broker response ring %s:%d\n", szName, iError);
+		HeapFree(GetProcessHeap(), 0, pLink);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	//Other clients may be connecting too, the accept ring takes one producer at a time
+
+	EnterCriticalSection(&g_csIPCBrokerConnect);
+
+	dwStart = GetTickCount();
+	while ((iError = IPCRingOpenNamed(&Accept, IPC_BROKER_ACCEPT_RING)) == IPC_BROKER_RING_BUSY &&
+		GetTickCount() - dwStart < IPC_BROKER_CONNECT_MS)
+	{
+		Sleep(1);
+	}
+	if (iError)
+	{
+		LeaveCriticalSection(&g_csIPCBrokerConnect);
+		LOG_ERROR("Unable to reach IPCBroker:%d\n", iError);
+		IPCRingClose(&pLink->Response);
+		HeapFree(GetProcessHeap(), 0, pLink);
+		return iError == IPC_BROKER_RING_BUSY ? ERROR_BUSY : ERROR_FILE_NOT_FOUND;
+	}
+
+	//The accept ring outlives a broker that was killed
+
+	pClient->dwBrokerPid = Accept.pHeader->dwConsumerPid;
+	if (!IPCRingPidAlive(pClient->dwBrokerPid))
+	{
+		IPCRingClose(&Accept);
+		LeaveCriticalSection(&g_csIPCBrokerConnect);
+		LOG_ERROR("IPCBroker %u is not running\n", pClient->dwBrokerPid);
+		IPCRingClose(&pLink->Response);
+		HeapFree(GetProcessHeap(), 0, pLink);
+		return ERROR_FILE_NOT_FOUND;
+	}
+
+	pRecord = IPCRingReserve(&Accept, sizeof(IPC_BROKER_CONNECT), IPC_BROKER_CONNECT_MS);
+	if (pRecord)
+	{
+		pConnect = (PIPC_BROKER_CONNECT)pRecord->szMsg;
+		pConnect->dwPid = dwPid;
+		pConnect->uiSession = pClient->uiSession;
+		pConnect->uiChannel = pLink->uiChannel;
+		pConnect->uiReserved = 0;
+		IPCRingCommit(&Accept, pRecord);
+	}
+	IPCRingClose(&Accept);
+
+	LeaveCriticalSection(&g_csIPCBrokerConnect);
+
+	if (!pRecord)
+	{
+		LOG_ERROR("IPCBroker is not accepting connections\n");
+		IPCRingClose(&pLink->Response);
+		HeapFree(GetProcessHeap(), 0, pLink);
+		return ERROR_BUSY;
+	}
+
+	//The broker acknowledges with sequence number 0 once it serves the channel
+
+	dwError = IPCBrokerWaitResponse(pClient, pLink, 0, INFINITE, NULL, 0, NULL, &lStatus);
+	if (dwError == ERROR_SUCCESS && lStatus)
+	{
+		dwError = IPCPacketStatusToError(lStatus);
+	}
+	if (dwError == ERROR_SUCCESS)
+	{
+		snprintf(szName, sizeof(szName), IPC_BROKER_REQUEST_RING, dwPid, pLink->uiChannel);
+		iError = IPCRingOpenNamed(&pLink->Request, szName);
+		if (iError)
+		{
+			LOG_ERROR("Unable to open broker request ring %s:%d\n", szName, iError);
+			dwError = ERROR_GEN_FAILURE;
+		}
+	}
+	if (dwError != ERROR_SUCCESS)
+	{
+		IPCRingClose(&pLink->Response);
+		HeapFree(GetProcessHeap(), 0, pLink);
+		return dwError;
+	}
+
+	EnterCriticalSection(&pClient->csLinks);
+	pLink->pNextAll = pClient->pAll;
+	pClient->pAll = pLink;
+	LeaveCriticalSection(&pClient->csLinks);
+
+	*ppLink = pLink;
+	return ERROR_SUCCESS;
+}
+
+/*
+Takes an idle channel of the session, or connects a new one when every channel has a request outstanding
+*/
+
+static DWORD IPCBrokerTakeLink(PIPC_BROKER_CLIENT pClient, PIPC_BROKER_LINK* ppLink)
+{
+	EnterCriticalSection(&pClient->csLinks);
+	*ppLink = pClient->pIdle;
+	if (*ppLink)
+	{
+		pClient->pIdle = (*ppLink)->pNextIdle;
+	}
+	LeaveCriticalSection(&pClient->csLinks);
+
+	return *ppLink ? ERROR_SUCCESS : IPCBrokerConnect(pClient, ppLink);
+}
+
+static VOID IPCBrokerPutLink(PIPC_BROKER_CLIENT pClient, PIPC_BROKER_LINK pLink)
+{
+	EnterCriticalSection(&pClient->csLinks);
+	pLink->pNextIdle = pClient->pIdle;
+	pClient->pIdle = pLink;
+	LeaveCriticalSection(&pClient->csLinks);
+}
+
+/*
+Forgets a channel whose broker exited
+*/
+
+static VOID IPCBrokerDropLink(PIPC_BROKER_CLIENT pClient, PIPC_BROKER_LINK pLink)
+{
+	PIPC_BROKER_LINK* ppLink;
+
+	EnterCriticalSection(&pClient->csLinks);
+	for (ppLink = &pClient->pAll; *ppLink; ppLink = &(*ppLink)->pNextAll)
+	{
+		if (*ppLink == pLink)
+		{
+			*ppLink = pLink->pNextAll;
+			break;
+		}
+	}
+	LeaveCriticalSection(&pClient->csLinks);
+
+	IPCBrokerFreeLink(pLink);
+}
+
+/*
+Sends one request to the broker and waits for its response, the broker backend's
+DeviceIoControl. The input is the nIn segments back to back, each copied once into the
+request ring. Fails with the status the driver would have completed it with mapped to
+a Win32 error, as the device backend does
+*/
+
+static BOOL IPCBrokerTransactGather(PIPC_VAR pVar, DWORD dwOp, DWORD dwIoControlCode, const IPC_GATHER_SEGMENT* pIn,
+	UINT nIn, PVOID pOutBuffer, DWORD cbOutBuffer, DWORD* pdwBytes, DWORD dwTimeoutMs)
+{
+	PIPC_BROKER_CLIENT pClient = (PIPC_BROKER_CLIENT)pVar->pBackendContext;
+	PIPC_BROKER_LINK pLink;
+	PIPC_RING_RECORD pRecord;
+	PIPC_BROKER_REQUEST pRequest;
+	UINT64 cbInBuffer = 0;
+	char* pNext;
+	DWORD dwError;
+	LONG lStatus;
+	UINT i;
+
+	*pdwBytes = 0;
+
+	for (i = 0; i < nIn; i++)
+	{
+		cbInBuffer += pIn[i].cbData;
+	}
+
+	if (cbInBuffer > IPC_BROKER_MAX_TRANSFER || cbOutBuffer > IPC_BROKER_MAX_TRANSFER)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	dwError = IPCBrokerTakeLink(pClient, &pLink);
+	if (dwError != ERROR_SUCCESS)
+	{
+		SetLastError(dwError);
+		return FALSE;
+	}
+
+	//The request ring only fills up if the broker stopped reading it
+
+	while (!(pRecord = IPCRingReserve(&pLink->Request, sizeof(IPC_BROKER_REQUEST) + (size_t)cbInBuffer, IPC_BROKER_POLL_MS)))
+	{
+		if (!IPCRingPidAlive(pClient->dwBrokerPid))
+		{
+			IPCBrokerDropLink(pClient, pLink);
+			SetLastError(ERROR_BROKEN_PIPE);
+			return FALSE;
+		}
+	}
+
+	pRequest = (PIPC_BROKER_REQUEST)pRecord->szMsg;
+	pRequest->dwOp = dwOp;
+	pRequest->dwIoControlCode = dwIoControlCode;
+	pRequest->uiSeq = ++pLink->uiSeq ? pLink->uiSeq : ++pLink->uiSeq;	//0 is the connect acknowledgement
+	pRequest->cbOut = cbOutBuffer;
+	for (i = 0, pNext = (char*)(pRequest + 1); i < nIn; pNext += pIn[i++].cbData)
+	{
+		if (pIn[i].cbData)
+		{
+			memcpy(pNext, (const VOID*)(ULONG_PTR)pIn[i].pData, pIn[i].cbData);
+		}
+	}
+	IPCRingCommit(&pLink->Request, pRecord);
+
+	dwError = IPCBrokerWaitResponse(pClient, pLink, pLink->uiSeq, dwTimeoutMs, pOutBuffer, cbOutBuffer, pdwBytes, &lStatus);
+	if (dwError != ERROR_SUCCESS)
+	{
+		IPCBrokerDropLink(pClient, pLink);
+		SetLastError(dwError);
+		return FALSE;
+	}
+
+	IPCBrokerPutLink(pClient, pLink);
+
+	if (lStatus)
+	{
+		SetLastError(IPCPacketStatusToError(lStatus));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL IPCBrokerTransact(PIPC_VAR pVar, DWORD dwOp, DWORD dwIoControlCode, PVOID pInBuffer, DWORD cbInBuffer,
+	PVOID pOutBuffer, DWORD cbOutBuffer, DWORD* pdwBytes, DWORD dwTimeoutMs)
+{
+	IPC_GATHER_SEGMENT In = { (UINT64)(ULONG_PTR)pInBuffer, cbInBuffer, 0 };
+
+	return IPCBrokerTransactGather(pVar, dwOp, dwIoControlCode, &In, 1, pOutBuffer, cbOutBuffer, pdwBytes, dwTimeoutMs);
+}
+
+/*
+Broker backend, a session opens its first channel here and more as its threads need them
+*/
+
+static BOOL IPCBrokerOpen(PIPC_VAR pVar)
+{
+	PIPC_BROKER_CLIENT pClient;
+	PIPC_BROKER_LINK pLink;
+	DWORD dwError;
+
+	pClient = (PIPC_BROKER_CLIENT)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_BROKER_CLIENT));
+	if (!pClient)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return FALSE;
+	}
+	InitializeCriticalSection(&pClient->csLinks);
+	pClient->uiSession = (UINT32)InterlockedIncrement(&g_lIPCBrokerSessionId);
+
+	dwError = IPCBrokerConnect(pClient, &pLink);
+	if (dwError != ERROR_SUCCESS)
+	{
+		LOG_ERROR("OpenDeviceforIPC() failed to connect to IPCBroker:%d\n", dwError);
+		DeleteCriticalSection(&pClient->csLinks);
+		HeapFree(GetProcessHeap(), 0, pClient);
+		SetLastError(dwError);
+		return FALSE;
+	}
+	IPCBrokerPutLink(pClient, pLink);
+
+	LOG_INFO("OpenDeviceforIPC() connected to IPCBroker %u\n", pClient->dwBrokerPid);
+	pVar->pBackendContext = pClient;
+	return TRUE;
+}
+
+/*
+The cleanup request removes the port and completes every request still pending on the
+session, then each channel is closed. The caller's threads are done with the session
+*/
+
+static VOID IPCBrokerClose(PIPC_VAR pVar)
+{
+	PIPC_BROKER_CLIENT pClient = (PIPC_BROKER_CLIENT)pVar->pBackendContext;
+	PIPC_BROKER_LINK pLink;
+	PIPC_RING_RECORD pRecord;
+	DWORD dwBytes;
+
+	if (!IPCBrokerTransact(pVar, IPC_BROKER_OP_CLEANUP, 0, NULL, 0, NULL, 0, &dwBytes, INFINITE))
+	{
+		LOG_ERROR("Broker cleanup failed:%d\n", GetLastError());
+	}
+
+	while ((pLink = pClient->pAll) != NULL)
+	{
+		pClient->pAll = pLink->pNextAll;
+
+		pRecord = IPCRingReserve(&pLink->Request, sizeof(IPC_BROKER_REQUEST), IPC_BROKER_POLL_MS);
+		if (pRecord)
+		{
+			memset(pRecord->szMsg, 0, sizeof(IPC_BROKER_REQUEST));
+			((PIPC_BROKER_REQUEST)pRecord->szMsg)->dwOp = IPC_BROKER_OP_CLOSE;
+			IPCRingCommit(&pLink->Request, pRecord);
+		}
+		IPCBrokerFreeLink(pLink);
+	}
+
+	DeleteCriticalSection(&pClient->csLinks);
+	HeapFree(GetProcessHeap(), 0, pClient);
+	pVar->pBackendContext = NULL;
+}
+
+static BOOL IPCBrokerWaitRecv(PIPC_VAR pVar)
+{
+	DWORD dwBytes;
+
+	return IPCBrokerTransact(pVar, IPC_BROKER_OP_WAIT, 0, NULL, 0, NULL, 0, &dwBytes, INFINITE);
+}
+
+static BOOL IPCBrokerRead(PIPC_VAR pVar, PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes)
+{
+	return IPCBrokerTransact(pVar, IPC_BROKER_OP_READ, 0, NULL, 0, pBuffer, cbBuffer, pdwBytes, INFINITE);
+}
+
+static BOOL IPCBrokerWrite(PIPC_VAR pVar, PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes)
+{
+	return IPCBrokerTransact(pVar, IPC_BROKER_OP_WRITE, 0, pBuffer, cbBuffer, NULL, 0, pdwBytes, INFINITE);
+}
+
+static BOOL IPCBrokerIoctl(PIPC_VAR pVar, DWORD dwIoControlCode, PVOID pInBuffer, DWORD cbInBuffer,
+	PVOID pOutBuffer, DWORD cbOutBuffer, DWORD* pdwBytes, DWORD dwTimeoutMs)
+{
+	return IPCBrokerTransact(pVar, IPC_BROKER_OP_IOCTL, dwIoControlCode, pInBuffer, cbInBuffer, pOutBuffer, cbOutBuffer,
+		pdwBytes, dwTimeoutMs);
+}
+
+/*
+The broker cannot read the caller's memory, so the packet is written to it like any other
+with the wire header and the segments copied straight into the request ring
+*/
+
+static BOOL IPCBrokerWriteGather(PIPC_VAR pVar, PIPC_GATHER_HEADER pGather)
+{
+	IPC_GATHER_SEGMENT In[1 + IPC_GATHER_MAX_SEGMENTS];
+	DWORD dwBytes;
+
+	In[0].pData = (UINT64)(ULONG_PTR)&pGather->Wire;
+	In[0].cbData = sizeof(IPC_WIRE_HEADER);
+	In[0].uiReserved = 0;
+	memcpy(&In[1], pGather + 1, pGather->nSegments * sizeof(IPC_GATHER_SEGMENT));
+
+	return IPCBrokerTransactGather(pVar, IPC_BROKER_OP_WRITE, 0, In, 1 + pGather->nSegments, NULL, 0, &dwBytes, INFINITE);
+}
+
+const IPC_BACKEND g_IPCBrokerBackend = { "broker", IPCBrokerOpen, IPCBrokerClose, IPCBrokerWaitRecv,
+	IPCBrokerRead, IPCBrokerWrite, IPCBrokerIoctl, IPCBrokerWriteGather };
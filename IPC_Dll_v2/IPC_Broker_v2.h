@@ -0,0 +1,74 @@
+#pragma once
+/*
+IPC_Broker_v2.h
+
+Protocol between the broker backend of IPC_Dll_v2 and the IPCBroker process,
+which hosts the routing core of IPCDrv in user mode where there is no driver.
+Every request the DLL would send to the device (read, write, IOCTL) is written
+to a shared memory ring instead and the broker answers in another ring. A client
+opens one or more channels, each a request ring created by the broker and a
+response ring created by the client, and keeps one request outstanding on each.
+Every channel of a client session shares one port, the way every request on a
+device handle shares its File object.
+
+The layouts below are shared between processes so they only use fixed size types.
+*/
+
+#include"IPC_Ring_v2.h"
+
+#define IPC_BROKER_ACCEPT_RING "ipcbroker_accept"		//Ring the broker reads IPC_BROKER_CONNECT from
+#define IPC_BROKER_REQUEST_RING "ipcbroker_req_%u_%u"	//Request ring of a channel, formatted with the client's PID and channel ID
+#define IPC_BROKER_RESPONSE_RING "ipcbroker_rsp_%u_%u"	//Response ring of a channel, formatted the same way
+#define IPC_BROKER_ACCEPT_SIZE (64 * 1024)				//Data area of the accept ring
+#define IPC_BROKER_RING_SIZE (8 * 1024 * 1024)			//Data area of the request and response rings
+#define IPC_BROKER_MAX_TRANSFER (IPC_BROKER_RING_SIZE - 4096)	//Largest request or response data, headers excluded
+#define IPC_BROKER_POLL_MS 1000							//Longest wait before a side checks the other one is still running
+
+//Linux PIDs may be odd, which the routing core would take for endpoint handles, so the broker hands
+//out endpoint handles with the top bit set instead (bits 15-30 generation, bits 0-14 slot)
+
+#define IPC_BROKER_ENDPOINT_TAG 0x80000000
+
+//Operations of a request
+
+typedef enum _IPC_BROKER_OP
+{
+	IPC_BROKER_OP_READ,				//ReadFile, cbOut is the buffer size
+	IPC_BROKER_OP_WRITE,			//WriteFile, the packet follows the request
+	IPC_BROKER_OP_IOCTL,			//DeviceIoControl of dwIoControlCode, the input buffer follows the request
+	IPC_BROKER_OP_WAIT,				//Completes once a packet is queued to the port (the Read notification event)
+	IPC_BROKER_OP_CANCEL,			//Cancels the pending request uiSeq of the channel, it completes with STATUS_CANCELLED. No response of its own
+	IPC_BROKER_OP_CLEANUP,			//Last handle closed: the port is removed and every pending request of the session completes
+	IPC_BROKER_OP_CLOSE				//Closes the channel, no response. The port is freed with the last channel
+}IPC_BROKER_OP;
+
+//Written to the accept ring to open a channel. The broker creates the request ring, opens the
+//response ring the client created beforehand and acknowledges with a response of uiSeq 0
+
+typedef struct _IPC_BROKER_CONNECT
+{
+	uint32_t dwPid;					//PID of the client
+	uint32_t uiSession;				//Session of the client the channel belongs to, a new session creates a port
+	uint32_t uiChannel;				//Channel ID, unique within the client
+	uint32_t uiReserved;			//0
+}IPC_BROKER_CONNECT, *PIPC_BROKER_CONNECT;
+
+//Payload of a request ring record, the input data follows it
+
+typedef struct _IPC_BROKER_REQUEST
+{
+	uint32_t dwOp;					//IPC_BROKER_OP
+	uint32_t dwIoControlCode;		//IOCTL code of IPC_BROKER_OP_IOCTL
+	uint32_t uiSeq;					//Sequence number of the request, echoed by the response
+	uint32_t cbOut;					//Size of the client's output buffer
+}IPC_BROKER_REQUEST, *PIPC_BROKER_REQUEST;
+
+//Payload of a response ring record, cbReturned bytes of output data follow it
+
+typedef struct _IPC_BROKER_RESPONSE
+{
+	uint32_t uiSeq;					//Request answered
+	int32_t lStatus;				//NTSTATUS the driver would have completed the request with
+	uint32_t cbReturned;			//Bytes of output data, the driver's IoStatus.Information
+	uint32_t uiReserved;			//0
+}IPC_BROKER_RESPONSE, *PIPC_BROKER_RESPONSE;
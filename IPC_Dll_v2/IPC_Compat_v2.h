@@ -0,0 +1,200 @@
+#pragma once
+/*
+IPC_Compat_v2.h
+
+The part of Windows.h the IPC dll uses, for building it on Linux where it
+talks to the IPCBroker process instead of the driver. Only what the dll and
+its callers need is declared: the Win32 types, the process heap, the last
+error of the calling thread, critical sections and the error codes the dll
+returns. Included by IPC_Dll_v2.h in place of Windows.h when _WIN32 is not defined.
+*/
+
+#include<stdint.h>
+#include<stddef.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include<time.h>
+#include<unistd.h>
+
+//Types
+
+typedef int BOOL;
+typedef unsigned char BOOLEAN;
+typedef unsigned int UINT;
+typedef uint8_t UINT8;
+typedef uint32_t DWORD;
+typedef uint32_t DWORD32;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef uint64_t ULONG64;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONG64;
+typedef uintptr_t ULONG_PTR;
+typedef void VOID;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef void* HANDLE;
+typedef const char* LPCSTR;
+
+typedef union _LARGE_INTEGER
+{
+	LONG64 QuadPart;
+}LARGE_INTEGER;
+
+typedef struct _LIST_ENTRY
+{
+	struct _LIST_ENTRY* Flink;
+	struct _LIST_ENTRY* Blink;
+}LIST_ENTRY, *PLIST_ENTRY;
+
+//Only the layout, overlapped IO is not available without the driver
+
+typedef struct _OVERLAPPED
+{
+	ULONG_PTR Internal;
+	ULONG_PTR InternalHigh;
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+}OVERLAPPED, *LPOVERLAPPED;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+#define INFINITE 0xFFFFFFFF
+#define MAXUINT32 ((UINT32)~((UINT32)0))
+#define MAXUINT64 ((UINT64)~((UINT64)0))
+#define __declspec(a) __thread		//Only __declspec(thread) is used
+
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define CONTAINING_RECORD(address, type, field) ((type*)((char*)(address) - offsetof(type, field)))
+
+//IOCTL codes, the broker answers the driver's codes
+
+#define METHOD_BUFFERED 0
+#define METHOD_OUT_DIRECT 2
+#define FILE_READ_DATA 0x0001
+#define FILE_WRITE_DATA 0x0002
+#define CTL_CODE(DeviceType, Function, Method, Access) (((DWORD)(DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+//Error codes
+
+#define ERROR_SUCCESS 0
+#define ERROR_INVALID_FUNCTION 1
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_GEN_FAILURE 31
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_BROKEN_PIPE 109
+#define ERROR_SEM_TIMEOUT 121
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_BUSY 170
+#define ERROR_ALREADY_EXISTS 183
+#define ERROR_MORE_DATA 234
+#define ERROR_NO_MORE_ITEMS 259
+#define ERROR_OPERATION_ABORTED 995
+#define ERROR_IO_PENDING 997
+#define ERROR_TIMEOUT 1460
+#define ERROR_NOT_FOUND 1168
+#define ERROR_NOT_ENOUGH_QUOTA 1816
+#define WAIT_TIMEOUT 258
+
+//Last error of the calling thread, defined in IPC_Dll_v2.c
+
+extern __thread DWORD t_dwIPCLastError;
+
+static inline DWORD GetLastError(void)
+{
+	return t_dwIPCLastError;
+}
+
+static inline VOID SetLastError(DWORD dwError)
+{
+	t_dwIPCLastError = dwError;
+}
+
+//The process heap is the C heap
+
+#define HEAP_ZERO_MEMORY 0x00000008
+
+static inline HANDLE GetProcessHeap(void)
+{
+	return NULL;
+}
+
+static inline LPVOID HeapAlloc(HANDLE hHeap, DWORD dwFlags, size_t cbBytes)
+{
+	(void)hHeap;
+	return (dwFlags & HEAP_ZERO_MEMORY) ? calloc(1, cbBytes) : malloc(cbBytes);
+}
+
+static inline LPVOID HeapReAlloc(HANDLE hHeap, DWORD dwFlags, LPVOID pMem, size_t cbBytes)
+{
+	(void)hHeap; (void)dwFlags;
+	return realloc(pMem, cbBytes);
+}
+
+static inline BOOL HeapFree(HANDLE hHeap, DWORD dwFlags, LPVOID pMem)
+{
+	(void)hHeap; (void)dwFlags;
+	free(pMem);
+	return TRUE;
+}
+
+//Critical sections are recursive like Windows ones
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+static inline VOID InitializeCriticalSection(CRITICAL_SECTION* pCs)
+{
+	pthread_mutexattr_t Attr;
+
+	pthread_mutexattr_init(&Attr);
+	pthread_mutexattr_settype(&Attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(pCs, &Attr);
+	pthread_mutexattr_destroy(&Attr);
+}
+
+#define EnterCriticalSection(pCs) pthread_mutex_lock(pCs)
+#define LeaveCriticalSection(pCs) pthread_mutex_unlock(pCs)
+#define DeleteCriticalSection(pCs) pthread_mutex_destroy(pCs)
+
+//Interlocked operations
+
+#define InterlockedIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+
+//Time and processes. The performance counter counts nanoseconds, as the broker's does
+
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER* pCount)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	pCount->QuadPart = (LONG64)Now.tv_sec * 1000000000 + Now.tv_nsec;
+	return TRUE;
+}
+
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* pFrequency)
+{
+	pFrequency->QuadPart = 1000000000;
+	return TRUE;
+}
+
+static inline DWORD GetTickCount(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (DWORD)(Now.tv_sec * 1000 + Now.tv_nsec / 1000000);
+}
+
+#define GetCurrentProcessId() ((DWORD)getpid())
+#define Sleep(dwMilliseconds) usleep((useconds_t)(dwMilliseconds) * 1000)
@@ -8,234 +8,2822 @@ This file contains the various functions for the client side dll of the IPCDrv d
 
 #pragma once
 #include"IPC_Dll_v2.h"
+#ifdef _WIN32
 #include<Windows.h>
+#endif
+#include<stdlib.h>
+
+//Global pointer to our IPC_VAR structure, the session InitDeviceforIPC opened
+
+PIPC_VAR pIpc_Var;
+
+//Session the calling thread bound with SetIPCThreadSession, NULL for the one InitDeviceforIPC opened
+
+static __declspec(thread) PIPC_VAR t_pIPCSession;
+
+//Sessions opened with OpenIPCSession and not closed yet, only these are accepted as session handles
+
+static CRITICAL_SECTION g_csIPCSessions;
+static PIPC_VAR g_pIPCSessions;
+
+//Transport selected with SetIPCBackend, NULL for the IPC_BACKEND environment variable or the platform default
+
+static const IPC_BACKEND* g_pIPCBackend;
+
+#ifndef _WIN32
+__thread DWORD t_dwIPCLastError;	//GetLastError() of IPC_Compat_v2.h
+#endif
+
+//Buffer sizes of the thread local packet buffer pool size classes, header included
+
+static const size_t g_IPCBufClassSizes[IPC_BUF_CLASSES] = { 512, 4096, 65536, 1048576 };
+
+//Packet buffer cache of the calling thread. Threads share sessions, so a per session cache would need a lock
+//on every call. No buffer outlives the call it was taken for, a thread binding another session keeps using
+//them and closing a session leaves none behind. The read buffer grows to the session's cbRecvHighWater
+
+static __declspec(thread) IPC_BUF_CACHE t_IPCBufCache;
+
+#ifndef _WIN32
+
+//Threads get no DLL_THREAD_DETACH here, the destructor of this key frees the cache at thread exit instead.
+//The key is set once the thread's cache holds memory
+
+static pthread_key_t g_IPCBufThreadKey;
+#define IPC_BUF_TRACK_THREAD() pthread_setspecific(g_IPCBufThreadKey, &t_IPCBufCache)
+#else
+#define IPC_BUF_TRACK_THREAD()
+#endif
+
+#ifdef _WIN32
+
+//Event the calling thread waits on for its synchronous requests, created on first use
+
+static __declspec(thread) HANDLE t_hIPCSyncEvent;
+
+#endif
 
 /*
-User Mode process first needs to call this function to initialize the IPC driver.
-The function performs the following:
-1.Calls CreateFile to get the handle to the file object of the device
-2.Calls DeviceIoControl to register Read notification event with the driver
-3.Creates Read thread which wait on the above event to be signalled
+Returns a packet buffer of at least cbSize bytes from the calling thread's cache,
+falling back to the process heap when the cache has no buffer of that size class.
+Buffers are not zeroed, every byte sent or read is written first
+*/
 
-Function accepts PIPC_VAR as input and returns TRUE if above tasks complete successfully,
-else returns FALSE. Call GetLastError() to get more info about failure
+static PVOID IPCBufAlloc(size_t cbSize)
+{
+	PIPC_BUF_CACHE pCache = &t_IPCBufCache;
+	PIPC_BUF_HEADER pBuf;
+	DWORD dwClass;
+
+	for (dwClass = 0; dwClass < IPC_BUF_CLASSES; dwClass++)
+	{
+		if (sizeof(IPC_BUF_HEADER) + cbSize <= g_IPCBufClassSizes[dwClass])
+		{
+			break;
+		}
+	}
+
+	if (dwClass < IPC_BUF_CLASSES && pCache->pFree[dwClass])
+	{
+		pBuf = pCache->pFree[dwClass];
+		pCache->pFree[dwClass] = pBuf->pNext;
+		pCache->nFree[dwClass]--;
+		pCache->nHits++;
+		return pBuf + 1;
+	}
+
+	pCache->nMisses++;
+	pBuf = (PIPC_BUF_HEADER)HeapAlloc(GetProcessHeap(), 0,
+		dwClass < IPC_BUF_CLASSES ? g_IPCBufClassSizes[dwClass] : sizeof(IPC_BUF_HEADER) + cbSize);
+	if (!pBuf)
+	{
+		return NULL;
+	}
+
+	pBuf->dwClass = dwClass;
+	return pBuf + 1;
+}
+
+/*
+Returns a packet buffer to the calling thread's cache, or to the process heap if
+the cache already holds IPC_BUF_CLASS_DEPTH buffers of that size class
 */
 
-BOOL InitDeviceforIPC()
+static VOID IPCBufFree(PVOID pBuffer)
 {
-	//Alloc memory for the IPC_VAR structure
+	PIPC_BUF_CACHE pCache = &t_IPCBufCache;
+	PIPC_BUF_HEADER pBuf = (PIPC_BUF_HEADER)pBuffer - 1;
+
+	if (pBuf->dwClass < IPC_BUF_CLASSES && pCache->nFree[pBuf->dwClass] < IPC_BUF_CLASS_DEPTH)
+	{
+		pBuf->pNext = pCache->pFree[pBuf->dwClass];
+		pCache->pFree[pBuf->dwClass] = pBuf;
+		if (++pCache->nFree[pBuf->dwClass] == 1)
+		{
+			IPC_BUF_TRACK_THREAD();
+		}
+		return;
+	}
+
+	HeapFree(GetProcessHeap(), 0, pBuf);
+}
+
+/*
+Frees every buffer cached by the calling thread, called when the thread exits
+*/
+
+static VOID IPCBufFlushThread()
+{
+	PIPC_BUF_CACHE pCache = &t_IPCBufCache;
+	PIPC_BUF_HEADER pBuf;
+	DWORD dwClass;
+
+	LOG_INFO("Packet buffer pool hits:%llu misses:%llu\n", pCache->nHits, pCache->nMisses);
+
+	for (dwClass = 0; dwClass < IPC_BUF_CLASSES; dwClass++)
+	{
+		while ((pBuf = pCache->pFree[dwClass]) != NULL)
+		{
+			pCache->pFree[dwClass] = pBuf->pNext;
+			HeapFree(GetProcessHeap(), 0, pBuf);
+		}
+		pCache->nFree[dwClass] = 0;
+	}
+
+	if (pCache->pRecvPacket)
+	{
+		HeapFree(GetProcessHeap(), 0, pCache->pRecvPacket);
+		pCache->pRecvPacket = NULL;
+		pCache->cbRecvPacket = 0;
+	}
+}
+
+/*
+Drops a reference on a session, the last one frees its IPC_VAR
+*/
+
+static VOID IPCSessionRelease(PIPC_VAR pVar)
+{
+	if (InterlockedDecrement(&(pVar->nRefs)) == 0)
+	{
+		HeapFree(GetProcessHeap(), 0, pVar);
+	}
+}
+
+/*
+Returns the session the API calls of the calling thread go over. A thread whose session was
+closed by another thread is bound back to the process' session and lets go of the closed one
+*/
+
+static PIPC_VAR IPCSession()
+{
+	PIPC_VAR pVar = t_pIPCSession;
+
+	if (pVar && pVar->bClosed)
+	{
+		t_pIPCSession = NULL;
+		IPCSessionRelease(pVar);
+		pVar = NULL;
+	}
+	return pVar ? pVar : pIpc_Var;
+}
+
+/*
+Records the size of a packet read on the session's handle. Read buffers are sized to the largest
+packet seen so far, so only the first packet of a new size costs a second read. Concurrent updates
+may lose a larger size, which then just costs one more retry
+*/
+
+static VOID IPCRecvHighWater(PIPC_VAR pVar, DWORD cbPacket)
+{
+	if (cbPacket > pVar->cbRecvHighWater)
+	{
+		pVar->cbRecvHighWater = cbPacket;
+	}
+}
+
+/*
+Returns the calling thread's read buffer for RecvIPCMsg, grown to at least cbSize bytes
+*/
+
+static PIPC_WIRE_HEADER IPCRecvBufReserve(DWORD cbSize)
+{
+	PIPC_BUF_CACHE pCache = &t_IPCBufCache;
+	PIPC_WIRE_HEADER pRecvPacket;
+
+	if (pCache->cbRecvPacket >= cbSize)
+	{
+		return pCache->pRecvPacket;
+	}
+
+	//The old contents are not needed, free before allocating so the heap can reuse the block
+
+	if (pCache->pRecvPacket)
+	{
+		HeapFree(GetProcessHeap(), 0, pCache->pRecvPacket);
+		pCache->pRecvPacket = NULL;
+		pCache->cbRecvPacket = 0;
+	}
+
+	pRecvPacket = (PIPC_WIRE_HEADER)HeapAlloc(GetProcessHeap(), 0, cbSize);
+	if (!pRecvPacket)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	pCache->pRecvPacket = pRecvPacket;
+	pCache->cbRecvPacket = cbSize;
+	IPC_BUF_TRACK_THREAD();
+	return pRecvPacket;
+}
+
+#ifdef _WIN32
+
+/*
+The device handle is opened for overlapped IO so reads can be kept in flight by the
+asynchronous receive API. The synchronous functions issue their requests with an
+OVERLAPPED of their own and wait for them here. The low bit of hEvent is set so the
+completion is not queued to a completion port the handle may be associated with.
+A request still pending after dwTimeoutMs is cancelled and waited for, it then fails
+with ERROR_OPERATION_ABORTED unless it completed meanwhile
+*/
+
+static BOOL IPCSyncBegin(LPOVERLAPPED pOverlapped)
+{
+	if (!t_hIPCSyncEvent)
+	{
+		t_hIPCSyncEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (!t_hIPCSyncEvent)
+		{
+			LOG_ERROR("Unable to create synchronous IO event:%d\n", GetLastError());
+			return FALSE;
+		}
+	}
+
+	memset(pOverlapped, 0, sizeof(OVERLAPPED));
+	pOverlapped->hEvent = (HANDLE)((ULONG_PTR)t_hIPCSyncEvent | 1);
+	return TRUE;
+}
+
+static BOOL IPCSyncEnd(PIPC_VAR pVar, BOOL bIssued, LPOVERLAPPED pOverlapped, DWORD* pdwBytes, DWORD dwTimeoutMs)
+{
+	if (!bIssued)
+	{
+		if (GetLastError() != ERROR_IO_PENDING)
+		{
+			return FALSE;
+		}
+		if (WaitForSingleObject(t_hIPCSyncEvent, dwTimeoutMs) == WAIT_TIMEOUT)
+		{
+			CancelIoEx(pVar->hFile, pOverlapped);
+			WaitForSingleObject(t_hIPCSyncEvent, INFINITE);
+		}
+	}
+
+	return GetOverlappedResult(pVar->hFile, pOverlapped, pdwBytes, FALSE);
+}
 
-	pIpc_Var = (PIPC_VAR)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_VAR));
+/*
+Device backend, the requests go to IPCDrv. Opening it registers the Read notification
+event the receive functions wait on before a batch read
+*/
+
+static BOOL IPCDeviceOpen(PIPC_VAR pVar)
+{
+	//Local for DeviceIoControl bytes returned
+
+	DWORD dwBytesReturned;
 
 	//Open DOS Device Name and get handle to file object
 
-	pIpc_Var->hFile = CreateFile("\\\\.\\IPCDrv",              // Name of object
+	pVar->hFile = CreateFile("\\\\.\\IPCDrv",              // Name of object
 		GENERIC_READ | GENERIC_WRITE, // Desired Access
 		0,                            // Share Mode
 		NULL,                         // reserved
 		OPEN_EXISTING,                // Fail if object does not exist
-		0,                            // Flags
+		FILE_FLAG_OVERLAPPED,         // Flags, reads can be kept in flight by StartIPCAsyncRecv
 		NULL);                        // reserved
 
-	if (pIpc_Var->hFile == INVALID_HANDLE_VALUE)
+	if (pVar->hFile == INVALID_HANDLE_VALUE)
 	{
 		LOG_ERROR("OpenDeviceforIPC() failed to open handle to IPC Device Object:%d\n", GetLastError());
-		HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pIpc_Var);
 		return FALSE;
 	}
 
 	LOG_INFO("OpenDeviceforIPC() succeeded\n");
 
-	//Local for DeviceIoControl bytes returned
-
-	DWORD dwBytesReturned;
-
 	//Create Read notification event
 
-	pIpc_Var->hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (pIpc_Var->hEvent == NULL) //if it fails return NULL
+	pVar->hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (pVar->hEvent == NULL) //if it fails return NULL
 	{
 		LOG_ERROR("Unable to Create Read Notification Event:%d\n", GetLastError());
-		CloseHandle(pIpc_Var->hFile);
-		HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pIpc_Var);
+		CloseHandle(pVar->hFile);
 		return FALSE;
 	}
 
 	//Sent IOCTL to register Read notification event to driver
 
-	if (!DeviceIoControl(pIpc_Var->hFile,   //handle to our file object
-				IOCTL_REG_EVENT,			//IOCTL
-				&(pIpc_Var->hEvent),		//Input buffer
-				sizeof(pIpc_Var->hEvent),	//input buffer size
-				NULL,						//Output buffer
-				0,							//Output buffer size
-				&dwBytesReturned,			//size returned
-				NULL))
+	if (!pVar->pBackend->pfnIoctl(pVar, IOCTL_REG_EVENT,		//IOCTL
+				&(pVar->hEvent),		//Input buffer
+				sizeof(pVar->hEvent),	//input buffer size
+				NULL,					//Output buffer
+				0,						//Output buffer size
+				&dwBytesReturned,		//size returned
+				INFINITE))				//Timeout
 	{
-		printf("RegRecvNotificationEvent() failed :%d\n", GetLastError());
+		LOG_ERROR("RegRecvNotificationEvent() failed :%d\n", GetLastError());
+		CloseHandle(pVar->hEvent);
+		CloseHandle(pVar->hFile);
 		return FALSE;
 	}
 
 	LOG_INFO("RegRecvNotificationEvent() succeeded\n");
+	return TRUE;
+}
+
+static VOID IPCDeviceClose(PIPC_VAR pVar)
+{
+	CloseHandle(pVar->hEvent);
+	CloseHandle(pVar->hFile);
+}
 
-	/*Create Read thread which waits on the above read event to be signalled by driver.
+static BOOL IPCDeviceWaitRecv(PIPC_VAR pVar)
+{
+	//Wait on Read Notification Event
+	return WaitForSingleObject(pVar->hEvent, INFINITE) == WAIT_OBJECT_0;
+}
+
+static BOOL IPCDeviceRead(PIPC_VAR pVar, PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes)
+{
+	OVERLAPPED Overlapped;
 
-	pIpc_Var->hThread = CreateThread(NULL, 0, RecvIPCMsg, pIpc_Var, 0, 0);
-	if (!pIpc_Var->hThread)
+	if (!IPCSyncBegin(&Overlapped))
 	{
-		LOG_ERROR("Unable to create Read Thread:%d\n", GetLastError());
 		return FALSE;
 	}
+	return IPCSyncEnd(pVar, ReadFile(pVar->hFile, pBuffer, cbBuffer, NULL, &Overlapped), &Overlapped, pdwBytes, INFINITE);
+}
 
-	LOG_INFO("Read Thread creation successful\n");
-	*/
+static BOOL IPCDeviceWrite(PIPC_VAR pVar, PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes)
+{
+	OVERLAPPED Overlapped;
 
-	return TRUE;
+	if (!IPCSyncBegin(&Overlapped))
+	{
+		return FALSE;
+	}
+	return IPCSyncEnd(pVar, WriteFile(pVar->hFile, pBuffer, cbBuffer, NULL, &Overlapped), &Overlapped, pdwBytes, INFINITE);
 }
 
+static BOOL IPCDeviceIoctl(PIPC_VAR pVar, DWORD dwIoControlCode, PVOID pInBuffer, DWORD cbInBuffer,
+	PVOID pOutBuffer, DWORD cbOutBuffer, DWORD* pdwBytes, DWORD dwTimeoutMs)
+{
+	OVERLAPPED Overlapped;
 
-PIPCMSG RecvIPCMsg()
+	if (!IPCSyncBegin(&Overlapped))
+	{
+		return FALSE;
+	}
+	return IPCSyncEnd(pVar, DeviceIoControl(pVar->hFile, dwIoControlCode, pInBuffer, cbInBuffer, pOutBuffer, cbOutBuffer, NULL, &Overlapped),
+		&Overlapped, pdwBytes, dwTimeoutMs);
+}
+
+/*
+Only the header and the segment list are passed, the driver copies the payload straight
+from the caller's buffers into the packet
+*/
+
+static BOOL IPCDeviceWriteGather(PIPC_VAR pVar, PIPC_GATHER_HEADER pGather)
 {
-	//Locals 
+	DWORD dwBytesReturned;
 
-	int iRecvBufSize = sizeof(IPC_PACKET) + (INITIALRECVBUFSIZE * sizeof(char)); //Initial Read buffer size
-	DWORD dwNumOfBytesRead;  //Number of Bytes Read
-	BOOL bReadStatus;		 //Read Status
-	DWORD dwError;			 //Error code of ReadFile operation
+	return IPCDeviceIoctl(pVar, IOCTL_SEND_GATHER, pGather,
+		(DWORD)(sizeof(IPC_GATHER_HEADER) + pGather->nSegments * sizeof(IPC_GATHER_SEGMENT)), NULL, 0, &dwBytesReturned, INFINITE);
+}
 
-	//Wait on Read Notification Event
-	WaitForSingleObject(pIpc_Var->hEvent, INFINITE);
+const IPC_BACKEND g_IPCDeviceBackend = { "device", IPCDeviceOpen, IPCDeviceClose, IPCDeviceWaitRecv,
+	IPCDeviceRead, IPCDeviceWrite, IPCDeviceIoctl, IPCDeviceWriteGather };
 
-	//Read Notification Event Signalled
-	LOG_INFO("Received notification for Read\n");
+#endif
 
-	//Reading from Driver
+/*
+The synchronous requests of the dll go over the backend of the calling thread's session
+*/
 
-	LOG_INFO("Sending read request with default buffer\n");		
-	PIPC_PACKET pReceivePacket = (PIPC_PACKET)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, iRecvBufSize);
-	bReadStatus = ReadFile(pIpc_Var->hFile, pReceivePacket, iRecvBufSize, &dwNumOfBytesRead, NULL);
-	
-	if (!bReadStatus)
-	{
-		dwError = GetLastError();
-		LOG_ERROR("Read with default buffer failed with error %d\n", dwError);
+static BOOL IPCSyncRead(PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes)
+{
+	PIPC_VAR pVar = IPCSession();
 
-		if (dwError == ERROR_INSUFFICIENT_BUFFER)
-		{
-			//if we fail with insufficient buffer, driver returns size of correct buffer size in user buffer
-				
-			iRecvBufSize = (int)(*(int*)pReceivePacket);
+	return pVar->pBackend->pfnRead(pVar, pBuffer, cbBuffer, pdwBytes);
+}
 
-			//Free the Packet with old receive buffer size
-			HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pReceivePacket);
+static BOOL IPCSyncWrite(PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes)
+{
+	PIPC_VAR pVar = IPCSession();
 
-			//Now read again with the correct buffer size
-			LOG_INFO("Trying Read again with correct buffer\n");
-			pReceivePacket = (PIPC_PACKET)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, iRecvBufSize);
-			bReadStatus = ReadFile(pIpc_Var->hFile, pReceivePacket, iRecvBufSize, &dwNumOfBytesRead, NULL);
+	return pVar->pBackend->pfnWrite(pVar, pBuffer, cbBuffer, pdwBytes);
+}
 
-			if (!bReadStatus)
-			{
-				dwError = GetLastError();
-				LOG_ERROR("Read with correct buffer size also failed with error %d\n", dwError);
-				ResetEvent(pIpc_Var->hEvent);
-				HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pReceivePacket);
-			}
-			else
-			{
-				PIPCMSG	pMsg = (PIPCMSG)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPCMSG) + (pReceivePacket->header.sizeofpayload));
-				pMsg->bEndofMsg = pReceivePacket->header.bEndOfPayload;
-				pMsg->MsgSize = pReceivePacket->header.sizeofpayload;
-				pMsg->uiMsgID = pReceivePacket->header.uiPacketid;
-				pMsg->uiDestPID = (UINT)pReceivePacket->header.dwDestinationPid;
-				pMsg->uiSourcePID = (UINT)pReceivePacket->header.dwSourcePid;
-				memcpy(pMsg->szMsg, pReceivePacket->szbuffer, pReceivePacket->header.sizeofpayload);
-				HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pReceivePacket);
-
-				return pMsg;
-			}
-		}
-		
-	}
-	PIPCMSG	pMsg = (PIPCMSG)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPCMSG) + (pReceivePacket->header.sizeofpayload));
-	pMsg->bEndofMsg = pReceivePacket->header.bEndOfPayload;
-	pMsg->MsgSize = pReceivePacket->header.sizeofpayload;
-	pMsg->uiMsgID = pReceivePacket->header.uiPacketid;
-	pMsg->uiDestPID = (UINT)pReceivePacket->header.dwDestinationPid;
-	pMsg->uiSourcePID = (UINT)pReceivePacket->header.dwSourcePid;
-	memcpy(pMsg->szMsg, pReceivePacket->szbuffer, pReceivePacket->header.sizeofpayload);
-	HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pReceivePacket);
+static BOOL IPCSyncIoctl(DWORD dwIoControlCode, PVOID pInBuffer, DWORD cbInBuffer, PVOID pOutBuffer, DWORD cbOutBuffer, DWORD* pdwBytes)
+{
+	PIPC_VAR pVar = IPCSession();
 
-	return pMsg;
+	return pVar->pBackend->pfnIoctl(pVar, dwIoControlCode, pInBuffer, cbInBuffer, pOutBuffer, cbOutBuffer, pdwBytes, INFINITE);
 }
 
+/*
+Writes the wire header of a message to the start of a send buffer and returns where its payload
+goes. A reply (uiCallId not 0) carries its call ID between the header and the payload, so the
+buffer holds IPCWireSize(uiCallId, cbPayload) bytes. The caller copies the payload
+*/
+
+static char* IPCWireWrite(PIPC_WIRE_HEADER pWire, UINT uiDestPID, UINT uiMsgID, UINT uiPriority, BOOL bEndofMsg,
+	UINT uiCallId, size_t cbPayload)
+{
+	pWire->bVersion = IPC_WIRE_VERSION;
+	pWire->bFlags = (bEndofMsg ? IPC_WIRE_END_OF_MSG : 0) | (uiCallId ? IPC_WIRE_CALL : 0);
+	pWire->bPriority = (UINT8)(uiPriority > 0xFF ? 0xFF : uiPriority);	//Above the highest lane is the highest lane
+	pWire->bReserved = 0;
+	pWire->dwPid = uiDestPID;
+	pWire->uiMsgID = uiMsgID;
+	pWire->cbPayload = (UINT32)cbPayload;
+	if (uiCallId)
+	{
+		((PIPC_WIRE_CALL_ID)(pWire + 1))->uiCallId = uiCallId;
+		((PIPC_WIRE_CALL_ID)(pWire + 1))->uiReserved = 0;
+	}
+	return IPCWirePayload(pWire);
+}
 
+/*
+Describes an IPC Packet read from the driver in a view of the buffer it was read into.
+A packet read carries its source PID, the destination is this process. The receive stamp
+of a traced packet is written in place, into the stamps following the payload
+*/
 
-BOOL SendIPCMsg(PIPCMSG pMsg)
+static VOID IPCPacketToView(PIPC_WIRE_HEADER pReceivePacket, PIPCMSGVIEW pView)
 {
-	if (!pMsg)
+	LARGE_INTEGER Now;
+
+	pView->uiMsgID = pReceivePacket->uiMsgID;
+	pView->uiSourcePID = pReceivePacket->dwPid;
+	pView->uiDestPID = GetCurrentProcessId();
+	pView->MsgSize = pReceivePacket->cbPayload;
+	pView->bEndofMsg = (pReceivePacket->bFlags & IPC_WIRE_END_OF_MSG) != 0;
+	pView->uiPriority = pReceivePacket->bPriority;
+	pView->uiCallID = IPCWireCallId(pReceivePacket);
+	pView->bTraced = (pReceivePacket->bFlags & IPC_WIRE_TRACED) != 0;
+	pView->pMsg = IPCWirePayload(pReceivePacket);
+	pView->cbRequired = 0;
+
+	if (pView->bTraced)
 	{
-		LOG_ERROR("Invalid pointer\n");
-		SetLastError(ERROR_INVALID_PARAMETER);
-		return FALSE;
+		//The stamps follow a payload of any length, they are not aligned
+
+		QueryPerformanceCounter(&Now);
+		memcpy((char*)pView->pMsg + pView->MsgSize + offsetof(IPC_PACKET_TRACE, Stamps[IPC_TRACE_RECEIVED]),
+			&Now.QuadPart, sizeof(LONG64));
 	}
+}
 
-	//Locals
+/*
+Converts an IPC Packet read from the driver to a heap allocated IPCMSG, NULL if out of memory.
+The stamps of a traced packet are kept after the message
+*/
 
-	BOOL fSuccess;
-	DWORD dwNumofBytesWritten;
-	size_t payloadbytes = pMsg->MsgSize;
-	//Create IPC Packet
+static PIPCMSG IPCPacketToMsg(PIPC_WIRE_HEADER pReceivePacket)
+{
+	IPCMSGVIEW View;
+	PIPCMSG pMsg;
 
-	PIPC_PACKET pSendPacket = (PIPC_PACKET)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_PACKET) + payloadbytes);
+	IPCPacketToView(pReceivePacket, &View);
 
-	if (pSendPacket == NULL) //if it fails return NULL
+	pMsg = (PIPCMSG)HeapAlloc(GetProcessHeap(), 0, sizeof(IPCMSG) + View.MsgSize + (View.bTraced ? sizeof(IPC_PACKET_TRACE) : 0));
+	if (!pMsg)
 	{
 		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-		LOG_ERROR("Unable to create IPC Packet:%d\n", GetLastError());
-		return FALSE;
+		return NULL;
 	}
 
-	pSendPacket->header.dwSourcePid = pMsg->uiSourcePID;      //Source PID
-	pSendPacket->header.dwDestinationPid = (HANDLE)pMsg->uiDestPID;	  //Destination PID
-	pSendPacket->header.uiPacketid = pMsg->uiMsgID;			  //Packet ID
-	pSendPacket->header.bEndOfPayload = pMsg->bEndofMsg;	  //EndofPayload
-	pSendPacket->header.sizeofpayload = payloadbytes;		  //Size in bytes of payload
+	pMsg->bEndofMsg = View.bEndofMsg;
+	pMsg->MsgSize = View.MsgSize;
+	pMsg->uiMsgID = View.uiMsgID;
+	pMsg->uiDestPID = View.uiDestPID;
+	pMsg->uiSourcePID = View.uiSourcePID;
+	pMsg->uiPriority = View.uiPriority;
+	pMsg->uiCallID = View.uiCallID;
+	pMsg->bTraced = View.bTraced;
+	memcpy(pMsg->szMsg, View.pMsg, View.MsgSize + (View.bTraced ? sizeof(IPC_PACKET_TRACE) : 0));
 
-	memcpy(pSendPacket->szbuffer, pMsg->szMsg, payloadbytes); //Mem Copy  
+	return pMsg;
+}
 
-	LOG_INFO("IPC Packet created and ready to be sent\n");
+/*
+Maps the NTSTATUS the driver returns for each packet of a batch send to a Win32 error.
+The broker backend maps the status of its requests with it too, the way the IO manager does
+*/
 
-	//Send Write IRP to our device/driver
+DWORD IPCPacketStatusToError(LONG lStatus)
+{
+	switch ((ULONG)lStatus)
+	{
+	case 0x00000000:	//STATUS_SUCCESS
+		return ERROR_SUCCESS;
+	case 0x80000005:	//STATUS_BUFFER_OVERFLOW, the output is the size the message needs
+		return ERROR_MORE_DATA;
+	case 0x8000001A:	//STATUS_NO_MORE_ENTRIES, nothing queued
+		return ERROR_NO_MORE_ITEMS;
+	case 0xC000000D:	//STATUS_INVALID_PARAMETER
+		return ERROR_INVALID_PARAMETER;
+	case 0xC0000023:	//STATUS_BUFFER_TOO_SMALL
+		return ERROR_INSUFFICIENT_BUFFER;
+	case 0xC0000035:	//STATUS_OBJECT_NAME_COLLISION, the endpoint name is taken
+		return ERROR_ALREADY_EXISTS;
+	case 0xC00000BB:	//STATUS_NOT_SUPPORTED
+		return ERROR_NOT_SUPPORTED;
+	case 0xC000014B:	//STATUS_PIPE_BROKEN, the broker went away
+		return ERROR_BROKEN_PIPE;
+	case 0xC0000225:	//STATUS_NOT_FOUND, no process registered for the destination PID
+		return ERROR_NOT_FOUND;
+	case 0xC000009A:	//STATUS_INSUFFICIENT_RESOURCES
+		return ERROR_NOT_ENOUGH_MEMORY;
+	case 0xC0000044:	//STATUS_QUOTA_EXCEEDED, the destination is over its queue limit
+		return ERROR_NOT_ENOUGH_QUOTA;
+	case 0xC00000B5:	//STATUS_IO_TIMEOUT, IPC_OVERFLOW_BLOCK waited too long for the destination
+		return ERROR_SEM_TIMEOUT;
+	case 0xC0000120:	//STATUS_CANCELLED
+		return ERROR_OPERATION_ABORTED;
+	default:
+		return ERROR_GEN_FAILURE;
+	}
+}
 
-	fSuccess = WriteFile(pIpc_Var->hFile,						//handle to file object
-		pSendPacket,											//Buffer to write
-		sizeof(IPC_PACKET) + payloadbytes,						//size of buffer
-		&dwNumofBytesWritten,									//Num of bytes written
-		NULL);
+/*
+Appends a message read ahead by RecvIPCStream to the session's deferred list, the next receive
+call returns it. Returns FALSE if out of memory, the message is then freed
+*/
 
-	if (!fSuccess)
+static BOOL IPCDeferMsg(PIPC_VAR pVar, PIPCMSG pMsg)
+{
+	PIPC_DEFERRED_MSG pDeferred = (PIPC_DEFERRED_MSG)HeapAlloc(GetProcessHeap(), 0, sizeof(IPC_DEFERRED_MSG));
+	if (!pDeferred)
 	{
-		LOG_ERROR("Sending IPC message/WriteFile failed:%d\n", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pMsg);
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return FALSE;
+	}
+
+	pDeferred->pMsg = pMsg;
+	pDeferred->pNext = NULL;
+
+	EnterCriticalSection(&(pVar->csDeferred));
+	if (pVar->pDeferredTail)
+	{
+		pVar->pDeferredTail->pNext = pDeferred;
 	}
 	else
 	{
-		LOG_INFO("Sent IPC Message to driver\n");
+		pVar->pDeferredHead = pDeferred;
 	}
+	pVar->pDeferredTail = pDeferred;
+	LeaveCriticalSection(&(pVar->csDeferred));
 
-	//Free Heap for the IPC Packet
-	HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pSendPacket);
-
-	return fSuccess;
-}
-
-BOOL CloseDeviceforIPC()
-{
-	CloseHandle(pIpc_Var->hEvent);
-	CloseHandle(pIpc_Var->hFile);
-	HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pIpc_Var);
 	return TRUE;
 }
 
+/*
+Removes the oldest deferred message, NULL if there is none. The list is checked without the
+lock first so the receive calls pay nothing while no stream is being received. A message whose
+payload and stamps take more than cbMax bytes is left in place and NULL returned, with the
+bytes it takes in *pcbRequired (optional, 0 otherwise)
+*/
+
+static PIPCMSG IPCTakeDeferredMsg(PIPC_VAR pVar, size_t cbMax, size_t* pcbRequired)
+{
+	PIPC_DEFERRED_MSG pDeferred;
+	PIPCMSG pMsg = NULL;
+	size_t cbRequired = 0;
 
+	if (pcbRequired)
+	{
+		*pcbRequired = 0;
+	}
+	if (!pVar->pDeferredHead)
+	{
+		return NULL;
+	}
 
+	EnterCriticalSection(&(pVar->csDeferred));
+	pDeferred = pVar->pDeferredHead;
+	if (pDeferred && pDeferred->pMsg->MsgSize + (pDeferred->pMsg->bTraced ? sizeof(IPC_PACKET_TRACE) : 0) > cbMax)
+	{
+		cbRequired = pDeferred->pMsg->MsgSize + (pDeferred->pMsg->bTraced ? sizeof(IPC_PACKET_TRACE) : 0);
+		pDeferred = NULL;
+	}
+	else if (pDeferred)
+	{
+		pVar->pDeferredHead = pDeferred->pNext;
+		if (!pVar->pDeferredHead)
+		{
+			pVar->pDeferredTail = NULL;
+		}
+	}
+	LeaveCriticalSection(&(pVar->csDeferred));
+
+	if (pDeferred)
+	{
+		pMsg = pDeferred->pMsg;
+		HeapFree(GetProcessHeap(), 0, pDeferred);
+	}
+	if (pcbRequired)
+	{
+		*pcbRequired = cbRequired;
+	}
+	return pMsg;
+}
+
+/*
+Adds a fragment to the message RecvIPCStream is reassembling. The first fragment received
+picks the message, later ones must carry the same source PID and message ID. Payload beyond
+the caller's buffer is counted but not copied.
+Returns FALSE if the fragment belongs to another message
+*/
+
+static BOOL IPCStreamAppend(PIPC_STREAM_RECV pStream, UINT uiSourcePID, UINT uiMsgID, BOOL bEndOfPayload,
+	const char* pPayload, size_t cbPayload)
+{
+	if (pStream->bComplete)
+	{
+		return FALSE;
+	}
+	if (!pStream->bStarted)
+	{
+		pStream->uiSourcePID = uiSourcePID;
+		pStream->uiMsgID = uiMsgID;
+		pStream->bStarted = TRUE;
+	}
+	else if (pStream->uiSourcePID != uiSourcePID || pStream->uiMsgID != uiMsgID)
+	{
+		return FALSE;
+	}
+
+	if (pStream->cbMsg < pStream->cbBuffer)
+	{
+		size_t cbCopy = pStream->cbBuffer - pStream->cbMsg;
+
+		memcpy(pStream->pBuffer + pStream->cbMsg, pPayload, cbPayload < cbCopy ? cbPayload : cbCopy);
+	}
+	pStream->cbMsg += cbPayload;
+	pStream->bComplete = bEndOfPayload;
+
+	return TRUE;
+}
+
+#ifdef _WIN32
+
+BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
+{
+	//Free the exiting thread's cached buffers and IO event. On process termination (lpvReserved set)
+	//the heap and handles go away with the process so nothing needs freeing
+
+	switch (fdwReason)
+	{
+	case DLL_PROCESS_ATTACH:
+		InitializeCriticalSection(&g_csIPCSessions);
+		IPCBrokerProcessAttach();
+		break;
+	case DLL_THREAD_DETACH:
+		SetIPCThreadSession(NULL);
+		IPCBufFlushThread();
+		if (t_hIPCSyncEvent)
+		{
+			CloseHandle(t_hIPCSyncEvent);
+			t_hIPCSyncEvent = NULL;
+		}
+		break;
+	case DLL_PROCESS_DETACH:
+		if (!lpvReserved)
+		{
+			IPCBufFlushThread();
+			if (t_hIPCSyncEvent)
+			{
+				CloseHandle(t_hIPCSyncEvent);
+				t_hIPCSyncEvent = NULL;
+			}
+		}
+		break;
+	}
+	return TRUE;
+}
+
+#else
+
+static VOID IPCBufThreadExit(PVOID pCache)
+{
+	SetIPCThreadSession(NULL);
+	IPCBufFlushThread();
+}
+
+__attribute__((constructor)) static VOID IPCDllInit()
+{
+	InitializeCriticalSection(&g_csIPCSessions);
+	pthread_key_create(&g_IPCBufThreadKey, IPCBufThreadExit);
+	IPCBrokerProcessAttach();
+}
+
+#endif
+
+/*
+Selects the backend InitDeviceforIPC opens by name, "device" (Windows only) or "broker".
+Returns FALSE with ERROR_NOT_SUPPORTED for any other name
+*/
+
+static const IPC_BACKEND* IPCFindBackend(LPCSTR szBackend)
+{
+#ifdef _WIN32
+	if (strcmp(szBackend, g_IPCDeviceBackend.szName) == 0)
+	{
+		return &g_IPCDeviceBackend;
+	}
+#endif
+	if (strcmp(szBackend, g_IPCBrokerBackend.szName) == 0)
+	{
+		return &g_IPCBrokerBackend;
+	}
+	return NULL;
+}
+
+BOOL SetIPCBackend(LPCSTR szBackend)
+{
+	const IPC_BACKEND* pBackend = szBackend ? IPCFindBackend(szBackend) : NULL;
+
+	if (!pBackend)
+	{
+		LOG_ERROR("Unknown IPC backend\n");
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	g_pIPCBackend = pBackend;
+	return TRUE;
+}
+
+/*
+Opens a session, a port of its own in the driver or the broker:
+1.Picks the backend, set by SetIPCBackend, else named by the IPC_BACKEND environment
+  variable, else the driver on Windows and the broker elsewhere
+2.Device: calls CreateFile to get the handle to the file object of the device and
+  DeviceIoControl to register Read notification event with the driver.
+  Broker: connects to the IPCBroker process, which creates the port
+
+Returns the session, or NULL on failure. Call GetLastError() to get more info about failure
+*/
+
+static PIPC_VAR IPCSessionOpen()
+{
+	//Locals
+
+	const IPC_BACKEND* pBackend = g_pIPCBackend;
+	const char* szBackend;
+	PIPC_VAR pVar;
+
+	if (!pBackend)
+	{
+		szBackend = getenv("IPC_BACKEND");
+#ifdef _WIN32
+		pBackend = szBackend ? IPCFindBackend(szBackend) : &g_IPCDeviceBackend;
+#else
+		pBackend = szBackend ? IPCFindBackend(szBackend) : &g_IPCBrokerBackend;
+#endif
+		if (!pBackend)
+		{
+			LOG_ERROR("Unknown IPC backend %s\n", szBackend);
+			SetLastError(ERROR_NOT_SUPPORTED);
+			return NULL;
+		}
+	}
+
+	//Alloc memory for the IPC_VAR structure
+
+	pVar = (PIPC_VAR)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_VAR));
+	if (!pVar)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	pVar->pBackend = pBackend;
+	pVar->nRefs = 1;
+	InitializeCriticalSection(&(pVar->csRecv));
+	InitializeCriticalSection(&(pVar->csDeferred));
+	pVar->cbRecvHighWater = sizeof(IPC_WIRE_HEADER) + (INITIALRECVBUFSIZE * sizeof(char)); //Initial Read buffer size
+
+	//Open the device, or connect to the broker
+
+	if (!pBackend->pfnOpen(pVar))
+	{
+		DeleteCriticalSection(&(pVar->csRecv));
+		DeleteCriticalSection(&(pVar->csDeferred));
+		HeapFree(GetProcessHeap(), 0, pVar);
+		return NULL;
+	}
+
+	LOG_INFO("IPC backend %s opened\n", pBackend->szName);
+	return pVar;
+}
+
+/*
+User Mode process first needs to call this function to initialize the IPC driver. It opens
+the process' session, the one every thread uses unless it bound another with SetIPCThreadSession.
+
+Function returns TRUE if the session was opened,
+else returns FALSE. Call GetLastError() to get more info about failure
+*/
+
+BOOL InitDeviceforIPC()
+{
+	PIPC_VAR pVar = IPCSessionOpen();
+
+	if (!pVar)
+	{
+		return FALSE;
+	}
+	pIpc_Var = pVar;
+	return TRUE;
+}
+
+/*
+Opens another session of the process, with its own device handle (or broker channels), port,
+Read notification event and receive buffer sizing, independent of every other session. The
+session's port has the PID of the process, so it is best given an endpoint name
+(RegisterIPCEndpoint) to be reached by. Threads use it after SetIPCThreadSession.
+
+Returns the session handle, or NULL on failure. Call GetLastError() to get more info about failure
+*/
+
+HIPCSESSION OpenIPCSession()
+{
+	PIPC_VAR pVar = IPCSessionOpen();
+
+	if (pVar)
+	{
+		EnterCriticalSection(&g_csIPCSessions);
+		pVar->pNextSession = g_pIPCSessions;
+		g_pIPCSessions = pVar;
+		LeaveCriticalSection(&g_csIPCSessions);
+	}
+	return pVar;
+}
+
+/*
+Binds the calling thread to a session, every API call of the thread then goes over it. NULL
+binds it back to the session of InitDeviceforIPC. Threads bound to the same session may call
+the API concurrently. The thread holds a reference on the session while it is bound, so the
+session's memory stays valid after another thread closes it.
+
+Returns FALSE with ERROR_INVALID_HANDLE if hSession is not a session opened with OpenIPCSession
+or has been closed
+*/
+
+BOOL SetIPCThreadSession(HIPCSESSION hSession)
+{
+	PIPC_VAR pOld = t_pIPCSession;
+	PIPC_VAR pVar = NULL;
+
+	if (hSession)
+	{
+		EnterCriticalSection(&g_csIPCSessions);
+		for (pVar = g_pIPCSessions; pVar && pVar != hSession; pVar = pVar->pNextSession);
+		if (pVar)
+		{
+			InterlockedIncrement(&(pVar->nRefs));
+		}
+		LeaveCriticalSection(&g_csIPCSessions);
+
+		if (!pVar)
+		{
+			SetLastError(ERROR_INVALID_HANDLE);
+			return FALSE;
+		}
+		IPC_BUF_TRACK_THREAD();		//The exit of the thread drops its reference
+	}
+
+	t_pIPCSession = pVar;
+	if (pOld)
+	{
+		IPCSessionRelease(pOld);
+	}
+	return TRUE;
+}
+
+
+/*
+Reads the next message, a read which finds no message queued waits in the driver (or the
+broker) until one is, so the Read notification event is not waited on. The read buffer is kept
+by the calling thread and sized to the largest message read on the handle so far, so a
+message normally takes a single ReadFile. If the message is larger the driver leaves it at
+the head of the queue and returns its size, and it is read again with a buffer that fits.
+Messages RecvIPCStream read ahead are returned first.
+
+Returns the message in a heap allocated IPCMSG (freed by the caller with HeapFree), or NULL
+on failure. Call GetLastError() to get more info about failure
+*/
+
+PIPCMSG RecvIPCMsg()
+{
+	//Locals 
+
+	DWORD dwNumOfBytesRead;  //Number of Bytes Read
+	BOOL bReadStatus;		 //Read Status
+	DWORD dwRequired;		 //Size of the message which did not fit
+	PIPC_WIRE_HEADER pReceivePacket;
+	PIPCMSG pMsg;
+	PIPC_VAR pVar = IPCSession();
+
+	pMsg = IPCTakeDeferredMsg(pVar, (size_t)-1, NULL);
+	if (pMsg)
+	{
+		return pMsg;
+	}
+
+	//Reading from Driver, a read finding no message is parked until one is queued
+
+	pReceivePacket = IPCRecvBufReserve(pVar->cbRecvHighWater);
+	if (!pReceivePacket)
+	{
+		return NULL;
+	}
+	bReadStatus = IPCSyncRead(pReceivePacket, t_IPCBufCache.cbRecvPacket, &dwNumOfBytesRead);
+
+	if (!bReadStatus && GetLastError() == ERROR_MORE_DATA && dwNumOfBytesRead >= sizeof(int))
+	{
+		//The driver returned the size of the message at the head of the queue, read it again with a buffer that fits
+
+		dwRequired = (DWORD)(*(int*)pReceivePacket);
+		IPCRecvHighWater(pVar, dwRequired);
+		LOG_INFO("Trying Read again with a %d byte buffer\n", dwRequired);
+
+		pReceivePacket = IPCRecvBufReserve(dwRequired);
+		if (!pReceivePacket)
+		{
+			return NULL;
+		}
+		bReadStatus = IPCSyncRead(pReceivePacket, t_IPCBufCache.cbRecvPacket, &dwNumOfBytesRead);
+	}
+
+	if (!bReadStatus)
+	{
+		LOG_ERROR("Read failed with error %d\n", GetLastError());
+		return NULL;
+	}
+
+	return IPCPacketToMsg(pReceivePacket);
+}
+
+/*
+Reads the next message straight into the caller's buffer and describes it in *pView, nothing
+is allocated or copied in user mode. The view's payload is in the buffer and stays valid until
+the buffer is reused. If the message does not fit the driver leaves it at the head of the queue,
+FALSE is returned with ERROR_MORE_DATA and pView->cbRequired is the buffer size it needs.
+A message RecvIPCStream read ahead is returned first, copied to the start of the buffer.
+
+Returns TRUE with the message in *pView, or FALSE on failure. Call GetLastError() to get more
+info about failure
+*/
+
+BOOL RecvIPCMsgInto(PVOID pBuffer, DWORD cbBuffer, PIPCMSGVIEW pView)
+{
+	//Locals
+
+	DWORD dwNumOfBytesRead;  //Number of Bytes Read
+	size_t cbRequired;		 //Size of a read ahead message which did not fit
+	PIPCMSG pMsg;
+	PIPC_VAR pVar = IPCSession();
+
+	if (!pBuffer || !pView || cbBuffer < sizeof(IPC_WIRE_HEADER))
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	pMsg = IPCTakeDeferredMsg(pVar, cbBuffer, &cbRequired);
+	if (pMsg)
+	{
+		pView->uiMsgID = pMsg->uiMsgID;
+		pView->uiSourcePID = pMsg->uiSourcePID;
+		pView->uiDestPID = pMsg->uiDestPID;
+		pView->MsgSize = pMsg->MsgSize;
+		pView->bEndofMsg = pMsg->bEndofMsg;
+		pView->uiPriority = pMsg->uiPriority;
+		pView->uiCallID = pMsg->uiCallID;
+		pView->bTraced = pMsg->bTraced;
+		pView->pMsg = (const char*)pBuffer;
+		pView->cbRequired = 0;
+		memcpy(pBuffer, pMsg->szMsg, pMsg->MsgSize + (pMsg->bTraced ? sizeof(IPC_PACKET_TRACE) : 0));
+		HeapFree(GetProcessHeap(), 0, pMsg);
+		return TRUE;
+	}
+	if (cbRequired)
+	{
+		pView->cbRequired = (DWORD)cbRequired;
+		SetLastError(ERROR_MORE_DATA);
+		return FALSE;
+	}
+
+	//Reading from Driver into the caller's buffer, a read finding no message is parked until one is queued
+
+	if (!IPCSyncRead(pBuffer, cbBuffer, &dwNumOfBytesRead))
+	{
+		if (GetLastError() == ERROR_MORE_DATA && dwNumOfBytesRead >= sizeof(int))
+		{
+			//The driver returned the size of the message at the head of the queue
+
+			pView->cbRequired = (DWORD)(*(int*)pBuffer);
+		}
+		else
+		{
+			LOG_ERROR("Read failed with error %d\n", GetLastError());
+		}
+		return FALSE;
+	}
+
+	IPCPacketToView((PIPC_WIRE_HEADER)pBuffer, pView);
+	return TRUE;
+}
+
+
+
+BOOL SendIPCMsg(PIPCMSG pMsg)
+{
+	if (!pMsg || pMsg->MsgSize > MAXUINT32)
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//Locals
+
+	BOOL fSuccess;
+	DWORD dwNumofBytesWritten;
+	size_t payloadbytes = pMsg->MsgSize;
+	//Create IPC Packet in a buffer from the thread local pool
+
+	PIPC_WIRE_HEADER pSendPacket = (PIPC_WIRE_HEADER)IPCBufAlloc(IPCWireSize(0, payloadbytes));
+
+	if (pSendPacket == NULL) //if it fails return NULL
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create IPC Packet:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	//The driver stamps the source PID, the message's uiSourcePID is not sent
+
+	memcpy(IPCWireWrite(pSendPacket, pMsg->uiDestPID, pMsg->uiMsgID, pMsg->uiPriority, pMsg->bEndofMsg, 0, payloadbytes),
+		pMsg->szMsg, payloadbytes); //Mem Copy
+
+	LOG_INFO("IPC Packet created and ready to be sent\n");
+
+	//Send Write IRP to our device/driver
+
+	fSuccess = IPCSyncWrite(pSendPacket,						//Buffer to write
+		(DWORD)IPCWireSize(0, payloadbytes),					//size of buffer
+		&dwNumofBytesWritten);									//Num of bytes written
+
+	if (!fSuccess)
+	{
+		LOG_ERROR("Sending IPC message/WriteFile failed:%d\n", GetLastError());
+	}
+	else
+	{
+		LOG_INFO("Sent IPC Message to driver\n");
+	}
+
+	//Return the IPC Packet buffer to the thread local pool
+	IPCBufFree(pSendPacket);
+
+	return fSuccess;
+}
+
+/*
+Sends one message whose payload is nSegments buffers of the caller, back to back. The
+message ID, destination, priority and end of message flag are taken from pHeader, its
+other members are ignored. The segments are described to the transport rather than
+copied into a send buffer first: the driver copies each one straight into the packet
+and the broker backend into its request ring, so the payload is copied once.
+
+Returns TRUE if the message was routed. Call GetLastError() to get more info
+*/
+
+BOOL SendIPCMsgGather(PIPCMSG pHeader, const IPCSEGMENT* pSegments, UINT nSegments)
+{
+	//Locals
+
+	struct
+	{
+		IPC_GATHER_HEADER Header;
+		IPC_GATHER_SEGMENT Segments[IPC_GATHER_MAX_SEGMENTS];
+	}Gather;
+	UINT64 cbPayload = 0;
+	UINT i;
+	PIPC_VAR pVar = IPCSession();
+
+	if (!pHeader || (!pSegments && nSegments) || nSegments > IPC_GATHER_MAX_SEGMENTS)
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	for (i = 0; i < nSegments; i++)
+	{
+		if (pSegments[i].cbData > MAXUINT32 || (pSegments[i].cbData && !pSegments[i].pData))
+		{
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return FALSE;
+		}
+		Gather.Segments[i].pData = (UINT64)(ULONG_PTR)pSegments[i].pData;
+		Gather.Segments[i].cbData = (UINT32)pSegments[i].cbData;
+		Gather.Segments[i].uiReserved = 0;
+		cbPayload += pSegments[i].cbData;
+	}
+
+	if (cbPayload > MAXUINT32)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//The driver stamps the source PID, the header's uiSourcePID is not sent
+
+	IPCWireWrite(&Gather.Header.Wire, pHeader->uiDestPID, pHeader->uiMsgID, pHeader->uiPriority, pHeader->bEndofMsg, 0,
+		(size_t)cbPayload);
+	Gather.Header.nSegments = nSegments;
+	Gather.Header.uiReserved = 0;
+
+	if (!pVar->pBackend->pfnWriteGather(pVar, &Gather.Header))
+	{
+		LOG_ERROR("Gather send failed:%d\n", GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+Packs nMsgs messages into one buffer (IPC_BATCH_HEADER followed by the IPC Packets) and
+hands it to the driver with one DeviceIoControl. The driver routes the whole batch in that
+call and returns the NTSTATUS of every packet, which is translated to a Win32 error code
+in pdwResults[i] if pdwResults is not NULL.
+
+Returns TRUE if every message was routed, FALSE otherwise. Call GetLastError() to get
+more info when the batch itself failed
+*/
+
+BOOL SendIPCMsgBatch(PIPCMSG* ppMsgs, UINT nMsgs, DWORD* pdwResults)
+{
+	if (!ppMsgs || nMsgs == 0)
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//Locals
+
+	size_t cbBatch = sizeof(IPC_BATCH_HEADER);
+	size_t uiOffset, uiStatusOffset;
+	PIPC_WIRE_HEADER pSendPacket;
+	LONG* plStatus;
+	DWORD dwBytesReturned;
+	BOOL fSuccess;
+	UINT i;
+
+	//Size the batch, every packet starts on an IPC_BATCH_ALIGN boundary
+
+	for (i = 0; i < nMsgs; i++)
+	{
+		if (!ppMsgs[i] || ppMsgs[i]->MsgSize > MAXUINT32)
+		{
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return FALSE;
+		}
+		cbBatch = IPC_BATCH_ALIGN_UP(cbBatch);
+		cbBatch += IPCWireSize(0, ppMsgs[i]->MsgSize);
+	}
+
+	//The per packet status returned by the driver lands right after the batch
+
+	uiStatusOffset = (cbBatch + sizeof(LONG) - 1) & ~(sizeof(LONG) - 1);
+
+	PIPC_BATCH_HEADER pBatch = (PIPC_BATCH_HEADER)IPCBufAlloc(uiStatusOffset + nMsgs * sizeof(LONG));
+	if (!pBatch)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create IPC Packet batch:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	plStatus = (LONG*)((char*)pBatch + uiStatusOffset);
+
+	pBatch->nPackets = nMsgs;
+	pBatch->cbNext = 0;
+
+	uiOffset = sizeof(IPC_BATCH_HEADER);
+	for (i = 0; i < nMsgs; i++)
+	{
+		uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+		pSendPacket = (PIPC_WIRE_HEADER)((char*)pBatch + uiOffset);
+
+		memcpy(IPCWireWrite(pSendPacket, ppMsgs[i]->uiDestPID, ppMsgs[i]->uiMsgID, ppMsgs[i]->uiPriority,
+			ppMsgs[i]->bEndofMsg, 0, ppMsgs[i]->MsgSize), ppMsgs[i]->szMsg, ppMsgs[i]->MsgSize);
+
+		uiOffset += IPCWireSize(0, ppMsgs[i]->MsgSize);
+	}
+
+	//Send the batch to our device/driver, it returns one NTSTATUS per packet
+
+	fSuccess = IPCSyncIoctl(IOCTL_SEND_BATCH,	//IOCTL
+		pBatch,										//Input buffer
+		(DWORD)cbBatch,								//input buffer size
+		plStatus,									//Output buffer
+		nMsgs * sizeof(LONG),						//Output buffer size
+		&dwBytesReturned);							//size returned
+
+	if (!fSuccess)
+	{
+		LOG_ERROR("Sending IPC message batch failed:%d\n", GetLastError());
+	}
+	else
+	{
+		for (i = 0; i < nMsgs; i++)
+		{
+			DWORD dwResult = IPCPacketStatusToError(plStatus[i]);
+
+			if (dwResult != ERROR_SUCCESS && fSuccess)
+			{
+				SetLastError(dwResult);		//Error of the first message which was not sent
+				fSuccess = FALSE;
+			}
+			if (pdwResults)
+			{
+				pdwResults[i] = dwResult;
+			}
+		}
+
+		LOG_INFO("Sent IPC Message batch to driver\n");
+	}
+
+	IPCBufFree(pBatch);
+
+	return fSuccess;
+}
+
+/*
+Copies a group name into a NUL padded IPC_GROUP_NAME_MAX buffer, FALSE if it is empty or too long
+*/
+
+static BOOL IPCGroupName(char* pName, LPCSTR szGroup)
+{
+	size_t cchGroup = szGroup ? strlen(szGroup) : 0;
+
+	if (cchGroup == 0 || cchGroup >= IPC_GROUP_NAME_MAX)
+	{
+		LOG_ERROR("Invalid group name\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	memset(pName, 0, IPC_GROUP_NAME_MAX);
+	memcpy(pName, szGroup, cchGroup);
+	return TRUE;
+}
+
+/*
+Builds an IPC_MULTICAST_HEADER, the PID list and the IPC Packet in one buffer and hands it to the
+driver with one DeviceIoControl (IOCTL_SEND_MULTICAST). The driver keeps a single copy of the
+packet however many processes receive it and returns the number of recipients
+*/
+
+static BOOL IPCSendMulticast(PIPCMSG pMsg, UINT32 uiTarget, const UINT* puiDestPIDs, UINT nDestPIDs, LPCSTR szGroup, UINT* pnDelivered)
+{
+	if (!pMsg || (nDestPIDs && !puiDestPIDs))
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//Locals
+
+	size_t uiOffset = IPC_BATCH_ALIGN_UP(sizeof(IPC_MULTICAST_HEADER) + nDestPIDs * sizeof(DWORD32));
+	size_t payloadbytes = pMsg->MsgSize;
+	PIPC_MULTICAST_HEADER pHeader;
+	PIPC_WIRE_HEADER pSendPacket;
+	ULONG nDelivered = 0;
+	DWORD dwBytesReturned;
+	BOOL fSuccess;
+	UINT i;
+
+	pHeader = (PIPC_MULTICAST_HEADER)IPCBufAlloc(uiOffset + IPCWireSize(0, payloadbytes));
+	if (!pHeader)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create IPC Packet:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	memset(pHeader, 0, sizeof(IPC_MULTICAST_HEADER));
+	pHeader->uiTarget = uiTarget;
+	pHeader->nPids = nDestPIDs;
+	if (uiTarget == IPC_MULTICAST_GROUP && !IPCGroupName(pHeader->szGroup, szGroup))
+	{
+		IPCBufFree(pHeader);
+		return FALSE;
+	}
+	for (i = 0; i < nDestPIDs; i++)
+	{
+		((DWORD32*)(pHeader + 1))[i] = puiDestPIDs[i];
+	}
+
+	//The destination is set per recipient by the driver
+
+	pSendPacket = (PIPC_WIRE_HEADER)((char*)pHeader + uiOffset);
+	memcpy(IPCWireWrite(pSendPacket, 0, pMsg->uiMsgID, pMsg->uiPriority, pMsg->bEndofMsg, 0, payloadbytes),
+		pMsg->szMsg, payloadbytes);
+
+	fSuccess = IPCSyncIoctl(IOCTL_SEND_MULTICAST,	//IOCTL
+		pHeader,										//Input buffer
+		(DWORD)(uiOffset + IPCWireSize(0, payloadbytes)),	//input buffer size
+		&nDelivered,									//Output buffer
+		sizeof(ULONG),									//Output buffer size
+		&dwBytesReturned);								//size returned
+
+	if (!fSuccess)
+	{
+		LOG_ERROR("Sending IPC multicast message failed:%d\n", GetLastError());
+	}
+	else
+	{
+		LOG_INFO("Sent IPC multicast message to %u processes\n", nDelivered);
+	}
+
+	if (pnDelivered)
+	{
+		*pnDelivered = fSuccess ? nDelivered : 0;
+	}
+
+	IPCBufFree(pHeader);
+
+	return fSuccess;
+}
+
+BOOL SendIPCMsgMulticast(PIPCMSG pMsg, const UINT* puiDestPIDs, UINT nDestPIDs, UINT* pnDelivered)
+{
+	return IPCSendMulticast(pMsg, IPC_MULTICAST_PIDS, puiDestPIDs, nDestPIDs, NULL, pnDelivered);
+}
+
+BOOL SendIPCMsgToGroup(PIPCMSG pMsg, LPCSTR szGroup, UINT* pnDelivered)
+{
+	return IPCSendMulticast(pMsg, IPC_MULTICAST_GROUP, NULL, 0, szGroup, pnDelivered);
+}
+
+BOOL BroadcastIPCMsg(PIPCMSG pMsg, UINT* pnDelivered)
+{
+	return IPCSendMulticast(pMsg, IPC_MULTICAST_BROADCAST, NULL, 0, NULL, pnDelivered);
+}
+
+/*
+Joins or leaves a multicast group with IOCTL_JOIN_GROUP / IOCTL_LEAVE_GROUP.
+Leaving a group the process is not a member of fails with ERROR_NOT_FOUND
+*/
+
+BOOL JoinIPCGroup(LPCSTR szGroup)
+{
+	char Name[IPC_GROUP_NAME_MAX];
+	DWORD dwBytesReturned;
+
+	if (!IPCGroupName(Name, szGroup))
+	{
+		return FALSE;
+	}
+
+	if (!IPCSyncIoctl(IOCTL_JOIN_GROUP, Name, IPC_GROUP_NAME_MAX, NULL, 0, &dwBytesReturned))
+	{
+		LOG_ERROR("Joining group %s failed:%d\n", szGroup, GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL LeaveIPCGroup(LPCSTR szGroup)
+{
+	char Name[IPC_GROUP_NAME_MAX];
+	DWORD dwBytesReturned;
+
+	if (!IPCGroupName(Name, szGroup))
+	{
+		return FALSE;
+	}
+
+	if (!IPCSyncIoctl(IOCTL_LEAVE_GROUP, Name, IPC_GROUP_NAME_MAX, NULL, 0, &dwBytesReturned))
+	{
+		LOG_ERROR("Leaving group %s failed:%d\n", szGroup, GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Drains up to nMaxMsgs queued messages with one DeviceIoControl (IOCTL_RECV_BATCH). The driver
+fills the read buffer of cbBuffer bytes with as many packets as fit, so a consumer that has
+fallen behind pays one call per batch rather than one per message. If none is queued the read
+waits in the driver like RecvIPCMsg does and returns the next message alone, so any number of
+threads can call RecvIPCMsgBatch on one session and each message is returned to one of them.
+If the next message alone is larger than the buffer the read is repeated once with a buffer
+of the size the driver reports. Messages RecvIPCStream read ahead are returned on their own,
+without reading from the driver.
+
+Returns the number of messages stored in ppMsgs, 0 on failure. Call GetLastError() to get
+more info about failure
+*/
+
+UINT RecvIPCMsgBatch(PIPCMSG* ppMsgs, UINT nMaxMsgs, DWORD cbBuffer)
+{
+	if (!ppMsgs || nMaxMsgs == 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+
+	//Locals
+
+	IPC_RECV_BATCH RecvBatch = { nMaxMsgs, IPC_RECV_BATCH_WAIT };	//Input of the batch read, at most nMaxMsgs packets
+	DWORD dwNumOfBytesRead;			//Number of Bytes Read
+	BOOL bReadStatus;				//Read Status
+	PIPC_BATCH_HEADER pBatch;
+	PIPC_WIRE_HEADER pReceivePacket;
+	size_t uiOffset;
+	UINT i, nMsgs = 0;
+
+	if (cbBuffer < sizeof(IPC_BATCH_HEADER) + sizeof(IPC_WIRE_HEADER))
+	{
+		cbBuffer = RECVBATCHBUFSIZE;
+	}
+
+	while (nMsgs < nMaxMsgs && (ppMsgs[nMsgs] = IPCTakeDeferredMsg(IPCSession(), (size_t)-1, NULL)) != NULL)
+	{
+		nMsgs++;
+	}
+	if (nMsgs)
+	{
+		return nMsgs;
+	}
+
+	pBatch = (PIPC_BATCH_HEADER)IPCBufAlloc(cbBuffer);
+	if (!pBatch)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return 0;
+	}
+
+	bReadStatus = IPCSyncIoctl(IOCTL_RECV_BATCH, &RecvBatch, sizeof(RecvBatch),
+		pBatch, cbBuffer, &dwNumOfBytesRead);
+
+	if (!bReadStatus && GetLastError() == ERROR_MORE_DATA && pBatch->cbNext)
+	{
+		//The next message does not fit, read again with a buffer large enough for it
+
+		cbBuffer = (DWORD)IPC_BATCH_ALIGN_UP(sizeof(IPC_BATCH_HEADER)) + pBatch->cbNext;
+		IPCBufFree(pBatch);
+		LOG_INFO("Trying batch read again with a %d byte buffer\n", cbBuffer);
+
+		pBatch = (PIPC_BATCH_HEADER)IPCBufAlloc(cbBuffer);
+		if (!pBatch)
+		{
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			return 0;
+		}
+		bReadStatus = IPCSyncIoctl(IOCTL_RECV_BATCH, &RecvBatch, sizeof(RecvBatch),
+			pBatch, cbBuffer, &dwNumOfBytesRead);
+	}
+
+	if (!bReadStatus)
+	{
+		LOG_ERROR("Batch read failed with error %d\n", GetLastError());
+		IPCBufFree(pBatch);
+		return 0;
+	}
+
+	//Convert every packet of the batch to an IPCMSG
+
+	uiOffset = sizeof(IPC_BATCH_HEADER);
+	for (i = 0; i < pBatch->nPackets && i < nMaxMsgs; i++)
+	{
+		uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+		pReceivePacket = (PIPC_WIRE_HEADER)((char*)pBatch + uiOffset);
+
+		PIPCMSG pMsg = IPCPacketToMsg(pReceivePacket);
+		if (!pMsg)
+		{
+			LOG_ERROR("Unable to allocate IPC message, %d messages of the batch dropped\n", pBatch->nPackets - i);
+			break;
+		}
+		ppMsgs[nMsgs++] = pMsg;
+
+		uiOffset += IPCWireReadLength(pReceivePacket);
+	}
+
+	IPCBufFree(pBatch);
+
+	return nMsgs;
+}
+
+/*
+Sends cbData bytes of pData as one message, split into fragments of IPC_STREAM_FRAGMENT bytes.
+uiMsgID, uiSourcePID and uiDestPID are taken from pHeader, its other members are ignored.
+Every fragment carries the message ID and only the last one has bEndOfPayload set. The
+fragments go to the driver IPC_STREAM_BATCH at a time with one DeviceIoControl
+(IOCTL_SEND_BATCH), and the driver allocates a packet per fragment, so neither the IO
+buffer nor any kernel allocation grows with the size of the message.
+
+Returns TRUE if every fragment was routed, FALSE otherwise. Fragments routed before a
+failure stay queued to the receiver. Call GetLastError() to get more info about failure
+*/
+
+BOOL SendIPCStream(PIPCMSG pHeader, const VOID* pData, size_t cbData)
+{
+	if (!pHeader || (!pData && cbData))
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//Locals
+
+	const char* pNext = (const char*)pData;	//Payload of the next fragment
+	size_t cbLeft = cbData;					//Payload bytes not sent yet
+	size_t cbFragment;
+	size_t uiOffset;
+	PIPC_WIRE_HEADER pSendPacket;
+	LONG* plStatus;
+	DWORD dwBytesReturned;
+	DWORD dwResult;
+	BOOL fSuccess = TRUE;
+	BOOL bLast = FALSE;
+	UINT i, nFragments;
+
+	//One buffer holds a full batch of fragments followed by their status, it is reused for every batch
+
+	PIPC_BATCH_HEADER pBatch = (PIPC_BATCH_HEADER)IPCBufAlloc(IPC_BATCH_ALIGN_UP(sizeof(IPC_BATCH_HEADER)) +
+		IPC_STREAM_BATCH * (IPC_BATCH_ALIGN_UP(IPCWireSize(0, IPC_STREAM_FRAGMENT)) + sizeof(LONG)));
+	if (!pBatch)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create IPC Packet batch:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	do
+	{
+		uiOffset = sizeof(IPC_BATCH_HEADER);
+		for (nFragments = 0; nFragments < IPC_STREAM_BATCH && !bLast; nFragments++)
+		{
+			cbFragment = cbLeft < IPC_STREAM_FRAGMENT ? cbLeft : IPC_STREAM_FRAGMENT;
+			bLast = (cbFragment == cbLeft);
+
+			uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+			pSendPacket = (PIPC_WIRE_HEADER)((char*)pBatch + uiOffset);
+
+			//Every fragment has the message ID and priority of the message, the last one ends it
+
+			memcpy(IPCWireWrite(pSendPacket, pHeader->uiDestPID, pHeader->uiMsgID, pHeader->uiPriority, bLast, 0, cbFragment),
+				pNext, cbFragment);
+
+			pNext += cbFragment;
+			cbLeft -= cbFragment;
+			uiOffset += IPCWireSize(0, cbFragment);
+		}
+
+		pBatch->nPackets = nFragments;
+		pBatch->cbNext = 0;
+		plStatus = (LONG*)((char*)pBatch + ((uiOffset + sizeof(LONG) - 1) & ~(sizeof(LONG) - 1)));
+
+		fSuccess = IPCSyncIoctl(IOCTL_SEND_BATCH, pBatch, (DWORD)uiOffset, plStatus, nFragments * sizeof(LONG), &dwBytesReturned);
+		if (!fSuccess)
+		{
+			LOG_ERROR("Sending IPC stream fragments failed:%d\n", GetLastError());
+			break;
+		}
+
+		for (i = 0; i < nFragments; i++)
+		{
+			dwResult = IPCPacketStatusToError(plStatus[i]);
+			if (dwResult != ERROR_SUCCESS)
+			{
+				LOG_ERROR("Sending IPC stream fragment failed:%d\n", dwResult);
+				SetLastError(dwResult);
+				fSuccess = FALSE;
+				break;
+			}
+		}
+	} while (fSuccess && !bLast);
+
+	IPCBufFree(pBatch);
+
+	return fSuccess;
+}
+
+/*
+Receives the next message into the caller's buffer, reassembling the fragments SendIPCStream
+split it into. Queued packets are drained IPC_STREAM_RECVBUFSIZE bytes per DeviceIoControl
+(IOCTL_RECV_BATCH) and each fragment's payload is copied straight to its place in pBuffer.
+A message sent by SendIPCMsg is a single fragment and is received the same way. Packets of
+other messages read in the meantime are kept and returned first by the next receive call.
+Streams are received by one thread at a time, and RecvIPCMsg, RecvIPCMsgBatch and the
+asynchronous receive return fragments as individual messages.
+
+*pcbMsg receives the size of the message, puiSourcePID and puiMsgID (optional) its source PID
+and ID. Returns TRUE if the message fit into pBuffer. If it did not, FALSE is returned with
+ERROR_MORE_DATA, pBuffer holds its first cbBuffer bytes and the rest is dropped.
+Call GetLastError() to get more info about other failures
+*/
+
+BOOL RecvIPCStream(PVOID pBuffer, size_t cbBuffer, size_t* pcbMsg, UINT* puiSourcePID, UINT* puiMsgID)
+{
+	if (!pcbMsg || (!pBuffer && cbBuffer))
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//Locals
+
+	IPC_STREAM_RECV Stream = { (char*)pBuffer, cbBuffer, 0, 0, 0, FALSE, FALSE };
+	PIPC_DEFERRED_MSG pDeferred;
+	PIPC_DEFERRED_MSG pPrev = NULL;
+	PIPC_DEFERRED_MSG* ppLink;
+	PIPC_BATCH_HEADER pBatch = NULL;
+	IPC_RECV_BATCH RecvBatch = { 0, IPC_RECV_BATCH_WAIT };	//Input of the batch read, as many packets as fit
+	DWORD cbBatch = IPC_STREAM_RECVBUFSIZE;
+	DWORD dwNumOfBytesRead;
+	BOOL bReadStatus = TRUE;
+	PIPC_WIRE_HEADER pReceivePacket;
+	PIPCMSG pMsg;
+	size_t uiOffset;
+	UINT i;
+	PIPC_VAR pVar = IPCSession();
+
+	//Fragments an earlier call read ahead come first, in the order they were read
+
+	EnterCriticalSection(&(pVar->csDeferred));
+	ppLink = &(pVar->pDeferredHead);
+	while (!Stream.bComplete && (pDeferred = *ppLink) != NULL)
+	{
+		pMsg = pDeferred->pMsg;
+		if (!IPCStreamAppend(&Stream, pMsg->uiSourcePID, pMsg->uiMsgID, pMsg->bEndofMsg, pMsg->szMsg, pMsg->MsgSize))
+		{
+			pPrev = pDeferred;
+			ppLink = &(pDeferred->pNext);
+			continue;
+		}
+
+		*ppLink = pDeferred->pNext;
+		if (pVar->pDeferredTail == pDeferred)
+		{
+			pVar->pDeferredTail = pPrev;
+		}
+		HeapFree(GetProcessHeap(), 0, pMsg);
+		HeapFree(GetProcessHeap(), 0, pDeferred);
+	}
+	LeaveCriticalSection(&(pVar->csDeferred));
+
+	//Then the fragments still queued in the driver
+
+	while (!Stream.bComplete)
+	{
+		if (!pBatch)
+		{
+			pBatch = (PIPC_BATCH_HEADER)IPCBufAlloc(cbBatch);
+			if (!pBatch)
+			{
+				SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+				bReadStatus = FALSE;
+				break;
+			}
+		}
+
+		//Waits in the driver if no packet is queued
+		bReadStatus = IPCSyncIoctl(IOCTL_RECV_BATCH, &RecvBatch, sizeof(RecvBatch), pBatch, cbBatch, &dwNumOfBytesRead);
+		if (!bReadStatus && GetLastError() == ERROR_MORE_DATA && pBatch->cbNext)
+		{
+			//A message larger than the buffer, read again with a buffer large enough for it
+
+			cbBatch = (DWORD)IPC_BATCH_ALIGN_UP(sizeof(IPC_BATCH_HEADER)) + pBatch->cbNext;
+			IPCBufFree(pBatch);
+			pBatch = NULL;
+			bReadStatus = TRUE;
+			continue;
+		}
+		if (!bReadStatus)
+		{
+			LOG_ERROR("Stream read failed with error %d\n", GetLastError());
+			break;
+		}
+
+		uiOffset = sizeof(IPC_BATCH_HEADER);
+		for (i = 0; i < pBatch->nPackets; i++)
+		{
+			uiOffset = IPC_BATCH_ALIGN_UP(uiOffset);
+			pReceivePacket = (PIPC_WIRE_HEADER)((char*)pBatch + uiOffset);
+
+			if (!IPCStreamAppend(&Stream, pReceivePacket->dwPid, pReceivePacket->uiMsgID,
+				(pReceivePacket->bFlags & IPC_WIRE_END_OF_MSG) != 0, IPCWirePayload(pReceivePacket), pReceivePacket->cbPayload))
+			{
+				pMsg = IPCPacketToMsg(pReceivePacket);
+				if (!pMsg || !IPCDeferMsg(pVar, pMsg))
+				{
+					LOG_ERROR("Unable to keep a message read ahead, message dropped\n");
+				}
+			}
+
+			uiOffset += IPCWireReadLength(pReceivePacket);
+		}
+	}
+
+	if (pBatch)
+	{
+		IPCBufFree(pBatch);
+	}
+	if (!bReadStatus)
+	{
+		return FALSE;
+	}
+
+	*pcbMsg = Stream.cbMsg;
+	if (puiSourcePID)
+	{
+		*puiSourcePID = Stream.uiSourcePID;
+	}
+	if (puiMsgID)
+	{
+		*puiMsgID = Stream.uiMsgID;
+	}
+
+	if (Stream.cbMsg > cbBuffer)
+	{
+		SetLastError(ERROR_MORE_DATA);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+Limits the incoming queue of this process with IOCTL_SET_QUEUE_LIMIT. Messages beyond nMaxMsgs
+or cbMaxBytes (header and payload) are handled according to the overflow policy of their sender,
+0 removes the respective limit. A single message is always accepted into an empty queue
+
+Returns TRUE on success. Call GetLastError() to get more info about failure
+*/
+
+BOOL SetIPCQueueLimit(UINT nMaxMsgs, ULONG64 cbMaxBytes)
+{
+	IPC_QUEUE_LIMIT Limit;
+	DWORD dwBytesReturned;
+
+	Limit.nMaxPkts = nMaxMsgs;
+	Limit.uiReserved = 0;
+	Limit.cbMaxBytes = cbMaxBytes;
+
+	if (!IPCSyncIoctl(IOCTL_SET_QUEUE_LIMIT, &Limit, sizeof(Limit), NULL, 0, &dwBytesReturned))
+	{
+		LOG_ERROR("Setting the queue limit failed:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Selects the overflow policy of the messages this process sends with IOCTL_SET_OVERFLOW.
+dwTimeoutMs only applies to IPC_OVERFLOW_BLOCK, it is the longest the sender waits without the
+receiver reading anything (INFINITE to wait until the receiver closes the device). Blocking
+sends should not be made from a thread that also has to read this process's own messages
+
+Returns TRUE on success. Call GetLastError() to get more info about failure
+*/
+
+BOOL SetIPCOverflowPolicy(UINT uiPolicy, DWORD dwTimeoutMs)
+{
+	IPC_OVERFLOW Overflow;
+	DWORD dwBytesReturned;
+
+	Overflow.uiPolicy = uiPolicy;
+	Overflow.uiTimeoutMs = dwTimeoutMs;
+
+	if (!IPCSyncIoctl(IOCTL_SET_OVERFLOW, &Overflow, sizeof(Overflow), NULL, 0, &dwBytesReturned))
+	{
+		LOG_ERROR("Setting the overflow policy failed:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Returns the credits of the process uiDestPID with IOCTL_QUERY_CREDITS, how many more messages
+and bytes it accepts before it is over its queue limit. A sender can pace itself on them
+instead of relying on the overflow policy. The credits are a snapshot
+
+Returns TRUE on success, FALSE with ERROR_NOT_FOUND if the process has not opened the device.
+Call GetLastError() to get more info about other failures
+*/
+
+BOOL QueryIPCCredits(UINT uiDestPID, PIPC_CREDITS pCredits)
+{
+	union
+	{
+		DWORD32 dwPID;
+		IPC_CREDITS Credits;
+	}Buffer;
+	DWORD dwBytesReturned;
+
+	Buffer.dwPID = (DWORD32)uiDestPID;
+
+	if (!IPCSyncIoctl(IOCTL_QUERY_CREDITS, &Buffer, sizeof(DWORD32), &Buffer, sizeof(IPC_CREDITS), &dwBytesReturned))
+	{
+		LOG_ERROR("Querying the credits of %u failed:%d\n", uiDestPID, GetLastError());
+		return FALSE;
+	}
+
+	*pCredits = Buffer.Credits;
+	return TRUE;
+}
+
+/*
+Sends IOCTL_REGISTER_ENDPOINT or IOCTL_RESOLVE_ENDPOINT with the NUL padded name and returns the
+endpoint handle the driver answers with
+*/
+
+static BOOL IPCEndpointIoctl(DWORD dwIoControlCode, LPCSTR szName, UINT* puiEndpoint)
+{
+	char Name[IPC_ENDPOINT_NAME_MAX];
+	size_t cchName = szName ? strlen(szName) : 0;
+	DWORD32 dwEndpoint = 0;
+	DWORD dwBytesReturned;
+
+	if (cchName == 0 || cchName >= IPC_ENDPOINT_NAME_MAX || !puiEndpoint)
+	{
+		LOG_ERROR("Invalid endpoint name\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	memset(Name, 0, IPC_ENDPOINT_NAME_MAX);
+	memcpy(Name, szName, cchName);
+
+	if (!IPCSyncIoctl(dwIoControlCode, Name, IPC_ENDPOINT_NAME_MAX, &dwEndpoint, sizeof(dwEndpoint), &dwBytesReturned))
+	{
+		LOG_ERROR("Endpoint %s failed:%d\n", szName, GetLastError());
+		return FALSE;
+	}
+
+	*puiEndpoint = dwEndpoint;
+	return TRUE;
+}
+
+/*
+Registers this process's port under szName and returns its endpoint handle in *puiEndpoint.
+Registering the same name again returns the same handle, a name taken by another port fails
+with ERROR_ALREADY_EXISTS and a port can only have one name. For several endpoints a process
+opens the device once per endpoint
+
+Returns TRUE on success. Call GetLastError() to get more info about failure
+*/
+
+BOOL RegisterIPCEndpoint(LPCSTR szName, UINT* puiEndpoint)
+{
+	return IPCEndpointIoctl(IOCTL_REGISTER_ENDPOINT, szName, puiEndpoint);
+}
+
+/*
+Returns in *puiEndpoint the handle of the endpoint registered as szName. The handle is meant to be
+resolved once and used as uiDestPID for as long as sends to it succeed, resolve again after
+ERROR_NOT_FOUND in case the name has been registered anew
+
+Returns TRUE on success, FALSE with ERROR_NOT_FOUND if no endpoint has that name.
+Call GetLastError() to get more info about other failures
+*/
+
+BOOL ResolveIPCEndpoint(LPCSTR szName, UINT* puiEndpoint)
+{
+	return IPCEndpointIoctl(IOCTL_RESOLVE_ENDPOINT, szName, puiEndpoint);
+}
+
+/*
+Builds the IPC Packet of a call request or reply in a buffer from the thread local pool and
+returns its size in *pcbPacket, NULL if out of memory or the message is too large. The caller
+returns it with IPCBufFree
+*/
+
+static PIPC_WIRE_HEADER IPCCallPacket(PIPCMSG pMsg, UINT uiDestPID, UINT uiCallId, DWORD* pcbPacket)
+{
+	PIPC_WIRE_HEADER pSendPacket;
+
+	if (pMsg->MsgSize > MAXUINT32)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+
+	pSendPacket = (PIPC_WIRE_HEADER)IPCBufAlloc(IPCWireSize(uiCallId, pMsg->MsgSize));
+	if (!pSendPacket)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create IPC Packet:%d\n", GetLastError());
+		return NULL;
+	}
+
+	//uiCallId is 0 for a request, the driver stamps it
+
+	memcpy(IPCWireWrite(pSendPacket, uiDestPID, pMsg->uiMsgID, pMsg->uiPriority, pMsg->bEndofMsg, uiCallId, pMsg->MsgSize),
+		pMsg->szMsg, pMsg->MsgSize);
+	*pcbPacket = (DWORD)IPCWireSize(uiCallId, pMsg->MsgSize);
+
+	return pSendPacket;
+}
+
+/*
+Sends pRequest to its uiDestPID and waits for the reply with a single DeviceIoControl (IOCTL_CALL).
+The driver routes the request in this thread's context with a new call ID and parks the IRP until
+the callee's IOCTL_REPLY, which copies the reply straight into this thread's read buffer: there is
+no Read notification to wait on and no second read. A reply larger than the buffer is kept by the
+driver and fetched with IOCTL_COLLECT_REPLY. After dwMilliseconds the IRP is cancelled and a reply
+arriving later fails in the callee with ERROR_NOT_FOUND
+
+Returns TRUE with the reply in *ppReply (freed by the caller with HeapFree). FALSE with ERROR_TIMEOUT
+if no reply came in time, ERROR_NOT_FOUND if the callee does not exist or closed the device without
+replying. Call GetLastError() to get more info about other failures
+*/
+
+BOOL CallIPC(PIPCMSG pRequest, PIPCMSG* ppReply, DWORD dwMilliseconds)
+{
+	if (!pRequest || !ppReply)
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//Locals
+
+	PIPC_WIRE_HEADER pSendPacket;
+	PIPC_WIRE_HEADER pReceivePacket;
+	IPC_CALL_OVERFLOW CallOverflow;
+	DWORD dwNumOfBytesRead = 0;
+	DWORD cbSendPacket;
+	BOOL fSuccess;
+	PIPC_VAR pVar = IPCSession();
+
+	*ppReply = NULL;
+
+	pSendPacket = IPCCallPacket(pRequest, pRequest->uiDestPID, 0, &cbSendPacket);
+	if (!pSendPacket)
+	{
+		return FALSE;
+	}
+
+	//The reply lands in the read buffer of RecvIPCMsg, sized to the largest message read so far
+
+	pReceivePacket = IPCRecvBufReserve(pVar->cbRecvHighWater);
+	if (!pReceivePacket)
+	{
+		IPCBufFree(pSendPacket);
+		return FALSE;
+	}
+
+	//After dwMilliseconds the call is cancelled and waited for, a reply may still win the race
+
+	fSuccess = pVar->pBackend->pfnIoctl(pVar, IOCTL_CALL, pSendPacket, cbSendPacket,
+		pReceivePacket, t_IPCBufCache.cbRecvPacket, &dwNumOfBytesRead, dwMilliseconds);
+	if (!fSuccess && GetLastError() == ERROR_OPERATION_ABORTED)
+	{
+		SetLastError(ERROR_TIMEOUT);
+	}
+
+	IPCBufFree(pSendPacket);
+
+	if (!fSuccess && GetLastError() == ERROR_MORE_DATA && dwNumOfBytesRead >= sizeof(IPC_CALL_OVERFLOW))
+	{
+		//The driver kept the reply and returned its size, collect it with a buffer that fits
+
+		memcpy(&CallOverflow, pReceivePacket, sizeof(IPC_CALL_OVERFLOW));
+		IPCRecvHighWater(pVar, CallOverflow.cbReply);
+		LOG_INFO("Collecting the reply with a %d byte buffer\n", CallOverflow.cbReply);
+
+		pReceivePacket = IPCRecvBufReserve(CallOverflow.cbReply);
+		if (!pReceivePacket)
+		{
+			return FALSE;
+		}
+		fSuccess = IPCSyncIoctl(IOCTL_COLLECT_REPLY, &CallOverflow.uiCallId, sizeof(UINT32),
+			pReceivePacket, t_IPCBufCache.cbRecvPacket, &dwNumOfBytesRead);
+	}
+
+	if (!fSuccess)
+	{
+		LOG_ERROR("Call failed with error %d\n", GetLastError());
+		return FALSE;
+	}
+
+	*ppReply = IPCPacketToMsg(pReceivePacket);
+	return *ppReply != NULL;
+}
+
+/*
+Answers a request received with a non zero uiCallID. The reply goes to the request's source with
+IOCTL_REPLY, the driver copies it into the caller's waiting CallIPC and nothing is queued. The
+reply's uiDestPID and uiCallID are ignored. Only the process the request was delivered to can
+reply, and only once
+
+Returns TRUE on success, FALSE with ERROR_NOT_FOUND if the caller stopped waiting (timeout or
+closed device) or the request was already answered. Call GetLastError() to get more info about
+other failures
+*/
+
+BOOL ReplyIPCMsg(PIPCMSG pRequest, PIPCMSG pReply)
+{
+	if (!pRequest || !pReply || pRequest->uiCallID == 0)
+	{
+		LOG_ERROR("Invalid pointer or not a call request\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	//Locals
+
+	PIPC_WIRE_HEADER pSendPacket;
+	DWORD dwBytesReturned;
+	DWORD cbSendPacket;
+	BOOL fSuccess;
+
+	pSendPacket = IPCCallPacket(pReply, pRequest->uiSourcePID, pRequest->uiCallID, &cbSendPacket);
+	if (!pSendPacket)
+	{
+		return FALSE;
+	}
+
+	fSuccess = IPCSyncIoctl(IOCTL_REPLY, pSendPacket, cbSendPacket, NULL, 0, &dwBytesReturned);
+	if (!fSuccess)
+	{
+		LOG_ERROR("Sending the reply failed:%d\n", GetLastError());
+	}
+
+	IPCBufFree(pSendPacket);
+	return fSuccess;
+}
+
+/*
+Sets the read order of this process's priority lanes with IOCTL_SET_LANE_WEIGHTS. pWeights holds
+IPC_PRIORITY_LANES weights indexed by priority, each lane gives up to its weight in messages per
+round, highest priority first, and a weight of 0 counts as 1. NULL or all weights 0 restores the
+default strict priority, in which a lower lane is only read once every higher lane is empty
+
+Returns TRUE on success. Call GetLastError() to get more info about failure
+*/
+
+BOOL SetIPCLaneWeights(const UINT* pWeights)
+{
+	IPC_LANE_WEIGHTS Weights;
+	DWORD dwBytesReturned;
+	UINT i;
+
+	for (i = 0; i < IPC_PRIORITY_LANES; i++)
+	{
+		Weights.Weights[i] = pWeights ? pWeights[i] : 0;
+	}
+
+	if (!IPCSyncIoctl(IOCTL_SET_LANE_WEIGHTS, &Weights, sizeof(Weights), NULL, 0, &dwBytesReturned))
+	{
+		LOG_ERROR("Setting the lane weights failed:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Queries the runtime statistics of the driver with IOCTL_QUERY_STATS. cbStats must hold at least
+an IPC_STATS, which receives the totals and the counters of every routing thread. Every further
+IPC_PORT_STATS it holds receives the counters of one process. The driver sums its per processor
+counters for the query, the result is a snapshot
+
+Returns TRUE on success. Call GetLastError() to get more info about failure
+*/
+
+BOOL QueryIPCStats(PIPC_STATS pStats, DWORD cbStats)
+{
+	DWORD dwBytesReturned;
+
+	if (!pStats || cbStats < sizeof(IPC_STATS))
+	{
+		LOG_ERROR("Statistics buffer too small\n");
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+
+	if (!IPCSyncIoctl(IOCTL_QUERY_STATS, NULL, 0, pStats, cbStats, &dwBytesReturned))
+	{
+		LOG_ERROR("Querying the statistics failed:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Switches the per stage timestamps of the messages read by this process on or off with
+IOCTL_SET_TRACE. Messages already queued keep the stamps they were queued with
+
+Returns TRUE on success, FALSE with ERROR_NOT_SUPPORTED if the driver was built without tracing.
+Call GetLastError() to get more info about failure
+*/
+
+BOOL SetIPCTrace(BOOL bEnable)
+{
+	UINT32 uiEnable = bEnable ? 1 : 0;
+	DWORD dwBytesReturned;
+
+	if (!IPCSyncIoctl(IOCTL_SET_TRACE, &uiEnable, sizeof(uiEnable), NULL, 0, &dwBytesReturned))
+	{
+		LOG_ERROR("Switching the latency tracing failed:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Copies the stamps of a message returned by RecvIPCMsg, RecvIPCMsgBatch, CompleteIPCAsyncRecv or
+WaitIPCAsyncRecv to pTrace. A stage which was not stamped, because tracing was switched on while
+the message was on its way, is 0. Stamps are QueryPerformanceCounter ticks
+
+Returns FALSE with ERROR_NOT_FOUND if the message was read while tracing was off
+*/
+
+BOOL GetIPCMsgTrace(PIPCMSG pMsg, PIPC_PACKET_TRACE pTrace)
+{
+	if (!pMsg || !pTrace)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if (!pMsg->bTraced)
+	{
+		SetLastError(ERROR_NOT_FOUND);
+		return FALSE;
+	}
+
+	memcpy(pTrace, pMsg->szMsg + pMsg->MsgSize, sizeof(IPC_PACKET_TRACE));
+	return TRUE;
+}
+
+/*
+Returns the stamps of a message received with RecvIPCMsgInto, they follow its payload in the
+caller's buffer
+*/
+
+BOOL GetIPCMsgViewTrace(PIPCMSGVIEW pView, PIPC_PACKET_TRACE pTrace)
+{
+	if (!pView || !pTrace)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if (!pView->bTraced)
+	{
+		SetLastError(ERROR_NOT_FOUND);
+		return FALSE;
+	}
+
+	memcpy(pTrace, pView->pMsg + pView->MsgSize, sizeof(IPC_PACKET_TRACE));
+	return TRUE;
+}
+
+/*
+Queries the latency histograms the driver keeps for the messages read by uiPID (0 for this
+process) with IOCTL_QUERY_TRACE. The counts are totals since tracing was first switched on,
+rates are derived from the difference between two queries
+
+Returns TRUE on success. Call GetLastError() to get more info about failure
+*/
+
+BOOL QueryIPCTrace(UINT uiPID, PIPC_TRACE_STATS pTraceStats)
+{
+	DWORD32 dwPID = uiPID;
+	DWORD dwBytesReturned;
+
+	if (!pTraceStats)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	if (!IPCSyncIoctl(IOCTL_QUERY_TRACE, &dwPID, sizeof(dwPID), pTraceStats, sizeof(IPC_TRACE_STATS), &dwBytesReturned))
+	{
+		LOG_ERROR("Querying the latency histograms failed:%d\n", GetLastError());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#ifdef _WIN32
+
+/*
+Puts a receive request (back) in flight, unless StopIPCAsyncRecv was called.
+Returns FALSE if the read could not be issued, no completion is queued for it then
+*/
+
+static BOOL IPCPostRecvRequest(PIPC_RECV_REQUEST pRequest)
+{
+	PIPC_VAR pVar = pRequest->pVar;
+	BOOL bIssued;
+
+	memset(&(pRequest->Overlapped), 0, sizeof(OVERLAPPED));
+
+	EnterCriticalSection(&(pVar->csRecv));
+	if (pVar->bRecvStopping)
+	{
+		LeaveCriticalSection(&(pVar->csRecv));
+		SetLastError(ERROR_OPERATION_ABORTED);
+		return FALSE;
+	}
+	bIssued = ReadFile(pVar->hFile, pRequest->pPacket, pRequest->cbPacket, NULL, &(pRequest->Overlapped));
+	LeaveCriticalSection(&(pVar->csRecv));
+
+	return bIssued || GetLastError() == ERROR_IO_PENDING;
+}
+
+/*
+Allocates a receive request with a read buffer of cbBuffer bytes and links it to the session's list
+*/
+
+static PIPC_RECV_REQUEST IPCAllocRecvRequest(PIPC_VAR pVar, DWORD cbBuffer)
+{
+	PIPC_RECV_REQUEST pRequest = (PIPC_RECV_REQUEST)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_RECV_REQUEST));
+	if (!pRequest)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	pRequest->pPacket = (PIPC_WIRE_HEADER)HeapAlloc(GetProcessHeap(), 0, cbBuffer);
+	if (!pRequest->pPacket)
+	{
+		HeapFree(GetProcessHeap(), 0, pRequest);
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+	pRequest->cbPacket = cbBuffer;
+	pRequest->pVar = pVar;
+
+	EnterCriticalSection(&(pVar->csRecv));
+	pRequest->pNext = pVar->pRecvRequests;
+	if (pRequest->pNext)
+	{
+		pRequest->pNext->pPrev = pRequest;
+	}
+	pVar->pRecvRequests = pRequest;
+	pVar->nRecvRequests++;
+	LeaveCriticalSection(&(pVar->csRecv));
+
+	return pRequest;
+}
+
+/*
+Unlinks a receive request which is no longer in flight and frees it
+*/
+
+static VOID IPCFreeRecvRequest(PIPC_RECV_REQUEST pRequest)
+{
+	PIPC_VAR pVar = pRequest->pVar;
+
+	EnterCriticalSection(&(pVar->csRecv));
+	if (pRequest->pPrev)
+	{
+		pRequest->pPrev->pNext = pRequest->pNext;
+	}
+	else
+	{
+		pVar->pRecvRequests = pRequest->pNext;
+	}
+	if (pRequest->pNext)
+	{
+		pRequest->pNext->pPrev = pRequest->pPrev;
+	}
+	pVar->nRecvRequests--;
+	LeaveCriticalSection(&(pVar->csRecv));
+
+	HeapFree(GetProcessHeap(), 0, pRequest->pPacket);
+	HeapFree(GetProcessHeap(), 0, pRequest);
+}
+
+/*
+Starts asynchronous receive. nRequests overlapped reads of cbBuffer bytes (0 for ASYNCRECVBUFSIZE,
+or the largest message read so far if larger) are put in flight on the device. A read which finds no
+message is parked in the driver and completes as soon as a message is routed to this process, so one
+thread can wait on many messages at once.
+
+The device handle is associated with hIocp under CompletionKey. If hIocp is NULL the DLL creates a
+completion port of its own, and WaitIPCAsyncRecv returns the messages. A handle can only be associated
+with one completion port, so StartIPCAsyncRecv may be called again only with the same port.
+
+Returns TRUE if every read was started, FALSE with ERROR_NOT_SUPPORTED if the device backend is
+not the one in use. Call GetLastError() to get more info about other failures
+*/
+
+BOOL StartIPCAsyncRecv(HANDLE hIocp, ULONG_PTR CompletionKey, UINT nRequests, DWORD cbBuffer)
+{
+	PIPC_RECV_REQUEST pRequest;
+	UINT i;
+	PIPC_VAR pVar = IPCSession();
+
+	if (!pVar || nRequests == 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	if (pVar->pBackend != &g_IPCDeviceBackend)
+	{
+		LOG_ERROR("Asynchronous receive needs the device backend\n");
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	if (cbBuffer < sizeof(IPC_WIRE_HEADER))
+	{
+		cbBuffer = max(ASYNCRECVBUFSIZE, pVar->cbRecvHighWater);
+	}
+
+	if (!hIocp && !pVar->hIocp)
+	{
+		pVar->hIocp = CreateIoCompletionPort(pVar->hFile, NULL, CompletionKey, 0);
+		if (!pVar->hIocp)
+		{
+			LOG_ERROR("Unable to create IO completion port:%d\n", GetLastError());
+			return FALSE;
+		}
+	}
+	else if (hIocp && hIocp != pVar->hIocp)
+	{
+		if (!CreateIoCompletionPort(pVar->hFile, hIocp, CompletionKey, 0))
+		{
+			LOG_ERROR("Unable to associate the device with the IO completion port:%d\n", GetLastError());
+			return FALSE;
+		}
+		pVar->hIocp = NULL;
+	}
+
+	EnterCriticalSection(&(pVar->csRecv));
+	pVar->bRecvStopping = FALSE;
+	LeaveCriticalSection(&(pVar->csRecv));
+
+	for (i = 0; i < nRequests; i++)
+	{
+		pRequest = IPCAllocRecvRequest(pVar, cbBuffer);
+		if (!pRequest)
+		{
+			return FALSE;
+		}
+		if (!IPCPostRecvRequest(pRequest))
+		{
+			LOG_ERROR("Unable to start asynchronous read:%d\n", GetLastError());
+			IPCFreeRecvRequest(pRequest);
+			return FALSE;
+		}
+	}
+
+	LOG_INFO("%d asynchronous reads in flight\n", nRequests);
+	return TRUE;
+}
+
+/*
+Handles the completion of an asynchronous read, pOverlapped being the OVERLAPPED dequeued from
+the completion port. The message read is returned in a heap allocated IPCMSG (freed by the caller
+with HeapFree) and the read is put back in flight.
+
+NULL is returned if the completion carried no message:
+ERROR_IO_PENDING - the read buffer was too small, it was enlarged and the read reissued
+ERROR_OPERATION_ABORTED - the read was cancelled by StopIPCAsyncRecv and is freed
+*/
+
+PIPCMSG CompleteIPCAsyncRecv(LPOVERLAPPED pOverlapped)
+{
+	if (!pOverlapped)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+
+	//Locals
+
+	PIPC_RECV_REQUEST pRequest = CONTAINING_RECORD(pOverlapped, IPC_RECV_REQUEST, Overlapped);
+	PIPC_VAR pVar = pRequest->pVar;
+	PIPCMSG pMsg = NULL;
+	PIPC_WIRE_HEADER pLargerPacket;
+	DWORD dwNumOfBytesRead;
+	DWORD dwRequired;
+	DWORD dwError = ERROR_IO_PENDING;
+
+	if (GetOverlappedResult(pVar->hFile, pOverlapped, &dwNumOfBytesRead, FALSE))
+	{
+		pMsg = IPCPacketToMsg(pRequest->pPacket);
+		if (!pMsg)
+		{
+			dwError = ERROR_NOT_ENOUGH_MEMORY;
+			LOG_ERROR("Unable to allocate IPC message, message dropped\n");
+		}
+	}
+	else if (GetLastError() == ERROR_MORE_DATA && dwNumOfBytesRead >= sizeof(int))
+	{
+		//The message was handed to the next read, grow this one to its size so the next one like it fits
+
+		dwRequired = (DWORD)(*(int*)pRequest->pPacket);
+		IPCRecvHighWater(pVar, dwRequired);
+		pLargerPacket = (PIPC_WIRE_HEADER)HeapReAlloc(GetProcessHeap(), 0, pRequest->pPacket, dwRequired);
+		if (pLargerPacket)
+		{
+			pRequest->pPacket = pLargerPacket;
+			pRequest->cbPacket = dwRequired;
+			LOG_INFO("Asynchronous read buffer grown to %d bytes\n", pRequest->cbPacket);
+		}
+	}
+	else
+	{
+		dwError = GetLastError();
+		LOG_ERROR("Asynchronous read failed with error %d\n", dwError);
+	}
+
+	//Put the read back in flight, a request which cannot be reissued is retired
+
+	if (!IPCPostRecvRequest(pRequest))
+	{
+		if (!pMsg)
+		{
+			dwError = GetLastError();
+		}
+		IPCFreeRecvRequest(pRequest);
+	}
+
+	if (!pMsg)
+	{
+		SetLastError(dwError);
+	}
+	return pMsg;
+}
+
+/*
+Waits up to dwMilliseconds for the next message on the completion port created by
+StartIPCAsyncRecv(NULL, ...). Returns NULL on timeout (WAIT_TIMEOUT) or once every
+read has been stopped (ERROR_OPERATION_ABORTED)
+*/
+
+static PIPCMSG IPCWaitAsyncRecv(PIPC_VAR pVar, DWORD dwMilliseconds)
+{
+	if (!pVar || !pVar->hIocp)
+	{
+		SetLastError(ERROR_INVALID_FUNCTION);
+		return NULL;
+	}
+
+	//Locals
+
+	LPOVERLAPPED pOverlapped;
+	ULONG_PTR CompletionKey;
+	DWORD dwNumOfBytesRead;
+	PIPCMSG pMsg;
+
+	while (pVar->nRecvRequests)
+	{
+		if (!GetQueuedCompletionStatus(pVar->hIocp, &dwNumOfBytesRead, &CompletionKey, &pOverlapped, dwMilliseconds) &&
+			!pOverlapped)
+		{
+			return NULL;
+		}
+
+		pMsg = CompleteIPCAsyncRecv(pOverlapped);
+		if (pMsg)
+		{
+			return pMsg;
+		}
+	}
+
+	SetLastError(ERROR_OPERATION_ABORTED);
+	return NULL;
+}
+
+/*
+Cancels every asynchronous read. Each one still completes through the completion port with
+ERROR_OPERATION_ABORTED, and CompleteIPCAsyncRecv frees it instead of reissuing it
+*/
+
+static BOOL IPCStopAsyncRecv(PIPC_VAR pVar)
+{
+	PIPC_RECV_REQUEST pRequest;
+
+	if (!pVar)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	EnterCriticalSection(&(pVar->csRecv));
+	pVar->bRecvStopping = TRUE;
+	for (pRequest = pVar->pRecvRequests; pRequest; pRequest = pRequest->pNext)
+	{
+		CancelIoEx(pVar->hFile, &(pRequest->Overlapped));
+	}
+	LeaveCriticalSection(&(pVar->csRecv));
+
+	return TRUE;
+}
+
+PIPCMSG WaitIPCAsyncRecv(DWORD dwMilliseconds)
+{
+	return IPCWaitAsyncRecv(IPCSession(), dwMilliseconds);
+}
+
+BOOL StopIPCAsyncRecv()
+{
+	return IPCStopAsyncRecv(IPCSession());
+}
+
+#else
+
+//Overlapped receive needs the driver, without it no read is ever in flight
+
+BOOL StartIPCAsyncRecv(HANDLE hIocp, ULONG_PTR CompletionKey, UINT nRequests, DWORD cbBuffer)
+{
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+PIPCMSG CompleteIPCAsyncRecv(LPOVERLAPPED pOverlapped)
+{
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return NULL;
+}
+
+PIPCMSG WaitIPCAsyncRecv(DWORD dwMilliseconds)
+{
+	SetLastError(ERROR_INVALID_FUNCTION);
+	return NULL;
+}
+
+BOOL StopIPCAsyncRecv()
+{
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+#endif
+
+/*
+Closes a session. Reads in flight on the DLL's own completion port are retired here. With a
+caller supplied port the caller stops them and passes their completions to CompleteIPCAsyncRecv first
+*/
+
+static VOID IPCSessionClose(PIPC_VAR pVar)
+{
+#ifdef _WIN32
+	if (pVar->hIocp)
+	{
+		IPCStopAsyncRecv(pVar);
+		while (pVar->nRecvRequests)
+		{
+			PIPCMSG pMsg = IPCWaitAsyncRecv(pVar, INFINITE);
+			if (pMsg)
+			{
+				HeapFree(GetProcessHeap(), 0, pMsg);
+			}
+		}
+		CloseHandle(pVar->hIocp);
+	}
+#endif
+
+	//Messages read ahead by RecvIPCStream and never received
+
+	PIPCMSG pDeferredMsg;
+	while ((pDeferredMsg = IPCTakeDeferredMsg(pVar, (size_t)-1, NULL)) != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, pDeferredMsg);
+	}
+
+	pVar->pBackend->pfnClose(pVar);
+	DeleteCriticalSection(&(pVar->csRecv));
+	DeleteCriticalSection(&(pVar->csDeferred));
+	IPCSessionRelease(pVar);
+}
+
+BOOL CloseDeviceforIPC()
+{
+	IPCSessionClose(pIpc_Var);
+	pIpc_Var = NULL;
+	return TRUE;
+}
+
+/*
+Closes a session opened with OpenIPCSession. No thread may still be calling the API over it.
+Threads merely bound to it are bound back to the process' session on their next API call, the
+session's memory is freed once the last of them has let go of it.
+
+Returns FALSE with ERROR_INVALID_HANDLE if hSession is not a session opened with OpenIPCSession
+or has already been closed
+*/
+
+BOOL CloseIPCSession(HIPCSESSION hSession)
+{
+	PIPC_VAR* ppVar;
+	BOOL bFound = FALSE;
+
+	//Unlinked and marked closed under the lock, so no thread can bind to it from here on
+
+	EnterCriticalSection(&g_csIPCSessions);
+	for (ppVar = &g_pIPCSessions; *ppVar && *ppVar != hSession; ppVar = &((*ppVar)->pNextSession));
+	if (hSession && *ppVar)
+	{
+		*ppVar = hSession->pNextSession;
+		hSession->bClosed = TRUE;
+		bFound = TRUE;
+	}
+	LeaveCriticalSection(&g_csIPCSessions);
+
+	if (!bFound)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	if (t_pIPCSession == hSession)
+	{
+		SetIPCThreadSession(NULL);
+	}
+
+	IPCSessionClose(hSession);
+	return TRUE;
+}
+
+
+/*
+Creates the shared memory ring for the calling process' port. cbRing is the size of the
+ring's data area in bytes (0 for IPC_RING_DEFAULT_SIZE), it is rounded up to a power of 2.
+Another process attaches to it with OpenIPCRing(<our PID>) and its messages are then
+read with RecvIPCRingMsg without going through the driver.
+
+Returns the ring handle, or NULL on failure. Call GetLastError() to get more info about failure
+*/
+
+HIPCRING CreateIPCRing(DWORD cbRing)
+{
+	int iError;
+
+	HIPCRING hRing = (HIPCRING)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_RING));
+	if (!hRing)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	iError = IPCRingCreate(hRing, GetCurrentProcessId(), cbRing ? cbRing : IPC_RING_DEFAULT_SIZE);
+	if (iError)
+	{
+		LOG_ERROR("Unable to create IPC ring:%d\n", iError);
+		HeapFree(GetProcessHeap(), 0, hRing);
+		SetLastError(iError);
+		return NULL;
+	}
+
+	LOG_INFO("IPC ring created\n");
+	return hRing;
+}
+
+/*
+Attaches to the ring created by process uiDestPID as its producer. A ring has a
+single producer, ERROR_BUSY is returned while another live process is attached
+*/
+
+HIPCRING OpenIPCRing(UINT uiDestPID)
+{
+	int iError;
+
+	HIPCRING hRing = (HIPCRING)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPC_RING));
+	if (!hRing)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	iError = IPCRingOpen(hRing, uiDestPID);
+	if (iError)
+	{
+		LOG_ERROR("Unable to open IPC ring of process %d:%d\n", uiDestPID, iError);
+		HeapFree(GetProcessHeap(), 0, hRing);
+		SetLastError(iError);
+		return NULL;
+	}
+
+	LOG_INFO("IPC ring opened\n");
+	return hRing;
+}
+
+/*
+Writes a message straight into the ring, waiting for space if the ring is full.
+The payload is copied once, from the caller's IPCMSG into shared memory
+*/
+
+BOOL SendIPCRingMsg(HIPCRING hRing, PIPCMSG pMsg)
+{
+	if (!hRing || !pMsg || !hRing->bProducer)
+	{
+		LOG_ERROR("Invalid pointer\n");
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	PIPC_RING_RECORD pRecord = IPCRingReserve(hRing, pMsg->MsgSize, IPC_RING_INFINITE);
+	if (!pRecord)
+	{
+		LOG_ERROR("Message does not fit in the IPC ring\n");
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+
+	pRecord->uiMsgID = pMsg->uiMsgID;
+	pRecord->bEndofMsg = pMsg->bEndofMsg;
+	memcpy(pRecord->szMsg, pMsg->szMsg, pMsg->MsgSize);
+
+	IPCRingCommit(hRing, pRecord);
+	return TRUE;
+}
+
+/*
+Waits for the next message in the ring and returns it in a heap allocated IPCMSG,
+the caller frees it with HeapFree as with RecvIPCMsg
+*/
+
+PIPCMSG RecvIPCRingMsg(HIPCRING hRing)
+{
+	if (!hRing || hRing->bProducer)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+
+	PIPC_RING_RECORD pRecord = IPCRingPeek(hRing, IPC_RING_INFINITE);
+	if (!pRecord)
+	{
+		return NULL;
+	}
+
+	PIPCMSG pMsg = (PIPCMSG)HeapAlloc(GetProcessHeap(), 0, sizeof(IPCMSG) + (size_t)pRecord->MsgSize);
+	if (pMsg)
+	{
+		pMsg->uiMsgID = pRecord->uiMsgID;
+		pMsg->uiSourcePID = pRecord->uiSourcePID;
+		pMsg->uiDestPID = GetCurrentProcessId();
+		pMsg->MsgSize = (size_t)pRecord->MsgSize;
+		pMsg->bEndofMsg = pRecord->bEndofMsg;
+		pMsg->uiPriority = IPC_PRIORITY_NORMAL;	//A ring has a single lane
+		pMsg->uiCallID = 0;
+		pMsg->bTraced = FALSE;			//Ring messages do not pass through the driver
+		memcpy(pMsg->szMsg, pRecord->szMsg, (size_t)pRecord->MsgSize);
+	}
+	else
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+	}
+
+	IPCRingRelease(hRing, pRecord);
+	return pMsg;
+}
+
+BOOL CloseIPCRing(HIPCRING hRing)
+{
+	if (!hRing)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	IPCRingClose(hRing);
+	HeapFree(GetProcessHeap(), 0, hRing);
+	return TRUE;
+}
@@ -1,8 +1,13 @@
 #pragma once
 #include<stdio.h>
+#ifdef _WIN32
 #include<Windows.h>
+#else
+#include"IPC_Compat_v2.h"
+#endif
 #include"IPC_Dll_v2_Private.h"
 #include"IPC_Dll_v2_Debug.h"
+#include"IPC_Ring_v2.h"
 
 //IPCMSG structure to be used by the client for sending messages
 typedef struct _IPCMSG
@@ -12,11 +17,157 @@ typedef struct _IPCMSG
 	UINT uiDestPID;		//Destination process PID
 	size_t MsgSize;		//Message Size
 	BOOL bEndofMsg;		//End of Message Flag
+	UINT uiPriority;	//Priority lane at the destination, IPC_PRIORITY_NORMAL to IPC_PRIORITY_CONTROL
+	UINT uiCallID;		//Call the message is the request or reply of, 0 for other messages. Set by the driver
+	BOOL bTraced;		//The message carries its per stage timestamps, read with GetIPCMsgTrace. Set by the DLL
 	char szMsg[];		//Message in the form of string
 }IPCMSG, *PIPCMSG;
 
+//Selects the transport InitDeviceforIPC opens, "device" for the driver or "broker" for the IPCBroker process.
+//Without a call the IPC_BACKEND environment variable decides, else the driver on Windows and the broker elsewhere
+BOOL SetIPCBackend(LPCSTR);
+
 BOOL InitDeviceforIPC();
 BOOL SendIPCMsg(PIPCMSG);
 PIPCMSG RecvIPCMsg();
 BOOL CloseDeviceforIPC();
 
+//Sessions. Each one has its own device handle (or broker channels), port, Read notification event and receive
+//buffer sizing. A thread bound to a session with SetIPCThreadSession makes every API call over it, NULL binds it
+//back to the session of InitDeviceforIPC. Threads may call the API concurrently, on the same session or not.
+//A handle which is not an open session fails with ERROR_INVALID_HANDLE, and threads still bound to a session
+//another thread closed go back to the session of InitDeviceforIPC on their next call
+typedef PIPC_VAR HIPCSESSION;
+
+HIPCSESSION OpenIPCSession();
+BOOL SetIPCThreadSession(HIPCSESSION);
+BOOL CloseIPCSession(HIPCSESSION);
+
+//Receive into the caller's memory. RecvIPCMsgInto reads the next message straight into a buffer the caller
+//owns and reuses, and describes it in an IPCMSGVIEW whose pMsg points at the payload in that buffer, valid
+//until the buffer is reused. Nothing is allocated per message. A buffer of IPC_RECV_OVERHEAD bytes more than
+//the largest payload always fits, a message which does not fit stays queued and FALSE is returned with
+//ERROR_MORE_DATA and the buffer size needed in cbRequired. GetIPCMsgViewTrace returns the stamps of a view
+#define IPC_RECV_OVERHEAD (sizeof(IPC_WIRE_HEADER) + sizeof(IPC_WIRE_CALL_ID) + sizeof(IPC_PACKET_TRACE))
+
+typedef struct _IPCMSGVIEW
+{
+	UINT uiMsgID;		//Message ID
+	UINT uiSourcePID;	//Source process PID
+	UINT uiDestPID;		//Destination process PID, this process
+	size_t MsgSize;		//Message Size
+	BOOL bEndofMsg;		//End of Message Flag
+	UINT uiPriority;	//Priority lane the message was read from
+	UINT uiCallID;		//Call the message is the request of, 0 for other messages
+	BOOL bTraced;		//Per stage timestamps follow the payload, read with GetIPCMsgViewTrace
+	const char* pMsg;	//Message, in the caller's buffer
+	DWORD cbRequired;	//Buffer size the message needs, set when it did not fit
+}IPCMSGVIEW, *PIPCMSGVIEW;
+
+BOOL RecvIPCMsgInto(PVOID, DWORD, PIPCMSGVIEW);
+
+//Gather send. Sends one message whose payload is the nSegments (at most IPC_GATHER_MAX_SEGMENTS) buffers
+//of the array back to back, so a header, a blob and a trailer need not be assembled into an IPCMSG first.
+//The header's message ID, destination PID, priority and end of message flag are used, its payload is not.
+//The payload goes from the buffers into the driver with a single copy
+typedef struct _IPCSEGMENT
+{
+	const VOID* pData;	//Bytes of the segment
+	size_t cbData;		//Size of the segment
+}IPCSEGMENT, *PIPCSEGMENT;
+
+BOOL SendIPCMsgGather(PIPCMSG, const IPCSEGMENT*, UINT);
+
+//Sends several messages with a single call into the driver. pdwResults (optional) receives
+//ERROR_SUCCESS or the error of each message, TRUE is returned only if every message was sent
+BOOL SendIPCMsgBatch(PIPCMSG*, UINT, DWORD*);
+
+//Waits for messages and returns up to nMaxMsgs of them with a single read of cbBuffer bytes
+//(0 for the default). Every returned IPCMSG is freed by the caller with HeapFree
+UINT RecvIPCMsgBatch(PIPCMSG*, UINT, DWORD);
+
+//Multicast. The message is copied into the driver once and queued to every recipient, uiDestPID is
+//ignored and each recipient reads its own PID as destination. pnDelivered (optional) receives the
+//number of recipients, FALSE with ERROR_NOT_FOUND is returned if there were none. A group exists while
+//it has members, membership ends with JoinIPCGroup's counterpart or when the device is closed.
+//Group and broadcast messages are not delivered to the sender
+BOOL SendIPCMsgMulticast(PIPCMSG, const UINT*, UINT, UINT*);
+BOOL SendIPCMsgToGroup(PIPCMSG, LPCSTR, UINT*);
+BOOL BroadcastIPCMsg(PIPCMSG, UINT*);
+BOOL JoinIPCGroup(LPCSTR);
+BOOL LeaveIPCGroup(LPCSTR);
+
+//Streaming. SendIPCStream sends a payload of any size as fragments of at most 64KB, which is all the
+//driver ever holds per packet. RecvIPCStream reassembles the next message into the caller's buffer and
+//returns its size, FALSE with ERROR_MORE_DATA if it was truncated. The header's message ID, source and
+//destination PIDs are used, other messages read while a stream is reassembled are returned by later calls
+BOOL SendIPCStream(PIPCMSG, const VOID*, size_t);
+BOOL RecvIPCStream(PVOID, size_t, size_t*, UINT*, UINT*);
+
+//Flow control. SetIPCQueueLimit bounds the messages and bytes queued to this process (0 for no limit).
+//SetIPCOverflowPolicy picks what happens to this process's messages when their destination is over its
+//limit: IPC_OVERFLOW_FAIL (the default) fails the send with ERROR_NOT_ENOUGH_QUOTA, IPC_OVERFLOW_BLOCK
+//waits for the receiver, failing with ERROR_SEM_TIMEOUT after dwTimeoutMs without progress, and
+//IPC_OVERFLOW_DROP_OLDEST drops the destination's oldest messages. QueryIPCCredits returns how many
+//more messages and bytes a destination accepts (MAXUINT32/MAXUINT64 without a limit)
+BOOL SetIPCQueueLimit(UINT, ULONG64);
+BOOL SetIPCOverflowPolicy(UINT, DWORD);
+BOOL QueryIPCCredits(UINT, PIPC_CREDITS);
+
+//Named endpoints. RegisterIPCEndpoint names this process's port, ResolveIPCEndpoint returns the
+//handle of a name once, to be passed as uiDestPID of every later send (single, batch, stream and
+//multicast PID lists alike) so routing needs neither a PID nor a name compare. Names are unique and
+//live as long as the registering handle, a send to a handle whose endpoint has gone fails with
+//ERROR_NOT_FOUND even if the name is registered again. Messages sent to an endpoint carry its handle
+//as uiDestPID. Both return the handle in the UINT pointed to
+BOOL RegisterIPCEndpoint(LPCSTR, UINT*);
+BOOL ResolveIPCEndpoint(LPCSTR, UINT*);
+
+//Request/response calls. CallIPC sends a request and waits up to dwMilliseconds (INFINITE for no
+//limit) for its reply, returned in *ppReply (freed by the caller with HeapFree). The request reaches
+//the callee like any message but with a non zero uiCallID, the callee answers with ReplyIPCMsg, which
+//the driver copies straight to the waiting caller. FALSE with ERROR_TIMEOUT if no reply came in time,
+//ERROR_NOT_FOUND if the callee does not exist or closed the device without replying
+BOOL CallIPC(PIPCMSG, PIPCMSG*, DWORD);
+BOOL ReplyIPCMsg(PIPCMSG, PIPCMSG);
+
+//Priority lanes. A message's uiPriority selects its lane at the destination, a process reads its
+//highest priority lane first so control messages do not wait behind bulk data. SetIPCLaneWeights
+//(IPC_PRIORITY_LANES weights, NULL or all 0 for strict priority) reads the lanes in weighted round
+//robin order instead, so a busy high lane cannot starve the lower ones. Order is only kept per lane
+BOOL SetIPCLaneWeights(const UINT*);
+
+//Runtime statistics. QueryIPCStats fills cbStats bytes at pStats with the driver's totals and the
+//counters of as many processes as fit, a larger buffer is needed if nPorts exceeds nReturned. The
+//counters only ever grow, so rates are derived from the difference between two queries
+BOOL QueryIPCStats(PIPC_STATS, DWORD);
+
+//Latency tracing. SetIPCTrace switches the per stage timestamps of the messages this process receives
+//on or off, the driver then stamps them as they are written, copied in, queued and read and the DLL as
+//they are returned. GetIPCMsgTrace returns the stamps of a received message, FALSE if it has none.
+//QueryIPCTrace returns the latency histograms the driver keeps for a process (0 for this one)
+BOOL SetIPCTrace(BOOL);
+BOOL GetIPCMsgTrace(PIPCMSG, PIPC_PACKET_TRACE);
+BOOL GetIPCMsgViewTrace(PIPCMSGVIEW, PIPC_PACKET_TRACE);
+BOOL QueryIPCTrace(UINT, PIPC_TRACE_STATS);
+
+//Overlapped receive. StartIPCAsyncRecv keeps nRequests reads of cbBuffer bytes (0 for the default)
+//in flight, their completions are queued to hIocp with CompletionKey. If hIocp is NULL a completion
+//port is created for the DLL and WaitIPCAsyncRecv returns the messages. Otherwise every completion
+//dequeued from hIocp with CompletionKey is passed to CompleteIPCAsyncRecv, which returns the message
+//(freed by the caller with HeapFree) and puts the read back in flight
+BOOL StartIPCAsyncRecv(HANDLE, ULONG_PTR, UINT, DWORD);
+PIPCMSG CompleteIPCAsyncRecv(LPOVERLAPPED);
+PIPCMSG WaitIPCAsyncRecv(DWORD);
+BOOL StopIPCAsyncRecv();
+
+//Shared memory ring transport. The receiving process creates the ring for its port,
+//a single sending process opens it by the receiver's PID. Messages do not pass through the driver
+typedef PIPC_RING HIPCRING;
+
+HIPCRING CreateIPCRing(DWORD);
+HIPCRING OpenIPCRing(UINT);
+BOOL SendIPCRingMsg(HIPCRING, PIPCMSG);
+PIPCMSG RecvIPCRingMsg(HIPCRING);
+BOOL CloseIPCRing(HIPCRING);
+
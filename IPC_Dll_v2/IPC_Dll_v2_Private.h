@@ -2,30 +2,304 @@
 #define IPC_DEVICE_TYPE 40000	//IPC_Device_Type code for creating IOCTL
 #define IOCTL_REG_EVENT\
  CTL_CODE(IPC_DEVICE_TYPE, 0x800, METHOD_BUFFERED, FILE_READ_DATA|FILE_WRITE_DATA) // Read notification event IOCTL
+#define IOCTL_SEND_BATCH\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA) // Batch send IOCTL
+#define IOCTL_RECV_BATCH\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x802, METHOD_OUT_DIRECT, FILE_READ_DATA) // Batch read IOCTL
+#define IOCTL_SEND_MULTICAST\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA) // Multicast send IOCTL
+#define IOCTL_JOIN_GROUP\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x804, METHOD_BUFFERED, FILE_READ_DATA) // Join multicast group IOCTL
+#define IOCTL_LEAVE_GROUP\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x805, METHOD_BUFFERED, FILE_READ_DATA) // Leave multicast group IOCTL
+#define IOCTL_SET_QUEUE_LIMIT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x806, METHOD_BUFFERED, FILE_READ_DATA) // Incoming queue limit IOCTL
+#define IOCTL_SET_OVERFLOW\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x807, METHOD_BUFFERED, FILE_WRITE_DATA) // Overflow policy IOCTL
+#define IOCTL_QUERY_CREDITS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x808, METHOD_BUFFERED, FILE_WRITE_DATA) // Destination credits IOCTL
+#define IOCTL_SET_LANE_WEIGHTS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x809, METHOD_BUFFERED, FILE_READ_DATA) // Priority lane weights IOCTL
+#define IOCTL_REGISTER_ENDPOINT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80A, METHOD_BUFFERED, FILE_READ_DATA) // Register named endpoint IOCTL
+#define IOCTL_RESOLVE_ENDPOINT\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80B, METHOD_BUFFERED, FILE_WRITE_DATA) // Resolve named endpoint IOCTL
+#define IOCTL_CALL\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80C, METHOD_BUFFERED, FILE_READ_DATA|FILE_WRITE_DATA) // Request/response call IOCTL
+#define IOCTL_REPLY\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80D, METHOD_BUFFERED, FILE_WRITE_DATA) // Reply to a call IOCTL
+#define IOCTL_COLLECT_REPLY\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80E, METHOD_BUFFERED, FILE_READ_DATA) // Collect a reply which did not fit IOCTL
+#define IOCTL_QUERY_STATS\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x80F, METHOD_BUFFERED, FILE_READ_DATA) // Runtime statistics IOCTL
+#define IOCTL_SET_TRACE\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x810, METHOD_BUFFERED, FILE_WRITE_DATA) // Latency tracing switch IOCTL
+#define IOCTL_QUERY_TRACE\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x811, METHOD_BUFFERED, FILE_READ_DATA) // Latency histograms IOCTL
+#define IOCTL_SEND_GATHER\
+ CTL_CODE(IPC_DEVICE_TYPE, 0x812, METHOD_BUFFERED, FILE_WRITE_DATA) // Gather send IOCTL
 #define INITIALRECVBUFSIZE 255  //Initial receive size buffer to be used
+#define RECVBATCHBUFSIZE 65536	//Default buffer size of a batch read
+#define IPC_BUF_CLASSES 4		//Size classes of the thread local packet buffer pool, 512B, 4KB, 64KB and 1MB
+#define IPC_BUF_CLASS_DEPTH 4	//Free buffers each thread keeps per size class
+#define ASYNCRECVBUFSIZE 4096	//Default buffer size of an overlapped receive request
+#define IPC_GROUP_NAME_MAX 32	//Size of a multicast group name including the terminating NUL
+#define IPC_ENDPOINT_NAME_MAX 32	//Size of an endpoint name including the terminating NUL
+#define IPC_ENDPOINT_TAG 1		//Low bit set in every endpoint handle, PIDs are multiples of 4
+#define IPC_STREAM_FRAGMENT 65280	//Payload bytes of a stream fragment, the driver keeps it in its largest packet size class
+#define IPC_STREAM_BATCH 15			//Fragments per send call, a batch of them fills the 1MB packet buffer class
+#define IPC_STREAM_RECVBUFSIZE (1048576 - 64)	//Batch read buffer of a stream receive, the 1MB packet buffer class
 
-//This structure holds data pertaining to each user mode process interacting with the device/drive for IPC
+//An overlapped read kept in flight on the device by the asynchronous receive API.
+//The OVERLAPPED comes first, completion packets carry its address
+
+typedef struct _IPC_RECV_REQUEST {
+	OVERLAPPED Overlapped;					//Overlapped structure of the outstanding ReadFile
+	struct _IPC_WIRE_HEADER* pPacket;		//Read buffer
+	DWORD cbPacket;							//Size of the read buffer
+	struct _IPC_VAR* pVar;					//Session the read is in flight on
+	struct _IPC_RECV_REQUEST* pNext;		//Next request of the session
+	struct _IPC_RECV_REQUEST* pPrev;		//Previous request of the session
+}IPC_RECV_REQUEST, *PIPC_RECV_REQUEST;
+
+//A message read by RecvIPCStream while it was reassembling another one, returned by the next receive call
+
+typedef struct _IPC_DEFERRED_MSG {
+	struct _IPCMSG* pMsg;					//Message, heap allocated the way RecvIPCMsg returns it
+	struct _IPC_DEFERRED_MSG* pNext;		//Next message, in the order they were read
+}IPC_DEFERRED_MSG, *PIPC_DEFERRED_MSG;
+
+//Reassembly state of RecvIPCStream
+
+typedef struct _IPC_STREAM_RECV {
+	char* pBuffer;							//Caller's buffer the fragments are copied into
+	size_t cbBuffer;						//Size of pBuffer
+	size_t cbMsg;							//Payload bytes of the message received so far
+	UINT uiSourcePID;						//Source PID of the message, set by its first fragment
+	UINT uiMsgID;							//Message ID of the message, set by its first fragment
+	BOOL bStarted;							//Set once the first fragment has been received
+	BOOL bComplete;							//Set once the fragment with bEndOfPayload has been received
+}IPC_STREAM_RECV, *PIPC_STREAM_RECV;
+
+//Transport the dll sends its requests over. The device backend issues them to the driver, the broker
+//backend hands them to the IPCBroker process where there is no driver. Every function returns like the
+//Win32 call it stands for, FALSE with the error in GetLastError()
+
+struct _IPC_VAR;
+struct _IPC_GATHER_HEADER;
+
+typedef struct _IPC_BACKEND {
+	const char* szName;					//Name SetIPCBackend selects the backend by
+	BOOL (*pfnOpen)(struct _IPC_VAR* pVar);		//CreateFile, registers the Read notification if the backend needs one
+	VOID (*pfnClose)(struct _IPC_VAR* pVar);	//CloseHandle, the port and every pending request go with it
+	BOOL (*pfnWaitRecv)(struct _IPC_VAR* pVar);	//Waits until a message is queued to the port
+	BOOL (*pfnRead)(struct _IPC_VAR* pVar, PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes);		//ReadFile
+	BOOL (*pfnWrite)(struct _IPC_VAR* pVar, PVOID pBuffer, DWORD cbBuffer, DWORD* pdwBytes);	//WriteFile
+	BOOL (*pfnIoctl)(struct _IPC_VAR* pVar, DWORD dwIoControlCode, PVOID pInBuffer, DWORD cbInBuffer,
+		PVOID pOutBuffer, DWORD cbOutBuffer, DWORD* pdwBytes, DWORD dwTimeoutMs);	//DeviceIoControl, cancelled with ERROR_OPERATION_ABORTED after dwTimeoutMs
+	BOOL (*pfnWriteGather)(struct _IPC_VAR* pVar, struct _IPC_GATHER_HEADER* pGather);	//Write of a packet whose payload is the gather's segments
+}IPC_BACKEND, *PIPC_BACKEND;
+
+#ifdef _WIN32
+extern const IPC_BACKEND g_IPCDeviceBackend;	//IPCDrv, the default on Windows
+#endif
+extern const IPC_BACKEND g_IPCBrokerBackend;	//IPCBroker, the default elsewhere
+
+//Initializes the process wide state of the broker backend, called once when the dll is loaded
+VOID IPCBrokerProcessAttach();
+
+//This structure holds data pertaining to each session of a user mode process interacting with the device/drive for IPC
 
 typedef struct _IPC_VAR {
-	HANDLE hFile;		//handle to file object
+	const IPC_BACKEND* pBackend;			//Transport the requests go over
+	PVOID pBackendContext;					//State of the broker backend
+	HANDLE hFile;		//handle to file object, opened for overlapped IO
 	HANDLE hEvent;		//handle to Read notification event passed to driver
 	//HANDLE hThread;		//handle to Read IPC message thread
+	HANDLE hIocp;							//Completion port created by StartIPCAsyncRecv when the caller passes none
+	CRITICAL_SECTION csRecv;				//Protects the receive request list and bRecvStopping
+	PIPC_RECV_REQUEST pRecvRequests;		//Receive requests in flight
+	UINT nRecvRequests;						//Number of receive requests in flight
+	BOOL bRecvStopping;						//Set by StopIPCAsyncRecv, completed requests are not reposted
+	DWORD cbRecvHighWater;					//Largest packet read on the handle, receive buffers start at this size
+	CRITICAL_SECTION csDeferred;			//Protects the deferred message list
+	PIPC_DEFERRED_MSG pDeferredHead;		//Messages read ahead by RecvIPCStream, oldest first
+	PIPC_DEFERRED_MSG pDeferredTail;		//Last deferred message
+	struct _IPC_VAR* pNextSession;			//Next session opened with OpenIPCSession, linked while it is open
+	LONG nRefs;								//1 while open plus 1 per thread bound to it, the IPC_VAR is freed with the last
+	volatile BOOL bClosed;					//Set by CloseIPCSession, threads still bound to it go back to the process' session
 }IPC_VAR, *PIPC_VAR;
 
-//Global pointer to our IPC_VAR structure
+//Global pointer to the IPC_VAR structure of the session InitDeviceforIPC opened, defined in IPC_Dll_v2.c
+
+extern PIPC_VAR pIpc_Var;
+
+//Maps the NTSTATUS the driver or the broker returns to a Win32 error
+DWORD IPCPacketStatusToError(LONG lStatus);
+
+//The IPC Packets sent to and read from the driver are wire packets, an IPC_WIRE_HEADER followed by
+//the call ID of a call and the payload. IPC_Wire_v2.h is shared with the driver and the broker
+
+#include"IPC_Wire_v2.h"
+
+//Header of a batch of IPC Packets sent with IOCTL_SEND_BATCH or read with IOCTL_RECV_BATCH,
+//the packets follow it back to back, each one starting on an IPC_BATCH_ALIGN boundary
+
+#define IPC_BATCH_ALIGN 8
+#define IPC_BATCH_ALIGN_UP(uiLength) (((uiLength) + IPC_BATCH_ALIGN - 1) & ~((size_t)IPC_BATCH_ALIGN - 1))
+
+typedef struct _IPC_BATCH_HEADER {
+	UINT32 nPackets;					//Number of IPC Packets in the batch
+	UINT32 cbNext;						//Read: size of the next queued packet if it did not fit, else 0. Send: must be 0
+}IPC_BATCH_HEADER, *PIPC_BATCH_HEADER;
+
+//Input of IOCTL_RECV_BATCH. With IPC_RECV_BATCH_WAIT the driver parks the read on an empty queue and
+//completes it with the next packet alone, so threads receiving in parallel each get a different packet
+
+#define IPC_RECV_BATCH_WAIT 0x1		//Wait for a packet if none is queued
+
+typedef struct _IPC_RECV_BATCH {
+	UINT32 nMaxPkts;					//Most packets to return, 0 for no limit
+	UINT32 uiFlags;						//IPC_RECV_BATCH_* flags
+}IPC_RECV_BATCH, *PIPC_RECV_BATCH;
+
+//Header of a multicast send with IOCTL_SEND_MULTICAST. nPids destination PIDs (DWORD32) follow it
+//for IPC_MULTICAST_PIDS, then the IPC Packet on an IPC_BATCH_ALIGN boundary
+
+#define IPC_MULTICAST_PIDS 0		//Every PID of the list
+#define IPC_MULTICAST_GROUP 1		//Every member of the group except the sender
+#define IPC_MULTICAST_BROADCAST 2	//Every process with the device open except the sender
+
+typedef struct _IPC_MULTICAST_HEADER {
+	UINT32 uiTarget;					//IPC_MULTICAST_PIDS, IPC_MULTICAST_GROUP or IPC_MULTICAST_BROADCAST
+	UINT32 nPids;						//Number of PIDs following the header
+	char szGroup[IPC_GROUP_NAME_MAX];	//Group name for IPC_MULTICAST_GROUP
+}IPC_MULTICAST_HEADER, *PIPC_MULTICAST_HEADER;
+
+//Flow control. A receiver bounds its incoming queue with IOCTL_SET_QUEUE_LIMIT, a sender picks what
+//happens to its messages when the destination is over its limit with IOCTL_SET_OVERFLOW
+
+#define IPC_OVERFLOW_FAIL 0			//The message is rejected, ERROR_NOT_ENOUGH_QUOTA
+#define IPC_OVERFLOW_BLOCK 1		//The sender waits until the receiver has read enough
+#define IPC_OVERFLOW_DROP_OLDEST 2	//The oldest messages queued to the destination are dropped
+
+typedef struct _IPC_QUEUE_LIMIT {
+	UINT32 nMaxPkts;					//Packets, 0 for no limit
+	UINT32 uiReserved;					//Must be 0
+	UINT64 cbMaxBytes;					//Bytes of packet header and payload, 0 for no limit
+}IPC_QUEUE_LIMIT, *PIPC_QUEUE_LIMIT;
+
+typedef struct _IPC_OVERFLOW {
+	UINT32 uiPolicy;					//IPC_OVERFLOW_FAIL, IPC_OVERFLOW_BLOCK or IPC_OVERFLOW_DROP_OLDEST
+	UINT32 uiTimeoutMs;					//IPC_OVERFLOW_BLOCK: longest wait without a message being read, INFINITE for no limit
+}IPC_OVERFLOW, *PIPC_OVERFLOW;
+
+typedef struct _IPC_CREDITS {
+	UINT32 nPkts;						//Packets the destination still accepts, MAXUINT32 if it has no packet limit
+	UINT32 nQueuedPkts;					//Packets queued to it, 0 if it has no limit
+	UINT64 cbBytes;						//Bytes it still accepts, MAXUINT64 if it has no byte limit
+	UINT64 cbQueuedBytes;				//Bytes queued to it, 0 if it has no limit
+	UINT64 nDropped;					//Messages dropped from its queue for IPC_OVERFLOW_DROP_OLDEST senders
+}IPC_CREDITS, *PIPC_CREDITS;
+
+//IOCTL_CALL completes with ERROR_MORE_DATA and this structure when the reply did not fit, the reply
+//is then fetched with IOCTL_COLLECT_REPLY and a buffer of cbReply bytes
+
+typedef struct _IPC_CALL_OVERFLOW {
+	UINT32 cbReply;						//Size of the reply IPC Packet
+	UINT32 uiCallId;					//Call ID to pass to IOCTL_COLLECT_REPLY
+}IPC_CALL_OVERFLOW, *PIPC_CALL_OVERFLOW;
+
+//Priority lanes. Every process reads its messages from the highest priority lane holding one,
+//or in weighted round robin order after IOCTL_SET_LANE_WEIGHTS. Order is only kept within a lane
+
+#define IPC_PRIORITY_LANES 4		//Number of lanes, priorities above the highest lane use the highest lane
+#define IPC_PRIORITY_NORMAL 0		//Default lane, the lowest
+#define IPC_PRIORITY_ELEVATED 1
+#define IPC_PRIORITY_HIGH 2
+#define IPC_PRIORITY_CONTROL 3		//Highest lane, for control messages which must not wait behind bulk data
+
+typedef struct _IPC_LANE_WEIGHTS {
+	UINT32 Weights[IPC_PRIORITY_LANES];	//Messages each lane gives per round, all 0 for strict priority
+}IPC_LANE_WEIGHTS, *PIPC_LANE_WEIGHTS;
+
+//Runtime statistics returned by IOCTL_QUERY_STATS, the counters of the whole driver followed by
+//those of as many processes as the buffer holds
+
+typedef struct _IPC_PORT_STATS {
+	DWORD32 dwPID;						//PID of the process, 0 for the totals
+	UINT32 nDepth;						//Messages queued to it and not yet read or dropped
+	UINT32 nPeakDepth;					//Most messages its incoming queue held at once, the highest of any process for the totals
+	UINT32 uiReserved;					//0
+	char szEndpoint[IPC_ENDPOINT_NAME_MAX];	//Endpoint name of the process, empty if it has none
+	UINT64 nPktsIn;						//Messages queued to it
+	UINT64 cbBytesIn;					//Payload bytes of those messages
+	UINT64 nPktsOut;					//Messages it has read
+	UINT64 cbBytesOut;					//Payload bytes of those messages
+	UINT64 nUndeliverable;				//Messages it sent to a process or endpoint which did not exist
+	UINT64 nAllocFailures;				//Messages it sent which the driver could not allocate
+	UINT64 nTooSmall;					//Reads which had to be retried with a larger buffer
+	UINT64 nDropped;					//Messages dropped from its queue for IPC_OVERFLOW_DROP_OLDEST senders
+}IPC_PORT_STATS, *PIPC_PORT_STATS;
+
+//Counters of one of the driver's routing threads. The latency of a message runs from the write
+//queueing it to the routing thread until the thread has delivered it
+
+#define IPC_STATS_ROUTER_THREADS 64		//Entries of IPC_STATS.Router
+
+typedef struct _IPC_ROUTER_STATS {
+	UINT64 nPkts;						//Messages routed
+	UINT64 nDrains;						//Wake ups which found messages queued
+	UINT64 llLatencyTotal;				//Sum of the messages' latencies, in nanoseconds
+	UINT64 llLatencyMax;				//Largest latency of a message, in nanoseconds
+	UINT32 nBacklog;					//Messages queued to the thread and not yet routed
+	UINT32 uiCpu;						//Processor the thread is bound to
+}IPC_ROUTER_STATS, *PIPC_ROUTER_STATS;
+
+typedef struct _IPC_STATS {
+	UINT32 nPorts;						//Processes with the device open, more than nReturned if the buffer was too small
+	UINT32 nReturned;					//Entries of Ports
+	IPC_PORT_STATS Totals;				//Counters of the whole driver
+	UINT32 nRouterThreads;				//Entries of Router
+	UINT32 uiReserved;					//0
+	IPC_ROUTER_STATS Router[IPC_STATS_ROUTER_THREADS];	//Counters of each routing thread
+	IPC_PORT_STATS Ports[];				//Counters of each process
+}IPC_STATS, *PIPC_STATS;
+
+//Latency histograms returned by IOCTL_QUERY_TRACE. Bucket i of a span counts the messages which
+//took 2^i to 2^(i+1)-1 nanoseconds, the last bucket also counts everything longer
+
+typedef enum _IPC_TRACE_SPAN {
+	IPC_TRACE_SPAN_COPY,				//IPC_TRACE_WRITE to IPC_TRACE_COPIED
+	IPC_TRACE_SPAN_ROUTE,				//IPC_TRACE_COPIED to IPC_TRACE_QUEUED
+	IPC_TRACE_SPAN_QUEUE,				//IPC_TRACE_QUEUED to IPC_TRACE_READ
+	IPC_TRACE_SPAN_TOTAL,				//IPC_TRACE_WRITE to IPC_TRACE_READ
+	IPC_TRACE_SPANS
+}IPC_TRACE_SPAN;
+
+#define IPC_TRACE_BUCKETS 32
+
+typedef struct _IPC_TRACE_STATS {
+	UINT32 bEnabled;					//Tracing is switched on for the process
+	UINT32 uiReserved;					//0
+	UINT64 Counts[IPC_TRACE_SPANS][IPC_TRACE_BUCKETS];	//Messages read per span and bucket
+}IPC_TRACE_STATS, *PIPC_TRACE_STATS;
+
+//Every buffer of the thread local packet buffer pool starts with this header, the IPC Packet follows it
 
-PIPC_VAR pIpc_Var;
+typedef struct _IPC_BUF_HEADER {
+	struct _IPC_BUF_HEADER* pNext;		//Next free buffer of the same size class
+	DWORD dwClass;						//Size class, IPC_BUF_CLASSES for buffers larger than every class
+	DWORD dwReserved;					//Keeps the packet 16 byte aligned
+}IPC_BUF_HEADER, *PIPC_BUF_HEADER;
 
-//Definition of the IPC_PACKET which is sent to the driver
+//Per thread cache of free packet buffers, SendIPCMsg and RecvIPCMsg take their packet buffers from it
 
-typedef struct _IPC_PACKET {
-	struct _header {
-		DWORD32 dwSourcePid;			//Source PID
-		HANDLE dwDestinationPid;		//Destination PID	
-		size_t sizeofpayload;			//size of payload in bytes
-		UINT uiPacketid;				//Packet ID
-		BOOL bEndOfPayload;				//End of Payload
-	}header;
-	LIST_ENTRY list_entry;				//List_Entry structure for queuing IPC Packets
-	char szbuffer[];					//Flexible Array Member of structure for variable size payload
-}IPC_PACKET, *PIPC_PACKET;
\ No newline at end of file
+typedef struct _IPC_BUF_CACHE {
+	PIPC_BUF_HEADER pFree[IPC_BUF_CLASSES];	//Free buffers of each size class
+	DWORD nFree[IPC_BUF_CLASSES];				//Number of free buffers of each size class
+	ULONG64 nHits;								//Buffers handed out from the cache
+	ULONG64 nMisses;							//Buffers which had to be allocated from the process heap
+	struct _IPC_WIRE_HEADER* pRecvPacket;		//Read buffer of RecvIPCMsg, grown to the largest packet read
+	DWORD cbRecvPacket;							//Size of pRecvPacket
+}IPC_BUF_CACHE, *PIPC_BUF_CACHE;
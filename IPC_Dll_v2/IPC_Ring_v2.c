@@ -0,0 +1,561 @@
+/*
+IPC_Ring_v2.c
+Author:ashokh@microsoft.com
+Last modified date: 07-01-2020
+
+This file contains the shared memory single producer / single consumer ring
+used by the ring transport of the IPC dll. It builds on Windows (named section
+and auto reset events) and on Linux (shm_open and futexes) so the ring can be
+benchmarked on either.
+
+Producer and consumer only touch their own position in the fast path. A side
+that finds the ring full or empty spins briefly, then sets its waiting flag and
+sleeps; the other side only makes a wakeup call when it sees that flag set.
+*/
+
+#include"IPC_Ring_v2.h"
+#include<stdio.h>
+#include<string.h>
+
+#ifdef _WIN32
+
+//MSVC gives volatile accesses acquire/release semantics on x86 and x64 (/volatile:ms)
+#define RING_LOAD_ACQUIRE(p) (*(p))
+#define RING_STORE_RELEASE(p, v) (*(p) = (v))
+#define RING_FULL_FENCE() MemoryBarrier()
+#define RING_EXCHANGE32(p, v) InterlockedExchange((volatile LONG*)(p), (v))
+#define RING_CAS32(p, v, c) InterlockedCompareExchange((volatile LONG*)(p), (v), (c))
+#define RING_INCREMENT32(p) InterlockedIncrement((volatile LONG*)(p))
+
+#else
+
+#include<errno.h>
+#include<fcntl.h>
+#include<limits.h>
+#include<signal.h>
+#include<time.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<linux/futex.h>
+
+#define RING_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define RING_FULL_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define RING_EXCHANGE32(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define RING_CAS32(p, v, c) __sync_val_compare_and_swap((p), (c), (v))
+#define RING_INCREMENT32(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+
+#endif
+
+#define RING_ALIGN_UP(x) (((x) + (IPC_RING_ALIGN - 1)) & ~((uint64_t)IPC_RING_ALIGN - 1))
+
+
+//Platform specific mapping, wait and wake helpers
+
+#ifdef _WIN32
+
+static int RingPidAlive(uint32_t dwPid)
+{
+	HANDLE hProcess = OpenProcess(SYNCHRONIZE, FALSE, dwPid);
+	DWORD dwWait;
+
+	if (!hProcess)
+	{
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	}
+	dwWait = WaitForSingleObject(hProcess, 0);
+	CloseHandle(hProcess);
+	return dwWait == WAIT_TIMEOUT;
+}
+
+static int RingMap(PIPC_RING pRing, const char* szRingName, size_t cbMapping, int bCreate)
+{
+	char szName[96];
+
+	sprintf_s(szName, sizeof(szName), "Local\\%s", szRingName);
+	if (bCreate)
+	{
+		pRing->hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			(DWORD)((uint64_t)cbMapping >> 32), (DWORD)cbMapping, szName);
+	}
+	else
+	{
+		pRing->hMapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, szName);
+	}
+	if (!pRing->hMapping)
+	{
+		return (int)GetLastError();
+	}
+
+	//An existing ring is mapped whole, its size is taken from the control block
+
+	pRing->pHeader = (PIPC_RING_HEADER)MapViewOfFile(pRing->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, bCreate ? cbMapping : 0);
+	if (!pRing->pHeader)
+	{
+		int iError = (int)GetLastError();
+		CloseHandle(pRing->hMapping);
+		return iError;
+	}
+
+	//Auto reset events used to wake a sleeping consumer or producer
+
+	sprintf_s(szName, sizeof(szName), "Local\\%s_Data", szRingName);
+	pRing->hDataEvent = CreateEventA(NULL, FALSE, FALSE, szName);
+	sprintf_s(szName, sizeof(szName), "Local\\%s_Space", szRingName);
+	pRing->hSpaceEvent = CreateEventA(NULL, FALSE, FALSE, szName);
+	if (!pRing->hDataEvent || !pRing->hSpaceEvent)
+	{
+		int iError = (int)GetLastError();
+		IPCRingClose(pRing);
+		return iError;
+	}
+
+	pRing->cbMapping = bCreate ? cbMapping : sizeof(IPC_RING_HEADER) + pRing->pHeader->cbData;
+	return 0;
+}
+
+static void RingUnmap(PIPC_RING pRing)
+{
+	if (pRing->pHeader)
+	{
+		UnmapViewOfFile(pRing->pHeader);
+	}
+	if (pRing->hMapping)
+	{
+		CloseHandle(pRing->hMapping);
+	}
+	if (pRing->hDataEvent)
+	{
+		CloseHandle(pRing->hDataEvent);
+	}
+	if (pRing->hSpaceEvent)
+	{
+		CloseHandle(pRing->hSpaceEvent);
+	}
+}
+
+//Sleeps until woken or the timeout expires. Returns 0 on timeout
+
+static int RingSleep(PIPC_RING pRing, volatile uint32_t* pSeq, uint32_t dwSeq, int bData, uint32_t dwTimeoutMs)
+{
+	(void)pSeq; (void)dwSeq;
+	return WaitForSingleObject(bData ? pRing->hDataEvent : pRing->hSpaceEvent, dwTimeoutMs) == WAIT_OBJECT_0;
+}
+
+static void RingWake(PIPC_RING pRing, volatile uint32_t* pSeq, int bData)
+{
+	(void)pSeq;
+	SetEvent(bData ? pRing->hDataEvent : pRing->hSpaceEvent);
+}
+
+static uint64_t RingNowMs()
+{
+	return GetTickCount64();
+}
+
+#else
+
+static int RingPidAlive(uint32_t dwPid)
+{
+	return kill((pid_t)dwPid, 0) == 0 || errno == EPERM;
+}
+
+static int RingMap(PIPC_RING pRing, const char* szRingName, size_t cbMapping, int bCreate)
+{
+	snprintf(pRing->szName, sizeof(pRing->szName), "/%s", szRingName);
+
+	if (bCreate)
+	{
+		//A ring of the same name left behind by an earlier process is replaced
+
+		shm_unlink(pRing->szName);
+		pRing->fd = shm_open(pRing->szName, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (pRing->fd < 0)
+		{
+			return errno;
+		}
+		if (ftruncate(pRing->fd, (off_t)cbMapping) != 0)
+		{
+			int iError = errno;
+			close(pRing->fd);
+			shm_unlink(pRing->szName);
+			return iError;
+		}
+	}
+	else
+	{
+		struct stat st;
+
+		pRing->fd = shm_open(pRing->szName, O_RDWR, 0);
+		if (pRing->fd < 0)
+		{
+			return errno;
+		}
+		if (fstat(pRing->fd, &st) != 0)
+		{
+			int iError = errno;
+			close(pRing->fd);
+			return iError;
+		}
+		cbMapping = (size_t)st.st_size;
+	}
+
+	pRing->pHeader = (PIPC_RING_HEADER)mmap(NULL, cbMapping, PROT_READ | PROT_WRITE, MAP_SHARED, pRing->fd, 0);
+	if (pRing->pHeader == MAP_FAILED)
+	{
+		int iError = errno;
+		pRing->pHeader = NULL;
+		close(pRing->fd);
+		if (bCreate)
+		{
+			shm_unlink(pRing->szName);
+		}
+		return iError;
+	}
+
+	pRing->cbMapping = cbMapping;
+	return 0;
+}
+
+static void RingUnmap(PIPC_RING pRing)
+{
+	if (pRing->pHeader)
+	{
+		munmap(pRing->pHeader, pRing->cbMapping);
+	}
+	if (pRing->fd >= 0)
+	{
+		close(pRing->fd);
+	}
+	if (!pRing->bProducer && pRing->szName[0])
+	{
+		shm_unlink(pRing->szName);
+	}
+}
+
+//Sleeps on the futex word while it still holds dwSeq. Returns 0 on timeout
+
+static int RingSleep(PIPC_RING pRing, volatile uint32_t* pSeq, uint32_t dwSeq, int bData, uint32_t dwTimeoutMs)
+{
+	struct timespec ts;
+	(void)pRing; (void)bData;
+
+	ts.tv_sec = dwTimeoutMs / 1000;
+	ts.tv_nsec = (long)(dwTimeoutMs % 1000) * 1000000;
+
+	if (syscall(SYS_futex, pSeq, FUTEX_WAIT, dwSeq, dwTimeoutMs == IPC_RING_INFINITE ? NULL : &ts, NULL, 0) != 0)
+	{
+		return errno != ETIMEDOUT;
+	}
+	return 1;
+}
+
+static void RingWake(PIPC_RING pRing, volatile uint32_t* pSeq, int bData)
+{
+	(void)pRing; (void)bData;
+	RING_INCREMENT32(pSeq);
+	syscall(SYS_futex, pSeq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint64_t RingNowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif
+
+
+//Waits until pfnReady(pRing) holds. The waiter spins for a while, then publishes its waiting
+//flag and sleeps. The flag is rechecked after it is set so a wakeup cannot be missed
+
+typedef int (*PRING_READY)(PIPC_RING, uint64_t);
+
+static int RingWait(PIPC_RING pRing, PRING_READY pfnReady, uint64_t ullNeed, int bData, uint32_t dwTimeoutMs)
+{
+	volatile int32_t* pWaiting = bData ? &pRing->pHeader->lConsumerWaiting : &pRing->pHeader->lProducerWaiting;
+	volatile uint32_t* pSeq = bData ? &pRing->pHeader->dwDataSeq : &pRing->pHeader->dwSpaceSeq;
+	uint64_t ullDeadline = RingNowMs() + dwTimeoutMs;
+	uint32_t dwSeq;
+	int i;
+
+	for (i = 0; i < IPC_RING_SPIN_COUNT; i++)
+	{
+		if (pfnReady(pRing, ullNeed))
+		{
+			return 1;
+		}
+	}
+
+	for (;;)
+	{
+		uint32_t dwWait = IPC_RING_INFINITE;
+
+		dwSeq = RING_LOAD_ACQUIRE(pSeq);
+		RING_EXCHANGE32(pWaiting, 1);
+		RING_FULL_FENCE();
+
+		if (pfnReady(pRing, ullNeed))
+		{
+			RING_EXCHANGE32(pWaiting, 0);
+			return 1;
+		}
+
+		if (dwTimeoutMs != IPC_RING_INFINITE)
+		{
+			uint64_t ullNow = RingNowMs();
+			if (ullNow >= ullDeadline)
+			{
+				RING_EXCHANGE32(pWaiting, 0);
+				return 0;
+			}
+			dwWait = (uint32_t)(ullDeadline - ullNow);
+		}
+
+		RingSleep(pRing, pSeq, dwSeq, bData, dwWait);
+	}
+}
+
+//Wakes the other side if it has published its waiting flag
+
+static void RingSignal(PIPC_RING pRing, int bData)
+{
+	volatile int32_t* pWaiting = bData ? &pRing->pHeader->lConsumerWaiting : &pRing->pHeader->lProducerWaiting;
+
+	RING_FULL_FENCE();
+	if (*pWaiting && RING_EXCHANGE32(pWaiting, 0))
+	{
+		RingWake(pRing, bData ? &pRing->pHeader->dwDataSeq : &pRing->pHeader->dwSpaceSeq, bData);
+	}
+}
+
+static int RingHasData(PIPC_RING pRing, uint64_t ullNeed)
+{
+	(void)ullNeed;
+	return RING_LOAD_ACQUIRE(&pRing->pHeader->ullHead) != pRing->pHeader->ullTail;
+}
+
+static int RingHasSpace(PIPC_RING pRing, uint64_t ullNeed)
+{
+	return pRing->pHeader->cbData - (pRing->pHeader->ullHead - RING_LOAD_ACQUIRE(&pRing->pHeader->ullTail)) >= ullNeed;
+}
+
+
+int IPCRingCreate(PIPC_RING pRing, uint32_t dwOwnerPid, uint32_t cbData)
+{
+	char szName[IPC_RING_NAME_MAX];
+
+	snprintf(szName, sizeof(szName), IPC_RING_PORT_NAME, dwOwnerPid);
+	return IPCRingCreateNamed(pRing, szName, dwOwnerPid, cbData);
+}
+
+
+int IPCRingCreateNamed(PIPC_RING pRing, const char* szName, uint32_t dwOwnerPid, uint32_t cbData)
+{
+	uint32_t cbRounded = 4096;
+	int iError;
+
+	//The data area is a power of 2 so positions map to offsets with a mask
+
+	while (cbRounded < cbData && cbRounded < 0x80000000)
+	{
+		cbRounded <<= 1;
+	}
+
+	memset(pRing, 0, sizeof(IPC_RING));
+#ifndef _WIN32
+	pRing->fd = -1;
+#endif
+
+	iError = RingMap(pRing, szName, sizeof(IPC_RING_HEADER) + cbRounded, 1);
+	if (iError)
+	{
+		return iError;
+	}
+
+	pRing->pData = (char*)(pRing->pHeader + 1);
+	pRing->uiMask = cbRounded - 1;
+	pRing->bProducer = 0;
+	pRing->dwPid = dwOwnerPid;
+
+	memset(pRing->pHeader, 0, sizeof(IPC_RING_HEADER));
+	pRing->pHeader->dwVersion = IPC_RING_VERSION;
+	pRing->pHeader->cbData = cbRounded;
+	pRing->pHeader->dwConsumerPid = dwOwnerPid;
+	RING_FULL_FENCE();
+	RING_STORE_RELEASE(&pRing->pHeader->dwMagic, IPC_RING_MAGIC);
+
+	return 0;
+}
+
+
+int IPCRingOpen(PIPC_RING pRing, uint32_t dwOwnerPid)
+{
+	char szName[IPC_RING_NAME_MAX];
+
+	snprintf(szName, sizeof(szName), IPC_RING_PORT_NAME, dwOwnerPid);
+	return IPCRingOpenNamed(pRing, szName);
+}
+
+
+int IPCRingOpenNamed(PIPC_RING pRing, const char* szName)
+{
+	uint32_t dwSelf;
+	int32_t lOwner;
+	int iError;
+
+	memset(pRing, 0, sizeof(IPC_RING));
+#ifdef _WIN32
+	dwSelf = GetCurrentProcessId();
+#else
+	pRing->fd = -1;
+	dwSelf = (uint32_t)getpid();
+#endif
+	pRing->bProducer = 1;
+	pRing->dwPid = dwSelf;
+
+	iError = RingMap(pRing, szName, 0, 0);
+	if (iError)
+	{
+		return iError;
+	}
+
+	if (RING_LOAD_ACQUIRE(&pRing->pHeader->dwMagic) != IPC_RING_MAGIC || pRing->pHeader->dwVersion != IPC_RING_VERSION)
+	{
+		IPCRingClose(pRing);
+#ifdef _WIN32
+		return ERROR_INVALID_DATA;
+#else
+		return EPROTO;
+#endif
+	}
+
+	pRing->pData = (char*)(pRing->pHeader + 1);
+	pRing->uiMask = pRing->pHeader->cbData - 1;
+
+	//The ring has a single producer. A producer slot held by a process that has exited is taken over
+
+	lOwner = RING_CAS32(&pRing->pHeader->lProducerPid, (int32_t)dwSelf, 0);
+	if (lOwner != 0 && lOwner != (int32_t)dwSelf)
+	{
+		if (RingPidAlive((uint32_t)lOwner) || RING_CAS32(&pRing->pHeader->lProducerPid, (int32_t)dwSelf, lOwner) != lOwner)
+		{
+			IPCRingClose(pRing);
+#ifdef _WIN32
+			return ERROR_BUSY;
+#else
+			return EBUSY;
+#endif
+		}
+	}
+
+	return 0;
+}
+
+
+int IPCRingPidAlive(uint32_t dwPid)
+{
+	return RingPidAlive(dwPid);
+}
+
+
+void IPCRingClose(PIPC_RING pRing)
+{
+	if (pRing->bProducer && pRing->pHeader && pRing->pHeader->dwMagic == IPC_RING_MAGIC)
+	{
+#ifdef _WIN32
+		RING_CAS32(&pRing->pHeader->lProducerPid, 0, (int32_t)GetCurrentProcessId());
+#else
+		RING_CAS32(&pRing->pHeader->lProducerPid, 0, (int32_t)getpid());
+#endif
+	}
+
+	RingUnmap(pRing);
+	memset(pRing, 0, sizeof(IPC_RING));
+}
+
+
+PIPC_RING_RECORD IPCRingReserve(PIPC_RING pRing, uint64_t cbPayload, uint32_t dwTimeoutMs)
+{
+	PIPC_RING_HEADER pHeader = pRing->pHeader;
+	uint64_t cbRecord = RING_ALIGN_UP(sizeof(IPC_RING_RECORD) + cbPayload);
+
+	if (cbRecord > pHeader->cbData)
+	{
+		return NULL;
+	}
+
+	for (;;)
+	{
+		uint64_t ullHead = pHeader->ullHead;
+		uint64_t cbContig = pHeader->cbData - (ullHead & pRing->uiMask);
+		uint64_t ullNeed = cbRecord > cbContig ? cbContig : cbRecord;
+
+		if (!RingHasSpace(pRing, ullNeed) && !RingWait(pRing, RingHasSpace, ullNeed, 0, dwTimeoutMs))
+		{
+			return NULL;
+		}
+
+		if (cbRecord > cbContig)
+		{
+			//Records never wrap, fill the tail of the data area and start again at offset 0
+
+			PIPC_RING_RECORD pPad = (PIPC_RING_RECORD)(pRing->pData + (ullHead & pRing->uiMask));
+			pPad->cbRecord = (uint32_t)cbContig;
+			pPad->dwType = IPC_RING_RECORD_PAD;
+			RING_STORE_RELEASE(&pHeader->ullHead, ullHead + cbContig);
+			continue;
+		}
+
+		PIPC_RING_RECORD pRecord = (PIPC_RING_RECORD)(pRing->pData + (ullHead & pRing->uiMask));
+		pRecord->cbRecord = (uint32_t)cbRecord;
+		pRecord->dwType = IPC_RING_RECORD_MSG;
+		pRecord->uiSourcePID = pRing->dwPid;
+		pRecord->MsgSize = cbPayload;
+		return pRecord;
+	}
+}
+
+
+void IPCRingCommit(PIPC_RING pRing, PIPC_RING_RECORD pRecord)
+{
+	RING_STORE_RELEASE(&pRing->pHeader->ullHead, pRing->pHeader->ullHead + pRecord->cbRecord);
+	RingSignal(pRing, 1);
+}
+
+
+PIPC_RING_RECORD IPCRingPeek(PIPC_RING pRing, uint32_t dwTimeoutMs)
+{
+	PIPC_RING_HEADER pHeader = pRing->pHeader;
+
+	for (;;)
+	{
+		PIPC_RING_RECORD pRecord;
+
+		if (!RingHasData(pRing, 0) && !RingWait(pRing, RingHasData, 0, 1, dwTimeoutMs))
+		{
+			return NULL;
+		}
+
+		pRecord = (PIPC_RING_RECORD)(pRing->pData + (pHeader->ullTail & pRing->uiMask));
+		if (pRecord->dwType != IPC_RING_RECORD_PAD)
+		{
+			return pRecord;
+		}
+
+		//Skip the padding at the end of the data area
+
+		RING_STORE_RELEASE(&pHeader->ullTail, pHeader->ullTail + pRecord->cbRecord);
+		RingSignal(pRing, 0);
+	}
+}
+
+
+void IPCRingRelease(PIPC_RING pRing, PIPC_RING_RECORD pRecord)
+{
+	RING_STORE_RELEASE(&pRing->pHeader->ullTail, pRing->pHeader->ullTail + pRecord->cbRecord);
+	RingSignal(pRing, 0);
+}
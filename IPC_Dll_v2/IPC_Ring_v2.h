@@ -0,0 +1,118 @@
+#pragma once
+/*
+IPC_Ring_v2.h
+
+Shared memory single producer / single consumer ring used by the ring
+transport of IPC_Dll_v2. The ring for a port is created by the receiving
+process and named after its PID, the sending process maps the same memory.
+Messages are written straight into the ring by the sender and read straight
+out of it by the receiver, the driver is not involved once the ring is mapped.
+Wakeups use named events on Windows and futexes on Linux.
+
+The ring layout below is shared between processes so it only uses fixed size types.
+*/
+
+#include<stdint.h>
+#include<stddef.h>
+
+#ifdef _WIN32
+#include<Windows.h>
+#endif
+
+#define IPC_RING_MAGIC 0x474E5249		//'IRNG'
+#define IPC_RING_VERSION 1
+#define IPC_RING_DEFAULT_SIZE (4 * 1024 * 1024)	//Default data area size in bytes
+#define IPC_RING_ALIGN 8				//Records start on 8 byte boundaries
+#define IPC_RING_SPIN_COUNT 1024		//Polls of the ring before a reader or writer goes to sleep
+#define IPC_RING_INFINITE 0xFFFFFFFF	//Wait forever
+#define IPC_RING_NAME_MAX 48			//Size of a ring name including the terminating NUL
+#define IPC_RING_PORT_NAME "ipcring_%u"	//Name of the ring of a port, formatted with the owner's PID
+
+#define IPC_RING_RECORD_MSG 1			//Record carries a message
+#define IPC_RING_RECORD_PAD 2			//Record fills the space up to the end of the data area
+
+//Every message in the ring starts with this record header, the payload follows it
+
+typedef struct _IPC_RING_RECORD
+{
+	uint32_t cbRecord;			//Size of the record including header and padding
+	uint32_t dwType;			//IPC_RING_RECORD_MSG or IPC_RING_RECORD_PAD
+	uint32_t uiMsgID;			//Message ID
+	uint32_t uiSourcePID;		//Source process PID, stamped by IPCRingReserve
+	uint64_t MsgSize;			//Payload size in bytes
+	uint32_t bEndofMsg;			//End of Message Flag
+	uint32_t uiReserved;
+	char szMsg[];				//Payload
+}IPC_RING_RECORD, *PIPC_RING_RECORD;
+
+//Control block at the start of the shared memory. Producer and consumer
+//positions live on separate cache lines so the two sides do not false share
+
+typedef struct _IPC_RING_HEADER
+{
+	uint32_t dwMagic;					//IPC_RING_MAGIC once the ring is initialized
+	uint32_t dwVersion;					//IPC_RING_VERSION
+	uint32_t cbData;					//Size of the data area, a power of 2
+	uint32_t dwConsumerPid;				//PID of the process that created the ring
+	volatile int32_t lProducerPid;		//PID of the attached producer, 0 if none
+	char Pad0[44];
+	volatile uint64_t ullHead;			//Bytes written by the producer
+	volatile int32_t lProducerWaiting;	//Set while the producer sleeps on a full ring
+	volatile uint32_t dwSpaceSeq;		//Bumped by the consumer to wake the producer (futex word)
+	char Pad1[48];
+	volatile uint64_t ullTail;			//Bytes consumed by the consumer
+	volatile int32_t lConsumerWaiting;	//Set while the consumer sleeps on an empty ring
+	volatile uint32_t dwDataSeq;		//Bumped by the producer to wake the consumer (futex word)
+	char Pad2[48];
+}IPC_RING_HEADER, *PIPC_RING_HEADER;
+
+//Process local view of a mapped ring
+
+typedef struct _IPC_RING
+{
+	PIPC_RING_HEADER pHeader;	//Mapped control block
+	char* pData;				//Mapped data area
+	uint32_t uiMask;			//cbData - 1
+	int bProducer;				//Non zero if this side writes to the ring
+	uint32_t dwPid;				//PID of the process which mapped the ring
+	size_t cbMapping;			//Size of the mapping
+#ifdef _WIN32
+	HANDLE hMapping;			//Section backing the ring
+	HANDLE hDataEvent;			//Signalled by the producer when the consumer is waiting
+	HANDLE hSpaceEvent;			//Signalled by the consumer when the producer is waiting
+#else
+	int fd;						//shm file descriptor
+	char szName[IPC_RING_NAME_MAX + 1];	//shm object name, unlinked by the creator
+#endif
+}IPC_RING, *PIPC_RING;
+
+//Creates the ring of the calling process with a data area of at least cbData bytes.
+//Returns 0 on success or an errno/GetLastError style code
+int IPCRingCreate(PIPC_RING pRing, uint32_t dwOwnerPid, uint32_t cbData);
+
+//Maps the ring created by dwOwnerPid as its producer
+int IPCRingOpen(PIPC_RING pRing, uint32_t dwOwnerPid);
+
+//Create and open a ring by name rather than by its owner's PID, for rings which are not the ring
+//of a port. Names are at most IPC_RING_NAME_MAX - 1 characters
+int IPCRingCreateNamed(PIPC_RING pRing, const char* szName, uint32_t dwOwnerPid, uint32_t cbData);
+int IPCRingOpenNamed(PIPC_RING pRing, const char* szName);
+
+//Returns non zero if the process dwPid is still running
+int IPCRingPidAlive(uint32_t dwPid);
+
+//Unmaps the ring, the creator also removes the name
+void IPCRingClose(PIPC_RING pRing);
+
+//Reserves room for a message with cbPayload bytes, waiting up to dwTimeoutMs for the
+//consumer to free space. Returns the record to fill in, or NULL on timeout or if the message can never fit
+PIPC_RING_RECORD IPCRingReserve(PIPC_RING pRing, uint64_t cbPayload, uint32_t dwTimeoutMs);
+
+//Publishes the record returned by IPCRingReserve and wakes the consumer if it sleeps
+void IPCRingCommit(PIPC_RING pRing, PIPC_RING_RECORD pRecord);
+
+//Returns the next message in the ring without copying it, waiting up to dwTimeoutMs. NULL on timeout
+PIPC_RING_RECORD IPCRingPeek(PIPC_RING pRing, uint32_t dwTimeoutMs);
+
+//Releases the record returned by IPCRingPeek and wakes the producer if it sleeps
+void IPCRingRelease(PIPC_RING pRing, PIPC_RING_RECORD pRecord);
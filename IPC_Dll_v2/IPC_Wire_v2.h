@@ -0,0 +1,95 @@
+#pragma once
+/*
+IPC_Wire_v2.h
+
+Layout of an IPC Packet as it crosses the user/kernel boundary, in WriteFile,
+ReadFile and the batch, multicast and call IOCTLs. This is the only definition,
+the DLL, the driver's routing core and the broker all include it. The driver
+queues its own descriptor (IPC_PACKET in IPCRoute_v2.h) and translates at the
+boundary, so no kernel pointer, list entry or pointer sized field is copied.
+
+A packet is the IPC_WIRE_HEADER, an IPC_WIRE_CALL_ID if IPC_WIRE_CALL is set,
+cbPayload bytes of payload and, when read with IPC_WIRE_TRACED set, an
+IPC_PACKET_TRACE. The layouts only use fixed size types so 32 and 64 bit
+processes and the kernel agree on them.
+*/
+
+#define IPC_WIRE_VERSION 1		//bVersion of every packet, a packet of another version is rejected
+
+//bFlags
+
+#define IPC_WIRE_END_OF_MSG 0x01	//Last packet of a message
+#define IPC_WIRE_TRACED 0x02		//An IPC_PACKET_TRACE follows the payload. Set by the driver on packets read
+#define IPC_WIRE_CALL 0x04			//An IPC_WIRE_CALL_ID follows the header: a request when read, a reply when written
+#define IPC_WIRE_FLAGS (IPC_WIRE_END_OF_MSG | IPC_WIRE_TRACED | IPC_WIRE_CALL)
+
+typedef struct _IPC_WIRE_HEADER
+{
+	UINT8 bVersion;				//IPC_WIRE_VERSION
+	UINT8 bFlags;				//IPC_WIRE_* flags
+	UINT8 bPriority;			//Incoming lane at the destination
+	UINT8 bReserved;			//0
+	UINT32 dwPid;				//Destination PID or endpoint handle when written, source PID when read
+	UINT32 uiMsgID;				//Message ID
+	UINT32 cbPayload;			//Bytes of payload
+}IPC_WIRE_HEADER, *PIPC_WIRE_HEADER;
+
+//Call ID of a packet flagged IPC_WIRE_CALL, stamped by the driver on a request and echoed by its reply
+
+typedef struct _IPC_WIRE_CALL_ID
+{
+	UINT32 uiCallId;			//Call ID
+	UINT32 uiReserved;			//0, keeps the payload 8 byte aligned
+}IPC_WIRE_CALL_ID, *PIPC_WIRE_CALL_ID;
+
+#define IPCWireCallLength(pWire) (((pWire)->bFlags & IPC_WIRE_CALL) ? sizeof(IPC_WIRE_CALL_ID) : 0)
+#define IPCWireCallId(pWire) (((pWire)->bFlags & IPC_WIRE_CALL) ? ((const IPC_WIRE_CALL_ID*)((pWire) + 1))->uiCallId : 0)
+#define IPCWirePayload(pWire) ((char*)((pWire) + 1) + IPCWireCallLength(pWire))
+
+//Bytes of a packet, without and with the stamps of a traced packet
+
+#define IPCWireLength(pWire) (sizeof(IPC_WIRE_HEADER) + IPCWireCallLength(pWire) + (pWire)->cbPayload)
+#define IPCWireReadLength(pWire) (IPCWireLength(pWire) + (((pWire)->bFlags & IPC_WIRE_TRACED) ? sizeof(IPC_PACKET_TRACE) : 0))
+
+//Bytes of a packet to be written, with a call ID extension if uiCallId is not 0
+
+#define IPCWireSize(uiCallId, cbPayload) (sizeof(IPC_WIRE_HEADER) + ((uiCallId) ? sizeof(IPC_WIRE_CALL_ID) : 0) + (cbPayload))
+
+//Per stage timestamps of a packet read by a process which switched tracing on. The driver stamps
+//every stage up to the read, the DLL the receive
+
+typedef enum _IPC_TRACE_STAMP
+{
+	IPC_TRACE_WRITE,			//The write reached the routing core, before the packet was allocated
+	IPC_TRACE_COPIED,			//The packet was copied in from the sender
+	IPC_TRACE_QUEUED,			//The packet was queued to its destination or handed to a parked reader
+	IPC_TRACE_READ,				//The packet was copied out to a reader
+	IPC_TRACE_RECEIVED,			//The message was returned to the receiving process, stamped in user mode
+	IPC_TRACE_STAMPS
+}IPC_TRACE_STAMP;
+
+typedef struct _IPC_PACKET_TRACE
+{
+	LONG64 Stamps[IPC_TRACE_STAMPS];	//Performance counter ticks indexed by IPC_TRACE_STAMP, 0 if the stage was not stamped
+	LONG64 llFrequency;					//Performance counter ticks per second
+}IPC_PACKET_TRACE, *PIPC_PACKET_TRACE;
+
+//Gather send (IOCTL_SEND_GATHER). An IPC_GATHER_HEADER, whose wire header gives the payload size but is
+//not followed by the payload, then nSegments IPC_GATHER_SEGMENTs in the sender's address space. The
+//payload is the segments back to back, copied from the sender's memory straight into the packet
+
+#define IPC_GATHER_MAX_SEGMENTS 64		//Segments of one gather send
+
+typedef struct _IPC_GATHER_SEGMENT
+{
+	UINT64 pData;				//Address of the bytes in the sender, 32 bit senders zero extend it
+	UINT32 cbData;				//Bytes
+	UINT32 uiReserved;			//0
+}IPC_GATHER_SEGMENT, *PIPC_GATHER_SEGMENT;
+
+typedef struct _IPC_GATHER_HEADER
+{
+	IPC_WIRE_HEADER Wire;		//Header of the packet, cbPayload is the sum of the segments' cbData
+	UINT32 nSegments;			//IPC_GATHER_SEGMENTs following
+	UINT32 uiReserved;			//0
+}IPC_GATHER_HEADER, *PIPC_GATHER_HEADER;
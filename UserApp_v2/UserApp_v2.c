@@ -13,7 +13,7 @@ This is the testcase User App to demonstrate the behaviour of IPC communication
 char* randstr()
 {
 	int sz = rand() % 20;
-	char* arr = (char*)malloc(sz * sizeof(char));
+	char* arr = (char*)malloc((sz + 1) * sizeof(char));
 	int i;
 	for (i = 0; i < sz; i++)
 	{
@@ -42,7 +42,8 @@ int main()
 
 	char prompt;				//user choice prompt
 	HANDLE hThread;				//Handle to Thread to process the received payload
-	PIPCMSG pMyMsg;				//pointer to Sample Message
+	IPCMSG MyMsgHeader;			//Header of Sample Message, the payload is sent from the string itself
+	IPCSEGMENT MySegment;		//Payload of Sample Message
 
 	//Loading IPC_DLL_v2.dll explicitly and getting the relevant function pointers
 	hIPCDll = LoadLibraryExW(L"IPC_DLL_v2", NULL, 0);
@@ -55,6 +56,7 @@ int main()
 	_InitDeviceforIPC = (MYPROC)GetProcAddress(hIPCDll, "InitDeviceforIPC");
 	_CloseDeviceforIPC = (MYPROC)GetProcAddress(hIPCDll, "CloseDeviceforIPC");
 	_SendIPCMsg = (MYPROC2)GetProcAddress(hIPCDll, "SendIPCMsg");
+	_SendIPCMsgGather = (MYPROC3)GetProcAddress(hIPCDll, "SendIPCMsgGather");
 
 	//First initialize the Device/driver for IPC Communication
 
@@ -98,25 +100,16 @@ int main()
 				char * sz = randstr();
 				size_t ilen = strlen(sz);
 
-				//Allocate Heap for Msg
-				pMyMsg = (PIPCMSG)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(IPCMSG)+ilen);
-				if (!pMyMsg)
-				{
-					SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-					printf("Unable to create Msg:%d\n", GetLastError());
-					return -1;
-				}
-
-				//Create Msg
-				pMyMsg->uiMsgID = i;
-				pMyMsg->bEndofMsg = TRUE;
-				pMyMsg->uiDestPID = uiDestPid;
-				pMyMsg->uiSourcePID = GetCurrentProcessId();
-				pMyMsg->MsgSize = ilen;
-				memcpy(pMyMsg->szMsg, sz, ilen);
+				//Create Msg header, the string is the only segment so it is not copied into an IPCMSG
+				memset(&MyMsgHeader, 0, sizeof(MyMsgHeader));
+				MyMsgHeader.uiMsgID = i;
+				MyMsgHeader.bEndofMsg = TRUE;
+				MyMsgHeader.uiDestPID = uiDestPid;
+				MySegment.pData = sz;
+				MySegment.cbData = ilen;
 
 				//Send Msg
-				if (_SendIPCMsg(pMyMsg))
+				if (_SendIPCMsgGather(&MyMsgHeader, &MySegment, 1))
 				{
 					printf("Sent Msg %d to Process %d: %s\n", i, uiDestPid,sz);
 				}
@@ -125,8 +118,8 @@ int main()
 					printf("Sending Msg %d failed with error : %d\n", i, GetLastError());
 				}
 
-				//Free alloc for Msg
-				HeapFree(GetProcessHeap(), HEAP_ZERO_MEMORY, pMyMsg);
+				//Free the string
+				free(sz);
 			}
 		}
 
@@ -7,11 +7,13 @@
 typedef BOOL(*MYPROC)();
 typedef PIPCMSG(*MYPROC1)();
 typedef BOOL(*MYPROC2)(PIPCMSG);
+typedef BOOL(*MYPROC3)(PIPCMSG, const IPCSEGMENT*, UINT);
 
 MYPROC _InitDeviceforIPC;
 MYPROC _CloseDeviceforIPC;
 MYPROC1 _RecvIPCMsg;
 MYPROC2 _SendIPCMsg;
+MYPROC3 _SendIPCMsgGather;
 
 HANDLE g_hEvent;
 HMODULE hIPCDll;